@@ -0,0 +1,81 @@
+/* Measure the throughput of the checksum functions used for disk data.
+ *
+ * Usage: crc-benchmark [SIZE [ITERATIONS]]
+ *
+ * where SIZE is the size in bytes of the buffer to checksum (default 8
+ * Megabytes, the size of a segment) and ITERATIONS is how many times to do it
+ * (default 100). */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "../src/byte.h"
+
+typedef unsigned (*crcFunc)(const void *buf, size_t size, unsigned init);
+
+/* Return the current monotonic time in nanoseconds. */
+static uint64_t now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+static void run(const char *name,
+                crcFunc func,
+                const void *buf,
+                size_t size,
+                unsigned iterations)
+{
+    uint64_t start;
+    uint64_t elapsed;
+    unsigned crc = 0;
+    unsigned i;
+
+    start = now();
+    for (i = 0; i < iterations; i++) {
+        crc = func(buf, size, crc);
+    }
+    elapsed = now() - start;
+    if (elapsed == 0) {
+        elapsed = 1;
+    }
+
+    printf("%-16s %10.1f MB/s (crc %08x)\n", name,
+           (double)size * iterations / elapsed * 1000000000 / (1024 * 1024),
+           crc);
+}
+
+int main(int argc, char *argv[])
+{
+    size_t size = 8 * 1024 * 1024;
+    unsigned iterations = 100;
+    uint8_t *buf;
+    size_t i;
+
+    if (argc > 1) {
+        size = strtoul(argv[1], NULL, 10);
+    }
+    if (argc > 2) {
+        iterations = (unsigned)strtoul(argv[2], NULL, 10);
+    }
+
+    buf = malloc(size);
+    if (buf == NULL) {
+        fprintf(stderr, "error: can't allocate %zu bytes\n", size);
+        return 1;
+    }
+    for (i = 0; i < size; i++) {
+        buf[i] = (uint8_t)rand();
+    }
+
+    run("crc32", byteCrc32, buf, size, iterations);
+    run("crc32c-portable", byteCrc32cPortable, buf, size, iterations);
+    run("crc32c", byteCrc32c, buf, size, iterations);
+
+    free(buf);
+
+    return 0;
+}
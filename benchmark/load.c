@@ -0,0 +1,214 @@
+/* Measure how long it takes to load the log of a data directory at startup.
+ *
+ * Usage: load-benchmark DIR [N_SEGMENTS [ENTRY_SIZE]]
+ *
+ * The given DIR must exist and be empty. It gets populated with N_SEGMENTS
+ * closed segments of 1 Megabyte (default 256), filled with entries of
+ * ENTRY_SIZE bytes (default 1024), then the log is loaded back with a fresh
+ * raft_io instance and the time taken is reported. */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../include/raft.h"
+#include "../include/raft/uv.h"
+
+#define SEGMENT_SIZE (1024 * 1024)
+#define BATCH_SIZE 64
+
+struct benchmark
+{
+    struct uv_loop_s loop;
+    struct raft_uv_transport transport;
+    struct raft_logger logger;
+    struct raft_io io;
+    struct raft_io_append req;
+    struct raft_entry entries[BATCH_SIZE];
+    unsigned n_batches; /* Number of batches still to be appended */
+    int status;
+};
+
+/* Return the current monotonic time in nanoseconds. */
+static uint64_t now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+static int setup(struct benchmark *b, const char *dir)
+{
+    int rv;
+    rv = raft_uv_tcp_init(&b->transport, &b->loop);
+    if (rv != 0) {
+        return rv;
+    }
+    rv = raft_uv_init(&b->io, &b->loop, dir, &b->transport);
+    if (rv != 0) {
+        return rv;
+    }
+    raft_uv_set_segment_size(&b->io, SEGMENT_SIZE);
+    return b->io.init(&b->io, &b->logger, 1, "127.0.0.1:9000");
+}
+
+static void tearDown(struct benchmark *b)
+{
+    b->io.close(&b->io, NULL);
+    uv_run(&b->loop, UV_RUN_DEFAULT);
+    raft_uv_close(&b->io);
+    raft_uv_tcp_close(&b->transport);
+}
+
+static void appendCb(struct raft_io_append *req, int status)
+{
+    struct benchmark *b = req->data;
+    int rv;
+
+    if (status != 0) {
+        b->status = status;
+        return;
+    }
+    if (b->n_batches == 0) {
+        return;
+    }
+    b->n_batches--;
+    rv = b->io.append(&b->io, &b->req, b->entries, BATCH_SIZE, appendCb);
+    if (rv != 0) {
+        b->status = rv;
+    }
+}
+
+/* Fill the data directory with segments. */
+static int populate(struct benchmark *b,
+                    const char *dir,
+                    unsigned n_segments,
+                    size_t entry_size)
+{
+    void *data;
+    unsigned i;
+    int rv;
+
+    rv = setup(b, dir);
+    if (rv != 0) {
+        return rv;
+    }
+
+    data = calloc(1, entry_size);
+    for (i = 0; i < BATCH_SIZE; i++) {
+        b->entries[i].term = 1;
+        b->entries[i].type = RAFT_COMMAND;
+        b->entries[i].buf.base = data;
+        b->entries[i].buf.len = entry_size;
+        b->entries[i].batch = NULL;
+    }
+
+    b->req.data = b;
+    b->status = 0;
+    b->n_batches = n_segments * (SEGMENT_SIZE / (entry_size * BATCH_SIZE));
+    appendCb(&b->req, 0);
+    while (b->n_batches > 0 && b->status == 0) {
+        uv_run(&b->loop, UV_RUN_ONCE);
+    }
+    uv_run(&b->loop, UV_RUN_NOWAIT);
+
+    tearDown(b);
+    free(data);
+
+    return b->status;
+}
+
+/* Load the log back and report the time taken. */
+static int load(struct benchmark *b, const char *dir)
+{
+    raft_term term;
+    unsigned voted_for;
+    struct raft_snapshot *snapshot;
+    raft_index start_index;
+    struct raft_entry *entries;
+    size_t n;
+    size_t size = 0;
+    uint64_t start;
+    uint64_t elapsed;
+    size_t i;
+    void *batch = NULL;
+    int rv;
+
+    rv = setup(b, dir);
+    if (rv != 0) {
+        return rv;
+    }
+
+    start = now();
+    rv = b->io.load(&b->io, &term, &voted_for, &snapshot, &start_index,
+                    &entries, &n);
+    elapsed = now() - start;
+    if (rv != 0) {
+        fprintf(stderr, "error: load: %s\n", raft_strerror(rv));
+        tearDown(b);
+        return rv;
+    }
+
+    for (i = 0; i < n; i++) {
+        size += entries[i].buf.len;
+        if (entries[i].batch != batch) {
+            batch = entries[i].batch;
+            raft_free(batch);
+        }
+    }
+    raft_free(entries);
+
+    printf("loaded %zu entries (%zu MB) in %.1f ms: %.1f MB/s\n", n,
+           size / (1024 * 1024), (double)elapsed / 1000000,
+           (double)size / elapsed * 1000000000 / (1024 * 1024));
+
+    tearDown(b);
+
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    struct benchmark b;
+    const char *dir;
+    unsigned n_segments = 256;
+    size_t entry_size = 1024;
+    int rv;
+
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s DIR [N_SEGMENTS [ENTRY_SIZE]]\n", argv[0]);
+        return 1;
+    }
+    dir = argv[1];
+    if (argc > 2) {
+        n_segments = (unsigned)strtoul(argv[2], NULL, 10);
+    }
+    if (argc > 3) {
+        entry_size = strtoul(argv[3], NULL, 10);
+    }
+    if (entry_size == 0 || entry_size % 8 != 0 ||
+        entry_size * BATCH_SIZE > SEGMENT_SIZE) {
+        fprintf(stderr, "error: bad entry size %zu\n", entry_size);
+        return 1;
+    }
+
+    uv_loop_init(&b.loop);
+    raft_default_logger_init(&b.logger);
+
+    rv = populate(&b, dir, n_segments, entry_size);
+    if (rv != 0) {
+        fprintf(stderr, "error: populate: %s\n", raft_strerror(rv));
+        return 1;
+    }
+
+    rv = load(&b, dir);
+    if (rv != 0) {
+        return 1;
+    }
+
+    uv_loop_close(&b.loop);
+
+    return 0;
+}
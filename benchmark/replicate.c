@@ -0,0 +1,398 @@
+/* Measure how many network system calls it takes to replicate log entries.
+ *
+ * Usage: replicate-benchmark DIR [N_ENTRIES [WINDOW [TRANSPORT]]]
+ *
+ * The given DIR must exist and be empty. A cluster of three servers is started
+ * in the same process, with data directories created under DIR. Once a leader
+ * is elected, N_ENTRIES entries (default 10000) are applied, keeping at most
+ * WINDOW of them in flight (default 32), and the network writes of all servers
+ * are reported, along with the mean latency between applying an entry and
+ * seeing it committed.
+ *
+ * TRANSPORT is either "tcp" (the default), in which case the servers listen on
+ * 127.0.0.1 ports 9001 to 9003, "unix", in which case they listen on Unix
+ * domain sockets created under DIR, or "local", in which case they are attached
+ * to a raft_uv_local hub and messages don't go through the kernel at all.
+ * Running with a WINDOW of 1 compares the round-trip latency of the three.
+ *
+ * Without coalescing every RPC message costs one write system call, so the
+ * messages per committed entry are what the writes per committed entry would
+ * be if each message was written on its own. */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+
+#include "../include/raft.h"
+#include "../include/raft/uv.h"
+
+#define N_SERVERS 3
+#define ENTRY_SIZE 64
+
+struct server
+{
+    char dir[1024];
+    char address[1100];
+    struct raft_uv_transport transport;
+    struct raft_io io;
+    struct raft_fsm fsm;
+    struct raft raft;
+};
+
+struct benchmark
+{
+    struct uv_loop_s loop;
+    struct uv_timer_s timer; /* Poll for a leader to be elected */
+    struct raft_logger logger;
+    struct server servers[N_SERVERS];
+    struct raft *leader;
+    bool unix_domain; /* Use Unix sockets instead of TCP */
+    bool in_process;  /* Deliver messages through the hub */
+    struct raft_uv_local local;
+    unsigned n_entries; /* Entries to apply */
+    unsigned window;    /* Max entries in flight */
+    unsigned n_applying;
+    unsigned n_applied;
+    unsigned n_closed;
+    uint64_t start;
+    uint64_t elapsed;
+    uint64_t latency; /* Sum of the commit latencies of all entries */
+    int status;
+};
+
+/* Apply request that remembers when it was submitted. */
+struct apply
+{
+    struct raft_apply req;
+    uint64_t start;
+};
+
+/* Return the current monotonic time in nanoseconds. */
+static uint64_t now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+static int fsmApply(struct raft_fsm *fsm,
+                    const struct raft_buffer *buf,
+                    void **result)
+{
+    (void)fsm;
+    (void)buf;
+    *result = NULL;
+    return 0;
+}
+
+static int fsmSnapshot(struct raft_fsm *fsm,
+                       struct raft_buffer *bufs[],
+                       unsigned *n_bufs)
+{
+    (void)fsm;
+    *n_bufs = 1;
+    *bufs = raft_malloc(sizeof **bufs);
+    if (*bufs == NULL) {
+        return RAFT_NOMEM;
+    }
+    (*bufs)[0].len = sizeof(uint64_t);
+    (*bufs)[0].base = raft_malloc((*bufs)[0].len);
+    if ((*bufs)[0].base == NULL) {
+        raft_free(*bufs);
+        return RAFT_NOMEM;
+    }
+    memset((*bufs)[0].base, 0, (*bufs)[0].len);
+    return 0;
+}
+
+static int fsmRestore(struct raft_fsm *fsm, struct raft_buffer *buf)
+{
+    (void)fsm;
+    raft_free(buf->base);
+    return 0;
+}
+
+/* Fill @address with the address of the I'th server. */
+static void serverAddress(struct benchmark *b,
+                          unsigned i,
+                          const char *dir,
+                          char *address)
+{
+    if (b->unix_domain) {
+        sprintf(address, "%s/%u.sock", dir, i + 1);
+    } else {
+        sprintf(address, "127.0.0.1:900%u", i + 1);
+    }
+}
+
+static int serverInit(struct benchmark *b,
+                      unsigned i,
+                      const char *dir,
+                      struct raft_configuration *configuration)
+{
+    struct server *s = &b->servers[i];
+    unsigned id = i + 1;
+    int rv;
+
+    sprintf(s->dir, "%s/%u", dir, id);
+    serverAddress(b, i, dir, s->address);
+    if (mkdir(s->dir, 0755) != 0) {
+        return RAFT_IOERR;
+    }
+
+    s->fsm.version = 1;
+    s->fsm.data = NULL;
+    s->fsm.apply = fsmApply;
+    s->fsm.snapshot = fsmSnapshot;
+    s->fsm.restore = fsmRestore;
+
+    if (b->unix_domain) {
+        rv = raft_uv_unix_init(&s->transport, &b->loop);
+    } else {
+        rv = raft_uv_tcp_init(&s->transport, &b->loop);
+    }
+    if (rv != 0) {
+        return rv;
+    }
+    rv = raft_uv_init(&s->io, &b->loop, s->dir, &s->transport);
+    if (rv != 0) {
+        return rv;
+    }
+    if (b->in_process) {
+        raft_uv_set_local(&s->io, &b->local);
+    }
+    rv = raft_init(&s->raft, &s->io, &s->fsm, &b->logger, id, s->address);
+    if (rv != 0) {
+        return rv;
+    }
+    s->raft.data = b;
+    raft_set_election_timeout(&s->raft, 100);
+    raft_set_heartbeat_timeout(&s->raft, 20);
+    raft_set_snapshot_threshold(&s->raft, (unsigned)-1);
+    rv = raft_bootstrap(&s->raft, configuration);
+    if (rv != 0) {
+        return rv;
+    }
+    return raft_start(&s->raft);
+}
+
+static void closeCb(struct raft *r)
+{
+    struct benchmark *b = r->data;
+    b->n_closed++;
+    if (b->n_closed == N_SERVERS) {
+        uv_close((struct uv_handle_s *)&b->timer, NULL);
+    }
+}
+
+static void stopCb(struct uv_timer_s *timer)
+{
+    struct benchmark *b = timer->data;
+    unsigned i;
+    for (i = 0; i < N_SERVERS; i++) {
+        raft_close(&b->servers[i].raft, closeCb);
+    }
+}
+
+/* Close the servers from the timer, since they can't be closed from within
+ * their own callbacks. */
+static void stop(struct benchmark *b)
+{
+    uv_timer_stop(&b->timer);
+    uv_timer_start(&b->timer, stopCb, 0, 0);
+}
+
+static void applyCb(struct raft_apply *req, int status, void *result);
+
+/* Keep applying entries until the window is full. */
+static void fill(struct benchmark *b)
+{
+    while (b->n_applying < b->window &&
+           b->n_applied + b->n_applying < b->n_entries) {
+        struct apply *req;
+        struct raft_buffer buf;
+        int rv;
+
+        req = raft_malloc(sizeof *req);
+        buf.len = ENTRY_SIZE;
+        buf.base = raft_malloc(buf.len);
+        if (req == NULL || buf.base == NULL) {
+            b->status = RAFT_NOMEM;
+            stop(b);
+            return;
+        }
+        memset(buf.base, 0, buf.len);
+        req->req.data = b;
+        req->start = now();
+        rv = raft_apply(b->leader, &req->req, &buf, 1, applyCb);
+        if (rv != 0) {
+            b->status = rv;
+            stop(b);
+            return;
+        }
+        b->n_applying++;
+    }
+}
+
+static void applyCb(struct raft_apply *req, int status, void *result)
+{
+    struct benchmark *b = req->data;
+    uint64_t start = ((struct apply *)req)->start;
+    (void)result;
+    raft_free(req);
+    b->n_applying--;
+    if (b->status != 0) {
+        return;
+    }
+    if (status != 0) {
+        b->status = status;
+        stop(b);
+        return;
+    }
+    b->n_applied++;
+    b->latency += now() - start;
+    if (b->n_applied == b->n_entries) {
+        b->elapsed = now() - b->start;
+        stop(b);
+        return;
+    }
+    fill(b);
+}
+
+static void timerCb(struct uv_timer_s *timer)
+{
+    struct benchmark *b = timer->data;
+    unsigned i;
+    for (i = 0; i < N_SERVERS; i++) {
+        struct raft *r = &b->servers[i].raft;
+        if (raft_state(r) == RAFT_LEADER) {
+            uv_timer_stop(timer);
+            b->leader = r;
+            b->start = now();
+            fill(b);
+            return;
+        }
+    }
+}
+
+static void report(struct benchmark *b)
+{
+    struct raft_uv_send_stats stats;
+    unsigned long long n_messages = 0;
+    unsigned long long n_writes = 0;
+    unsigned max_messages = 0;
+    unsigned i;
+
+    for (i = 0; i < N_SERVERS; i++) {
+        raft_uv_get_send_stats(&b->servers[i].io, &stats);
+        n_messages += stats.n_messages;
+        n_writes += stats.n_writes;
+        if (stats.max_messages > max_messages) {
+            max_messages = stats.max_messages;
+        }
+    }
+
+    printf("committed %u entries in %.1f ms: %.0f entries/s\n", b->n_applied,
+           (double)b->elapsed / 1000000,
+           (double)b->n_applied / b->elapsed * 1000000000);
+    printf("mean commit latency:          %.1f us\n",
+           (double)b->latency / b->n_applied / 1000);
+    printf("messages per committed entry: %.2f\n",
+           (double)n_messages / b->n_applied);
+    printf("writes per committed entry:   %.2f (max %u messages per write)\n",
+           (double)n_writes / b->n_applied, max_messages);
+}
+
+int main(int argc, char *argv[])
+{
+    struct benchmark b;
+    struct raft_configuration configuration;
+    const char *dir;
+    unsigned i;
+    int rv;
+
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s DIR [N_ENTRIES [WINDOW [TRANSPORT]]]\n",
+                argv[0]);
+        return 1;
+    }
+    dir = argv[1];
+    memset(&b, 0, sizeof b);
+    b.n_entries = 10000;
+    b.window = 32;
+    if (argc > 2) {
+        b.n_entries = (unsigned)strtoul(argv[2], NULL, 10);
+    }
+    if (argc > 3) {
+        b.window = (unsigned)strtoul(argv[3], NULL, 10);
+    }
+    if (argc > 4) {
+        if (strcmp(argv[4], "unix") == 0) {
+            b.unix_domain = true;
+        } else if (strcmp(argv[4], "local") == 0) {
+            b.in_process = true;
+        } else if (strcmp(argv[4], "tcp") != 0) {
+            fprintf(stderr, "error: unknown transport %s\n", argv[4]);
+            return 1;
+        }
+    }
+    if (b.n_entries == 0 || b.window == 0) {
+        fprintf(stderr, "error: bad number of entries or window\n");
+        return 1;
+    }
+
+    uv_loop_init(&b.loop);
+    uv_timer_init(&b.loop, &b.timer);
+    b.timer.data = &b;
+    raft_default_logger_init(&b.logger);
+    if (raft_uv_local_init(&b.local) != 0) {
+        fprintf(stderr, "error: local hub: out of memory\n");
+        return 1;
+    }
+
+    raft_configuration_init(&configuration);
+    for (i = 0; i < N_SERVERS; i++) {
+        char address[1100];
+        serverAddress(&b, i, dir, address);
+        rv = raft_configuration_add(&configuration, i + 1, address, true);
+        if (rv != 0) {
+            fprintf(stderr, "error: configuration: %s\n", raft_strerror(rv));
+            return 1;
+        }
+    }
+    for (i = 0; i < N_SERVERS; i++) {
+        rv = serverInit(&b, i, dir, &configuration);
+        if (rv != 0) {
+            fprintf(stderr, "error: server %u: %s\n", i + 1,
+                    raft_strerror(rv));
+            return 1;
+        }
+    }
+    raft_configuration_close(&configuration);
+
+    uv_timer_start(&b.timer, timerCb, 10, 10);
+    uv_run(&b.loop, UV_RUN_DEFAULT);
+
+    for (i = 0; i < N_SERVERS; i++) {
+        raft_uv_close(&b.servers[i].io);
+        if (b.unix_domain) {
+            raft_uv_unix_close(&b.servers[i].transport);
+        } else {
+            raft_uv_tcp_close(&b.servers[i].transport);
+        }
+    }
+    raft_uv_local_close(&b.local);
+    uv_loop_close(&b.loop);
+
+    if (b.status != 0) {
+        fprintf(stderr, "error: apply: %s\n", raft_strerror(b.status));
+        return 1;
+    }
+
+    report(&b);
+
+    return 0;
+}
@@ -566,6 +566,13 @@ struct raft_io
      * Generate a random integer between min and max.
      */
     int (*random)(struct raft_io *io, int min, int max);
+
+    /**
+     * Return true if the backend is still holding entries or snapshots sent to
+     * the given server, so sending more of them would most probably fail with
+     * #RAFT_BUSY. This is optional and can be #NULL.
+     */
+    bool (*busy)(struct raft_io *io, unsigned server_id);
 };
 
 /**
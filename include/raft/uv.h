@@ -58,18 +58,46 @@ struct raft_uv_transport;
  * part of the log. Truncating a prefix of the log will only remove complete
  * segments that are before the new log start index. For example, if a
  * segment has entries 10 through 20 and the prefix of the log is truncated to
- * start at entry 15, that entire segment will be retained.
+ * start at entry 15, that entire segment will be retained. On boot, closed
+ * segments whose entries are all included in the last snapshot are not loaded
+ * in memory, so the time it takes to load the log depends only on the entries
+ * appended after that snapshot.
  *
- * Each segment file starts with a segment header, which currently contains
- * just an 8-byte version number for the format of that segment. The current
- * format (version 1) is just a concatenation of serialized entry batches.
+ * Each segment file starts with a segment header, which contains an 8-byte
+ * version number for the format of that segment. In format version 1 the
+ * header is followed by a concatenation of serialized entry batches. Format
+ * version 2 adds an 8-byte epoch after the version number, which is used to
+ * seed the batch checksums: this way segment files of obsolete entries can be
+ * recycled as open segments without their stale batches being loaded back.
+ * Format version 3 has the same layout as version 2, but uses CRC32C checksums
+ * instead of CRC32, since they can be computed in hardware on most CPUs.
  *
- * Each batch has the following format:
+ * In format versions 1 to 3 each batch has the following format:
  *
- * [4 bytes] CRC32 checksum of the batch header, little endian.
- * [4 bytes] CRC32 checksum of the batch data, little endian.
+ * [4 bytes] Checksum of the batch header, little endian.
+ * [4 bytes] Checksum of the batch data, little endian.
  * [  ...  ] Batch (as described in @raft_decode_entries_batch).
  *
+ * Format version 4 has the same segment header as version 3, but batches use
+ * a more compact encoding, where terms are delta-encoded and sizes are stored
+ * as variable-length integers:
+ *
+ * [4 bytes] Checksum of the batch header and sizes, little endian.
+ * [4 bytes] Checksum of the batch data, little endian.
+ * [4 bytes] Size of the batch header, little endian.
+ * [4 bytes] Size of the batch data, little endian.
+ * [  ...  ] Batch header, with the entries term, type and data size.
+ * [  ...  ] Batch data, with the entries data, not padded.
+ *
+ * If the most significant bit of the data size is set, the batch data is
+ * compressed (see @raft_uv_set_codec): its first byte is the ID of the codec,
+ * followed by the compressed entries data. The remaining bits hold the size of
+ * the compressed batch data, including the codec ID.
+ *
+ * When an open segment is closed, an index holding the offset and the first
+ * entry index of each of its batches is appended after the last batch, so
+ * closed segments can be truncated without decoding them.
+ *
  * [0] https://github.com/logcabin/logcabin/blob/master/Storage/SegmentedLog.h
  */
 int raft_uv_init(struct raft_io *io,
@@ -79,6 +107,241 @@ int raft_uv_init(struct raft_io *io,
 
 void raft_uv_close(struct raft_io *io);
 
+/**
+ * Set the size of open segment files, in bytes. The default is 8 Megabytes.
+ *
+ * The size is rounded up to a multiple of the block size of the data directory
+ * file system. Larger segments reduce the rate at which segments need to be
+ * prepared and finalized, at the cost of more disk space being preallocated.
+ *
+ * A batch of entries larger than a segment does not fail: it gets written to a
+ * dedicated segment large enough to hold it.
+ *
+ * This function must be called after @raft_uv_init and before the @init method
+ * of the @raft_io instance.
+ */
+void raft_uv_set_segment_size(struct raft_io *io, size_t size);
+
+/**
+ * Enable group commit of append requests.
+ *
+ * By default a write against the open segment is submitted as soon as an
+ * append request comes in and no other write is in flight. When a non-zero
+ * @msecs window is set, the first append request received after a write was
+ * submitted starts a timer, and all requests arriving before it expires are
+ * written and synced together with a single write. If @bytes is non-zero, the
+ * window is closed early as soon as the pending batches reach that size on
+ * disk.
+ *
+ * Passing #0 as @msecs disables group commit. This function can be called at
+ * any time after @raft_uv_init.
+ */
+void raft_uv_set_append_linger(struct raft_io *io,
+                               unsigned msecs,
+                               size_t bytes);
+
+/**
+ * Counters tracking how append requests were grouped into segment writes.
+ *
+ * The ratio between @n_reqs and @n_writes is the average group size achieved,
+ * which can be used to tune the window set with @raft_uv_set_append_linger.
+ *
+ * New open segments are prepared ahead of time, and the number of segments
+ * kept ready adapts to the rate at which appends fill them. The
+ * @n_prepare_stalls counter tracks how many times appends had to wait for a
+ * segment to be prepared anyways.
+ *
+ * With direct I/O, writes must cover whole disk blocks, so appending a small
+ * batch rewrites the whole block it ends in. Small writes are then submitted
+ * in buffered mode, which only writes the new data, if that turns out not to
+ * be slower on the device. The ratio between @n_disk_bytes and @n_bytes is the
+ * resulting write amplification.
+ */
+struct raft_uv_append_stats
+{
+    unsigned long long n_writes;          /* Segment writes submitted */
+    unsigned long long n_reqs;            /* Append requests written */
+    unsigned long long n_entries;         /* Entries written */
+    unsigned long long n_bytes;           /* Bytes of encoded batches written */
+    unsigned max_reqs;                    /* Largest number of reqs in a write */
+    unsigned long long n_prepare_stalls;  /* Waits for a segment to be ready */
+    unsigned prepare_pool_target;         /* Segments currently kept ready */
+    unsigned long long n_disk_bytes;      /* Bytes submitted to the disk */
+    unsigned long long n_buffered_writes; /* Writes in buffered mode */
+};
+
+/**
+ * Fill @stats with the append counters accumulated so far.
+ */
+void raft_uv_get_append_stats(struct raft_io *io,
+                              struct raft_uv_append_stats *stats);
+
+/**
+ * Set the maximum number of bytes of outgoing messages that can be queued for
+ * each peer server, including the ones being written. The default is 8
+ * Megabytes.
+ *
+ * Votes, heartbeats and results are always accepted, and go ahead of queued
+ * AppendEntries messages carrying entries and of InstallSnapshot messages,
+ * except for heartbeats, which can't overtake entries. A heartbeat which is
+ * still queued when a new one is sent to the same server is dropped.
+ *
+ * Messages carrying entries or snapshots that would exceed the limit are
+ * refused with #RAFT_BUSY, unless nothing is queued for that server, so the
+ * caller can retry later instead of piling up data behind a slow server.
+ *
+ * This function can be called at any time after @raft_uv_init.
+ */
+void raft_uv_set_send_queue_size(struct raft_io *io, size_t size);
+
+/**
+ * Send outgoing messages carrying a payload of at least @threshold bytes, like
+ * a large entry or a snapshot chunk, with MSG_ZEROCOPY, so the kernel reads
+ * them straight from the memory of the log instead of copying them into the
+ * socket buffer. Zero, the default, disables zero-copy sends.
+ *
+ * The send callback of such messages fires only once the kernel is done with
+ * their memory, which happens after the peer has acknowledged the data. Only
+ * TCP connections use zero-copy, and only on Linux 4.14 or later: other
+ * connections just write messages normally. Data sent to the loopback
+ * interface is copied anyway, see the @n_zero_copy_copied counter.
+ *
+ * This function takes effect on connections established after it's called.
+ */
+void raft_uv_set_zero_copy(struct raft_io *io, size_t threshold);
+
+/**
+ * Counters tracking how outgoing RPC messages were written to the network.
+ *
+ * Messages sent to the same server during the same loop iteration are corked
+ * and written together with a single vectored write once the loop is about to
+ * poll for I/O, or once it has run the I/O callbacks. The ratio between
+ * @n_messages and @n_writes is the average number of messages per system call.
+ *
+ * The @n_busy and @n_dropped counters track the effect of the limit set with
+ * @raft_uv_set_send_queue_size.
+ *
+ * An AppendEntries message sent to several servers during the same loop
+ * iteration, like a heartbeat or entries replicated to followers at the same
+ * index, is encoded once and its buffers are shared by all the writes. The
+ * @n_shared counter tracks the messages that reused such an encoding.
+ *
+ * The @n_zero_copy and @n_zero_copy_copied counters track the sendmsg() calls
+ * submitted with MSG_ZEROCOPY (see @raft_uv_set_zero_copy) and how many of them
+ * the kernel had to copy anyway.
+ */
+struct raft_uv_send_stats
+{
+    unsigned long long n_messages;         /* Messages written */
+    unsigned long long n_writes;           /* Stream writes submitted */
+    unsigned max_messages;                 /* Most messages in a write */
+    unsigned long long n_busy;             /* Messages refused with RAFT_BUSY */
+    unsigned long long n_dropped;          /* Stale heartbeats dropped */
+    unsigned long long n_shared;           /* Messages not re-encoded */
+    unsigned long long n_zero_copy;        /* Zero-copy sends submitted */
+    unsigned long long n_zero_copy_copied; /* Zero-copy sends copied anyway */
+};
+
+/**
+ * Fill @stats with the send counters accumulated so far.
+ */
+void raft_uv_get_send_stats(struct raft_io *io,
+                            struct raft_uv_send_stats *stats);
+
+/**
+ * Hub connecting raft_io instances living in the same process, which might run
+ * different event loops in different threads.
+ *
+ * Messages sent between instances attached to the same hub are handed over to
+ * the receiving instance directly, without being encoded and going through the
+ * transport and the kernel. This makes it cheap to embed several servers in
+ * one binary, for example to run many raft groups or benchmarks.
+ */
+struct raft_uv_local
+{
+    void *impl; /* Implementation-defined state */
+};
+
+/**
+ * Initialize an in-process hub with no instance attached to it.
+ */
+int raft_uv_local_init(struct raft_uv_local *local);
+
+/**
+ * Release all memory used by the hub. All instances attached to it must have
+ * been closed.
+ */
+void raft_uv_local_close(struct raft_uv_local *local);
+
+/**
+ * Attach the given instance to the given hub. Messages sent to a server whose
+ * address matches the one of another instance attached to the hub are
+ * delivered in-process, while the other ones still go through the transport.
+ *
+ * Each message is copied once for its receiver, since the receiver takes
+ * ownership of it, and the send callback is fired once the copy is queued.
+ *
+ * This function must be called after @raft_uv_init and before raft_io->init().
+ */
+void raft_uv_set_local(struct raft_io *io, struct raft_uv_local *local);
+
+/**
+ * ID of the built-in codec returned by @raft_uv_codec_lz.
+ */
+#define RAFT_UV_CODEC_LZ 1
+
+/**
+ * Interface to compress the data of log entries.
+ *
+ * When a codec is set, each batch of entries written to an open segment and
+ * each batch sent with an AppendEntries message is compressed as a whole, and
+ * it's stored or sent compressed if that makes it smaller. Compressed batches
+ * are tagged with the @id of the codec, so they can be decompressed by
+ * servers configured with the same codec.
+ */
+struct raft_uv_codec
+{
+    /**
+     * Unique identifier of the codec, between #1 and #255. The value
+     * #RAFT_UV_CODEC_LZ is reserved for the built-in codec.
+     */
+    unsigned id;
+
+    /**
+     * Compress the @size bytes at @src into @dst, which can hold up to
+     * @dst_size bytes, and set @dst_size to the size of the compressed data.
+     *
+     * Return a non-zero value if the compressed data doesn't fit in @dst.
+     */
+    int (*compress)(const void *src, size_t size, void *dst, size_t *dst_size);
+
+    /**
+     * Decompress the @size bytes at @src into @dst, which must then hold
+     * exactly @dst_size bytes.
+     *
+     * Return a non-zero value if the data is not valid.
+     */
+    int (*decompress)(const void *src, size_t size, void *dst, size_t dst_size);
+};
+
+/**
+ * Return the built-in codec, a fast LZ77-style compressor with no external
+ * dependencies.
+ */
+const struct raft_uv_codec *raft_uv_codec_lz(void);
+
+/**
+ * Set the codec used to compress log entries. The default is #NULL, which
+ * means that entries are not compressed.
+ *
+ * Batches compressed with the built-in codec can always be decompressed, even
+ * after a different codec was set.
+ *
+ * This function must be called after @raft_uv_init and before the @init method
+ * of the @raft_io instance.
+ */
+void raft_uv_set_codec(struct raft_io *io, const struct raft_uv_codec *codec);
+
 /**
  * Callback invoked by the transport implementation when a new incoming
  * connection has been established.
@@ -103,6 +366,16 @@ typedef void (*raft_uv_connect_cb)(struct raft_uv_connect *req,
                                    struct uv_stream_s *stream,
                                    int status);
 
+/**
+ * Channels of the outgoing connections to another server.
+ *
+ * AppendEntries messages carrying entries and InstallSnapshot messages are sent
+ * over a dedicated #RAFT_UV_BULK connection, if the other server supports it,
+ * so that large payloads don't delay the votes, heartbeats and results sent
+ * over the #RAFT_UV_CONTROL connection.
+ */
+enum { RAFT_UV_CONTROL = 0, RAFT_UV_BULK };
+
 /**
  * Handle to a connect request.
  */
@@ -110,6 +383,7 @@ struct raft_uv_connect
 {
     void *data;            /* User data */
     raft_uv_connect_cb cb; /* Callback */
+    int channel;           /* RAFT_UV_CONTROL or RAFT_UV_BULK */
 };
 
 /**
@@ -154,6 +428,11 @@ struct raft_uv_transport
      * The @cb callback must be invoked when the connection has been established
      * or the connection attempt has failed. The memory pointed by @req can be
      * released only after @cb has fired.
+     *
+     * The @channel field of @req tells which of the connections to the server
+     * is being established. The implementation should let the other end know,
+     * for example as part of its handshake, and can tune the connection for
+     * its purpose.
      */
     int (*connect)(struct raft_uv_transport *t,
                    struct raft_uv_connect *req,
@@ -185,4 +464,15 @@ int raft_uv_tcp_init(struct raft_uv_transport *t, struct uv_loop_s *loop);
 
 void raft_uv_tcp_close(struct raft_uv_transport *t);
 
+/**
+ * Init a transport interface that uses Unix domain sockets, with the same
+ * handshake as the TCP one. Server addresses are filesystem paths, which should
+ * be short enough to fit in a sockaddr_un. The socket file is removed when the
+ * transport is closed, but a stale one left behind by a crashed process must
+ * be removed before listening again.
+ */
+int raft_uv_unix_init(struct raft_uv_transport *t, struct uv_loop_s *loop);
+
+void raft_uv_unix_close(struct raft_uv_transport *t);
+
 #endif /* RAFT_IO_UV_H */
@@ -3,6 +3,7 @@
 #ifndef BYTE_H_
 #define BYTE_H_
 
+#include <stdbool.h>
 #include <stdint.h>
 #include <unistd.h>
 
@@ -103,6 +104,51 @@ RAFT_INLINE uint64_t byteGet64(const void **cursor)
     return value;
 }
 
+/* Return the number of bytes needed to encode the given value as a varint,
+ * i.e. 7 bits per byte, least significant group first, with the high bit of
+ * each byte set if more bytes follow. */
+RAFT_INLINE size_t byteSizeofVarint(uint64_t value)
+{
+    size_t n = 1;
+    while (value >= 0x80) {
+        value >>= 7;
+        n++;
+    }
+    return n;
+}
+
+RAFT_INLINE void bytePutVarint(void **cursor, uint64_t value)
+{
+    uint8_t *p = *cursor;
+    while (value >= 0x80) {
+        *p++ = (uint8_t)(value | 0x80);
+        value >>= 7;
+    }
+    *p++ = (uint8_t)value;
+    *cursor = p;
+}
+
+/* Decode a varint without reading past @end. Return #false if the encoded
+ * value is truncated or doesn't fit in 64 bits. */
+RAFT_INLINE bool byteGetVarint(const void **cursor,
+                               const void *end,
+                               uint64_t *value)
+{
+    const uint8_t *p = *cursor;
+    unsigned shift = 0;
+    *value = 0;
+    while (p < (const uint8_t *)end && shift < 64) {
+        uint8_t byte = *p++;
+        *value |= (uint64_t)(byte & 0x7f) << shift;
+        if ((byte & 0x80) == 0) {
+            *cursor = p;
+            return true;
+        }
+        shift += 7;
+    }
+    return false;
+}
+
 /* Add padding to size if it's not a multiple of 8. */
 RAFT_INLINE size_t bytePad64(size_t size)
 {
@@ -118,4 +164,13 @@ RAFT_INLINE size_t bytePad64(size_t size)
 /* Calculate the CRC32 checksum of the given data buffer. */
 unsigned byteCrc32(const void *buf, size_t size, unsigned init);
 
+/* Calculate the CRC32C (Castagnoli) checksum of the given data buffer, using
+ * the SSE4.2 crc32 instruction if the CPU supports it. No bit inversion is
+ * applied to @init or to the result, just like byteCrc32. */
+unsigned byteCrc32c(const void *buf, size_t size, unsigned init);
+
+/* Portable implementation of byteCrc32c, used when hardware support is not
+ * available. */
+unsigned byteCrc32cPortable(const void *buf, size_t size, unsigned init);
+
 #endif /* BYTE_H_ */
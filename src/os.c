@@ -1,6 +1,7 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <libgen.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <string.h>
 #include <sys/types.h>
@@ -172,53 +173,132 @@ int osIsEmpty(const osDir dir, const osFilename filename, bool *empty)
     return 0;
 }
 
+/* Size of the chunks read when checking for trailing zeros. */
+#define TRAILING_ZEROS_CHUNK_SIZE (64 * 1024)
+
+/* Return true if the given buffer contains only zeros. Whole words are OR'ed
+ * together, which the compiler can turn into vector instructions. */
+static bool isZero(const void *buf, size_t n)
+{
+    const uint64_t *words = buf;
+    const uint8_t *bytes;
+    size_t n_words = n / sizeof *words;
+    uint64_t acc = 0;
+    size_t i;
+
+    for (i = 0; i < n_words; i++) {
+        acc |= words[i];
+    }
+    bytes = (const uint8_t *)(words + n_words);
+    for (i = 0; i < n % sizeof *words; i++) {
+        acc |= bytes[i];
+    }
+
+    return acc == 0;
+}
+
+/* Check if the given region of the file contains only zeros. */
+static int regionIsZero(const int fd,
+                        uint64_t *chunk,
+                        off_t offset,
+                        const off_t end,
+                        bool *flag)
+{
+    ssize_t n;
+
+    while (offset < end) {
+        size_t size = TRAILING_ZEROS_CHUNK_SIZE;
+        if ((off_t)size > end - offset) {
+            size = (size_t)(end - offset);
+        }
+        n = pread(fd, chunk, size, offset);
+        if (n == -1) {
+            return errno;
+        }
+        if (n == 0) {
+            break;
+        }
+        if (!isZero(chunk, (size_t)n)) {
+            *flag = false;
+            return 0;
+        }
+        offset += n;
+    }
+
+    *flag = true;
+    return 0;
+}
+
 int osHasTrailingZeros(const int fd, bool *flag)
 {
-    off_t size;
+    uint64_t *chunk;
     off_t offset;
-    char *data;
-    size_t i;
+    off_t end;
+    off_t data;
+    off_t hole;
     int rv;
 
-    /* Save the current offset. */
     offset = lseek(fd, 0, SEEK_CUR);
-
-    /* Figure the size of the rest of the file. */
-    size = lseek(fd, 0, SEEK_END);
-    if (size == -1) {
+    if (offset == -1) {
         return errno;
     }
-    size -= offset;
-
-    /* Reposition the file descriptor offset to the original offset. */
-    offset = lseek(fd, offset, SEEK_SET);
-    if (offset == -1) {
+    end = lseek(fd, 0, SEEK_END);
+    if (end == -1) {
         return errno;
     }
 
-    data = malloc(size);
-    if (data == NULL) {
+    chunk = malloc(TRAILING_ZEROS_CHUNK_SIZE);
+    if (chunk == NULL) {
         return ENOMEM;
     }
 
-    rv = osReadN(fd, data, size);
-    if (rv != 0) {
-        return rv;
-    }
+    *flag = true;
 
-    for (i = 0; i < (size_t)size; i++) {
-        if (data[i] != 0) {
-            *flag = false;
-            goto done;
+    /* Only read the regions of the file that are actually allocated, since
+     * holes are known to read back as zeros. */
+    while (offset < end) {
+        data = lseek(fd, offset, SEEK_DATA);
+        if (data == -1) {
+            if (errno == ENXIO) {
+                /* There's only a hole left. */
+                break;
+            }
+            if (errno != EINVAL) {
+                rv = errno;
+                goto err;
+            }
+            /* SEEK_DATA is not supported, read everything. */
+            data = offset;
+            hole = end;
+        } else {
+            hole = lseek(fd, data, SEEK_HOLE);
+            if (hole == -1) {
+                rv = errno;
+                goto err;
+            }
+        }
+
+        rv = regionIsZero(fd, chunk, data, hole, flag);
+        if (rv != 0) {
+            goto err;
+        }
+        if (!*flag) {
+            break;
         }
+
+        offset = hole;
     }
 
-    *flag = true;
+    free(chunk);
 
-done:
-    free(data);
+    /* Leave the file descriptor offset at the end of the file. */
+    lseek(fd, end, SEEK_SET);
 
     return 0;
+
+err:
+    free(chunk);
+    return rv;
 }
 
 int osReadN(const int fd, void *buf, const size_t n)
@@ -488,12 +568,13 @@ err:
     return rv;
 }
 
-int osSetDirectIO(int fd)
+int osSetDirectIO(int fd, bool enabled)
 {
     int flags; /* Current fcntl flags */
     int rv;
     flags = fcntl(fd, F_GETFL);
-    rv = fcntl(fd, F_SETFL, flags | O_DIRECT);
+    flags = enabled ? flags | O_DIRECT : flags & ~O_DIRECT;
+    rv = fcntl(fd, F_SETFL, flags);
     if (rv == -1) {
         return errno;
     }
@@ -67,7 +67,9 @@ int osScanDir(const osDir dir, struct dirent ***entries, int *n_entries);
 int osIsEmpty(const osDir dir, const osFilename filename, bool *empty);
 
 /* Check if the content of the file associated with the given file descriptor
- * contains all zeros from the current offset onward. */
+ * contains all zeros from the current offset onward. Holes in sparse files are
+ * skipped without being read. The file descriptor offset is left at the end of
+ * the file. */
 int osHasTrailingZeros(int fd, bool *flag);
 
 /* Read exactly @n bytes from the given file descriptor. */
@@ -102,8 +104,8 @@ struct osFileSystemInfo
  * possible using the KAIO API. */
 int osProbeIO(const osDir dir, size_t *direct, bool *async);
 
-/* Configure the given file descriptor for direct I/O. */
-int osSetDirectIO(int fd);
+/* Turn direct I/O on or off for the given file descriptor. */
+int osSetDirectIO(int fd, bool enabled);
 
 /* Return a human-readable description of the given OS error */
 const char *osStrError(int rv);
@@ -100,8 +100,7 @@ int progressRebuildArray(struct raft *r,
 bool progressShouldReplicate(struct raft *r, unsigned i)
 {
     struct raft_progress *p = &r->leader_state.progress[i];
-    raft_time now = r->io->time(r->io);
-    bool needs_heartbeat = now - p->last_send >= r->heartbeat_timeout;
+    bool needs_heartbeat = progressNeedsHeartbeat(r, i);
     raft_index last_index = logLastIndex(&r->log);
     bool is_up_to_date = p->next_index == last_index + 1;
     bool result;
@@ -135,6 +134,13 @@ bool progressShouldReplicate(struct raft *r, unsigned i)
     return result;
 }
 
+bool progressNeedsHeartbeat(struct raft *r, unsigned i)
+{
+    struct raft_progress *p = &r->leader_state.progress[i];
+    raft_time now = r->io->time(r->io);
+    return now - p->last_send >= r->heartbeat_timeout;
+}
+
 raft_index progressNextIndex(struct raft *r, unsigned i)
 {
     return r->leader_state.progress[i].next_index;
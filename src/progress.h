@@ -34,6 +34,9 @@ int progressRebuildArray(struct raft *r,
  * is taken. */
 bool progressShouldReplicate(struct raft *r, unsigned i);
 
+/* Whether nothing was sent to the i'th server in the last heartbeat interval. */
+bool progressNeedsHeartbeat(struct raft *r, unsigned i);
+
 /* Return the index of the next entry that should be sent to the i'th server. */
 raft_index progressNextIndex(struct raft *r, unsigned i);
 
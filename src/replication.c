@@ -128,6 +128,21 @@ static int sendAppendEntries(struct raft *r,
 
     req->send.data = req;
     rv = r->io->send(r->io, &req->send, &message, sendAppendEntriesCb);
+
+    /* If the I/O backend can't take more data for this server at the moment,
+     * leave the entries for later, but still let the server know that we are
+     * alive if it's time to do so. */
+    if (rv == RAFT_BUSY && args->n_entries > 0 &&
+        progressNeedsHeartbeat(r, i)) {
+        tracef("send queue to server %lu is full -> send heartbeat",
+               server->id);
+        logRelease(&r->log, next_index, args->entries, args->n_entries);
+        args->entries = NULL;
+        args->n_entries = 0;
+        req->entries = NULL;
+        req->n = 0;
+        rv = r->io->send(r->io, &req->send, &message, sendAppendEntriesCb);
+    }
     if (rv != 0) {
         goto err_after_req_alloc;
     }
@@ -262,6 +277,14 @@ static int sendSnapshot(struct raft *r, const unsigned i)
     struct sendInstallSnapshot *request;
     int rv;
 
+    /* If the I/O backend would refuse the snapshot, don't bother loading it,
+     * we'll retry at the next heartbeat. */
+    if (r->io->busy != NULL && r->io->busy(r->io, server->id)) {
+        tracef("send queue to server %lu is full -> delay snapshot",
+               server->id);
+        return 0;
+    }
+
     progressToSnapshot(r, i);
 
     request = raft_malloc(sizeof *request);
@@ -373,7 +396,7 @@ static int triggerAll(struct raft *r)
             continue;
         }
         rv = replicationProgress(r, i);
-        if (rv != 0 && rv != RAFT_NOCONNECTION) {
+        if (rv != 0 && rv != RAFT_NOCONNECTION && rv != RAFT_BUSY) {
             /* This is not a critical failure, let's just log it. */
             debugf(r,
                    "failed to send append entries to server %ld: %s (%d)",
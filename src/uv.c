@@ -16,10 +16,13 @@
 #include "uv.h"
 #include "uv_encoding.h"
 
-/* Retry to connect to peer servers every second.
- *
- * TODO: implement an exponential backoff instead.  */
-#define CONNECT_RETRY_DELAY 1000
+/* Retry to connect to peer servers after 100 milliseconds, doubling the delay
+ * after each failed attempt up to 5 seconds. */
+#define CONNECT_RETRY_DELAY 100
+#define CONNECT_RETRY_MAX_DELAY 5000
+
+/* Queue at most 8 Megabytes of outgoing messages for each peer. */
+#define SEND_QUEUE_SIZE (8 * 1024 * 1024)
 
 /* Implementation of raft_io->init. */
 static int uvInit(struct raft_io *io,
@@ -59,9 +62,11 @@ static int uvInit(struct raft_io *io,
     uv->direct_io = direct_io != 0;
     uv->block_size = direct_io != 0 ? direct_io : 4096;
 
-    /* We expect the maximum segment size to be a multiple of the block size */
-    assert(UV__MAX_SEGMENT_SIZE % uv->block_size == 0);
-    uv->n_blocks = UV__MAX_SEGMENT_SIZE / uv->block_size;
+    /* Round the segment size up to a multiple of the block size. */
+    uv->n_blocks = uv->segment_size / uv->block_size;
+    if (uv->segment_size % uv->block_size != 0) {
+        uv->n_blocks++;
+    }
 
     assert(uv->state == 0);
     uv->id = id;
@@ -72,6 +77,16 @@ static int uvInit(struct raft_io *io,
     rv = uv_timer_init(uv->loop, &uv->timer);
     assert(rv == 0); /* This should never fail */
     uv->timer.data = uv;
+    rv = uv_timer_init(uv->loop, &uv->append_timer);
+    assert(rv == 0); /* This should never fail */
+    uv->append_timer.data = uv;
+    rv = uv_prepare_init(uv->loop, &uv->send_prepare);
+    assert(rv == 0); /* This should never fail */
+    uv->send_prepare.data = uv;
+    rv = uv_check_init(uv->loop, &uv->send_check);
+    assert(rv == 0); /* This should never fail */
+    uv->send_check.data = uv;
+    uvLocalStart(uv, address);
     uv->state = UV__ACTIVE;
     uv->log_level = RAFT_INFO;
 
@@ -87,6 +102,7 @@ static void timerCb(uv_timer_t *timer)
 {
     struct uv *uv;
     uv = timer->data;
+    uvPrepareTick(uv);
     if (uv->tick_cb != NULL) {
         uv->tick_cb(uv->io);
     }
@@ -151,10 +167,22 @@ static void timerCloseCb(uv_handle_t *handle)
     uvMaybeClose(uv);
 }
 
+static void appendTimerCloseCb(uv_handle_t *handle)
+{
+    struct uv *uv = handle->data;
+    uv_close((uv_handle_t *)&uv->timer, timerCloseCb);
+}
+
 static void transportCloseCb(struct raft_uv_transport *t)
 {
     struct uv *uv = t->data;
-    uv_close((uv_handle_t *)&uv->timer, timerCloseCb);
+    uv_close((uv_handle_t *)&uv->append_timer, appendTimerCloseCb);
+}
+
+static void localCloseCb(uv_handle_t *handle)
+{
+    struct uv *uv = handle->data;
+    uv->transport->close(uv->transport, transportCloseCb);
 }
 
 /* Implementation of raft_io->close. */
@@ -173,12 +201,39 @@ static int uvClose(struct raft_io *io, void (*cb)(struct raft_io *io))
     uvPrepareClose(uv);
     uvAppendClose(uv);
     uvTruncateClose(uv);
-    uv->transport->close(uv->transport, transportCloseCb);
+    if (uv->local != NULL) {
+        uvLocalClose(uv, localCloseCb);
+    } else {
+        uv->transport->close(uv->transport, transportCloseCb);
+    }
     return 0;
 }
 
-/* Load the last snapshot (if any) and all entries contained in all segment
- * files of the data directory. */
+/* Return the number of closed segments at the beginning of the given list that
+ * contain only entries already included in the snapshot with the given last
+ * index, leaving at least the last closed segment, so open segments can be
+ * stitched to it. */
+static size_t countSegmentsCoveredBySnapshot(struct uvSegmentInfo *segments,
+                                             size_t n_segments,
+                                             raft_index last_index)
+{
+    size_t n = 0;
+    while (n + 1 < n_segments && !segments[n].is_open &&
+           !segments[n + 1].is_open && segments[n].end_index <= last_index) {
+        n++;
+    }
+    return n;
+}
+
+/* Load the last snapshot (if any) and the entries contained in the segment
+ * files of the data directory.
+ *
+ * Closed segments whose entries are all included in the snapshot are not
+ * loaded: they are left on disk untouched, and will be removed once a new
+ * snapshot is taken. This way the time needed to load the log and the memory
+ * needed to hold it depend only on the number of entries appended since the
+ * last snapshot, and not on the amount of trailing entries retained on
+ * disk. */
 static int loadSnapshotAndEntries(struct uv *uv,
                                   struct raft_snapshot **snapshot,
                                   raft_index *start_index,
@@ -189,6 +244,7 @@ static int loadSnapshotAndEntries(struct uv *uv,
     struct uvSegmentInfo *segments;
     size_t n_snapshots;
     size_t n_segments;
+    size_t n_skipped = 0;
     raft_index last_index;
     int rv;
 
@@ -218,13 +274,16 @@ static int loadSnapshotAndEntries(struct uv *uv,
         snapshots = NULL;
 
         last_index = (*snapshot)->index;
-        /* Update the start index. If there are closed segments on disk and the
-         * first index of the first closed segment is lower than the snapshot's
-         * last index, let's retain those entries. TODO: implement a trailing
-         * amount. */
-        if (segments != NULL && !segments[0].is_open &&
-            segments[0].first_index <= last_index) {
-            *start_index = segments[0].first_index;
+        if (segments != NULL) {
+            n_skipped = countSegmentsCoveredBySnapshot(segments, n_segments,
+                                                       last_index);
+        }
+        /* Update the start index. If there are closed segments on disk that
+         * we're going to load and the first index of the first one is lower
+         * than the snapshot's last index, let's retain those entries. */
+        if (segments != NULL && !segments[n_skipped].is_open &&
+            segments[n_skipped].first_index <= last_index) {
+            *start_index = segments[n_skipped].first_index;
         } else {
             *start_index = (*snapshot)->index + 1;
         }
@@ -232,8 +291,8 @@ static int loadSnapshotAndEntries(struct uv *uv,
 
     /* Read data from segments, closing any open segments. */
     if (segments != NULL) {
-        rv = uvSegmentLoadAll(uv, *start_index, segments, n_segments, entries,
-                              n);
+        rv = uvSegmentLoadAll(uv, *start_index, segments + n_skipped,
+                              n_segments - n_skipped, entries, n);
         if (rv != 0) {
             goto err;
         }
@@ -291,6 +350,9 @@ static int uvLoad(struct raft_io *io,
         return rv;
     }
 
+    /* Loading might have closed or removed segments. */
+    uvCatalogInvalidate(uv);
+
     last_index = *start_index + *n_entries - 1;
 
     /* Set the index of the last entry that was persisted. */
@@ -344,6 +406,7 @@ static int uvBootstrap(struct raft_io *io,
     if (rv != 0) {
         return rv;
     }
+    uvCatalogAddSegment(uv, 1, 1);
 
     return 0;
 }
@@ -380,6 +443,9 @@ int uvSend(struct raft_io *io,
            const struct raft_message *message,
            raft_io_send_cb cb);
 
+/* Implementation of raft_io->busy (defined in uv_send.c). */
+bool uvSendBusy(struct raft_io *io, unsigned server_id);
+
 /* Implementation raft_io->snapshot_put (defined in uv_snapshot.c). */
 int uvSnapshotPut(struct raft_io *io,
                   struct raft_io_snapshot_put *req,
@@ -412,6 +478,7 @@ int raft_uv_init(struct raft_io *io,
                  struct raft_uv_transport *transport)
 {
     struct uv *uv;
+    int rv;
 
     assert(io != NULL);
     assert(loop != NULL);
@@ -437,20 +504,58 @@ int raft_uv_init(struct raft_io *io,
     uv->state = 0;
     uv->errored = false;
     uv->block_size = 0; /* Detected in raft_io->init() */
-    uv->n_blocks = 0;   /* Calculated in raft_io->init() */
+    uv->segment_size = UV__SEGMENT_SIZE;
+    uv->n_blocks = 0; /* Calculated in raft_io->init() */
     uv->clients = NULL;
     uv->n_clients = 0;
     uv->servers = NULL;
     uv->n_servers = 0;
     uv->connect_retry_delay = CONNECT_RETRY_DELAY;
+    uv->connect_retry_max_delay = CONNECT_RETRY_MAX_DELAY;
+    uv->send_n_messages = 0;
+    uv->send_n_writes = 0;
+    uv->send_max_messages = 0;
+    uv->send_n_busy = 0;
+    uv->send_n_dropped = 0;
+    uv->send_n_shared = 0;
+    uv->send_encoded = NULL;
+    uv->send_spare = NULL;
+    uv->zero_copy_threshold = 0;
+    uv->send_n_zero_copy = 0;
+    uv->send_n_zero_copy_copied = 0;
+    uv->send_queue_size = SEND_QUEUE_SIZE;
+    uv->local = NULL;
+    uv->address = NULL;
+    QUEUE_INIT(&uv->local_inbox);
+    QUEUE_INIT(&uv->local_sent);
     uv->prepare_file = NULL;
     QUEUE_INIT(&uv->prepare_reqs);
     QUEUE_INIT(&uv->prepare_pool);
     uv->prepare_next_counter = 1;
+    uv->prepare_last_counter = 0;
+    uv->prepare_pool_target = UV__PREPARE_POOL_SIZE;
+    uv->prepare_started_at = 0;
+    uv->prepare_create_time = 0;
+    uv->prepare_used_at = 0;
+    uv->prepare_interval = 0;
+    uv->prepare_n_stalls = 0;
     uv->append_next_index = 1;
     QUEUE_INIT(&uv->append_segments);
     QUEUE_INIT(&uv->append_pending_reqs);
     QUEUE_INIT(&uv->append_writing_reqs);
+    uv->append_linger = 0;
+    uv->append_linger_bytes = 0;
+    uv->append_n_writes = 0;
+    uv->append_n_reqs = 0;
+    uv->append_n_entries = 0;
+    uv->append_n_bytes = 0;
+    uv->append_max_reqs = 0;
+    uv->append_n_disk_bytes = 0;
+    uv->append_n_buffered_writes = 0;
+    uv->append_n_small_writes = 0;
+    uv->append_direct_latency = 0;
+    uv->append_buffered_latency = 0;
+    uv->codec = NULL;
     QUEUE_INIT(&uv->finalize_reqs);
     uv->finalize_last_index = 0;
     uv->finalize_work.data = NULL;
@@ -459,7 +564,13 @@ int raft_uv_init(struct raft_io *io,
     QUEUE_INIT(&uv->snapshot_put_reqs);
     QUEUE_INIT(&uv->snapshot_get_reqs);
     uv->snapshot_put_work.data = NULL;
+    rv = uvCatalogInit(uv);
+    if (rv != 0) {
+        raft_free(uv);
+        return rv;
+    }
     uv->tick_cb = NULL;
+    uv->recv_cb = NULL;
     uv->closing = false;
     uv->close_cb = NULL;
 
@@ -479,6 +590,7 @@ int raft_uv_init(struct raft_io *io,
     io->snapshot_get = uvSnapshotGet;
     io->time = uvTime;
     io->random = uvRandom;
+    io->busy = uvSendBusy;
 
     return 0;
 }
@@ -487,6 +599,7 @@ void raft_uv_close(struct raft_io *io)
 {
     struct uv *uv;
     uv = io->impl;
+    uvCatalogClose(uv);
     if (uv->clients != NULL) {
         raft_free(uv->clients);
     }
@@ -495,3 +608,87 @@ void raft_uv_close(struct raft_io *io)
     }
     raft_free(uv);
 }
+
+void raft_uv_set_segment_size(struct raft_io *io, size_t size)
+{
+    struct uv *uv;
+    uv = io->impl;
+    assert(uv->state == 0);
+    assert(size > 0);
+    uv->segment_size = size;
+}
+
+void raft_uv_set_append_linger(struct raft_io *io,
+                               unsigned msecs,
+                               size_t bytes)
+{
+    struct uv *uv;
+    uv = io->impl;
+    uv->append_linger = msecs;
+    uv->append_linger_bytes = bytes;
+}
+
+void raft_uv_set_send_queue_size(struct raft_io *io, size_t size)
+{
+    struct uv *uv;
+    uv = io->impl;
+    assert(size > 0);
+    uv->send_queue_size = size;
+}
+
+void raft_uv_set_zero_copy(struct raft_io *io, size_t threshold)
+{
+    struct uv *uv;
+    uv = io->impl;
+    uv->zero_copy_threshold = threshold;
+}
+
+void raft_uv_set_local(struct raft_io *io, struct raft_uv_local *local)
+{
+    struct uv *uv;
+    uv = io->impl;
+    assert(uv->state == 0);
+    uv->local = local->impl;
+}
+
+void raft_uv_set_codec(struct raft_io *io, const struct raft_uv_codec *codec)
+{
+    struct uv *uv;
+    uv = io->impl;
+    assert(uv->state == 0);
+    assert(codec == NULL || (codec->id > 0 && codec->id <= 255));
+    assert(codec == NULL || codec->id != RAFT_UV_CODEC_LZ ||
+           codec == raft_uv_codec_lz());
+    uv->codec = codec;
+}
+
+void raft_uv_get_append_stats(struct raft_io *io,
+                              struct raft_uv_append_stats *stats)
+{
+    struct uv *uv;
+    uv = io->impl;
+    stats->n_writes = uv->append_n_writes;
+    stats->n_reqs = uv->append_n_reqs;
+    stats->n_entries = uv->append_n_entries;
+    stats->n_bytes = uv->append_n_bytes;
+    stats->max_reqs = uv->append_max_reqs;
+    stats->n_disk_bytes = uv->append_n_disk_bytes;
+    stats->n_buffered_writes = uv->append_n_buffered_writes;
+    stats->n_prepare_stalls = uv->prepare_n_stalls;
+    stats->prepare_pool_target = uv->prepare_pool_target;
+}
+
+void raft_uv_get_send_stats(struct raft_io *io,
+                            struct raft_uv_send_stats *stats)
+{
+    struct uv *uv;
+    uv = io->impl;
+    stats->n_messages = uv->send_n_messages;
+    stats->n_writes = uv->send_n_writes;
+    stats->max_messages = uv->send_max_messages;
+    stats->n_busy = uv->send_n_busy;
+    stats->n_dropped = uv->send_n_dropped;
+    stats->n_shared = uv->send_n_shared;
+    stats->n_zero_copy = uv->send_n_zero_copy;
+    stats->n_zero_copy_copied = uv->send_n_zero_copy_copied;
+}
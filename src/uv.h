@@ -11,8 +11,51 @@
 /* Current disk format version. */
 #define UV__DISK_FORMAT 1
 
-/* 8 Megabytes */
-#define UV__MAX_SEGMENT_SIZE (8 * 1024 * 1024)
+/* Format version of the open segments written by the append logic.
+ *
+ * Version 2 extends version 1 with an 8-byte epoch after the format version,
+ * which is used to seed the checksums of the batches in the segment. Since
+ * segment files get recycled, this prevents batches left over from the
+ * previous use of the file from being considered valid. An epoch of 0 means
+ * that the file was recycled and nothing was written into it yet.
+ *
+ * Version 3 has the same layout as version 2, but checksums are computed with
+ * CRC32C instead of CRC32, since CRC32C can be hardware accelerated.
+ *
+ * Version 4 stores the size of the batch header and data after the checksums,
+ * and uses the compact encoding for the batch header, with unpadded entry
+ * data. */
+#define UV__SEGMENT_FORMAT 4
+
+/* Oldest segment format versions having an epoch, using CRC32C and using the
+ * compact batch encoding. */
+#define UV__SEGMENT_FORMAT_EPOCH 2
+#define UV__SEGMENT_FORMAT_CRC32C 3
+#define UV__SEGMENT_FORMAT_COMPACT 4
+
+/* Flag set in the data size of a batch using the compact encoding, if the
+ * batch data is compressed. Uncompressed batch data must then be smaller than
+ * this. */
+#define UV__SEGMENT_BATCH_COMPRESSED 0x80000000U
+
+/* Magic number marking the presence of a batch index footer at the end of a
+ * closed segment ("RAFTIDX1"). */
+#define UV__SEGMENT_INDEX_MAGIC 0x3158444954464152
+
+/* Maximum number of obsolete segments that get recycled into open segments
+ * after taking a snapshot, instead of being removed. */
+#define UV__MAX_RECYCLED_SEGMENTS 2
+
+/* Initial number of prepared open segments that we try to keep ready for
+ * writing, before any append rate has been observed. */
+#define UV__PREPARE_POOL_SIZE 2
+
+/* Bounds for the number of prepared open segments to keep ready. */
+#define UV__PREPARE_POOL_MIN 1
+#define UV__PREPARE_POOL_MAX 8
+
+/* Default size of a segment file: 8 Megabytes */
+#define UV__SEGMENT_SIZE (8 * 1024 * 1024)
 
 /* Template string for closed segment filenames: start index (inclusive), end
  * index (inclusive). */
@@ -21,6 +64,10 @@
 /* Template string for open segment filenames: incrementing counter. */
 #define UV__OPEN_TEMPLATE "open-%llu"
 
+/* Template string for closed segments being recycled into the open segment with
+ * the given counter. */
+#define UV__RECYCLE_TEMPLATE "recycle-%llu"
+
 /* State codes. */
 enum { UV__ACTIVE = 1, UV__CLOSED };
 
@@ -36,8 +83,27 @@ struct uvMetadata
 };
 
 struct uvClient;
+struct uvEncoded;
 struct uvServer;
 
+/* In-memory catalog of the closed segments and snapshots on disk. */
+struct uvCatalog
+{
+    uv_mutex_t mutex;                 /* Serialize access from the threadpool */
+    bool valid;                       /* Whether the catalog is up to date */
+    struct uvSegmentInfo *segments;   /* Closed segments, sorted by index */
+    size_t n_segments;                /* Length of the segments array */
+    struct uvSnapshotInfo *snapshots; /* Snapshots, older ones first */
+    size_t n_snapshots;               /* Length of the snapshots array */
+};
+
+/* Hub of the instances attached to a raft_uv_local object. */
+struct uvLocal
+{
+    uv_mutex_t mutex; /* Serialize access from different loops */
+    queue peers;      /* Attached instances, linked by uv->local_queue */
+};
+
 struct uv
 {
     struct raft_io *io;                  /* I/O object we're implementing */
@@ -51,20 +117,63 @@ struct uv
     bool direct_io;                      /* Whether direct I/O is supported */
     bool async_io;                       /* Whether async I/O is supported */
     size_t block_size;                   /* Block size of the data dir */
+    size_t segment_size;                 /* Desired size of a segment */
     unsigned n_blocks;                   /* N. of blocks in a segment */
     struct uvClient **clients;           /* Outgoing connections */
     unsigned n_clients;                  /* Length of the clients array */
     struct uvServer **servers;           /* Incoming connections */
     unsigned n_servers;                  /* Length of the servers array */
     unsigned connect_retry_delay;        /* Client connection retry delay */
+    unsigned connect_retry_max_delay;    /* Max retry delay after backoff */
+    struct uv_prepare_s send_prepare;    /* Flush corked messages before poll */
+    struct uv_check_s send_check;        /* Flush corked messages after poll */
+    unsigned long long send_n_messages;  /* N. of messages written */
+    unsigned long long send_n_writes;    /* N. of stream writes submitted */
+    unsigned send_max_messages;          /* Max messages per stream write */
+    unsigned long long send_n_busy;      /* N. of messages refused */
+    unsigned long long send_n_dropped;   /* N. of stale heartbeats dropped */
+    unsigned long long send_n_shared;    /* N. of messages not re-encoded */
+    struct uvEncoded *send_encoded;      /* Last AppendEntries encoded */
+    struct uvEncoded *send_spare;        /* Released encoding to reuse */
+    size_t send_queue_size;              /* Max bytes queued for each peer */
+    size_t zero_copy_threshold;          /* Min payload for MSG_ZEROCOPY */
+    unsigned long long send_n_zero_copy; /* N. of zero-copy sends */
+    unsigned long long send_n_zero_copy_copied; /* N. copied by the kernel */
+    struct uvLocal *local;               /* In-process hub, if any */
+    const char *address;                 /* Our address, for the hub */
+    struct uv_async_s local_async;       /* Deliver in-process messages */
+    queue local_queue;                   /* Link in the hub's peers */
+    queue local_inbox;                   /* In-process messages, hub locked */
+    queue local_sent;                    /* Delivered send requests */
     struct uvFile *prepare_file;         /* File segment being prepared */
     queue prepare_reqs;                  /* Pending prepare requests. */
     queue prepare_pool;                  /* Prepared open segments */
     uvCounter prepare_next_counter;      /* Counter of next open segment */
+    uvCounter prepare_last_counter;      /* Counter of last segment used */
+    unsigned prepare_pool_target;        /* Desired n. of prepared segments */
+    uint64_t prepare_started_at;         /* When the current creation began */
+    uint64_t prepare_create_time;        /* Duration of last creation, in ns */
+    uint64_t prepare_used_at;            /* When a segment was last used */
+    uint64_t prepare_interval;           /* Avg. time between segments used */
+    unsigned long long prepare_n_stalls; /* N. of requests that had to wait */
     raft_index append_next_index;        /* Index of next entry to append */
     queue append_segments;               /* Open segments in use. */
     queue append_pending_reqs;           /* Pending append requests. */
     queue append_writing_reqs;           /* Append requests in flight */
+    unsigned append_linger;              /* Group commit window, in msecs */
+    size_t append_linger_bytes;          /* Flush the window at this size */
+    struct uv_timer_s append_timer;      /* Expires the group commit window */
+    unsigned long long append_n_writes;  /* N. of segment writes submitted */
+    unsigned long long append_n_reqs;    /* N. of append requests written */
+    unsigned long long append_n_entries; /* N. of entries written */
+    unsigned long long append_n_bytes;   /* N. of batch bytes written */
+    const struct raft_uv_codec *codec;   /* Compress entries, if not NULL */
+    unsigned append_max_reqs;            /* Max append requests per write */
+    unsigned long long append_n_disk_bytes;      /* N. of bytes submitted */
+    unsigned long long append_n_buffered_writes; /* N. of buffered writes */
+    unsigned long long append_n_small_writes;    /* N. of small writes */
+    uint64_t append_direct_latency;   /* Avg. small direct write latency */
+    uint64_t append_buffered_latency; /* Avg. small buffered write latency */
     queue finalize_reqs;                 /* Segments waiting to be closed */
     raft_index finalize_last_index;      /* Last index of last closed seg */
     struct uv_work_s finalize_work;      /* Resize and rename segments */
@@ -74,6 +183,7 @@ struct uv
     queue snapshot_get_reqs;             /* Inflight get snapshot requests */
     struct uv_work_s snapshot_put_work;  /* Execute snapshot put requests */
     struct uvMetadata metadata;          /* Cache of metadata on disk */
+    struct uvCatalog catalog;            /* Closed segments and snapshots */
     struct uv_timer_s timer;             /* Timer for periodic ticks */
     raft_io_tick_cb tick_cb;             /* Invoked when the timer expires */
     raft_io_recv_cb recv_cb;             /* Invoked when upon RPC messages */
@@ -151,9 +261,12 @@ int uvSegmentLoadAll(struct uv *uv,
  * The memory is aligned at disk block boundary, to allow for direct I/O. */
 struct uvSegmentBuffer
 {
-    size_t block_size; /* Disk block size for direct I/O */
-    uv_buf_t arena;    /* Previously allocated memory that can be re-used */
-    size_t n;          /* Write offset */
+    size_t block_size;                 /* Disk block size for direct I/O */
+    uv_buf_t arena;                    /* Previously allocated memory */
+    size_t n;                          /* Write offset */
+    uint64_t format;                   /* Segment format version */
+    uint64_t epoch;                    /* Segment epoch, seeding checksums */
+    const struct raft_uv_codec *codec; /* Compress batches, if not NULL */
 };
 
 /* Initialize an empty buffer. */
@@ -163,8 +276,28 @@ void uvSegmentBufferInit(struct uvSegmentBuffer *b, size_t block_size);
 void uvSegmentBufferClose(struct uvSegmentBuffer *b);
 
 /* Encode the format version at the very beginning of the buffer. This function
- * must be called when the buffer is empty. */
-int uvSegmentBufferFormat(struct uvSegmentBuffer *b);
+ * must be called when the buffer is empty.
+ *
+ * If @epoch is 0, the segment uses the original format version 1, otherwise
+ * the segment uses #UV__SEGMENT_FORMAT with the given epoch. */
+int uvSegmentBufferFormat(struct uvSegmentBuffer *b, uint64_t epoch);
+
+/* Return the initial value of the batch checksums of a segment with the given
+ * epoch. */
+unsigned uvSegmentChecksumSeed(uint64_t epoch);
+
+/* Update the checksum @crc of a batch in a segment with the given format
+ * version, with the given data. */
+unsigned uvSegmentChecksum(uint64_t format,
+                           const void *buf,
+                           size_t size,
+                           unsigned crc);
+
+/* Return the number of bytes needed to store a batch with the given entries in
+ * a segment with the given format version. */
+size_t uvSegmentSizeofBatch(uint64_t format,
+                            const struct raft_entry entries[],
+                            unsigned n_entries);
 
 /* Extend the segment's buffer by encoding the given entries.
  *
@@ -191,11 +324,72 @@ void uvSegmentBufferReset(struct uvSegmentBuffer *b, unsigned retain);
 int uvSegmentCreateFirstClosed(struct uv *uv,
                                const struct raft_configuration *configuration);
 
-/* Truncate a segment that was already closed. */
+/* Truncate a segment that was already closed, removing all entries from the
+ * given index onward.
+ *
+ * The segment is truncated in place: it's first renamed according to its new
+ * end index and then cut at the boundary of the batch containing the given
+ * index, which is retained as a whole if the index is not its first one. */
 int uvSegmentTruncate(struct uv *uv,
                       struct uvSegmentInfo *segment,
                       raft_index index);
 
+/* Turn the given obsolete closed segment into an open segment with the given
+ * counter, ready to be written again. It's first renamed to a temporary name,
+ * then its header is overwritten with a recycled marker and its size is
+ * extended to the one of a regular segment if needed, and finally it's renamed
+ * to its open segment name. This is a blocking call, to be run in the
+ * threadpool. */
+int uvSegmentRecycle(struct uv *uv,
+                     const char *filename,
+                     unsigned long long counter);
+
+/* Index of the batches contained in a segment, tracking for each batch its
+ * offset in the segment file and the index of its first entry.
+ *
+ * When an open segment gets finalized, its index is appended to the segment
+ * file as a footer with the following format:
+ *
+ * [16 bytes * n] Offset and first index of each batch, little endian.
+ * [4 bytes] Number of batches n, little endian.
+ * [4 bytes] CRC32C checksum of the batch offsets and of the number of batches.
+ * [8 bytes] Magic number #UV__SEGMENT_INDEX_MAGIC.
+ *
+ * The footer is optional: a closed segment without it is just a concatenation
+ * of batches. */
+struct uvSegmentIndex
+{
+    uint64_t *slots; /* Pairs of batch offset and first index, in disk order */
+    unsigned n;      /* Number of batches */
+    unsigned cap;    /* Number of batches the slots array can hold */
+};
+
+/* Initialize an empty index. */
+void uvSegmentIndexInit(struct uvSegmentIndex *index);
+
+/* Release all memory used by the index. */
+void uvSegmentIndexClose(struct uvSegmentIndex *index);
+
+/* Add a batch starting at the given offset of the segment file, whose first
+ * entry has the given index. */
+int uvSegmentIndexAppend(struct uvSegmentIndex *index,
+                         size_t offset,
+                         raft_index first_index);
+
+/* Encode the footer of a segment holding the batches in the given index. The
+ * memory of @buf must be released with raft_free(). */
+int uvSegmentIndexEncode(const struct uvSegmentIndex *index, uv_buf_t *buf);
+
+/* Decode the footer at the end of the given segment content, if any.
+ *
+ * The @size output parameter is set to the size of the content preceding the
+ * footer, or to the full content size if there's no valid footer. If @index is
+ * not NULL, it will be filled with the decoded batches. */
+int uvSegmentIndexDecode(const void *content,
+                         size_t content_size,
+                         size_t *size,
+                         struct uvSegmentIndex *index);
+
 /* Info about a persisted snapshot stored in snapshot metadata file. */
 struct uvSnapshotInfo
 {
@@ -232,6 +426,49 @@ int uvList(struct uv *uv,
            struct uvSegmentInfo *segments[],
            size_t *n_segments);
 
+/* The catalog keeps track in memory of the closed segments and snapshots found
+ * in the data directory, so the truncate and snapshot logic don't need to scan
+ * it every time. It is built with uvList() the first time it's used, and then
+ * kept up to date by the code creating, renaming or removing those files. If
+ * it can't be updated because of an error, it gets rebuilt next time it's
+ * used.
+ *
+ * The catalog can be accessed from the threadpool. */
+int uvCatalogInit(struct uv *uv);
+void uvCatalogClose(struct uv *uv);
+
+/* Force the catalog to be rebuilt next time it's used. */
+void uvCatalogInvalidate(struct uv *uv);
+
+/* Return a copy of the closed segments in the catalog whose end index is equal
+ * to or greater than @index, sorted by index. */
+int uvCatalogSegmentsFrom(struct uv *uv,
+                          raft_index index,
+                          struct uvSegmentInfo *segments[],
+                          size_t *n_segments);
+
+/* Return a copy of the closed segments in the catalog whose end index is lower
+ * than @index, sorted by index. */
+int uvCatalogSegmentsBefore(struct uv *uv,
+                            raft_index index,
+                            struct uvSegmentInfo *segments[],
+                            size_t *n_segments);
+
+/* Return a copy of the snapshots in the catalog, older ones first. */
+int uvCatalogSnapshots(struct uv *uv,
+                       struct uvSnapshotInfo *snapshots[],
+                       size_t *n_snapshots);
+
+/* Add or remove a closed segment to or from the catalog. */
+void uvCatalogAddSegment(struct uv *uv,
+                         raft_index first_index,
+                         raft_index end_index);
+void uvCatalogRemoveSegment(struct uv *uv, raft_index first_index);
+
+/* Add or remove a snapshot to or from the catalog. */
+void uvCatalogAddSnapshot(struct uv *uv, const struct uvSnapshotInfo *info);
+void uvCatalogRemoveSnapshot(struct uv *uv, const struct uvSnapshotInfo *info);
+
 /* Request to obtain a newly prepared open segment. */
 struct uvPrepare;
 typedef void (*uvPrepareCb)(struct uvPrepare *req,
@@ -248,6 +485,15 @@ struct uvPrepare
 /* Submit a request to get a prepared open segment ready for writing. */
 void uvPrepare(struct uv *uv, struct uvPrepare *req, uvPrepareCb cb);
 
+/* Add the open segment with the given counter, which was recycled with
+ * uvSegmentRecycle() and opened with uvFileOpenFd(), to the pool of prepared
+ * segments. If @fd is -1 the segment could not be opened and is ignored. */
+void uvPrepareRecycle(struct uv *uv, unsigned long long counter, int fd);
+
+/* Invoked periodically to shrink the pool of prepared segments if they are
+ * being used at a lower rate than before. */
+void uvPrepareTick(struct uv *uv);
+
 /* Cancel all pending prepare requests and start removing all unused prepared
  * open segments. If a segment currently being created, wait for it to complete
  * and then remove it immediately. */
@@ -279,12 +525,17 @@ int uvAppendForceFinalizingCurrentSegment(struct uv *uv);
 /* Submit a request to finalize the open segment with the given counter.
  *
  * Requests are processed one at a time, to avoid ending up closing open segment
- * N + 1 before closing open segment N. */
+ * N + 1 before closing open segment N.
+ *
+ * If @index is not NULL, it must contain the batches written in the segment,
+ * and it gets appended to the closed segment. Ownership of its memory is
+ * transferred to the finalize request. */
 int uvFinalize(struct uv *uv,
                unsigned long long counter,
                size_t used,
                raft_index first_index,
-               raft_index last_index);
+               raft_index last_index,
+               struct uvSegmentIndex *index);
 
 /* Cancel all pending truncate requests. */
 void uvTruncateClose(struct uv *uv);
@@ -299,6 +550,30 @@ void uvTruncateMaybeProcessRequests(struct uv *uv);
  * pending send requests.  */
 void uvSendClose(struct uv *uv);
 
+/* Attach to the in-process hub, if one was set. */
+void uvLocalStart(struct uv *uv, const char *address);
+
+/* Hand the message over to the instance attached to our hub with the target
+ * address. Return #RAFT_NOCONNECTION if there's none, in which case the message
+ * should go through the transport. */
+int uvLocalSend(struct uv *uv,
+                struct raft_io_send *req,
+                const struct raft_message *message,
+                raft_io_send_cb cb);
+
+/* Return true if the instance attached to our hub with the given ID has not
+ * drained yet entries or snapshots we sent to it. */
+bool uvLocalBusy(struct uv *uv, unsigned id);
+
+/* Detach from the hub, dropping undelivered messages and completing the send
+ * requests that were delivered, and close the async handle. */
+void uvLocalClose(struct uv *uv, uv_close_cb cb);
+
+/* The server with the given ID has just connected to us, so it's probably up:
+ * reset the backoff of our clients connected to it, and retry right away if
+ * they're waiting for their next connection attempt. */
+void uvSendReconnect(struct uv *uv, unsigned id);
+
 /* Start receiving messages from new incoming connections. */
 int uvRecv(struct uv *uv);
 
@@ -306,6 +581,18 @@ int uvRecv(struct uv *uv);
  * requests being received.  */
 void uvRecvClose(struct uv *uv);
 
+/* Return #true if the server with the given ID has told us, over its most
+ * recent inbound connection, that it can decode compact batches. */
+bool uvRecvCanCompact(struct uv *uv, unsigned id);
+
+/* Return #true if the server with the given ID has told us, over its most
+ * recent inbound connection, that it accepts RAFT_UV_BULK connections. */
+bool uvRecvCanBulk(struct uv *uv, unsigned id);
+
+/* Return the ID of the codec that the server with the given ID has told us,
+ * over its most recent inbound connection, to be using, or #0 if none. */
+unsigned uvRecvCodec(struct uv *uv, unsigned id);
+
 /* Callback invoked after truncation has completed, possibly unblocking pending
  * snapshot put requests. */
 void uvSnapshotMaybeProcessRequests(struct uv *uv);
@@ -20,7 +20,9 @@
  *   queue the request and link it to the newly requested segment.
  *
  * - Wait for any pending write against the current segment to complete, and
- *   also for the prepare request if we asked for a new segment.
+ *   also for the prepare request if we asked for a new segment. If group
+ *   commit is enabled, also wait for the linger window to expire, unless
+ *   enough data has accumulated in the meantime.
  *
  * - Submit a write request for the entries in this append request. The write
  *   request might contain other entries that might have accumulated in the
@@ -39,6 +41,19 @@
  * callbacks.
  **/
 
+/* Size of the segment header: format version and epoch. */
+#define SEGMENT_HEADER_SIZE (sizeof(uint64_t) * 2)
+
+/* When direct I/O is available, every write rewrites the whole blocks it
+ * touches, so a small write costs at least a full block. Writes whose new data
+ * is at most 1/WRITE_SMALL_RATIO of the blocks they would rewrite are instead
+ * submitted in buffered mode, which only writes the new data, unless buffered
+ * writes turned out to be slower than direct ones on this device. Every
+ * WRITE_PROBE_INTERVAL small writes, the other mode is used, to keep the
+ * latency estimate of both modes up to date. */
+#define WRITE_SMALL_RATIO 2
+#define WRITE_PROBE_INTERVAL 32
+
 struct segment
 {
     struct uv *uv;                  /* Our writer */
@@ -49,10 +64,15 @@ struct segment
     raft_index first_index;         /* Index of the first entry written */
     raft_index last_index;          /* Index of the last entry written */
     size_t size;                    /* Total number of bytes used */
+    size_t capacity;                /* Maximum number of bytes to use */
     unsigned next_block;            /* Next segment block to write */
     struct uvSegmentBuffer pending; /* Buffer for data yet to be written */
+    struct uvSegmentIndex index;    /* Offsets of the batches written */
     uv_buf_t buf;                   /* Write buffer for current write */
     size_t written;                 /* Number of bytes actually written */
+    bool buffered;                  /* Current write is in buffered mode */
+    bool small;                     /* Current write is a small one */
+    uint64_t write_started_at;      /* When the current write was submitted */
     queue queue;                    /* Segment queue */
     bool finalize;                  /* Finalize the segment after writing */
 };
@@ -76,15 +96,10 @@ static void initRequest(struct append *r,
                         unsigned n,
                         raft_io_append_cb cb)
 {
-    unsigned i;
     r->req = req;
     r->entries = entries;
     r->n = n;
-    r->size = sizeof(uint32_t) * 2;       /* CRC checksums */
-    r->size += uvSizeofBatchHeader(r->n); /* Batch header */
-    for (i = 0; i < r->n; i++) {          /* Entries data */
-        r->size += bytePad64(r->entries[i].buf.len);
-    }
+    r->size = uvSegmentSizeofBatch(UV__SEGMENT_FORMAT, entries, n);
     req->cb = cb;
 }
 
@@ -92,8 +107,20 @@ static void initRequest(struct append *r,
  * greater than @size. */
 static bool segmentHasEnoughSpareCapacity(struct segment *s, size_t size)
 {
-    size_t cap = s->uv->block_size * s->uv->n_blocks;
-    return s->size + size <= cap;
+    return s->size + size <= s->capacity;
+}
+
+/* Grow the capacity of a segment that has not been written yet, so it can hold
+ * a batch of @size bytes which would not fit in a regular segment. The file
+ * gets extended past its preallocated size by the write itself. */
+static void growSegmentCapacity(struct segment *s, size_t size)
+{
+    size_t block_size = s->uv->block_size;
+    assert(s->size == SEGMENT_HEADER_SIZE);
+    s->capacity = s->size + size;
+    if (s->capacity % block_size != 0) {
+        s->capacity += block_size - s->capacity % block_size;
+    }
 }
 
 /* Add @size bytes to the number of bytes that the segment will hold. The actual
@@ -109,24 +136,46 @@ static void reserveSegmentCapacity(struct segment *s, size_t size)
  * data for these new entries will be appended. */
 static int encodeEntriesToSegmentWriteBuf(struct segment *s, struct append *req)
 {
+    size_t n;    /* Size of the write buffer before appending the batch */
+    size_t size; /* Actual size of the batch */
     int rv;
     assert(req->segment == s);
-    assert(s->written + req->size <= s->uv->block_size * s->uv->n_blocks);
+    assert(s->written + req->size <= s->capacity);
 
     /* If this is the very first write to the segment, we need to include the
-     * format version */
+     * format version and the epoch. A non-zero epoch lets the load logic tell
+     * our batches apart from stale data left in a recycled segment file. */
     if (s->pending.n == 0 && s->next_block == 0) {
-        rv = uvSegmentBufferFormat(&s->pending);
+        uint64_t epoch = uv_hrtime();
+        if (epoch == 0) {
+            epoch = 1;
+        }
+        rv = uvSegmentBufferFormat(&s->pending, epoch);
         if (rv != 0) {
             return rv;
         }
     }
 
+    rv = uvSegmentIndexAppend(&s->index,
+                              s->next_block * s->uv->block_size + s->pending.n,
+                              s->last_index + 1);
+    if (rv != 0) {
+        return rv;
+    }
+
+    n = s->pending.n;
     rv = uvSegmentBufferAppend(&s->pending, req->entries, req->n);
     if (rv != 0) {
         return rv;
     }
 
+    /* If the batch got compressed it takes less space than what was reserved
+     * for it, so give back the difference. */
+    size = s->pending.n - n;
+    assert(size <= req->size);
+    s->size -= req->size - size;
+    req->size = size;
+
     s->last_index += req->n;
 
     return 0;
@@ -138,7 +187,8 @@ static void finalizeSegment(struct segment *s)
     struct uv *uv = s->uv;
     int rv;
 
-    rv = uvFinalize(uv, s->counter, s->written, s->first_index, s->last_index);
+    rv = uvFinalize(uv, s->counter, s->written, s->first_index, s->last_index,
+                    &s->index);
     if (rv != 0) {
         uv->errored = true;
         /* We failed to submit the finalize request, but let's still close the
@@ -176,6 +226,30 @@ static void flushRequests(queue *q, int status)
     }
 }
 
+/* Update the latency estimate of the write mode used by a small write that
+ * has just completed, smoothing it out with an exponential moving average. */
+static void updateWriteLatency(struct segment *s)
+{
+    struct uv *uv = s->uv;
+    uint64_t *latency;
+    uint64_t elapsed;
+
+    if (!s->small) {
+        return;
+    }
+    latency = s->buffered ? &uv->append_buffered_latency
+                          : &uv->append_direct_latency;
+    elapsed = uv_hrtime() - s->write_started_at;
+    if (elapsed == 0) {
+        elapsed = 1;
+    }
+    if (*latency == 0) {
+        *latency = elapsed;
+    } else {
+        *latency = (*latency * 3 + elapsed) / 4;
+    }
+}
+
 static void processRequests(struct uv *uv);
 static void writeSegmentCb(struct uvFileWrite *write, const int status)
 {
@@ -186,8 +260,10 @@ static void writeSegmentCb(struct uvFileWrite *write, const int status)
 
     assert(uv->state != UV__CLOSED);
 
-    assert(s->buf.len % uv->block_size == 0);
-    assert(s->buf.len >= uv->block_size);
+    if (!s->buffered) {
+        assert(s->buf.len % uv->block_size == 0);
+        assert(s->buf.len >= uv->block_size);
+    }
 
     /* Check if the write was successful. */
     if (status != (int)s->buf.len) {
@@ -199,6 +275,8 @@ static void writeSegmentCb(struct uvFileWrite *write, const int status)
         }
         result = RAFT_IOERR;
         uv->errored = true;
+    } else {
+        updateWriteLatency(s);
     }
 
     s->written = s->next_block * uv->block_size + s->pending.n;
@@ -229,7 +307,8 @@ static void writeSegmentCb(struct uvFileWrite *write, const int status)
      *   case we advance the current block counter, reset the first buffer and
      *   set the scheduled marker to 0.
      */
-    n_blocks = s->buf.len / uv->block_size; /* Number of blocks written. */
+    n_blocks = (unsigned)((s->pending.n + uv->block_size - 1) /
+                          uv->block_size); /* Number of blocks touched */
     if (s->pending.n < uv->block_size) {
         /* Nothing to do */
         assert(n_blocks == 1);
@@ -239,7 +318,7 @@ static void writeSegmentCb(struct uvFileWrite *write, const int status)
         uvSegmentBufferReset(&s->pending, 0);
     } else {
         assert(s->pending.n > uv->block_size);
-        assert(s->buf.len > uv->block_size);
+        assert(s->buffered || s->buf.len > uv->block_size);
 
         if (s->pending.n % uv->block_size > 0) {
             s->next_block += n_blocks - 1;
@@ -258,16 +337,78 @@ static void writeSegmentCb(struct uvFileWrite *write, const int status)
     processRequests(uv);
 }
 
+/* Decide whether to write the @size bytes of new data in the write buffer in
+ * buffered mode, as opposed to rewriting the @blocks_size bytes of the blocks
+ * they touch in direct mode. */
+static bool shouldWriteBuffered(struct segment *s,
+                                size_t size,
+                                size_t blocks_size)
+{
+    struct uv *uv = s->uv;
+    bool buffered;
+
+    /* Without direct I/O writes go through the page cache anyways, so there's
+     * no point in rewriting whole blocks. */
+    if (!uv->direct_io) {
+        s->small = false;
+        return true;
+    }
+
+    s->small = size * WRITE_SMALL_RATIO <= blocks_size;
+    if (!s->small) {
+        return false;
+    }
+
+    buffered = uv->append_buffered_latency == 0 ||
+               uv->append_direct_latency == 0 ||
+               uv->append_buffered_latency <= uv->append_direct_latency;
+
+    uv->append_n_small_writes++;
+    if (uv->append_n_small_writes % WRITE_PROBE_INTERVAL == 0) {
+        buffered = !buffered;
+    }
+
+    return buffered;
+}
+
 /* Submit a file write request to append the entries encoded in the write buffer
  * of the given segment. */
 static int writeSegment(struct segment *s)
 {
+    struct uv *uv = s->uv;
+    size_t offset; /* File offset of the first block to write */
+    size_t skip;   /* Bytes of the first block that were already written */
+    size_t size;   /* Bytes of new data to write */
     int rv;
+
     assert(s->file != NULL);
     assert(s->pending.n > 0);
+
     uvSegmentBufferFinalize(&s->pending, &s->buf);
-    rv = uvFileWrite(s->file, &s->write, &s->buf, 1,
-                     s->next_block * s->uv->block_size, writeSegmentCb);
+    offset = s->next_block * uv->block_size;
+    assert(s->written >= offset);
+    skip = s->written - offset;
+    assert(skip < s->pending.n);
+    size = s->pending.n - skip;
+
+    s->buffered = shouldWriteBuffered(s, size, s->buf.len);
+    rv = uvFileSetBuffered(s->file, s->buffered);
+    if (rv != 0) {
+        uvErrorf(uv, "set buffered mode: %s", uv_strerror(rv));
+        return RAFT_IOERR;
+    }
+
+    /* In buffered mode only the new data gets written. */
+    if (s->buffered) {
+        s->buf.base += skip;
+        s->buf.len = size;
+        offset += skip;
+        uv->append_n_buffered_writes++;
+    }
+    uv->append_n_disk_bytes += s->buf.len;
+
+    s->write_started_at = uv_hrtime();
+    rv = uvFileWrite(s->file, &s->write, &s->buf, 1, offset, writeSegmentCb);
     if (rv != 0) {
         return rv;
     }
@@ -286,6 +427,52 @@ static struct segment *currentSegment(struct uv *uv)
     return QUEUE_DATA(head, struct segment, queue);
 }
 
+/* Return #true if the group commit window is still open and the pending
+ * requests have not yet reached the size that closes it early, meaning that we
+ * should wait for more requests to come in before writing. */
+static bool shouldLinger(struct uv *uv)
+{
+    queue *head;
+    size_t size;
+
+    if (uv->append_linger == 0 || uv->closing) {
+        return false;
+    }
+    if (!uv_is_active((struct uv_handle_s *)&uv->append_timer)) {
+        return false;
+    }
+    if (uv->append_linger_bytes == 0) {
+        return true;
+    }
+
+    size = 0;
+    QUEUE_FOREACH(head, &uv->append_pending_reqs)
+    {
+        struct append *r = QUEUE_DATA(head, struct append, queue);
+        size += r->size;
+    }
+
+    return size < uv->append_linger_bytes;
+}
+
+/* Update the group commit counters after submitting a write containing the
+ * given requests. */
+static void updateStats(struct uv *uv, queue *q, unsigned n_reqs)
+{
+    queue *head;
+    QUEUE_FOREACH(head, q)
+    {
+        struct append *r = QUEUE_DATA(head, struct append, queue);
+        uv->append_n_entries += r->n;
+        uv->append_n_bytes += r->size;
+    }
+    uv->append_n_writes++;
+    uv->append_n_reqs += n_reqs;
+    if (n_reqs > uv->append_max_reqs) {
+        uv->append_max_reqs = n_reqs;
+    }
+}
+
 /* Process pending append requests.
  *
  * Submit the relevant write request if the target open segment is available. */
@@ -318,6 +505,11 @@ static void processRequests(struct uv *uv)
         return;
     }
 
+    /* If the group commit window is open, let's wait for more requests. */
+    if (shouldLinger(uv)) {
+        return;
+    }
+
 prepare:
     segment = currentSegment(uv);
     assert(segment != NULL);
@@ -368,6 +560,8 @@ prepare:
         return;
     }
 
+    updateStats(uv, &q, n_reqs);
+
     while (!QUEUE_IS_EMPTY(&q)) {
         head = QUEUE_HEAD(&q);
         QUEUE_REMOVE(head);
@@ -379,6 +573,9 @@ prepare:
         goto err;
     }
 
+    /* Requests arriving from now on will open a new group commit window. */
+    uv_timer_stop(&uv->append_timer);
+
     return;
 
 err:
@@ -399,9 +596,10 @@ static void prepareSegmentCb(struct uvPrepare *req,
         if (status == 0) {
             uvFileClose(file, (uvFileCloseCb)raft_free);
             /* Ignore errors, as there's nothing we can do about it. */
-            uvFinalize(uv, counter, 0, 0, 0);
+            uvFinalize(uv, counter, 0, 0, 0, NULL);
         }
         uvSegmentBufferClose(&segment->pending);
+        uvSegmentIndexClose(&segment->index);
         raft_free(segment);
         return;
     }
@@ -431,10 +629,16 @@ static void initSegment(struct segment *s, struct uv *uv)
     s->file = NULL;
     s->first_index = uv->append_next_index;
     s->last_index = s->first_index - 1;
-    s->size = sizeof(uint64_t) /* Format version */;
+    s->size = SEGMENT_HEADER_SIZE;
+    s->capacity = uv->block_size * uv->n_blocks;
     s->next_block = 0;
     uvSegmentBufferInit(&s->pending, uv->block_size);
+    s->pending.codec = uv->codec;
+    uvSegmentIndexInit(&s->index);
     s->written = 0;
+    s->buffered = false;
+    s->small = false;
+    s->write_started_at = 0;
     s->finalize = false;
 }
 
@@ -481,13 +685,20 @@ void uvAppendFixPreparedSegmentFirstIndex(struct uv *uv)
     }
     assert(s->first_index == 1);
     assert(s->last_index == 0);
-    assert(s->size == sizeof(uint64_t));
+    assert(s->size == SEGMENT_HEADER_SIZE);
     assert(s->next_block == 0);
     assert(s->written == 0);
     s->first_index = uv->append_next_index;
     s->last_index = s->first_index - 1;
 }
 
+/* Invoked when the group commit window expires. */
+static void lingerTimerCb(struct uv_timer_s *timer)
+{
+    struct uv *uv = timer->data;
+    uvAppendMaybeProcessRequests(uv);
+}
+
 /* Enqueue an append entries request */
 static int enqueueRequest(struct uv *uv, struct append *req)
 {
@@ -499,12 +710,6 @@ static int enqueueRequest(struct uv *uv, struct append *req)
     assert(req->n > 0);
     assert(uv->append_next_index > 0);
 
-    /* TODO: at the moment we don't allow a single batch to exceed the size of a
-     * segment. */
-    if (req->size > uv->block_size * uv->n_blocks + sizeof(uint64_t)) {
-        return RAFT_TOOBIG;
-    }
-
     /* If we have no segments yet, it means this is the very first append, and
      * we need to add a new segment. Otherwise we check if the last segment has
      * enough room for this batch of entries. */
@@ -528,12 +733,28 @@ static int enqueueRequest(struct uv *uv, struct append *req)
     }
 
     segment = lastSegment(uv); /* Get the last added segment */
+
+    /* If this batch is larger than a regular segment, the segment we just
+     * requested will be dedicated to it. */
+    if (!fits && !segmentHasEnoughSpareCapacity(segment, req->size)) {
+        growSegmentCapacity(segment, req->size);
+    }
+
     reserveSegmentCapacity(segment, req->size);
 
     req->segment = segment;
     QUEUE_PUSH(&uv->append_pending_reqs, &req->queue);
     uv->append_next_index += req->n;
 
+    /* If group commit is enabled and this is the first request since the last
+     * write was submitted, open a new window. */
+    if (uv->append_linger > 0 &&
+        !uv_is_active((struct uv_handle_s *)&uv->append_timer)) {
+        rv = uv_timer_start(&uv->append_timer, lingerTimerCb,
+                            uv->append_linger, 0);
+        assert(rv == 0); /* This should never fail */
+    }
+
     processRequests(uv);
 
     return 0;
@@ -638,6 +859,7 @@ void uvAppendClose(struct uv *uv)
 {
     struct segment *s;
 
+    uv_timer_stop(&uv->append_timer);
     flushRequests(&uv->append_pending_reqs, RAFT_CANCELED);
     finalizeCurrentSegment(uv);
 
@@ -0,0 +1,313 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "assert.h"
+#include "uv.h"
+
+int uvCatalogInit(struct uv *uv)
+{
+    struct uvCatalog *c = &uv->catalog;
+    int rv;
+    rv = uv_mutex_init(&c->mutex);
+    if (rv != 0) {
+        return RAFT_NOMEM;
+    }
+    c->valid = false;
+    c->segments = NULL;
+    c->n_segments = 0;
+    c->snapshots = NULL;
+    c->n_snapshots = 0;
+    return 0;
+}
+
+/* Release the content of the catalog and mark it as invalid. */
+static void clear(struct uvCatalog *c)
+{
+    if (c->segments != NULL) {
+        raft_free(c->segments);
+    }
+    if (c->snapshots != NULL) {
+        raft_free(c->snapshots);
+    }
+    c->valid = false;
+    c->segments = NULL;
+    c->n_segments = 0;
+    c->snapshots = NULL;
+    c->n_snapshots = 0;
+}
+
+void uvCatalogClose(struct uv *uv)
+{
+    clear(&uv->catalog);
+    uv_mutex_destroy(&uv->catalog.mutex);
+}
+
+void uvCatalogInvalidate(struct uv *uv)
+{
+    struct uvCatalog *c = &uv->catalog;
+    uv_mutex_lock(&c->mutex);
+    clear(c);
+    uv_mutex_unlock(&c->mutex);
+}
+
+/* Scan the data directory to build the catalog, if it's not up to date. Must
+ * be called with the catalog mutex held. */
+static int ensureValid(struct uv *uv)
+{
+    struct uvCatalog *c = &uv->catalog;
+    struct uvSegmentInfo *segments;
+    size_t n_segments;
+    size_t n_closed;
+    size_t i;
+    int rv;
+
+    if (c->valid) {
+        return 0;
+    }
+
+    clear(c);
+    rv = uvList(uv, &c->snapshots, &c->n_snapshots, &segments, &n_segments);
+    if (rv != 0) {
+        return rv;
+    }
+
+    /* Only keep closed segments, which come before open ones. */
+    n_closed = 0;
+    for (i = 0; i < n_segments; i++) {
+        if (segments[i].is_open) {
+            break;
+        }
+        n_closed++;
+    }
+    if (n_closed == 0 && segments != NULL) {
+        raft_free(segments);
+        segments = NULL;
+    }
+    c->segments = segments;
+    c->n_segments = n_closed;
+    c->valid = true;
+
+    return 0;
+}
+
+/* Copy the catalog's closed segments in the range [@start, @end). */
+static int copySegments(struct uvCatalog *c,
+                        size_t start,
+                        size_t end,
+                        struct uvSegmentInfo *segments[],
+                        size_t *n_segments)
+{
+    *segments = NULL;
+    *n_segments = end - start;
+    if (*n_segments == 0) {
+        return 0;
+    }
+    *segments = raft_malloc(*n_segments * sizeof **segments);
+    if (*segments == NULL) {
+        return RAFT_NOMEM;
+    }
+    memcpy(*segments, &c->segments[start], *n_segments * sizeof **segments);
+    return 0;
+}
+
+/* Return the position of the first closed segment whose end index is equal to
+ * or greater than @index. */
+static size_t searchSegments(struct uvCatalog *c, raft_index index)
+{
+    size_t low = 0;
+    size_t high = c->n_segments;
+    while (low < high) {
+        size_t middle = low + (high - low) / 2;
+        if (c->segments[middle].end_index < index) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    return low;
+}
+
+int uvCatalogSegmentsFrom(struct uv *uv,
+                          raft_index index,
+                          struct uvSegmentInfo *segments[],
+                          size_t *n_segments)
+{
+    struct uvCatalog *c = &uv->catalog;
+    int rv;
+    uv_mutex_lock(&c->mutex);
+    rv = ensureValid(uv);
+    if (rv == 0) {
+        rv = copySegments(c, searchSegments(c, index), c->n_segments, segments,
+                          n_segments);
+    }
+    uv_mutex_unlock(&c->mutex);
+    return rv;
+}
+
+int uvCatalogSegmentsBefore(struct uv *uv,
+                            raft_index index,
+                            struct uvSegmentInfo *segments[],
+                            size_t *n_segments)
+{
+    struct uvCatalog *c = &uv->catalog;
+    int rv;
+    uv_mutex_lock(&c->mutex);
+    rv = ensureValid(uv);
+    if (rv == 0) {
+        rv = copySegments(c, 0, searchSegments(c, index), segments, n_segments);
+    }
+    uv_mutex_unlock(&c->mutex);
+    return rv;
+}
+
+int uvCatalogSnapshots(struct uv *uv,
+                       struct uvSnapshotInfo *snapshots[],
+                       size_t *n_snapshots)
+{
+    struct uvCatalog *c = &uv->catalog;
+    int rv;
+    uv_mutex_lock(&c->mutex);
+    rv = ensureValid(uv);
+    if (rv != 0) {
+        goto out;
+    }
+    *snapshots = NULL;
+    *n_snapshots = c->n_snapshots;
+    if (*n_snapshots == 0) {
+        goto out;
+    }
+    *snapshots = raft_malloc(*n_snapshots * sizeof **snapshots);
+    if (*snapshots == NULL) {
+        rv = RAFT_NOMEM;
+        goto out;
+    }
+    memcpy(*snapshots, c->snapshots, *n_snapshots * sizeof **snapshots);
+out:
+    uv_mutex_unlock(&c->mutex);
+    return rv;
+}
+
+void uvCatalogAddSegment(struct uv *uv,
+                         raft_index first_index,
+                         raft_index end_index)
+{
+    struct uvCatalog *c = &uv->catalog;
+    struct uvSegmentInfo *segments;
+    struct uvSegmentInfo *segment;
+    size_t i;
+
+    uv_mutex_lock(&c->mutex);
+    if (!c->valid) {
+        goto out;
+    }
+
+    /* The segment might have been already picked up by a directory scan
+     * happening after it was renamed. */
+    i = searchSegments(c, end_index);
+    if (i < c->n_segments && c->segments[i].first_index == first_index) {
+        goto out;
+    }
+
+    segments =
+        raft_realloc(c->segments, (c->n_segments + 1) * sizeof *segments);
+    if (segments == NULL) {
+        clear(c);
+        goto out;
+    }
+    c->segments = segments;
+
+    /* Segments are normally added at the end, as they get closed. */
+    memmove(&c->segments[i + 1], &c->segments[i],
+            (c->n_segments - i) * sizeof *segments);
+    c->n_segments++;
+
+    segment = &c->segments[i];
+    segment->is_open = false;
+    segment->first_index = first_index;
+    segment->end_index = end_index;
+    sprintf(segment->filename, UV__CLOSED_TEMPLATE, first_index, end_index);
+
+out:
+    uv_mutex_unlock(&c->mutex);
+}
+
+void uvCatalogRemoveSegment(struct uv *uv, raft_index first_index)
+{
+    struct uvCatalog *c = &uv->catalog;
+    size_t i;
+
+    uv_mutex_lock(&c->mutex);
+    if (!c->valid) {
+        goto out;
+    }
+    /* The segment might be missing if the catalog was built after the file
+     * was removed. */
+    i = searchSegments(c, first_index);
+    if (i == c->n_segments || c->segments[i].first_index != first_index) {
+        goto out;
+    }
+    memmove(&c->segments[i], &c->segments[i + 1],
+            (c->n_segments - i - 1) * sizeof *c->segments);
+    c->n_segments--;
+
+out:
+    uv_mutex_unlock(&c->mutex);
+}
+
+/* Return the position of the snapshot with the given metadata filename, or
+ * the number of snapshots if there's none. */
+static size_t searchSnapshots(struct uvCatalog *c, const char *filename)
+{
+    size_t i;
+    for (i = 0; i < c->n_snapshots; i++) {
+        if (strcmp(c->snapshots[i].filename, filename) == 0) {
+            break;
+        }
+    }
+    return i;
+}
+
+void uvCatalogAddSnapshot(struct uv *uv, const struct uvSnapshotInfo *info)
+{
+    struct uvCatalog *c = &uv->catalog;
+    struct uvSnapshotInfo *snapshots;
+
+    uv_mutex_lock(&c->mutex);
+    if (!c->valid || searchSnapshots(c, info->filename) < c->n_snapshots) {
+        goto out;
+    }
+    snapshots =
+        raft_realloc(c->snapshots, (c->n_snapshots + 1) * sizeof *snapshots);
+    if (snapshots == NULL) {
+        clear(c);
+        goto out;
+    }
+    c->snapshots = snapshots;
+    c->snapshots[c->n_snapshots] = *info;
+    c->n_snapshots++;
+    uvSnapshotSort(c->snapshots, c->n_snapshots);
+
+out:
+    uv_mutex_unlock(&c->mutex);
+}
+
+void uvCatalogRemoveSnapshot(struct uv *uv, const struct uvSnapshotInfo *info)
+{
+    struct uvCatalog *c = &uv->catalog;
+    size_t i;
+
+    uv_mutex_lock(&c->mutex);
+    if (!c->valid) {
+        goto out;
+    }
+    i = searchSnapshots(c, info->filename);
+    if (i == c->n_snapshots) {
+        goto out;
+    }
+    memmove(&c->snapshots[i], &c->snapshots[i + 1],
+            (c->n_snapshots - i - 1) * sizeof *c->snapshots);
+    c->n_snapshots--;
+
+out:
+    uv_mutex_unlock(&c->mutex);
+}
@@ -0,0 +1,297 @@
+#include <string.h>
+
+#include "assert.h"
+#include "uv_codec.h"
+
+/* The built-in codec uses a byte-oriented LZ77 format similar to LZ4's block
+ * format. The compressed data is a sequence of:
+ *
+ * [1 byte ] Token: number of literals in the upper 4 bits, match length minus
+ *           LZ_MIN_MATCH in the lower 4 bits.
+ * [  ...  ] If the number of literals is 15 or more, the rest of it as a
+ *           sequence of bytes, the last of which is less than 255.
+ * [  ...  ] Literals, copied as they are.
+ * [2 bytes] Distance back from the current position where the match starts,
+ *           little endian.
+ * [  ...  ] If the match length is 15 or more, the rest of it, encoded like
+ *           the number of literals.
+ *
+ * The last sequence only has literals, and ends right after them. */
+#define LZ_MIN_MATCH 4
+#define LZ_MAX_DISTANCE 65535
+#define LZ_HASH_BITS 12
+
+static uint32_t lzRead32(const uint8_t *p)
+{
+    uint32_t value;
+    memcpy(&value, p, sizeof value);
+    return value;
+}
+
+static unsigned lzHash(uint32_t value)
+{
+    return (value * 2654435761U) >> (32 - LZ_HASH_BITS);
+}
+
+/* Write the remainder of a literals or match length. */
+static int lzPutLength(uint8_t **cursor, const uint8_t *end, size_t length)
+{
+    for (; length >= 255; length -= 255) {
+        if (*cursor == end) {
+            return -1;
+        }
+        *(*cursor)++ = 255;
+    }
+    if (*cursor == end) {
+        return -1;
+    }
+    *(*cursor)++ = (uint8_t)length;
+    return 0;
+}
+
+/* Read the remainder of a literals or match length. */
+static int lzGetLength(const uint8_t **cursor,
+                       const uint8_t *end,
+                       size_t *length)
+{
+    uint8_t byte;
+    do {
+        if (*cursor == end) {
+            return -1;
+        }
+        byte = *(*cursor)++;
+        *length += byte;
+    } while (byte == 255);
+    return 0;
+}
+
+/* Write a sequence with the given literals, followed by a match unless
+ * @match_length is 0. */
+static int lzPutSequence(uint8_t **cursor,
+                         const uint8_t *end,
+                         const uint8_t *literals,
+                         size_t n_literals,
+                         size_t distance,
+                         size_t match_length)
+{
+    uint8_t *token = *cursor;
+    size_t length = match_length > 0 ? match_length - LZ_MIN_MATCH : 0;
+
+    if (*cursor == end) {
+        return -1;
+    }
+    (*cursor)++;
+    *token = (uint8_t)(((n_literals < 15 ? n_literals : 15) << 4) |
+                       (length < 15 ? length : 15));
+    if (n_literals >= 15 && lzPutLength(cursor, end, n_literals - 15) != 0) {
+        return -1;
+    }
+    if ((size_t)(end - *cursor) < n_literals) {
+        return -1;
+    }
+    memcpy(*cursor, literals, n_literals);
+    *cursor += n_literals;
+
+    if (match_length == 0) {
+        return 0;
+    }
+    if (end - *cursor < 2) {
+        return -1;
+    }
+    *(*cursor)++ = (uint8_t)(distance & 0xff);
+    *(*cursor)++ = (uint8_t)(distance >> 8);
+    if (length >= 15 && lzPutLength(cursor, end, length - 15) != 0) {
+        return -1;
+    }
+    return 0;
+}
+
+static int lzCompress(const void *src, size_t size, void *dst, size_t *dst_size)
+{
+    size_t table[1 << LZ_HASH_BITS]; /* Last position of each 4-byte hash */
+    const uint8_t *in = src;
+    uint8_t *cursor = dst;
+    const uint8_t *end = cursor + *dst_size;
+    size_t anchor = 0; /* Start of the pending literals */
+    size_t pos = 0;
+
+    memset(table, 0, sizeof table);
+
+    while (size >= LZ_MIN_MATCH && pos <= size - LZ_MIN_MATCH) {
+        uint32_t value = lzRead32(in + pos);
+        unsigned hash = lzHash(value);
+        size_t candidate = table[hash];
+        size_t length;
+
+        table[hash] = pos;
+        if (candidate >= pos || pos - candidate > LZ_MAX_DISTANCE ||
+            lzRead32(in + candidate) != value) {
+            pos++;
+            continue;
+        }
+
+        length = LZ_MIN_MATCH;
+        while (pos + length < size &&
+               in[candidate + length] == in[pos + length]) {
+            length++;
+        }
+        if (lzPutSequence(&cursor, end, in + anchor, pos - anchor,
+                          pos - candidate, length) != 0) {
+            return -1;
+        }
+        pos += length;
+        anchor = pos;
+    }
+
+    if (lzPutSequence(&cursor, end, in + anchor, size - anchor, 0, 0) != 0) {
+        return -1;
+    }
+
+    *dst_size = (size_t)(cursor - (uint8_t *)dst);
+    return 0;
+}
+
+static int lzDecompress(const void *src,
+                        size_t size,
+                        void *dst,
+                        size_t dst_size)
+{
+    const uint8_t *in = src;
+    const uint8_t *in_end = in + size;
+    uint8_t *out = dst;
+    uint8_t *out_end = out + dst_size;
+
+    for (;;) {
+        uint8_t token;
+        size_t n_literals;
+        size_t distance;
+        size_t length;
+
+        if (in == in_end) {
+            return -1;
+        }
+        token = *in++;
+        n_literals = token >> 4;
+
+        if (n_literals == 15 && lzGetLength(&in, in_end, &n_literals) != 0) {
+            return -1;
+        }
+        if ((size_t)(in_end - in) < n_literals ||
+            (size_t)(out_end - out) < n_literals) {
+            return -1;
+        }
+        memcpy(out, in, n_literals);
+        in += n_literals;
+        out += n_literals;
+
+        /* The last sequence has no match. */
+        if (in == in_end) {
+            break;
+        }
+
+        if (in_end - in < 2) {
+            return -1;
+        }
+        distance = (size_t)in[0] | ((size_t)in[1] << 8);
+        in += 2;
+        if (distance == 0 || distance > (size_t)(out - (uint8_t *)dst)) {
+            return -1;
+        }
+
+        length = token & 15;
+        if (length == 15 && lzGetLength(&in, in_end, &length) != 0) {
+            return -1;
+        }
+        length += LZ_MIN_MATCH;
+        if ((size_t)(out_end - out) < length) {
+            return -1;
+        }
+
+        /* The match can overlap with the bytes it produces. */
+        for (; length > 0; length--, out++) {
+            *out = *(out - distance);
+        }
+    }
+
+    return out == out_end ? 0 : -1;
+}
+
+static const struct raft_uv_codec lz = {RAFT_UV_CODEC_LZ, lzCompress,
+                                        lzDecompress};
+
+const struct raft_uv_codec *raft_uv_codec_lz(void)
+{
+    return &lz;
+}
+
+const struct raft_uv_codec *uvCodecLookup(const struct raft_uv_codec *codec,
+                                          unsigned id)
+{
+    if (codec != NULL && codec->id == id) {
+        return codec;
+    }
+    if (id == RAFT_UV_CODEC_LZ) {
+        return &lz;
+    }
+    return NULL;
+}
+
+int uvCodecCompress(const struct raft_uv_codec *codec,
+                    const struct raft_entry entries[],
+                    unsigned n,
+                    void *dst,
+                    size_t *size)
+{
+    void *src;
+    size_t src_size;
+    void *cursor;
+    unsigned i;
+    int rv;
+
+    /* The codec needs contiguous data, so copy it unless there's only one
+     * entry. */
+    if (n == 1) {
+        src = entries[0].buf.base;
+        src_size = entries[0].buf.len;
+    } else {
+        src_size = 0;
+        for (i = 0; i < n; i++) {
+            src_size += entries[i].buf.len;
+        }
+        src = raft_malloc(src_size);
+        if (src == NULL) {
+            return RAFT_NOMEM;
+        }
+        cursor = src;
+        for (i = 0; i < n; i++) {
+            memcpy(cursor, entries[i].buf.base, entries[i].buf.len);
+            cursor = (uint8_t *)cursor + entries[i].buf.len;
+        }
+    }
+
+    rv = codec->compress(src, src_size, dst, size);
+
+    if (n != 1) {
+        raft_free(src);
+    }
+
+    return rv == 0 ? 0 : RAFT_TOOBIG;
+}
+
+int uvCodecDecompress(const struct raft_uv_codec *codec,
+                      const void *src,
+                      size_t size,
+                      size_t dst_size,
+                      void **dst)
+{
+    assert(dst_size > 0);
+    *dst = raft_malloc(dst_size);
+    if (*dst == NULL) {
+        return RAFT_NOMEM;
+    }
+    if (codec->decompress(src, size, *dst, dst_size) != 0) {
+        raft_free(*dst);
+        return RAFT_MALFORMED;
+    }
+    return 0;
+}
@@ -0,0 +1,37 @@
+/* Compression of entries data for the libuv-based @raft_io backend. */
+
+#ifndef UV_CODEC_H_
+#define UV_CODEC_H_
+
+#include "../include/raft/uv.h"
+
+/* Batches whose data is smaller than this are never compressed, since the
+ * savings would hardly pay off. */
+#define UV__CODEC_MIN_SIZE 128
+
+/* Return the codec with the given ID, either the built-in one or @codec, or
+ * #NULL if no such codec is known. */
+const struct raft_uv_codec *uvCodecLookup(const struct raft_uv_codec *codec,
+                                          unsigned id);
+
+/* Compress the concatenated data of the given entries into @dst, which can hold
+ * up to @size bytes, and set @size to the size of the compressed data.
+ *
+ * Return #RAFT_TOOBIG if the compressed data doesn't fit in @dst, which is
+ * typically sized so that only compression that actually saves space
+ * succeeds. */
+int uvCodecCompress(const struct raft_uv_codec *codec,
+                    const struct raft_entry entries[],
+                    unsigned n,
+                    void *dst,
+                    size_t *size);
+
+/* Decompress the @size bytes at @src into a newly allocated buffer of exactly
+ * @dst_size bytes. Return #RAFT_MALFORMED if the data is not valid. */
+int uvCodecDecompress(const struct raft_uv_codec *codec,
+                      const void *src,
+                      size_t size,
+                      size_t dst_size,
+                      void **dst);
+
+#endif /* UV_CODEC_H_ */
@@ -5,6 +5,7 @@
 #include "assert.h"
 #include "byte.h"
 #include "configuration.h"
+#include "uv_codec.h"
 #include "uv_encoding.h"
 
 /**
@@ -28,8 +29,18 @@ static size_t sizeofRequestVoteResult()
            sizeof(uint64_t) /* Vote granted. */;
 }
 
-static size_t sizeofAppendEntries(const struct raft_append_entries *p)
+static size_t sizeofAppendEntries(const struct raft_append_entries *p,
+                                  bool compact,
+                                  bool compressed)
 {
+    if (compact) {
+        return sizeof(uint64_t) + /* Leader's term. */
+               sizeof(uint64_t) + /* Previous log entry index */
+               sizeof(uint64_t) + /* Previous log entry term */
+               sizeof(uint64_t) + /* Leader's commit index */
+               (compressed ? sizeof(uint64_t) : 0) + /* Compressed size */
+               uvSizeofBatchHeaderCompact(p->entries, p->n_entries);
+    }
     return sizeof(uint64_t) + /* Leader's term. */
            sizeof(uint64_t) + /* Leader ID */
            sizeof(uint64_t) + /* Previous log entry index */
@@ -84,7 +95,10 @@ static void encodeRequestVoteResult(const struct raft_request_vote_result *p,
     bytePut64(&cursor, p->vote_granted);
 }
 
-static void encodeAppendEntries(const struct raft_append_entries *p, void *buf)
+static void encodeAppendEntries(const struct raft_append_entries *p,
+                                bool compact,
+                                size_t compressed,
+                                void *buf)
 {
     void *cursor;
 
@@ -95,7 +109,15 @@ static void encodeAppendEntries(const struct raft_append_entries *p, void *buf)
     bytePut64(&cursor, p->prev_log_term);  /* Previous term. */
     bytePut64(&cursor, p->leader_commit);  /* Commit index. */
 
-    uvEncodeBatchHeader(p->entries, p->n_entries, cursor);
+    if (compressed > 0) {
+        bytePut64(&cursor, compressed); /* Compressed data size. */
+    }
+
+    if (compact) {
+        uvEncodeBatchHeaderCompact(p->entries, p->n_entries, cursor);
+    } else {
+        uvEncodeBatchHeader(p->entries, p->n_entries, cursor);
+    }
 }
 
 static void encodeAppendEntriesResult(
@@ -127,46 +149,139 @@ static void encodeInstallSnapshot(const struct raft_install_snapshot *p,
     bytePut64(&cursor, p->data.len); /* Snapshot data size. */
 }
 
-int uvEncodeMessage(const struct raft_message *message,
-                    uv_buf_t **bufs,
+/* Compress the entries data of the given AppendEntries message, if that makes
+ * it smaller. If it doesn't, @data is set to #NULL. */
+static int compressAppendEntries(const struct raft_append_entries *p,
+                                 const struct raft_uv_codec *codec,
+                                 uv_buf_t *data)
+{
+    size_t size;
+    unsigned i;
+    int rv;
+
+    data->base = NULL;
+    data->len = 0;
+
+    size = 0;
+    for (i = 0; i < p->n_entries; i++) {
+        size += p->entries[i].buf.len;
+    }
+    if (size < UV__CODEC_MIN_SIZE) {
+        return 0;
+    }
+
+    data->len = size - 1;
+    data->base = raft_malloc(data->len);
+    if (data->base == NULL) {
+        return RAFT_NOMEM;
+    }
+
+    rv = uvCodecCompress(codec, p->entries, p->n_entries, data->base,
+                         &data->len);
+    if (rv != 0) {
+        raft_free(data->base);
+        data->base = NULL;
+        data->len = 0;
+        return rv == RAFT_TOOBIG ? 0 : rv;
+    }
+
+    return 0;
+}
+
+int uvCompressMessage(const struct raft_message *message,
+                      const struct raft_uv_codec *codec,
+                      uv_buf_t *compressed)
+{
+    compressed->base = NULL;
+    compressed->len = 0;
+    if (message->type != RAFT_IO_APPEND_ENTRIES) {
+        return 0;
+    }
+    return compressAppendEntries(&message->append_entries, codec, compressed);
+}
+
+int uvSizeofMessage(const struct raft_message *message,
+                    bool compact,
+                    bool compressed,
+                    size_t *header_len,
                     unsigned *n_bufs)
 {
-    uv_buf_t header;
-    void *cursor;
+    /* Only AppendEntries messages carry a batch. */
+    if (message->type != RAFT_IO_APPEND_ENTRIES) {
+        compact = false;
+    }
 
-    /* Figure out the length of the header for this request and allocate a
-     * buffer for it. */
-    header.len = RAFT_IO_UV__PREAMBLE_SIZE;
+    /* Figure out the length of the header for this request. */
+    *header_len = RAFT_IO_UV__PREAMBLE_SIZE;
     switch (message->type) {
         case RAFT_IO_REQUEST_VOTE:
-            header.len += sizeofRequestVote();
+            *header_len += sizeofRequestVote();
             break;
         case RAFT_IO_REQUEST_VOTE_RESULT:
-            header.len += sizeofRequestVoteResult();
+            *header_len += sizeofRequestVoteResult();
             break;
         case RAFT_IO_APPEND_ENTRIES:
-            header.len += sizeofAppendEntries(&message->append_entries);
+            *header_len += sizeofAppendEntries(&message->append_entries,
+                                               compact, compressed);
             break;
         case RAFT_IO_APPEND_ENTRIES_RESULT:
-            header.len += sizeofAppendEntriesResult();
+            *header_len += sizeofAppendEntriesResult();
             break;
         case RAFT_IO_INSTALL_SNAPSHOT:
-            header.len += sizeofInstallSnapshot(&message->install_snapshot);
+            *header_len += sizeofInstallSnapshot(&message->install_snapshot);
             break;
         default:
             return RAFT_MALFORMED;
     };
 
-    header.base = raft_malloc(header.len);
-    if (header.base == NULL) {
-        goto oom;
+    *n_bufs = 1;
+
+    /* For AppendEntries request we also send the entries payload, either
+     * compressed in a single buffer or as it is. */
+    if (compressed) {
+        *n_bufs += 1;
+    } else if (message->type == RAFT_IO_APPEND_ENTRIES) {
+        *n_bufs += message->append_entries.n_entries;
+    }
+
+    /* For InstallSnapshot request we also send the snapshot payload. */
+    if (message->type == RAFT_IO_INSTALL_SNAPSHOT) {
+        *n_bufs += 1;
     }
 
-    cursor = header.base;
+    return 0;
+}
+
+void uvEncodeMessageTo(const struct raft_message *message,
+                       bool compact,
+                       const struct raft_uv_codec *codec,
+                       const uv_buf_t *compressed,
+                       const uv_buf_t *header,
+                       uv_buf_t bufs[])
+{
+    uint64_t type;
+    void *cursor;
+
+    /* Only AppendEntries messages carry a batch. */
+    if (message->type != RAFT_IO_APPEND_ENTRIES) {
+        compact = false;
+    }
+
+    cursor = header->base;
 
     /* Encode the request preamble, with message type and message size. */
-    bytePut64(&cursor, message->type);
-    bytePut64(&cursor, header.len - RAFT_IO_UV__PREAMBLE_SIZE);
+    type = message->type | UV__MESSAGE_CAN_COMPACT | UV__MESSAGE_CAN_BULK;
+    if (compact) {
+        type |= UV__MESSAGE_COMPACT;
+    }
+    if (codec != NULL) {
+        type |= (uint64_t)codec->id << UV__MESSAGE_CODEC_SHIFT;
+    }
+    if (compressed->base != NULL) {
+        type |= UV__MESSAGE_COMPRESSED;
+    }
+    bytePut64(&cursor, type);
+    bytePut64(&cursor, header->len - RAFT_IO_UV__PREAMBLE_SIZE);
 
     /* Encode the request header. */
     switch (message->type) {
@@ -177,7 +292,8 @@ int uvEncodeMessage(const struct raft_message *message,
             encodeRequestVoteResult(&message->request_vote_result, cursor);
             break;
         case RAFT_IO_APPEND_ENTRIES:
-            encodeAppendEntries(&message->append_entries, cursor);
+            encodeAppendEntries(&message->append_entries, compact,
+                                compressed->len, cursor);
             break;
         case RAFT_IO_APPEND_ENTRIES_RESULT:
             encodeAppendEntriesResult(&message->append_entries_result, cursor);
@@ -187,47 +303,77 @@ int uvEncodeMessage(const struct raft_message *message,
             break;
     };
 
-    *n_bufs = 1;
+    bufs[0] = *header;
 
-    /* For AppendEntries request we also send the entries payload. */
-    if (message->type == RAFT_IO_APPEND_ENTRIES) {
-        *n_bufs += message->append_entries.n_entries;
+    if (compressed->base != NULL) {
+        bufs[1] = *compressed;
+    } else if (message->type == RAFT_IO_APPEND_ENTRIES) {
+        unsigned i;
+        for (i = 0; i < message->append_entries.n_entries; i++) {
+            const struct raft_entry *entry =
+                &message->append_entries.entries[i];
+            bufs[i + 1].base = entry->buf.base;
+            bufs[i + 1].len = entry->buf.len;
+        }
     }
 
-    /* For InstallSnapshot request we also send the snapshot payload. */
     if (message->type == RAFT_IO_INSTALL_SNAPSHOT) {
-        *n_bufs += 1;
+        bufs[1].base = message->install_snapshot.data.base;
+        bufs[1].len = message->install_snapshot.data.len;
     }
+}
 
-    *bufs = raft_calloc(*n_bufs, sizeof **bufs);
-    if (*bufs == NULL) {
-        goto oom_after_header_alloc;
+int uvEncodeMessage(const struct raft_message *message,
+                    bool compact,
+                    const struct raft_uv_codec *codec,
+                    bool compress,
+                    uv_buf_t **bufs,
+                    unsigned *n_bufs)
+{
+    uv_buf_t header;
+    uv_buf_t compressed; /* Compressed entries data, if any */
+    int rv;
+
+    /* Compression is only supported along with the compact encoding. */
+    compressed.base = NULL;
+    compressed.len = 0;
+    if (compact && compress && codec != NULL) {
+        rv = uvCompressMessage(message, codec, &compressed);
+        if (rv != 0) {
+            return rv;
+        }
     }
 
-    (*bufs)[0] = header;
+    rv = uvSizeofMessage(message, compact, compressed.base != NULL,
+                         &header.len, n_bufs);
+    if (rv != 0) {
+        goto err;
+    }
 
-    if (message->type == RAFT_IO_APPEND_ENTRIES) {
-        unsigned i;
-        for (i = 0; i < message->append_entries.n_entries; i++) {
-            const struct raft_entry *entry =
-                &message->append_entries.entries[i];
-            (*bufs)[i + 1].base = entry->buf.base;
-            (*bufs)[i + 1].len = entry->buf.len;
-        }
+    header.base = raft_malloc(header.len);
+    if (header.base == NULL) {
+        rv = RAFT_NOMEM;
+        goto err;
     }
 
-    if (message->type == RAFT_IO_INSTALL_SNAPSHOT) {
-        (*bufs)[1].base = message->install_snapshot.data.base;
-        (*bufs)[1].len = message->install_snapshot.data.len;
+    *bufs = raft_calloc(*n_bufs, sizeof **bufs);
+    if (*bufs == NULL) {
+        rv = RAFT_NOMEM;
+        goto err_after_header_alloc;
     }
 
+    uvEncodeMessageTo(message, compact, codec, &compressed, &header, *bufs);
+
     return 0;
 
-oom_after_header_alloc:
+err_after_header_alloc:
     raft_free(header.base);
 
-oom:
-    return RAFT_NOMEM;
+err:
+    if (compressed.base != NULL) {
+        raft_free(compressed.base);
+    }
+    return rv;
 }
 
 void uvEncodeBatchHeader(const struct raft_entry *entries,
@@ -256,6 +402,57 @@ void uvEncodeBatchHeader(const struct raft_entry *entries,
     }
 }
 
+/* Return the index of the first entry after @i having a different term. */
+static unsigned runEnd(const struct raft_entry *entries, unsigned n, unsigned i)
+{
+    raft_term term = entries[i].term;
+    for (i++; i < n && entries[i].term == term; i++) {
+    }
+    return i;
+}
+
+size_t uvSizeofBatchHeaderCompact(const struct raft_entry *entries,
+                                  unsigned n)
+{
+    size_t size;
+    raft_term term = 0;
+    unsigned i = 0;
+
+    size = byteSizeofVarint(n);
+    while (i < n) {
+        unsigned end = runEnd(entries, n, i);
+        size += byteSizeofVarint(entries[i].term - term);
+        size += byteSizeofVarint(end - i);
+        term = entries[i].term;
+        for (; i < end; i++) {
+            size += sizeof(uint8_t) + byteSizeofVarint(entries[i].buf.len);
+        }
+    }
+
+    return size;
+}
+
+void uvEncodeBatchHeaderCompact(const struct raft_entry *entries,
+                                unsigned n,
+                                void *buf)
+{
+    void *cursor = buf;
+    raft_term term = 0;
+    unsigned i = 0;
+
+    bytePutVarint(&cursor, n);
+    while (i < n) {
+        unsigned end = runEnd(entries, n, i);
+        bytePutVarint(&cursor, entries[i].term - term);
+        bytePutVarint(&cursor, end - i);
+        term = entries[i].term;
+        for (; i < end; i++) {
+            bytePut8(&cursor, entries[i].type);
+            bytePutVarint(&cursor, entries[i].buf.len);
+        }
+    }
+}
+
 static void decodeRequestVote(const uv_buf_t *buf, struct raft_request_vote *p)
 {
     const void *cursor;
@@ -330,15 +527,100 @@ err:
     return rv;
 }
 
+int uvDecodeBatchHeaderCompact(const void *buf,
+                               size_t len,
+                               struct raft_entry **entries,
+                               unsigned *n)
+{
+    const void *cursor = buf;
+    const void *end = (const uint8_t *)buf + len;
+    raft_term term = 0;
+    uint64_t value;
+    unsigned i;
+
+    /* Each entry takes at least 2 bytes, don't allocate more than that. */
+    if (!byteGetVarint(&cursor, end, &value) || value > len / 2) {
+        return RAFT_MALFORMED;
+    }
+    *n = (unsigned)value;
+
+    if (*n == 0) {
+        *entries = NULL;
+        return cursor == end ? 0 : RAFT_MALFORMED;
+    }
+
+    *entries = raft_malloc(*n * sizeof **entries);
+    if (*entries == NULL) {
+        return RAFT_NOMEM;
+    }
+
+    i = 0;
+    while (i < *n) {
+        uint64_t delta;
+        uint64_t run;
+
+        if (!byteGetVarint(&cursor, end, &delta) ||
+            !byteGetVarint(&cursor, end, &run) || run == 0 || run > *n - i) {
+            goto err_after_alloc;
+        }
+        term += delta;
+
+        /* All entries of the run share the same term, so only their type and
+         * size need to be decoded. */
+        for (; run > 0; run--, i++) {
+            struct raft_entry *entry = &(*entries)[i];
+            uint64_t size;
+
+            if (cursor == end) {
+                goto err_after_alloc;
+            }
+            entry->term = term;
+            entry->type = byteGet8(&cursor);
+            if (entry->type != RAFT_COMMAND && entry->type != RAFT_BARRIER &&
+                entry->type != RAFT_CHANGE) {
+                goto err_after_alloc;
+            }
+            if (!byteGetVarint(&cursor, end, &size) || size > UINT32_MAX) {
+                goto err_after_alloc;
+            }
+            entry->buf.len = (size_t)size;
+        }
+    }
+
+    if (cursor != end) {
+        goto err_after_alloc;
+    }
+
+    return 0;
+
+err_after_alloc:
+    /* Don't leave the caller with a dangling pointer. */
+    raft_free(*entries);
+    *entries = NULL;
+    *n = 0;
+    return RAFT_MALFORMED;
+}
+
 static int decodeAppendEntries(const uv_buf_t *buf,
-                               struct raft_append_entries *args)
+                               bool compact,
+                               bool compressed,
+                               struct raft_append_entries *args,
+                               size_t *compressed_size)
 {
     const void *cursor;
+    size_t n_fields = compressed ? 5 : 4;
     int rv;
 
     assert(buf != NULL);
     assert(args != NULL);
 
+    if (compressed && !compact) {
+        return RAFT_MALFORMED;
+    }
+    if (compact && buf->len < sizeof(uint64_t) * n_fields) {
+        return RAFT_MALFORMED;
+    }
+
     cursor = buf->base;
 
     args->term = byteGet64(&cursor);
@@ -346,6 +628,20 @@ static int decodeAppendEntries(const uv_buf_t *buf,
     args->prev_log_term = byteGet64(&cursor);
     args->leader_commit = byteGet64(&cursor);
 
+    *compressed_size = 0;
+    if (compressed) {
+        *compressed_size = byteGet64(&cursor);
+        if (*compressed_size == 0) {
+            return RAFT_MALFORMED;
+        }
+    }
+
+    if (compact) {
+        return uvDecodeBatchHeaderCompact(
+            cursor, buf->len - sizeof(uint64_t) * n_fields, &args->entries,
+            &args->n_entries);
+    }
+
     rv = uvDecodeBatchHeader(cursor, &args->entries, &args->n_entries);
     if (rv != 0) {
         return rv;
@@ -395,14 +691,20 @@ static int decodeInstallSnapshot(const uv_buf_t *buf,
     return 0;
 }
 
-int uvDecodeMessage(unsigned type,
+int uvDecodeMessage(uint64_t type,
                     const uv_buf_t *header,
                     struct raft_message *message,
                     size_t *payload_len)
 {
+    bool compact = (type & UV__MESSAGE_COMPACT) != 0;
+    bool compressed = (type & UV__MESSAGE_COMPRESSED) != 0;
+    size_t compressed_size;
     unsigned i;
     int rv = 0;
 
+    /* Strip the flags. */
+    type = (unsigned)type;
+
     message->type = type;
 
     *payload_len = 0;
@@ -416,10 +718,23 @@ int uvDecodeMessage(unsigned type,
             decodeRequestVoteResult(header, &message->request_vote_result);
             break;
         case RAFT_IO_APPEND_ENTRIES:
-            rv = decodeAppendEntries(header, &message->append_entries);
+            rv = decodeAppendEntries(header, compact, compressed,
+                                     &message->append_entries,
+                                     &compressed_size);
+            /* The entries array is gone if the batch header is malformed. */
+            if (rv != 0) {
+                break;
+            }
             for (i = 0; i < message->append_entries.n_entries; i++) {
                 *payload_len += message->append_entries.entries[i].buf.len;
             }
+            if (compressed) {
+                if (*payload_len == 0) {
+                    rv = RAFT_MALFORMED;
+                    break;
+                }
+                *payload_len = compressed_size;
+            }
             break;
         case RAFT_IO_APPEND_ENTRIES_RESULT:
             decodeAppendEntriesResult(header, &message->append_entries_result);
@@ -465,3 +780,22 @@ void uvDecodeEntriesBatch(const struct raft_buffer *buf,
         }
     }
 }
+
+void uvDecodeEntriesBatchCompact(const struct raft_buffer *buf,
+                                 struct raft_entry *entries,
+                                 unsigned n)
+{
+    void *cursor;
+    size_t i;
+
+    assert(buf != NULL);
+
+    cursor = buf->base;
+
+    for (i = 0; i < n; i++) {
+        struct raft_entry *entry = &entries[i];
+        entry->batch = buf->base;
+        entry->buf.base = entry->buf.len == 0 ? NULL : cursor;
+        cursor += entry->buf.len;
+    }
+}
@@ -6,12 +6,77 @@
 #include <uv.h>
 
 #include "../include/raft.h"
+#include "../include/raft/uv.h"
 
+/* Flags stored in the upper 32 bits of the message type word of the message
+ * preamble. Older versions only look at the lower 32 bits, and ignore them.
+ *
+ * UV__MESSAGE_CAN_COMPACT is set in every message we send, and tells the peer
+ * that we are able to decode batches using the compact encoding.
+ *
+ * UV__MESSAGE_COMPACT is set in AppendEntries messages whose batch uses the
+ * compact encoding. It's only used with peers that sent us messages with
+ * UV__MESSAGE_CAN_COMPACT. */
+#define UV__MESSAGE_CAN_COMPACT ((uint64_t)1 << 32)
+#define UV__MESSAGE_COMPACT ((uint64_t)1 << 33)
+
+/* UV__MESSAGE_COMPRESSED is set in AppendEntries messages using the compact
+ * encoding whose entries data is compressed. The header then holds the size of
+ * the compressed data after the other fields, and the data is compressed with
+ * the codec whose ID is in the UV__MESSAGE_CODEC bits.
+ *
+ * The UV__MESSAGE_CODEC bits are set in every message we send to the ID of
+ * the codec we are configured with, if any. A peer only compresses the data it
+ * sends us if it is configured with the same codec. */
+#define UV__MESSAGE_COMPRESSED ((uint64_t)1 << 34)
+#define UV__MESSAGE_CODEC_SHIFT 40
+#define UV__MESSAGE_CODEC ((uint64_t)0xff << UV__MESSAGE_CODEC_SHIFT)
+
+/* UV__MESSAGE_CAN_BULK is set in every message we send, and tells the peer that
+ * we accept RAFT_UV_BULK connections. */
+#define UV__MESSAGE_CAN_BULK ((uint64_t)1 << 35)
+
+/* Encode the given message. If @compact is #true, the batch of AppendEntries
+ * messages uses the compact encoding. If @codec is not #NULL its ID is
+ * advertised, and if @compress is also #true and @compact is #true, the entries
+ * data of AppendEntries messages is compressed with it. */
 int uvEncodeMessage(const struct raft_message *message,
+                    bool compact,
+                    const struct raft_uv_codec *codec,
+                    bool compress,
                     uv_buf_t **bufs,
                     unsigned *n_bufs);
 
-int uvDecodeMessage(unsigned type,
+/* Compress the entries data of the given message with @codec, if it's an
+ * AppendEntries message and if that makes it smaller. Otherwise
+ * @compressed->base is set to #NULL. */
+int uvCompressMessage(const struct raft_message *message,
+                      const struct raft_uv_codec *codec,
+                      uv_buf_t *compressed);
+
+/* Compute the size of the buffer needed to hold the preamble and header of the
+ * given message, and the number of buffers needed to send it. */
+int uvSizeofMessage(const struct raft_message *message,
+                    bool compact,
+                    bool compressed,
+                    size_t *header_len,
+                    unsigned *n_bufs);
+
+/* Encode the given message into the @header buffer, whose length must be the
+ * one computed by uvSizeofMessage(), and fill the @bufs array with the buffers
+ * to send. Unless its base is #NULL, @compressed holds the entries data
+ * compressed with uvCompressMessage(). */
+void uvEncodeMessageTo(const struct raft_message *message,
+                       bool compact,
+                       const struct raft_uv_codec *codec,
+                       const uv_buf_t *compressed,
+                       const uv_buf_t *header,
+                       uv_buf_t bufs[]);
+
+/* Decode the header of a message of the given type, as found in the message
+ * preamble, possibly including flags. If the entries data of an AppendEntries
+ * message is compressed, @payload_len is set to its compressed size. */
+int uvDecodeMessage(uint64_t type,
                     const uv_buf_t *header,
                     struct raft_message *message,
                     size_t *payload_len);
@@ -52,4 +117,49 @@ void uvEncodeBatchHeader(const struct raft_entry *entries,
                          unsigned n,
                          void *buf);
 
+/**
+ * The compact encoding of a batch header avoids fixed-size fields, and is used
+ * when entries are small. Its layout is the following:
+ *
+ * [varint ] Number of entries in the batch.
+ * [run1   ] First run of entries with the same term.
+ * [  ...  ] More runs
+ * [runN   ] Last run of entries.
+ *
+ * Each run of entries has the following layout:
+ *
+ * [varint ] Term of the entries, minus the term of the previous run (or 0).
+ * [varint ] Number of entries in the run.
+ * [entry1 ] First entry of the run.
+ * [  ...  ] More entries
+ * [entryN ] Last entry of the run.
+ *
+ * Where each entry consists of:
+ *
+ * [1 byte ] Message type (Either RAFT_COMMAND, RAFT_BARRIER or RAFT_CHANGE)
+ * [varint ] Size of the log entry data.
+ *
+ * Varints use 7 bits per byte, least significant group first. The payload data
+ * of the entries is not padded.
+ */
+size_t uvSizeofBatchHeaderCompact(const struct raft_entry *entries,
+                                  unsigned n);
+
+void uvEncodeBatchHeaderCompact(const struct raft_entry *entries,
+                                unsigned n,
+                                void *buf);
+
+/* Decode a compact batch header of exactly @len bytes, allocating the entries
+ * array. */
+int uvDecodeBatchHeaderCompact(const void *buf,
+                               size_t len,
+                               struct raft_entry **entries,
+                               unsigned *n);
+
+/* Like uvDecodeEntriesBatch, but for batches using the compact encoding, whose
+ * entry data is not padded. */
+void uvDecodeEntriesBatchCompact(const struct raft_buffer *buf,
+                                 struct raft_entry *entries,
+                                 unsigned n);
+
 #endif /* UV_ENCODING_H_ */
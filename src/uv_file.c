@@ -63,7 +63,7 @@ static void createWorkCb(uv_work_t *work)
 
     /* Set direct I/O if available. */
     if (f->direct) {
-        rv = osSetDirectIO(f->fd);
+        rv = osSetDirectIO(f->fd, true);
         if (rv != 0) {
             goto err;
         }
@@ -357,6 +357,7 @@ int uvFileInit(struct uvFile *f,
     f->loop = loop;
     f->fd = -1;
     f->direct = direct;
+    f->buffered = false;
     f->async = async;
     f->event_fd = -1;
 
@@ -470,6 +471,84 @@ err:
     return rv;
 }
 
+int uvFileOpenFd(osPath path, int *fd)
+{
+    int flags = O_WRONLY; /* Common open flags */
+
+#if !defined(RWF_DSYNC)
+    /* If per-request synchronous I/O is not supported, open the file with the
+     * sync flag. */
+    flags |= O_DSYNC;
+#endif
+
+    *fd = open(path, flags);
+    if (*fd == -1) {
+        return uv_translate_sys_error(errno);
+    }
+
+    return 0;
+}
+
+int uvFileOpen(struct uvFile *f, int fd, unsigned max_n_writes)
+{
+    int rv;
+
+    assert(fd >= 0);
+    assert(!f->closing);
+
+    f->events = NULL;
+    f->n_events = max_n_writes;
+    f->fd = fd;
+
+    /* Set direct I/O if available. */
+    if (f->direct) {
+        rv = osSetDirectIO(f->fd, true);
+        if (rv != 0) {
+            rv = uv_translate_sys_error(rv);
+            goto err_after_open;
+        }
+    }
+
+    /* Setup the AIO context. */
+    rv = io_setup(f->n_events /* Maximum concurrent requests */, &f->ctx);
+    if (rv == -1) {
+        /* UNTESTED: should fail only with ENOMEM */
+        rv = uv_translate_sys_error(errno);
+        goto err_after_open;
+    }
+
+    /* Initialize the array of re-usable event objects. */
+    f->events = calloc(f->n_events, sizeof *f->events);
+    if (f->events == NULL) {
+        /* UNTESTED: define a configurable allocator that can fail? */
+        rv = UV_ENOMEM;
+        goto err_after_io_setup;
+    }
+
+    rv = uv_poll_start(&f->event_poller, UV_READABLE, writePollCb);
+    if (rv != 0) {
+        /* UNTESTED: the underlying libuv calls should never fail. */
+        goto err_after_events_alloc;
+    }
+
+    f->state = READY;
+
+    return 0;
+
+err_after_events_alloc:
+    free(f->events);
+    f->events = NULL;
+err_after_io_setup:
+    io_destroy(f->ctx);
+    f->ctx = 0;
+err_after_open:
+    close(f->fd);
+    f->fd = -1;
+    assert(rv != 0);
+    f->state = 0;
+    return rv;
+}
+
 int uvFileWrite(struct uvFile *f,
                 struct uvFileWrite *req,
                 const uv_buf_t bufs[],
@@ -525,8 +604,9 @@ int uvFileWrite(struct uvFile *f,
 
 #if defined(RWF_NOWAIT)
     /* If io_submit can be run in a 100% non-blocking way, we'll try to write
-     * without using the threadpool. */
-    if (f->async) {
+     * without using the threadpool. That's not the case for buffered writes,
+     * which need to wait for the data to be synced. */
+    if (f->async && !f->buffered) {
         req->iocb.aio_flags |= IOCB_FLAG_RESFD;
         req->iocb.aio_resfd = f->event_fd;
         req->iocb.aio_rw_flags |= RWF_NOWAIT;
@@ -539,7 +619,7 @@ int uvFileWrite(struct uvFile *f,
 
 #if defined(RWF_NOWAIT)
     /* Try to submit the write request asynchronously */
-    if (f->async) {
+    if (f->async && !f->buffered) {
         rv = io_submit(f->ctx, 1, &iocbs);
 
         /* If no error occurred, we're done, the write request was
@@ -592,6 +672,26 @@ err:
     return rv;
 }
 
+int uvFileSetBuffered(struct uvFile *f, bool buffered)
+{
+    int rv;
+
+    assert(f->state == READY);
+    assert(QUEUE_IS_EMPTY(&f->write_queue));
+
+    if (!f->direct || f->buffered == buffered) {
+        return 0;
+    }
+
+    rv = osSetDirectIO(f->fd, !buffered);
+    if (rv != 0) {
+        return uv_translate_sys_error(rv);
+    }
+    f->buffered = buffered;
+
+    return 0;
+}
+
 void uvFileClose(struct uvFile *f, uvFileCloseCb cb)
 {
     int rv;
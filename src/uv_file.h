@@ -46,6 +46,16 @@ int uvFileCreate(struct uvFile *f,
                  unsigned max_concurrent_writes,
                  uvFileCreateCb cb);
 
+/* Open the given existing file with the flags required by uvFileOpen(). This is
+ * a blocking call, to be run in the threadpool. */
+int uvFileOpenFd(osPath path, int *fd);
+
+/* Setup the given file descriptor, as returned by uvFileOpenFd(), for
+ * subsequent non-blocking writing. The handle takes ownership of the file
+ * descriptor, which gets closed also if this function fails. Unlike
+ * uvFileCreate, the file size is not changed. */
+int uvFileOpen(struct uvFile *f, int fd, unsigned max_concurrent_writes);
+
 /* Asynchronously write data to the file associated with the given handle. */
 int uvFileWrite(struct uvFile *f,
                 struct uvFileWrite *req,
@@ -54,6 +64,12 @@ int uvFileWrite(struct uvFile *f,
                 size_t offset,
                 uvFileWriteCb cb);
 
+/* Switch a file using direct I/O to buffered I/O for the subsequent writes, or
+ * back to direct I/O. Buffered writes don't need to be aligned to the block
+ * size, and they are still synced to disk before completing. There must be no
+ * write in progress. It's a no-op for files not using direct I/O. */
+int uvFileSetBuffered(struct uvFile *f, bool buffered);
+
 /* Close the given file and release all associated resources. There must be no
  * request in progress. */
 void uvFileClose(struct uvFile *f, uvFileCloseCb cb);
@@ -65,6 +81,7 @@ struct uvFile
     int state;                     /* Current state code */
     int fd;                        /* Operating system file descriptor */
     bool direct;                   /* Whether direct I/O is supported */
+    bool buffered;                 /* Whether direct I/O is turned off */
     bool async;                    /* Whether fully async I/O is supported */
     int event_fd;                  /* Poll'ed to check if write is finished */
     struct uv_poll_s event_poller; /* To make the loop poll for event_fd */
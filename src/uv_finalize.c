@@ -1,3 +1,7 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
 #include "assert.h"
 #include "os.h"
 #include "queue.h"
@@ -6,18 +10,69 @@
 struct segment
 {
     struct uv *uv;
-    uvCounter counter;      /* Segment counter */
-    size_t used;            /* Number of used bytes */
-    raft_index first_index; /* Index of first entry */
-    raft_index last_index;  /* Index of last entry */
-    int status;             /* Status code of blocking syscalls */
-    queue queue;            /* Link to finalize queue */
+    uvCounter counter;           /* Segment counter */
+    size_t used;                 /* Number of used bytes */
+    raft_index first_index;      /* Index of first entry */
+    raft_index last_index;       /* Index of last entry */
+    struct uvSegmentIndex index; /* Offsets of the batches in the segment */
+    int status;                  /* Status code of blocking syscalls */
+    queue queue;                 /* Link to finalize queue */
 };
 
+/* Append the index of the batches contained in the segment to its file, and
+ * make it durable before the segment gets its closed name, so that a closed
+ * segment never has a torn index. */
+static int appendIndex(struct segment *s, const char *filename)
+{
+    struct uv *uv = s->uv;
+    uv_buf_t buf;
+    int fd;
+    int rv;
+
+    rv = uvSegmentIndexEncode(&s->index, &buf);
+    if (rv != 0) {
+        goto err;
+    }
+
+    rv = osOpen(uv->dir, filename, O_WRONLY | O_APPEND, &fd);
+    if (rv != 0) {
+        uvErrorf(uv, "open segment %s: %s", filename, osStrError(rv));
+        rv = RAFT_IOERR;
+        goto err_after_encode;
+    }
+
+    rv = osWriteN(fd, buf.base, buf.len);
+    if (rv != 0) {
+        close(fd);
+        uvErrorf(uv, "write segment %s index: %s", filename, osStrError(rv));
+        rv = RAFT_IOERR;
+        goto err_after_encode;
+    }
+
+    rv = fsync(fd);
+    close(fd);
+    if (rv != 0) {
+        uvErrorf(uv, "fsync segment %s index: %s", filename,
+                 osStrError(errno));
+        rv = RAFT_IOERR;
+        goto err_after_encode;
+    }
+
+    raft_free(buf.base);
+    return 0;
+
+err_after_encode:
+    raft_free(buf.base);
+err:
+    assert(rv != 0);
+    return rv;
+}
+
 /* Run all blocking syscalls involved in closing a used open segment.
  *
  * An open segment is closed by truncating its length to the number of bytes
- * that were actually written into it and then renaming it. */
+ * that were actually written into it, appending the index of its batches and
+ * then renaming it. */
 static void workCb(uv_work_t *work)
 {
     struct segment *s = work->data;
@@ -43,6 +98,13 @@ static void workCb(uv_work_t *work)
         goto abort;
     }
 
+    if (s->index.n > 0) {
+        rv = appendIndex(s, filename1);
+        if (rv != 0) {
+            goto abort;
+        }
+    }
+
     sprintf(filename2, UV__CLOSED_TEMPLATE, s->first_index, s->last_index);
 
     rv = osRename(uv->dir, filename1, filename2);
@@ -51,6 +113,7 @@ static void workCb(uv_work_t *work)
         rv = RAFT_IOERR;
         goto abort;
     }
+    uvCatalogAddSegment(uv, s->first_index, s->last_index);
 
 out:
     s->status = 0;
@@ -71,6 +134,7 @@ static void afterWorkCb(uv_work_t *work, int status)
     if (s->status != 0) {
         uv->errored = true;
     }
+    uvSegmentIndexClose(&s->index);
     raft_free(s);
     processRequests(uv);
     uvTruncateMaybeProcessRequests(uv);
@@ -135,7 +199,8 @@ int uvFinalize(struct uv *uv,
                unsigned long long counter,
                size_t used,
                raft_index first_index,
-               raft_index last_index)
+               raft_index last_index,
+               struct uvSegmentIndex *index)
 {
     struct segment *segment;
 
@@ -152,6 +217,9 @@ int uvFinalize(struct uv *uv,
 
     segment = raft_malloc(sizeof *segment);
     if (segment == NULL) {
+        if (index != NULL) {
+            uvSegmentIndexClose(index);
+        }
         return RAFT_NOMEM;
     }
 
@@ -160,6 +228,12 @@ int uvFinalize(struct uv *uv,
     segment->used = used;
     segment->first_index = first_index;
     segment->last_index = last_index;
+    if (index != NULL) {
+        segment->index = *index;
+        uvSegmentIndexInit(index);
+    } else {
+        uvSegmentIndexInit(&segment->index);
+    }
 
     QUEUE_INIT(&segment->queue);
     QUEUE_PUSH(&uv->finalize_reqs, &segment->queue);
@@ -1,3 +1,4 @@
+#include <stdio.h>
 #include <string.h>
 
 #include "uv.h"
@@ -19,6 +20,18 @@ static bool shouldIgnore(const char *filename)
     return result;
 }
 
+/* Return true if the given filename is the one of a segment which was being
+ * recycled. */
+static bool isRecycling(const char *filename)
+{
+    unsigned long long counter;
+    unsigned consumed;
+    int matched;
+    matched =
+        sscanf(filename, UV__RECYCLE_TEMPLATE "%n", &counter, &consumed);
+    return matched == 1 && consumed == strlen(filename);
+}
+
 int uvList(struct uv *uv,
            struct uvSnapshotInfo *snapshots[],
            size_t *n_snapshots,
@@ -54,6 +67,13 @@ int uvList(struct uv *uv,
             goto next;
         }
 
+        /* If we crashed while recycling a segment, its content is stale, let's
+         * remove it. */
+        if (isRecycling(filename)) {
+            osUnlink(uv->dir, filename); /* Ignore errors */
+            goto next;
+        }
+
         /* Append to the snapshot list if it's a snapshot metadata filename and
          * a valid associated snapshot file exists. */
         rv = uvSnapshotInfoAppendIfMatch(uv, filename, snapshots, n_snapshots,
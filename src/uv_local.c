@@ -0,0 +1,479 @@
+#include <string.h>
+
+#include "../include/raft/uv.h"
+
+#include "assert.h"
+#include "configuration.h"
+#include "uv.h"
+
+/* Messages sent between raft_io instances attached to the same raft_uv_local
+ * hub skip the transport entirely:
+ *
+ * - The sender copies the message into a new raft_message owned by the
+ *   receiver, pushes it to the receiver's inbox and wakes up the receiver's
+ *   loop with uv_async_send(). The send request is queued locally and its
+ *   callback fired on the sender's next async wake up, so the sender can
+ *   release its entries right away.
+ *
+ * - The receiver's async callback drains the inbox and passes each message to
+ *   the receive callback, which takes ownership of it as usual.
+ *
+ * Like with the stream transport, the bytes of entries and snapshot data sent
+ * to a server are bounded by the send queue size: they are counted until the
+ * receiver drains them from its inbox, and messages that would exceed the
+ * bound are refused with RAFT_BUSY before being copied.
+ *
+ * Entries data is copied once into a single batch buffer, like the one the
+ * decoder of the stream transport would produce, since the receiver's log
+ * takes ownership of it and can't share the buffer of the sender's log.
+ *
+ * The hub mutex protects the list of attached instances and their inboxes,
+ * since instances might run different loops in different threads. */
+
+/* An in-flight message, owned by the receiver. */
+struct uvLocalMessage
+{
+    struct raft_message message; /* Message to deliver */
+    char *address;               /* Sender address, allocated with us */
+    size_t size;                 /* Bytes of entries or snapshot data */
+    queue queue;                 /* Link in the receiver's inbox */
+};
+
+/* A send request that was delivered, waiting for its callback to be fired. */
+struct uvLocalSend
+{
+    struct raft_io_send *req; /* User request */
+    queue queue;              /* Link in the sender's sent queue */
+};
+
+/* Return the instance attached to the hub having the given address, or #NULL.
+ * Must be called with the hub mutex held. */
+static struct uv *findPeer(struct uvLocal *l, const char *address)
+{
+    queue *head;
+    QUEUE_FOREACH(head, &l->peers)
+    {
+        struct uv *uv = QUEUE_DATA(head, struct uv, local_queue);
+        if (strcmp(uv->address, address) == 0) {
+            return uv;
+        }
+    }
+    return NULL;
+}
+
+/* Return the instance attached to the hub having the given ID, or #NULL. Must
+ * be called with the hub mutex held. */
+static struct uv *findPeerById(struct uvLocal *l, unsigned id)
+{
+    queue *head;
+    QUEUE_FOREACH(head, &l->peers)
+    {
+        struct uv *uv = QUEUE_DATA(head, struct uv, local_queue);
+        if (uv->id == id) {
+            return uv;
+        }
+    }
+    return NULL;
+}
+
+/* Return the number of bytes of entries or snapshot data carried by the given
+ * message, and whether it carries any of them at all, like an heartbeat
+ * doesn't. */
+static size_t sizeofPayload(const struct raft_message *message, bool *bulk)
+{
+    size_t size = 0;
+    unsigned i;
+    switch (message->type) {
+        case RAFT_IO_APPEND_ENTRIES:
+            for (i = 0; i < message->append_entries.n_entries; i++) {
+                size += message->append_entries.entries[i].buf.len;
+            }
+            *bulk = message->append_entries.n_entries > 0;
+            break;
+        case RAFT_IO_INSTALL_SNAPSHOT:
+            size = message->install_snapshot.data.len;
+            *bulk = true;
+            break;
+        default:
+            *bulk = false;
+            break;
+    }
+    return size;
+}
+
+/* Return the number of bytes of the messages sent by the server with the given
+ * ID which are still in the inbox of the given peer. Must be called with the
+ * hub mutex held. */
+static size_t pendingBytes(struct uv *peer, unsigned id)
+{
+    queue *head;
+    size_t n = 0;
+    QUEUE_FOREACH(head, &peer->local_inbox)
+    {
+        struct uvLocalMessage *m;
+        m = QUEUE_DATA(head, struct uvLocalMessage, queue);
+        if (m->message.server_id == id) {
+            n += m->size;
+        }
+    }
+    return n;
+}
+
+/* Release the memory owned by a message that won't be delivered. */
+static void destroyMessage(struct uvLocalMessage *m)
+{
+    struct raft_message *message = &m->message;
+    switch (message->type) {
+        case RAFT_IO_APPEND_ENTRIES:
+            if (message->append_entries.n_entries > 0) {
+                if (message->append_entries.entries[0].batch != NULL) {
+                    raft_free(message->append_entries.entries[0].batch);
+                }
+                raft_free(message->append_entries.entries);
+            }
+            break;
+        case RAFT_IO_INSTALL_SNAPSHOT:
+            raft_configuration_close(&message->install_snapshot.conf);
+            if (message->install_snapshot.data.base != NULL) {
+                raft_free(message->install_snapshot.data.base);
+            }
+            break;
+    }
+    raft_free(m);
+}
+
+/* Copy the entries of an AppendEntries message, placing all their data in a
+ * single batch. */
+static int copyEntries(const struct raft_append_entries *src,
+                       struct raft_append_entries *dst)
+{
+    struct raft_entry *entries;
+    size_t size = 0;
+    void *batch = NULL;
+    void *cursor;
+    unsigned i;
+
+    dst->entries = NULL;
+    if (src->n_entries == 0) {
+        return 0;
+    }
+
+    entries = raft_malloc(src->n_entries * sizeof *entries);
+    if (entries == NULL) {
+        return RAFT_NOMEM;
+    }
+    for (i = 0; i < src->n_entries; i++) {
+        size += src->entries[i].buf.len;
+    }
+    if (size > 0) {
+        batch = raft_malloc(size);
+        if (batch == NULL) {
+            raft_free(entries);
+            return RAFT_NOMEM;
+        }
+    }
+
+    cursor = batch;
+    for (i = 0; i < src->n_entries; i++) {
+        const struct raft_entry *entry = &src->entries[i];
+        entries[i].term = entry->term;
+        entries[i].type = entry->type;
+        entries[i].buf.len = entry->buf.len;
+        entries[i].buf.base = entry->buf.len > 0 ? cursor : NULL;
+        entries[i].batch = batch;
+        if (entry->buf.len > 0) {
+            memcpy(cursor, entry->buf.base, entry->buf.len);
+            cursor = (uint8_t *)cursor + entry->buf.len;
+        }
+    }
+
+    dst->entries = entries;
+    return 0;
+}
+
+/* Copy an InstallSnapshot message's configuration and data. */
+static int copySnapshot(const struct raft_install_snapshot *src,
+                        struct raft_install_snapshot *dst)
+{
+    int rv;
+
+    raft_configuration_init(&dst->conf);
+    rv = configurationCopy(&src->conf, &dst->conf);
+    if (rv != 0) {
+        return rv;
+    }
+
+    dst->data.base = NULL;
+    if (src->data.len > 0) {
+        dst->data.base = raft_malloc(src->data.len);
+        if (dst->data.base == NULL) {
+            raft_configuration_close(&dst->conf);
+            return RAFT_NOMEM;
+        }
+        memcpy(dst->data.base, src->data.base, src->data.len);
+    }
+
+    return 0;
+}
+
+/* Create a copy of the given message as seen by its receiver. */
+static int copyMessage(struct uv *uv,
+                       const struct raft_message *message,
+                       struct uvLocalMessage **m)
+{
+    size_t address_len = strlen(uv->address) + 1;
+    int rv;
+
+    *m = raft_malloc(sizeof **m + address_len);
+    if (*m == NULL) {
+        return RAFT_NOMEM;
+    }
+    (*m)->message = *message;
+    (*m)->address = (char *)(*m + 1);
+    memcpy((*m)->address, uv->address, address_len);
+    (*m)->message.server_id = uv->id;
+    (*m)->message.server_address = (*m)->address;
+    (*m)->size = 0;
+
+    switch (message->type) {
+        case RAFT_IO_APPEND_ENTRIES:
+            rv = copyEntries(&message->append_entries,
+                             &(*m)->message.append_entries);
+            break;
+        case RAFT_IO_INSTALL_SNAPSHOT:
+            rv = copySnapshot(&message->install_snapshot,
+                              &(*m)->message.install_snapshot);
+            break;
+        default:
+            rv = 0;
+            break;
+    }
+    if (rv != 0) {
+        raft_free(*m);
+        return rv;
+    }
+
+    return 0;
+}
+
+/* Fire the callbacks of our delivered send requests and deliver the messages
+ * sent to us. */
+static void asyncCb(struct uv_async_s *async)
+{
+    struct uv *uv = async->data;
+    queue inbox;
+
+    while (!QUEUE_IS_EMPTY(&uv->local_sent)) {
+        queue *head;
+        struct uvLocalSend *s;
+        head = QUEUE_HEAD(&uv->local_sent);
+        s = QUEUE_DATA(head, struct uvLocalSend, queue);
+        QUEUE_REMOVE(&s->queue);
+        s->req->cb(s->req, 0);
+        raft_free(s);
+    }
+
+    /* Grab the whole inbox at once, so we don't hold the lock while running
+     * the receive callback. */
+    QUEUE_INIT(&inbox);
+    uv_mutex_lock(&uv->local->mutex);
+    while (!QUEUE_IS_EMPTY(&uv->local_inbox)) {
+        queue *head = QUEUE_HEAD(&uv->local_inbox);
+        QUEUE_REMOVE(head);
+        QUEUE_PUSH(&inbox, head);
+    }
+    uv_mutex_unlock(&uv->local->mutex);
+
+    while (!QUEUE_IS_EMPTY(&inbox)) {
+        queue *head;
+        struct uvLocalMessage *m;
+        head = QUEUE_HEAD(&inbox);
+        m = QUEUE_DATA(head, struct uvLocalMessage, queue);
+        QUEUE_REMOVE(&m->queue);
+        /* The receive callback might close us, in which case the rest of the
+         * messages get dropped. */
+        if (uv->recv_cb == NULL || uv->closing) {
+            destroyMessage(m);
+            continue;
+        }
+        uv->recv_cb(uv->io, &m->message);
+        raft_free(m);
+    }
+}
+
+void uvLocalStart(struct uv *uv, const char *address)
+{
+    int rv;
+
+    if (uv->local == NULL) {
+        return;
+    }
+
+    uv->address = address;
+    rv = uv_async_init(uv->loop, &uv->local_async, asyncCb);
+    assert(rv == 0); /* This should never fail */
+    uv->local_async.data = uv;
+
+    uv_mutex_lock(&uv->local->mutex);
+    QUEUE_PUSH(&uv->local->peers, &uv->local_queue);
+    uv_mutex_unlock(&uv->local->mutex);
+}
+
+int uvLocalSend(struct uv *uv,
+                struct raft_io_send *req,
+                const struct raft_message *message,
+                raft_io_send_cb cb)
+{
+    struct uvLocalMessage *m;
+    struct uvLocalSend *s;
+    struct uv *peer;
+    size_t pending = 0;
+    size_t size;
+    bool bulk;
+    int rv;
+
+    size = sizeofPayload(message, &bulk);
+
+    /* Check if the target server is attached to the hub before copying the
+     * message, so messages going through the transport don't pay for it. Only
+     * we add messages from us to its inbox, so if the message fits now it will
+     * still fit once copied. */
+    uv_mutex_lock(&uv->local->mutex);
+    peer = findPeer(uv->local, message->server_address);
+    if (peer != NULL && bulk) {
+        pending = pendingBytes(peer, uv->id);
+    }
+    uv_mutex_unlock(&uv->local->mutex);
+    if (peer == NULL) {
+        return RAFT_NOCONNECTION;
+    }
+
+    /* Refuse entries and snapshots exceeding the bytes held for the server,
+     * unless nothing is held, as uvSend() does. */
+    if (bulk && pending > 0 && pending + size > uv->send_queue_size) {
+        uv->send_n_busy++;
+        return RAFT_BUSY;
+    }
+
+    s = raft_malloc(sizeof *s);
+    if (s == NULL) {
+        rv = RAFT_NOMEM;
+        goto err;
+    }
+    rv = copyMessage(uv, message, &m);
+    if (rv != 0) {
+        goto err_after_send_alloc;
+    }
+    m->size = size;
+
+    /* The peer might have been closed in the meantime. */
+    uv_mutex_lock(&uv->local->mutex);
+    peer = findPeer(uv->local, message->server_address);
+    if (peer == NULL) {
+        uv_mutex_unlock(&uv->local->mutex);
+        rv = RAFT_NOCONNECTION;
+        goto err_after_copy;
+    }
+    QUEUE_PUSH(&peer->local_inbox, &m->queue);
+    uv_async_send(&peer->local_async);
+    uv_mutex_unlock(&uv->local->mutex);
+
+    req->cb = cb;
+    s->req = req;
+    QUEUE_PUSH(&uv->local_sent, &s->queue);
+    uv_async_send(&uv->local_async);
+
+    return 0;
+
+err_after_copy:
+    destroyMessage(m);
+err_after_send_alloc:
+    raft_free(s);
+err:
+    assert(rv != 0);
+    return rv;
+}
+
+bool uvLocalBusy(struct uv *uv, unsigned id)
+{
+    struct uv *peer;
+    bool busy = false;
+
+    uv_mutex_lock(&uv->local->mutex);
+    peer = findPeerById(uv->local, id);
+    if (peer != NULL) {
+        busy = pendingBytes(peer, uv->id) > 0;
+    }
+    uv_mutex_unlock(&uv->local->mutex);
+
+    return busy;
+}
+
+void uvLocalClose(struct uv *uv, uv_close_cb cb)
+{
+    queue inbox;
+
+    assert(uv->local != NULL);
+
+    /* Detach from the hub, so no new messages are delivered to us. */
+    QUEUE_INIT(&inbox);
+    uv_mutex_lock(&uv->local->mutex);
+    QUEUE_REMOVE(&uv->local_queue);
+    while (!QUEUE_IS_EMPTY(&uv->local_inbox)) {
+        queue *head = QUEUE_HEAD(&uv->local_inbox);
+        QUEUE_REMOVE(head);
+        QUEUE_PUSH(&inbox, head);
+    }
+    uv_mutex_unlock(&uv->local->mutex);
+
+    while (!QUEUE_IS_EMPTY(&inbox)) {
+        queue *head;
+        struct uvLocalMessage *m;
+        head = QUEUE_HEAD(&inbox);
+        m = QUEUE_DATA(head, struct uvLocalMessage, queue);
+        QUEUE_REMOVE(&m->queue);
+        destroyMessage(m);
+    }
+
+    /* Our messages have already been handed over. */
+    while (!QUEUE_IS_EMPTY(&uv->local_sent)) {
+        queue *head;
+        struct uvLocalSend *s;
+        head = QUEUE_HEAD(&uv->local_sent);
+        s = QUEUE_DATA(head, struct uvLocalSend, queue);
+        QUEUE_REMOVE(&s->queue);
+        s->req->cb(s->req, 0);
+        raft_free(s);
+    }
+
+    uv_close((struct uv_handle_s *)&uv->local_async, cb);
+}
+
+int raft_uv_local_init(struct raft_uv_local *local)
+{
+    struct uvLocal *l;
+    int rv;
+
+    l = raft_malloc(sizeof *l);
+    if (l == NULL) {
+        return RAFT_NOMEM;
+    }
+    rv = uv_mutex_init(&l->mutex);
+    if (rv != 0) {
+        /* UNTESTED: this should fail only for lack of resources */
+        raft_free(l);
+        return RAFT_NOMEM;
+    }
+    QUEUE_INIT(&l->peers);
+    local->impl = l;
+
+    return 0;
+}
+
+void raft_uv_local_close(struct raft_uv_local *local)
+{
+    struct uvLocal *l = local->impl;
+    assert(QUEUE_IS_EMPTY(&l->peers));
+    uv_mutex_destroy(&l->mutex);
+    raft_free(l);
+}
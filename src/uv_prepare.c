@@ -13,6 +13,19 @@
  *   possibly kicking off the creation logic if no segment is being created
  *   currently.
  *
+ * Prepared open segments normally come from newly created files, but the
+ * snapshot logic can also hand us obsolete segments that it has recycled into
+ * open segments (see uvPrepareRecycle). In that case we save the cost of
+ * allocating and syncing a brand new file.
+ *
+ * The number of prepared segments that we try to keep in the pool adapts to the
+ * rate at which segments get used, which is the append byte rate divided by the
+ * segment size: we want enough segments to cover the appends that will happen
+ * while a new segment is being created, so bursts don't stall waiting for it,
+ * while not keeping more preallocated files around than needed when idle. The
+ * pool is also shrunk by the periodic tick, when no segment has been used for
+ * longer than the average interval.
+ *
  * Possible failure modes are:
  *
  * - The create file request fails, in that case we fail all pending prepare
@@ -29,9 +42,6 @@
  * concurrent writes. */
 #define MAX_CONCURRENT_WRITES 1
 
-/* Number of open segments that we try to keep ready for writing. */
-#define TARGET_POOL_SIZE 2
-
 /* An open segment being prepared or sitting in the pool */
 struct segment
 {
@@ -98,6 +108,95 @@ void uvPrepareClose(struct uv *uv)
     }
 }
 
+/* Add a prepared segment to the pool. Segments must be handed out in counter
+ * order, since that's the order in which they get loaded at startup, so keep
+ * the pool sorted. */
+static void addSegmentToPool(struct uv *uv, struct segment *s)
+{
+    queue *head;
+    QUEUE_FOREACH(head, &uv->prepare_pool)
+    {
+        struct segment *other = QUEUE_DATA(head, struct segment, queue);
+        if (other->counter > s->counter) {
+            QUEUE_PUSH(head, &s->queue); /* Insert before the other segment */
+            return;
+        }
+    }
+    QUEUE_PUSH(&uv->prepare_pool, &s->queue);
+}
+
+/* Return the number of segments in the pool. */
+static unsigned poolSize(struct uv *uv)
+{
+    queue *head;
+    unsigned n = 0;
+    QUEUE_FOREACH(head, &uv->prepare_pool) { n++; }
+    return n;
+}
+
+/* Set the target pool size to the number of segments that get used while a new
+ * one is being created, given the interval between segments being used, plus
+ * one so we never run out. */
+static void setPoolTarget(struct uv *uv, uint64_t interval)
+{
+    uint64_t target;
+
+    target = uv->prepare_create_time / interval + 1;
+    if (uv->prepare_create_time % interval != 0) {
+        target++;
+    }
+
+    if (target < UV__PREPARE_POOL_MIN) {
+        target = UV__PREPARE_POOL_MIN;
+    }
+    if (target > UV__PREPARE_POOL_MAX) {
+        target = UV__PREPARE_POOL_MAX;
+    }
+    uv->prepare_pool_target = (unsigned)target;
+}
+
+/* Update the average interval between segments being used, and adjust the
+ * target pool size accordingly. */
+static void updatePoolTarget(struct uv *uv)
+{
+    uint64_t now = uv_hrtime();
+    uint64_t interval;
+
+    if (uv->prepare_used_at == 0) {
+        uv->prepare_used_at = now;
+        return;
+    }
+
+    interval = now - uv->prepare_used_at;
+    uv->prepare_used_at = now;
+
+    /* Smooth out the interval with an exponential moving average. */
+    if (uv->prepare_interval == 0) {
+        uv->prepare_interval = interval;
+    } else {
+        uv->prepare_interval = (uv->prepare_interval * 3 + interval) / 4;
+    }
+    if (uv->prepare_interval == 0) {
+        uv->prepare_interval = 1;
+    }
+
+    setPoolTarget(uv, uv->prepare_interval);
+}
+
+/* Remove prepared segments exceeding the target pool size, starting from the
+ * ones with the highest counter. */
+static void trimPool(struct uv *uv)
+{
+    unsigned n = poolSize(uv);
+    while (n > uv->prepare_pool_target) {
+        queue *tail = QUEUE_TAIL(&uv->prepare_pool);
+        struct segment *s = QUEUE_DATA(tail, struct segment, queue);
+        QUEUE_REMOVE(&s->queue);
+        removeSegment(s);
+        n--;
+    }
+}
+
 /* Process pending prepare requests.
  *
  * If we have some segments in the pool, use them to complete some pending
@@ -105,6 +204,7 @@ void uvPrepareClose(struct uv *uv)
 static void processRequests(struct uv *uv)
 {
     queue *head;
+    bool used = false;
     assert(!uv->closing);
 
     /* We can finish the requests for which we have ready segments. */
@@ -128,9 +228,18 @@ static void processRequests(struct uv *uv)
         QUEUE_REMOVE(&req->queue);
 
         /* Finish the request */
+        uv->prepare_last_counter = segment->counter;
+        updatePoolTarget(uv);
+        used = true;
         req->cb(req, segment->file, segment->counter, 0);
         raft_free(segment);
     }
+
+    /* If the target pool size was lowered, release the surplus. The request
+     * callbacks might have closed the instance though. */
+    if (used && !uv->closing) {
+        trimPool(uv);
+    }
 }
 
 static void maybePrepareSegment(struct uv *uv);
@@ -161,7 +270,8 @@ static void prepareSegmentFileCreateCb(struct uvFileCreate *req, int status)
     }
 
     uv->prepare_file = NULL;
-    QUEUE_PUSH(&uv->prepare_pool, &s->queue);
+    uv->prepare_create_time = uv_hrtime() - uv->prepare_started_at;
+    addSegmentToPool(uv, s);
 
     /* Let's process any pending request. */
     processRequests(uv);
@@ -214,6 +324,7 @@ static int prepareSegment(struct uv *uv)
 
     uv->prepare_file = s->file;
     uv->prepare_next_counter++;
+    uv->prepare_started_at = uv_hrtime();
 
     return 0;
 
@@ -229,12 +340,10 @@ err:
     return rv;
 }
 
-/* If the pool has less than TARGET_POOL_SIZE segments, and we're not already
+/* If the pool has less segments than the target size, and we're not already
  * creating a segment, start creating a new segment. */
 static void maybePrepareSegment(struct uv *uv)
 {
-    queue *head;
-    unsigned n;
     int rv;
 
     assert(!uv->closing);
@@ -245,10 +354,7 @@ static void maybePrepareSegment(struct uv *uv)
     }
 
     /* Check how many prepared open segments we have. */
-    n = 0;
-    QUEUE_FOREACH(head, &uv->prepare_pool) { n++; }
-
-    if (n < TARGET_POOL_SIZE) {
+    if (poolSize(uv) < uv->prepare_pool_target) {
         rv = prepareSegment(uv);
         if (rv != 0) {
             flushRequests(uv, rv);
@@ -257,11 +363,99 @@ static void maybePrepareSegment(struct uv *uv)
     }
 }
 
+void uvPrepareTick(struct uv *uv)
+{
+    uint64_t idle;
+
+    if (uv->closing || uv->prepare_interval == 0) {
+        return;
+    }
+
+    /* If no segment was used for longer than the average interval, the rate
+     * has dropped, so shrink the pool as if the next segment were used right
+     * now, without waiting for that to actually happen. */
+    idle = uv_hrtime() - uv->prepare_used_at;
+    if (idle <= uv->prepare_interval) {
+        return;
+    }
+    setPoolTarget(uv, idle);
+    trimPool(uv);
+}
+
 void uvPrepare(struct uv *uv, struct uvPrepare *req, uvPrepareCb cb)
 {
     assert(uv->state == UV__ACTIVE);
     req->cb = cb;
     QUEUE_PUSH(&uv->prepare_reqs, &req->queue);
     processRequests(uv);
+    /* If the request could not be served from the pool, it stalls until a new
+     * segment gets created. */
+    if (!QUEUE_IS_EMPTY(&uv->prepare_reqs)) {
+        uv->prepare_n_stalls++;
+    }
     maybePrepareSegment(uv);
 }
+
+void uvPrepareRecycle(struct uv *uv, unsigned long long counter, int fd)
+{
+    struct segment *s;
+    osFilename filename;
+    int rv;
+
+    if (fd == -1) {
+        return;
+    }
+
+    sprintf(filename, UV__OPEN_TEMPLATE, counter);
+
+    /* If a segment with a higher counter was already handed out, we can't use
+     * this one anymore, since its entries would come later in the log. */
+    if (uv->closing || counter < uv->prepare_last_counter) {
+        goto err;
+    }
+
+    s = raft_malloc(sizeof *s);
+    if (s == NULL) {
+        goto err;
+    }
+    s->uv = uv;
+    s->file = raft_malloc(sizeof *s->file);
+    if (s->file == NULL) {
+        goto err_after_segment_alloc;
+    }
+
+    rv = uvFileInit(s->file, uv->loop, false, false);
+    if (rv != 0) {
+        goto err_after_file_alloc;
+    }
+    s->file->data = s;
+    s->counter = counter;
+    osJoin(uv->dir, filename, s->path);
+
+    /* The file was opened in the threadpool by the snapshot logic, this only
+     * sets up the AIO context and takes ownership of the descriptor. */
+    rv = uvFileOpen(s->file, fd, MAX_CONCURRENT_WRITES);
+    if (rv != 0) {
+        uvWarnf(uv, "open recycled segment %s: %s", filename,
+                uv_strerror(rv));
+        uvFileClose(s->file, (uvFileCloseCb)raft_free);
+        raft_free(s);
+        osUnlink(uv->dir, filename);
+        return;
+    }
+
+    addSegmentToPool(uv, s);
+    processRequests(uv);
+
+    return;
+
+err_after_file_alloc:
+    raft_free(s->file);
+err_after_segment_alloc:
+    raft_free(s);
+err:
+    /* Ignore errors, we just lose the chance to recycle this file. A recycled
+     * segment which was never written is removed at startup anyways. */
+    close(fd);
+    osUnlink(uv->dir, filename);
+}
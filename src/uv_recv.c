@@ -6,6 +6,7 @@
 #include "byte.h"
 #include "logging.h"
 #include "uv.h"
+#include "uv_codec.h"
 #include "uv_encoding.h"
 
 /* The happy path for a receiving an RPC message is:
@@ -14,17 +15,24 @@
  *   transport invokes our accept callback.
  *
  * - A new server object is created and added to the servers array. It starts
- *   reading from the stream handle of the new connection.
+ *   reading from the stream handle of the new connection into its receive
+ *   buffer, as much data as is available.
  *
- * - The RPC message preamble is read, which contains the message type and the
- *   message length.
+ * - The RPC message preamble is decoded, which contains the message type and
+ *   the message length.
  *
- * - The RPC message header is read, whose content depends on the message type.
+ * - The RPC message header is decoded, whose content depends on the message
+ *   type.
  *
- * - Optionally, the RPC message payload is read (for AppendEntries requests).
+ * - Optionally, the RPC message payload is copied out of the receive buffer
+ *   (for AppendEntries and InstallSnapshot requests).
  *
  * - The recv callback passed to raft_io->start() gets fired with the received
- *   message.
+ *   message, and the next message in the receive buffer, if any, is decoded.
+ *
+ * A header or payload that is too large to be worth buffering is instead read
+ * directly into a dedicated buffer, whose ownership is then transfered to the
+ * user together with the message, without further copies.
  *
  * Possible failure modes are:
  *
@@ -36,17 +44,36 @@
  *   handle and act like above.
  */
 
+/* Size of the receive buffer of each incoming connection. */
+#define BUF_SIZE (256 * 1024)
+
+/* Headers and payloads larger than this are read directly into a dedicated
+ * buffer, instead of being accumulated in the receive buffer. It must be small
+ * enough that a partial message always leaves room in the buffer for more
+ * data. */
+#define DIRECT_SIZE (64 * 1024)
+
+/* Parts of a message, in the order they get read. */
+enum { PREAMBLE = 0, HEADER, PAYLOAD };
+
 struct uvServer
 {
     struct uv *uv;               /* libuv I/O implementation object */
     unsigned id;                 /* ID of the remote server */
     char *address;               /* Address of the other server */
     struct uv_stream_s *stream;  /* Connection handle */
-    uv_buf_t buf;                /* Sliding buffer for reading incoming data */
+    uv_buf_t buf;                /* Receive buffer for incoming data */
+    size_t n_buf;                /* Number of bytes of data in buf */
+    uv_buf_t direct;             /* Unread part of a header or payload */
+    int stage;                   /* Part of the message we expect next */
     uint64_t preamble[2];        /* Static buffer with the request preamble */
-    uv_buf_t header;             /* Dynamic buffer with the request header */
+    uv_buf_t header;             /* Header, if read directly */
+    uv_buf_t scratch;            /* Aligned copy of a misaligned header */
     uv_buf_t payload;            /* Dynamic buffer with the request payload */
     struct raft_message message; /* The message being received */
+    bool can_compact;            /* Peer can decode compact batches */
+    bool can_bulk;               /* Peer accepts bulk connections */
+    unsigned codec;              /* ID of the peer's codec, or 0 */
 };
 
 static void copyAddress(const char *address1, char **address2)
@@ -76,13 +103,22 @@ static int initServer(struct uvServer *s,
     s->stream->data = s;
     s->buf.base = NULL;
     s->buf.len = 0;
+    s->n_buf = 0;
+    s->direct.base = NULL;
+    s->direct.len = 0;
+    s->stage = PREAMBLE;
     s->preamble[0] = 0;
     s->preamble[1] = 0;
     s->header.base = NULL;
     s->header.len = 0;
+    s->scratch.base = NULL;
+    s->scratch.len = 0;
     s->message.type = 0;
     s->payload.base = NULL;
     s->payload.len = 0;
+    s->can_compact = false;
+    s->can_bulk = false;
+    s->codec = 0;
     return 0;
 }
 
@@ -91,6 +127,10 @@ static void closeServer(struct uvServer *s)
     if (s->header.base != NULL) {
         /* This means we were interrupted while reading the header. */
         raft_free(s->header.base);
+    }
+    if (s->stage == PAYLOAD) {
+        /* This means we were interrupted while reading the payload, after
+         * having decoded the header. */
         switch (s->message.type) {
             case RAFT_IO_APPEND_ENTRIES:
                 raft_free(s->message.append_entries.entries);
@@ -101,9 +141,14 @@ static void closeServer(struct uvServer *s)
         }
     }
     if (s->payload.base != NULL) {
-        /* This means we were interrupted while reading the payload. */
         raft_free(s->payload.base);
     }
+    if (s->buf.base != NULL) {
+        raft_free(s->buf.base);
+    }
+    if (s->scratch.base != NULL) {
+        raft_free(s->scratch.base);
+    }
     raft_free(s->address);
     raft_free(s->stream);
 }
@@ -115,51 +160,29 @@ static void allocCb(uv_handle_t *handle, size_t suggested_size, uv_buf_t *buf)
     struct uvServer *s = handle->data;
     (void)suggested_size;
 
-    /* If this is the first read of the preamble, or of the header, or of the
-     * payload, then initialize the read buffer, according to the chunk of data
-     * that we expect next. */
-    if (s->buf.len == 0) {
-        assert(s->buf.base == NULL);
-
-        /* Check if we expect the preamble. */
-        if (s->header.len == 0) {
-            assert(s->preamble[0] == 0);
-            assert(s->preamble[1] == 0);
-            s->buf.base = (char *)s->preamble;
-            s->buf.len = sizeof s->preamble;
-            goto out;
-        }
-
-        /* Check if we expect the header. */
-        if (s->payload.len == 0) {
-            assert(s->header.len > 0);
-            assert(s->header.base == NULL);
-            s->header.base = raft_malloc(s->header.len);
-            if (s->header.base == NULL) {
-                /* Setting all buffer fields to 0 will make read_cb fail with
-                 * ENOBUFS. */
-                memset(buf, 0, sizeof *buf);
-                return;
-            }
-            s->buf = s->header;
-            goto out;
-        }
+    /* If we're reading a large header or payload, read the rest of it in
+     * place. */
+    if (s->direct.len > 0) {
+        *buf = s->direct;
+        return;
+    }
 
-        /* If we get here we should be expecting the payload. */
-        assert(s->payload.len > 0);
-        s->payload.base = raft_malloc(s->payload.len);
-        if (s->payload.base == NULL) {
+    if (s->buf.base == NULL) {
+        s->buf.base = raft_malloc(BUF_SIZE);
+        if (s->buf.base == NULL) {
             /* Setting all buffer fields to 0 will make read_cb fail with
              * ENOBUFS. */
             memset(buf, 0, sizeof *buf);
             return;
         }
-
-        s->buf = s->payload;
+        s->buf.len = BUF_SIZE;
     }
 
-out:
-    *buf = s->buf;
+    /* Data of partial messages is always moved at the beginning of the
+     * buffer, and is never larger than DIRECT_SIZE plus the preamble. */
+    assert(s->n_buf < s->buf.len);
+    buf->base = s->buf.base + s->n_buf;
+    buf->len = s->buf.len - s->n_buf;
 }
 
 /* Remove the given server connection */
@@ -198,6 +221,39 @@ static void stopServer(struct uvServer *s)
     uv_close((struct uv_handle_s *)s->stream, streamCloseCb);
 }
 
+/* Decompress the compressed entries data at @src of the AppendEntries message
+ * being received into a new buffer. */
+static int decompressPayload(struct uvServer *s,
+                             const void *src,
+                             struct raft_buffer *payload)
+{
+    const struct raft_uv_codec *codec;
+    size_t size;
+    void *buf;
+    unsigned i;
+    int rv;
+
+    codec = uvCodecLookup(s->uv->codec, s->codec);
+    if (codec == NULL) {
+        return RAFT_MALFORMED;
+    }
+
+    size = 0;
+    for (i = 0; i < s->message.append_entries.n_entries; i++) {
+        size += s->message.append_entries.entries[i].buf.len;
+    }
+
+    rv = uvCodecDecompress(codec, src, s->payload.len, size, &buf);
+    if (rv != 0) {
+        return rv;
+    }
+
+    payload->base = buf;
+    payload->len = size;
+
+    return 0;
+}
+
 /* Invoke the receive callback. */
 static void recvMessage(struct uvServer *s)
 {
@@ -207,109 +263,304 @@ static void recvMessage(struct uvServer *s)
      * release the payload buffer, since ownership was transfered to the
      * user. */
     memset(s->preamble, 0, sizeof s->preamble);
-    raft_free(s->header.base);
+    assert(s->header.base == NULL);
+    s->stage = PREAMBLE;
     s->message.type = 0;
-    s->header.base = NULL;
     s->header.len = 0;
     s->payload.base = NULL;
     s->payload.len = 0;
 }
 
-/* Callback invoked when data has been read from the socket. */
-static void readCb(uv_stream_t *stream, ssize_t nread, const uv_buf_t *buf)
+/* Start reading the rest of the given header or payload directly into its own
+ * buffer, after copying the @n bytes of it that we already have. */
+static int startDirect(struct uvServer *s,
+                       uv_buf_t *buf,
+                       const void *data,
+                       size_t n)
 {
-    struct uvServer *s = stream->data;
+    assert(buf->base == NULL);
+    assert(n < buf->len);
+    buf->base = raft_malloc(buf->len);
+    if (buf->base == NULL) {
+        uvWarnf(s->uv, "receive data: %s", raft_strerror(RAFT_NOMEM));
+        return RAFT_NOMEM;
+    }
+    memcpy(buf->base, data, n);
+    s->direct.base = buf->base + n;
+    s->direct.len = buf->len - n;
+    return 0;
+}
+
+/* Decode the message header, and deliver the message if it has no payload. */
+static int recvHeader(struct uvServer *s, const uv_buf_t *header)
+{
+    uint64_t type;
     int rv;
 
-    (void)buf;
+    type = byteFlip64(s->preamble[0]);
+    assert((unsigned)type > 0);
 
-    /* If the read was successful, let's check if we have received all the data
-     * we expected. */
-    if (nread > 0) {
-        size_t n = (size_t)nread;
+    if (type & UV__MESSAGE_CAN_COMPACT) {
+        s->can_compact = true;
+    }
+    if (type & UV__MESSAGE_CAN_BULK) {
+        s->can_bulk = true;
+    }
+    s->codec = (unsigned)((type & UV__MESSAGE_CODEC) >> UV__MESSAGE_CODEC_SHIFT);
 
-        /* We shouldn't have read more data than the pending amount. */
-        assert(n <= s->buf.len);
+    rv = uvDecodeMessage(type, header, &s->message, &s->payload.len);
+    if (rv != 0) {
+        uvWarnf(s->uv, "decode message: %s", raft_strerror(rv));
+        return rv;
+    }
 
-        /* Advance the read window */
-        s->buf.base += n;
-        s->buf.len -= n;
+    s->message.server_id = s->id;
+    s->message.server_address = s->address;
+    s->stage = PAYLOAD;
 
-        /* If there's more data to read in order to fill the current
-         * read buffer, just return, we'll be invoked again. */
-        if (s->buf.len > 0) {
-            return;
-        }
+    /* If the message has no payload, we're done. */
+    if (s->payload.len == 0) {
+        recvMessage(s);
+    }
 
-        if (s->header.len == 0) {
-            /* If the header buffer is not set, it means that we've just
-             * completed reading the preamble. */
-            assert(s->header.base == NULL);
+    return 0;
+}
 
-            s->header.len = byteFlip64(s->preamble[1]);
+/* Hand the payload at @data over to the message and deliver it. Unless the
+ * payload was read into its own buffer, @data points into the receive buffer,
+ * and gets copied. */
+static int recvPayload(struct uvServer *s, const void *data)
+{
+    struct raft_buffer payload;
+    uint64_t type;
+    int rv;
+
+    assert(s->payload.len > 0);
+    type = byteFlip64(s->preamble[0]);
+
+    if (s->message.type == RAFT_IO_APPEND_ENTRIES &&
+        (type & UV__MESSAGE_COMPRESSED)) {
+        rv = decompressPayload(s, data, &payload);
+        if (rv != 0) {
+            uvWarnf(s->uv, "decompress entries: %s", raft_strerror(rv));
+            return rv;
+        }
+        if (s->payload.base != NULL) {
+            raft_free(s->payload.base);
+        }
+        s->payload.base = payload.base;
+        s->payload.len = payload.len;
+    } else if (s->payload.base == NULL) {
+        s->payload.base = raft_malloc(s->payload.len);
+        if (s->payload.base == NULL) {
+            uvWarnf(s->uv, "receive data: %s", raft_strerror(RAFT_NOMEM));
+            return RAFT_NOMEM;
+        }
+        memcpy(s->payload.base, data, s->payload.len);
+    }
 
-            /* The length of the header must be greater than zero. */
-            if (s->header.len == 0) {
-                uvWarnf(s->uv, "message has zero length");
-                goto abort;
+    /* TODO: avoid converting from uv_buf_t */
+    payload.base = s->payload.base;
+    payload.len = s->payload.len;
+
+    switch (s->message.type) {
+        case RAFT_IO_APPEND_ENTRIES:
+            if (type & UV__MESSAGE_COMPACT) {
+                uvDecodeEntriesBatchCompact(&payload,
+                                            s->message.append_entries.entries,
+                                            s->message.append_entries.n_entries);
+            } else {
+                uvDecodeEntriesBatch(&payload,
+                                     s->message.append_entries.entries,
+                                     s->message.append_entries.n_entries);
             }
-        } else if (s->payload.len == 0) {
-            /* If the payload buffer is not set, it means we just completed
-             * reading the message header. */
-            unsigned type;
+            break;
+        case RAFT_IO_INSTALL_SNAPSHOT:
+            s->message.install_snapshot.data.base = s->payload.base;
+            break;
+        default:
+            /* We should never have read a payload in the first place */
+            assert(0);
+    }
 
-            assert(s->header.base != NULL);
+    recvMessage(s);
 
-            type = byteFlip64(s->preamble[0]);
-            assert(type > 0);
+    return 0;
+}
 
-            rv =
-                uvDecodeMessage(type, &s->header, &s->message, &s->payload.len);
-            if (rv != 0) {
-                uvWarnf(s->uv, "decode message: %s", raft_strerror(rv));
-                goto abort;
-            }
+/* Copy the header at @cursor into the scratch buffer, which is suitably
+ * aligned, and point @cursor to the copy. */
+static int alignHeader(struct uvServer *s, char **cursor)
+{
+    if (s->scratch.len < s->header.len) {
+        if (s->scratch.base != NULL) {
+            raft_free(s->scratch.base);
+        }
+        s->scratch.base = raft_malloc(s->header.len);
+        if (s->scratch.base == NULL) {
+            s->scratch.len = 0;
+            return RAFT_NOMEM;
+        }
+        s->scratch.len = s->header.len;
+    }
+    memcpy(s->scratch.base, *cursor, s->header.len);
+    *cursor = s->scratch.base;
+    return 0;
+}
 
-            s->message.server_id = s->id;
-            s->message.server_address = s->address;
+/* Decode all the complete messages in the receive buffer, and move the data of
+ * the last partial message, if any, to the beginning of the buffer.
+ *
+ * Return #RAFT_CANCELED if the connection got closed by the receive callback,
+ * or another error code if the connection must be aborted. */
+static int processBuffer(struct uvServer *s)
+{
+    size_t offset = 0;
+    int rv;
 
-            /* If the message has no payload, we're done. */
-            if (s->payload.len == 0) {
-                recvMessage(s);
-            }
-        } else {
-            /* If we get here it means that we've just completed reading the
-             * payload. TODO: avoid converting from uv_buf_t */
-            struct raft_buffer payload;
-            assert(s->payload.base != NULL);
-            assert(s->payload.len > 0);
-
-            switch (s->message.type) {
-                case RAFT_IO_APPEND_ENTRIES:
-                    payload.base = s->payload.base;
-                    payload.len = s->payload.len;
-                    uvDecodeEntriesBatch(&payload,
-                                         s->message.append_entries.entries,
-                                         s->message.append_entries.n_entries);
-                    break;
-                case RAFT_IO_INSTALL_SNAPSHOT:
-                    s->message.install_snapshot.data.base = s->payload.base;
-                    break;
-                default:
-                    /* We should never have read a payload in the first place */
-                    assert(0);
-            }
+    for (;;) {
+        char *cursor = s->buf.base + offset;
+        size_t n = s->n_buf - offset;
+        uv_buf_t header;
+
+        switch (s->stage) {
+            case PREAMBLE:
+                if (n < sizeof s->preamble) {
+                    goto out;
+                }
+                memcpy(s->preamble, cursor, sizeof s->preamble);
+                offset += sizeof s->preamble;
+                s->header.len = byteFlip64(s->preamble[1]);
+
+                /* The length of the header must be greater than zero. */
+                if (s->header.len == 0) {
+                    uvWarnf(s->uv, "message has zero length");
+                    return RAFT_MALFORMED;
+                }
+                s->stage = HEADER;
+                continue;
+            case HEADER:
+                if (n < s->header.len) {
+                    if (s->header.len > DIRECT_SIZE) {
+                        rv = startDirect(s, &s->header, cursor, n);
+                        offset += n;
+                        if (rv != 0) {
+                            return rv;
+                        }
+                    }
+                    goto out;
+                }
+                /* Headers are decoded in place, so make sure that they're
+                 * 8-byte aligned, copying them if needed. */
+                if ((uintptr_t)cursor % sizeof(uint64_t) != 0) {
+                    rv = alignHeader(s, &cursor);
+                    if (rv != 0) {
+                        return rv;
+                    }
+                }
+                header.base = cursor;
+                header.len = s->header.len;
+                offset += header.len;
+                rv = recvHeader(s, &header);
+                break;
+            case PAYLOAD:
+                if (n < s->payload.len) {
+                    if (s->payload.len > DIRECT_SIZE) {
+                        rv = startDirect(s, &s->payload, cursor, n);
+                        offset += n;
+                        if (rv != 0) {
+                            return rv;
+                        }
+                    }
+                    goto out;
+                }
+                offset += s->payload.len;
+                rv = recvPayload(s, cursor);
+                break;
+            default:
+                assert(0);
+                return RAFT_MALFORMED;
+        }
 
-            recvMessage(s);
+        if (rv != 0) {
+            return rv;
         }
+        if (uv_is_closing((struct uv_handle_s *)s->stream)) {
+            return RAFT_CANCELED;
+        }
+    }
 
-        /* Mark that we're done with this chunk. When the alloc callback will
-         * trigger again it will notice that it needs to change the read
-         * buffer. */
-        assert(s->buf.len == 0);
-        s->buf.base = NULL;
+out:
+    memmove(s->buf.base, s->buf.base + offset, s->n_buf - offset);
+    s->n_buf -= offset;
+    return 0;
+}
 
-        return;
+/* Process the header or payload that we just finished to read directly. */
+static int processDirect(struct uvServer *s)
+{
+    uv_buf_t header;
+    int rv;
+
+    assert(s->n_buf == 0);
+    s->direct.base = NULL;
+
+    if (s->stage == HEADER) {
+        header = s->header;
+        s->header.base = NULL;
+        rv = recvHeader(s, &header);
+        raft_free(header.base);
+    } else {
+        assert(s->stage == PAYLOAD);
+        rv = recvPayload(s, s->payload.base);
+    }
+    if (rv != 0) {
+        return rv;
+    }
+    if (uv_is_closing((struct uv_handle_s *)s->stream)) {
+        return RAFT_CANCELED;
+    }
+    return 0;
+}
+
+/* Callback invoked when data has been read from the socket. */
+static void readCb(uv_stream_t *stream, ssize_t nread, const uv_buf_t *buf)
+{
+    struct uvServer *s = stream->data;
+    int rv;
+
+    (void)buf;
+
+    /* If the read was successful, let's decode all the data we have
+     * received. */
+    if (nread > 0) {
+        size_t n = (size_t)nread;
+
+        if (s->direct.len > 0) {
+            /* We shouldn't have read more data than the pending amount. */
+            assert(n <= s->direct.len);
+
+            /* Advance the read window */
+            s->direct.base += n;
+            s->direct.len -= n;
+
+            /* If there's more data to read in order to fill the current
+             * header or payload, just return, we'll be invoked again. */
+            if (s->direct.len > 0) {
+                return;
+            }
+
+            rv = processDirect(s);
+        } else {
+            assert(n <= s->buf.len - s->n_buf);
+            s->n_buf += n;
+            rv = processBuffer(s);
+        }
+
+        if (rv == 0 || rv == RAFT_CANCELED) {
+            return;
+        }
+        goto abort;
     }
 
     /* The if nread>0 condition above should always exit the function with a
@@ -421,6 +672,8 @@ static void acceptCb(struct raft_uv_transport *transport,
         goto abort;
     }
 
+    uvSendReconnect(uv, id);
+
     return;
 
 abort:
@@ -444,3 +697,36 @@ void uvRecvClose(struct uv *uv)
         stopServer(uv->servers[i]);
     }
 }
+
+/* Return the most recent inbound connection from the server with the given ID,
+ * if any. Older ones might be stale connections from a previous run of the
+ * peer. */
+static struct uvServer *lookupServer(struct uv *uv, unsigned id)
+{
+    unsigned i;
+    for (i = uv->n_servers; i > 0; i--) {
+        struct uvServer *s = uv->servers[i - 1];
+        if (s->id == id) {
+            return s;
+        }
+    }
+    return NULL;
+}
+
+bool uvRecvCanCompact(struct uv *uv, unsigned id)
+{
+    struct uvServer *s = lookupServer(uv, id);
+    return s != NULL && s->can_compact;
+}
+
+bool uvRecvCanBulk(struct uv *uv, unsigned id)
+{
+    struct uvServer *s = lookupServer(uv, id);
+    return s != NULL && s->can_bulk;
+}
+
+unsigned uvRecvCodec(struct uv *uv, unsigned id)
+{
+    struct uvServer *s = lookupServer(uv, id);
+    return s != NULL ? s->codec : 0;
+}
@@ -1,6 +1,8 @@
 #include <errno.h>
+#include <fcntl.h>
 #include <stdio.h>
 #include <string.h>
+#include <sys/stat.h>
 #include <unistd.h>
 
 #include "array.h"
@@ -9,6 +11,7 @@
 #include "configuration.h"
 #include "entry.h"
 #include "uv.h"
+#include "uv_codec.h"
 #include "uv_encoding.h"
 
 /* Check if the given filename matches the one of a closed segment (xxx-yyy), or
@@ -109,12 +112,14 @@ void uvSegmentSort(struct uvSegmentInfo *infos, size_t n_infos)
     qsort(infos, n_infos, sizeof *infos, compare);
 }
 
-/* Open a segment file and read its format version. */
+/* Open a segment file and read its format version, and its epoch if the format
+ * has one (otherwise @epoch is set to 0). */
 static int openSegment(struct uv *uv,
                        const osFilename filename,
                        const int flags,
                        int *fd,
-                       uint64_t *format)
+                       uint64_t *format,
+                       uint64_t *epoch)
 {
     int rv;
     rv = osOpen(uv->dir, filename, flags, fd);
@@ -124,19 +129,233 @@ static int openSegment(struct uv *uv,
     }
     rv = osReadN(*fd, format, sizeof *format);
     if (rv != 0) {
-        uvErrorf(uv, "read %s: %s", filename, osStrError(rv));
-        close(*fd);
-        return RAFT_IOERR;
+        goto err_after_open;
     }
     *format = byteFlip64(*format);
+    *epoch = 0;
+    if (*format >= UV__SEGMENT_FORMAT_EPOCH &&
+        *format <= UV__SEGMENT_FORMAT) {
+        rv = osReadN(*fd, epoch, sizeof *epoch);
+        if (rv != 0) {
+            goto err_after_open;
+        }
+        *epoch = byteFlip64(*epoch);
+    }
+    return 0;
+
+err_after_open:
+    uvErrorf(uv, "read %s: %s", filename, osStrError(rv));
+    close(*fd);
+    return RAFT_IOERR;
+}
+
+/* Return #true if the given segment format version is one we can read. */
+static bool isKnownFormat(uint64_t format)
+{
+    return format >= UV__DISK_FORMAT && format <= UV__SEGMENT_FORMAT;
+}
+
+unsigned uvSegmentChecksumSeed(uint64_t epoch)
+{
+    return (unsigned)(epoch ^ (epoch >> 32));
+}
+
+unsigned uvSegmentChecksum(uint64_t format,
+                           const void *buf,
+                           size_t size,
+                           unsigned crc)
+{
+    if (format >= UV__SEGMENT_FORMAT_CRC32C) {
+        return byteCrc32c(buf, size, crc);
+    }
+    return byteCrc32(buf, size, crc);
+}
+
+/* Decompress the data of a compressed batch, consisting of the codec ID
+ * followed by the compressed entries data, into a new buffer holding the @size
+ * bytes of the entries data. */
+static int decompressBatch(struct uv *uv,
+                           const struct raft_buffer *data,
+                           size_t size,
+                           void **buf)
+{
+    const struct raft_uv_codec *codec;
+    unsigned id;
+    int rv;
+
+    assert(data->len > 1);
+    assert(size > 0);
+
+    id = *(uint8_t *)data->base;
+    codec = uvCodecLookup(uv->codec, id);
+    if (codec == NULL) {
+        uvErrorf(uv, "batch compressed with unknown codec %u", id);
+        return RAFT_CORRUPT;
+    }
+
+    rv = uvCodecDecompress(codec, (uint8_t *)data->base + 1, data->len - 1,
+                           size, buf);
+    if (rv != 0) {
+        if (rv == RAFT_MALFORMED) {
+            uvErrorf(uv, "corrupted compressed batch data");
+            rv = RAFT_CORRUPT;
+        }
+        return rv;
+    }
+
     return 0;
 }
 
-/* Load a single batch of entries from a segment.
+/* Return #true if the entries data size in the header of a compact batch is
+ * consistent with the data size found in its preamble. */
+static bool compactBatchSizeMatches(size_t data_len,
+                                    bool compressed,
+                                    size_t size)
+{
+    if (compressed) {
+        return size > 0 && data_len > 1;
+    }
+    return size == data_len;
+}
+
+/* Load the rest of a batch using the compact format, whose 16-byte preamble
+ * with the checksums and the sizes of the header and data has already been
+ * read from offset @offset. */
+static int loadCompactBatch(struct uv *uv,
+                            const int fd,
+                            uint64_t format,
+                            unsigned seed,
+                            const uint64_t preamble[2],
+                            off_t offset,
+                            struct raft_entry **entries,
+                            unsigned *n_entries)
+{
+    const void *cursor = preamble;
+    struct raft_buffer header; /* Batch header */
+    struct raft_buffer data;   /* Batch data */
+    uint32_t crc1;             /* Target checksum of the header */
+    uint32_t crc2;             /* Target checksum of the data */
+    struct stat st;            /* To get the size of the segment file */
+    size_t size;               /* Sum of the sizes of the entries */
+    bool compressed;           /* Whether the batch data is compressed */
+    void *buf;                 /* Decompressed batch data */
+    unsigned i;
+    int rv;
+
+    crc1 = byteGet32(&cursor);
+    crc2 = byteGet32(&cursor);
+    header.len = byteGet32(&cursor);
+    data.len = byteGet32(&cursor);
+    compressed = (data.len & UV__SEGMENT_BATCH_COMPRESSED) != 0;
+    data.len &= ~UV__SEGMENT_BATCH_COMPRESSED;
+
+    if (header.len == 0) {
+        uvErrorf(uv, "batch has zero entries");
+        return RAFT_CORRUPT;
+    }
+
+    /* Protect against allocating too much memory if the sizes are garbage. */
+    rv = fstat(fd, &st);
+    if (rv == -1) {
+        uvErrorf(uv, "stat: %s", osStrError(errno));
+        return RAFT_IOERR;
+    }
+    if (sizeof(uint32_t) * 4 + header.len + data.len >
+        (size_t)(st.st_size - offset)) {
+        uvErrorf(uv, "batch too big (preamble at %lld)", (long long)offset);
+        return RAFT_CORRUPT;
+    }
+
+    header.base = raft_malloc(header.len);
+    if (header.base == NULL) {
+        return RAFT_NOMEM;
+    }
+    rv = osReadN(fd, header.base, header.len);
+    if (rv != 0) {
+        uvErrorf(uv, "read: %s", osStrError(rv));
+        rv = RAFT_IOERR;
+        goto err_after_header_alloc;
+    }
+
+    /* Check batch header integrity, including the sizes. */
+    if (uvSegmentChecksum(
+            format, header.base, header.len,
+            uvSegmentChecksum(format, &preamble[1], sizeof preamble[1],
+                              seed)) != crc1) {
+        uvErrorf(uv, "corrupted batch header");
+        rv = RAFT_CORRUPT;
+        goto err_after_header_alloc;
+    }
+
+    rv = uvDecodeBatchHeaderCompact(header.base, header.len, entries,
+                                    n_entries);
+    if (rv != 0) {
+        goto err_after_header_alloc;
+    }
+    size = 0;
+    for (i = 0; i < *n_entries; i++) {
+        size += (*entries)[i].buf.len;
+    }
+    if (*n_entries == 0 ||
+        !compactBatchSizeMatches(data.len, compressed, size)) {
+        uvErrorf(uv, "batch header doesn't match data size");
+        rv = RAFT_CORRUPT;
+        goto err_after_header_decode;
+    }
+
+    data.base = raft_malloc(data.len);
+    if (data.base == NULL) {
+        rv = RAFT_NOMEM;
+        goto err_after_header_decode;
+    }
+    rv = osReadN(fd, data.base, data.len);
+    if (rv != 0) {
+        uvErrorf(uv, "read: %s", osStrError(rv));
+        rv = RAFT_IOERR;
+        goto err_after_data_alloc;
+    }
+    if (uvSegmentChecksum(format, data.base, data.len, seed) != crc2) {
+        uvErrorf(uv, "corrupted batch data");
+        rv = RAFT_CORRUPT;
+        goto err_after_data_alloc;
+    }
+
+    if (compressed) {
+        rv = decompressBatch(uv, &data, size, &buf);
+        if (rv != 0) {
+            goto err_after_data_alloc;
+        }
+        raft_free(data.base);
+        data.base = buf;
+        data.len = size;
+    }
+
+    uvDecodeEntriesBatchCompact(&data, *entries, *n_entries);
+
+    raft_free(header.base);
+
+    return 0;
+
+err_after_data_alloc:
+    raft_free(data.base);
+err_after_header_decode:
+    if (*entries != NULL) {
+        raft_free(*entries);
+    }
+err_after_header_alloc:
+    raft_free(header.base);
+    assert(rv != 0);
+    return rv;
+}
+
+/* Load a single batch of entries from a segment with the given format version,
+ * whose checksums are expected to be seeded with the given value.
  *
  * Set @last to #true if the loaded batch is the last one. */
 static int loadEntriesBatch(struct uv *uv,
                             const int fd,
+                            uint64_t format,
+                            unsigned seed,
                             struct raft_entry **entries,
                             unsigned *n_entries,
                             bool *last)
@@ -150,6 +369,7 @@ static int loadEntriesBatch(struct uv *uv,
     uint32_t crc1;             /* Target checksum */
     uint32_t crc2;             /* Actual checksum */
     off_t offset;              /* Current segment file offset */
+    struct stat st;            /* To get the size of the segment file */
     int rv;
 
     /* Save the current offset, to provide more information when logging. */
@@ -164,6 +384,16 @@ static int loadEntriesBatch(struct uv *uv,
         return RAFT_IOERR;
     }
 
+    if (format >= UV__SEGMENT_FORMAT_COMPACT) {
+        rv = loadCompactBatch(uv, fd, format, seed, preamble, offset, entries,
+                              n_entries);
+        if (rv != 0) {
+            return rv;
+        }
+        *last = osIsAtEof(fd);
+        return 0;
+    }
+
     n = byteFlip64(preamble[1]);
     if (n == 0) {
         uvErrorf(uv, "batch has zero entries");
@@ -171,14 +401,21 @@ static int loadEntriesBatch(struct uv *uv,
         goto err;
     }
 
-    /* Very optimistic upper bound of the number of entries we should
-     * expect. This is mainly a protection against allocating too much
-     * memory. Each entry will consume at least 4 words (for term, type, size
-     * and payload). */
-    max_n = UV__MAX_SEGMENT_SIZE / (sizeof(uint64_t) * 4);
+    /* Very optimistic upper bound of the number of entries we should expect,
+     * given the bytes left in the file. This is mainly a protection against
+     * allocating too much memory. Each entry will consume at least 2 words in
+     * the batch header (for term, type and size). Since segments don't have a
+     * fixed size, we can't use a constant limit here. */
+    rv = fstat(fd, &st);
+    if (rv == -1) {
+        uvErrorf(uv, "stat: %s", osStrError(errno));
+        return RAFT_IOERR;
+    }
+    max_n = (st.st_size - offset) / (sizeof(uint64_t) * 2);
 
     if (n > max_n) {
-        uvErrorf(uv, "batch has %u entries (preamble at %d)", n, offset);
+        uvErrorf(uv, "batch has %u entries (preamble at %lld)", n,
+                 (long long)offset);
         rv = RAFT_CORRUPT;
         goto err;
     }
@@ -203,7 +440,7 @@ static int loadEntriesBatch(struct uv *uv,
 
     /* Check batch header integrity. */
     crc1 = byteFlip32(*(uint32_t *)preamble);
-    crc2 = byteCrc32(header.base, header.len, 0);
+    crc2 = uvSegmentChecksum(format, header.base, header.len, seed);
     if (crc1 != crc2) {
         uvErrorf(uv, "corrupted batch header");
         rv = RAFT_CORRUPT;
@@ -237,7 +474,7 @@ static int loadEntriesBatch(struct uv *uv,
 
     /* Check batch data integrity. */
     crc1 = byteFlip32(*((uint32_t *)preamble + 1));
-    crc2 = byteCrc32(data.base, data.len, 0);
+    crc2 = uvSegmentChecksum(format, data.base, data.len, seed);
     if (crc1 != crc2) {
         uvErrorf(uv, "corrupted batch data");
         rv = RAFT_CORRUPT;
@@ -288,78 +525,406 @@ static int extendEntries(const struct raft_entry *entries1,
     return 0;
 }
 
+/* Like decodeEntriesBatch, for segments using the compact batch format. */
+static int decodeCompactBatch(struct uv *uv,
+                              uint64_t format,
+                              unsigned seed,
+                              const void *content,
+                              size_t size,
+                              size_t *offset,
+                              struct raft_entry **entries,
+                              unsigned *n_entries)
+{
+    const void *cursor;        /* Read position in the content */
+    const void *sizes;         /* Position of the header and data sizes */
+    struct raft_buffer header; /* Batch header */
+    struct raft_buffer data;   /* Batch data */
+    uint32_t crc1;             /* Target checksum of the header */
+    uint32_t crc2;             /* Target checksum of the data */
+    size_t total;              /* Sum of the sizes of the entries */
+    bool compressed;           /* Whether the batch data is compressed */
+    void *buf;                 /* Decompressed batch data */
+    unsigned i;
+    int rv;
+
+    if (size - *offset < sizeof(uint32_t) * 4) {
+        uvErrorf(uv, "short batch preamble at %zu", *offset);
+        return RAFT_IOERR;
+    }
+    cursor = (const uint8_t *)content + *offset;
+    crc1 = byteGet32(&cursor);
+    crc2 = byteGet32(&cursor);
+    sizes = cursor;
+    header.len = byteGet32(&cursor);
+    data.len = byteGet32(&cursor);
+    compressed = (data.len & UV__SEGMENT_BATCH_COMPRESSED) != 0;
+    data.len &= ~UV__SEGMENT_BATCH_COMPRESSED;
+    header.base = (void *)cursor;
+    data.base = (uint8_t *)header.base + header.len;
+
+    if (header.len == 0) {
+        uvErrorf(uv, "batch has zero entries");
+        return RAFT_CORRUPT;
+    }
+    if (size - *offset - sizeof(uint32_t) * 4 < header.len + data.len) {
+        uvErrorf(uv, "short batch at %zu", *offset);
+        return RAFT_IOERR;
+    }
+
+    /* Check batch header integrity, including the sizes. */
+    if (uvSegmentChecksum(format, sizes, sizeof(uint32_t) * 2 + header.len,
+                          seed) != crc1) {
+        uvErrorf(uv, "corrupted batch header");
+        return RAFT_CORRUPT;
+    }
+
+    rv = uvDecodeBatchHeaderCompact(header.base, header.len, entries,
+                                    n_entries);
+    if (rv != 0) {
+        return rv;
+    }
+    total = 0;
+    for (i = 0; i < *n_entries; i++) {
+        total += (*entries)[i].buf.len;
+    }
+    if (*n_entries == 0 ||
+        !compactBatchSizeMatches(data.len, compressed, total)) {
+        uvErrorf(uv, "batch header doesn't match data size");
+        rv = RAFT_CORRUPT;
+        goto err_after_header_decode;
+    }
+
+    if (uvSegmentChecksum(format, data.base, data.len, seed) != crc2) {
+        uvErrorf(uv, "corrupted batch data");
+        rv = RAFT_CORRUPT;
+        goto err_after_header_decode;
+    }
+
+    /* Compressed entries get their own batch, the others point into the
+     * content. */
+    if (compressed) {
+        rv = decompressBatch(uv, &data, total, &buf);
+        if (rv != 0) {
+            goto err_after_header_decode;
+        }
+        *offset += sizeof(uint32_t) * 4 + header.len + data.len;
+        data.base = buf;
+        data.len = total;
+        uvDecodeEntriesBatchCompact(&data, *entries, *n_entries);
+        return 0;
+    }
+
+    uvDecodeEntriesBatchCompact(&data, *entries, *n_entries);
+    for (i = 0; i < *n_entries; i++) {
+        (*entries)[i].batch = (void *)content;
+    }
+
+    *offset += sizeof(uint32_t) * 4 + header.len + data.len;
+
+    return 0;
+
+err_after_header_decode:
+    if (*entries != NULL) {
+        raft_free(*entries);
+    }
+    assert(rv != 0);
+    return rv;
+}
+
+/* Decode the batch of entries starting at @offset in the given segment content,
+ * whose checksums are expected to be seeded with the given value. The entries
+ * data is not copied: the buf attribute of each entry points into @content,
+ * which is also set as their batch, unless the batch is compressed, in which
+ * case the entries share a newly allocated batch. On success, @offset is
+ * advanced to the end of the batch. */
+static int decodeEntriesBatch(struct uv *uv,
+                              uint64_t format,
+                              unsigned seed,
+                              const void *content,
+                              size_t size,
+                              size_t *offset,
+                              struct raft_entry **entries,
+                              unsigned *n_entries)
+{
+    const void *cursor;        /* Read position in the content */
+    unsigned n;                /* Number of entries in the batch */
+    unsigned max_n;            /* Maximum number of entries we expect */
+    unsigned i;                /* Iterate through the entries */
+    struct raft_buffer header; /* Batch header */
+    struct raft_buffer data;   /* Batch data */
+    uint32_t crc1;             /* Target checksum of the header */
+    uint32_t crc2;             /* Target checksum of the data */
+    int rv;
+
+    if (format >= UV__SEGMENT_FORMAT_COMPACT) {
+        return decodeCompactBatch(uv, format, seed, content, size, offset,
+                                  entries, n_entries);
+    }
+
+    /* Read the preamble, consisting of the checksums for the batch header and
+     * data buffers and the first 8 bytes of the header buffer, which contains
+     * the number of entries in the batch. */
+    if (size - *offset < sizeof(uint64_t) * 2) {
+        uvErrorf(uv, "short batch preamble at %zu", *offset);
+        return RAFT_IOERR;
+    }
+    cursor = (const uint8_t *)content + *offset;
+    crc1 = byteGet32(&cursor);
+    crc2 = byteGet32(&cursor);
+    header.base = (void *)cursor;
+    n = byteGet64(&cursor);
+    if (n == 0) {
+        uvErrorf(uv, "batch has zero entries");
+        return RAFT_CORRUPT;
+    }
+
+    /* See loadEntriesBatch. */
+    max_n = (size - *offset) / (sizeof(uint64_t) * 2);
+    if (n > max_n) {
+        uvErrorf(uv, "batch has %u entries (preamble at %zu)", n, *offset);
+        return RAFT_CORRUPT;
+    }
+
+    header.len = uvSizeofBatchHeader(n);
+    if (size - *offset - sizeof(uint64_t) < header.len) {
+        uvErrorf(uv, "short batch header at %zu", *offset);
+        return RAFT_IOERR;
+    }
+
+    /* Check batch header integrity. */
+    if (uvSegmentChecksum(format, header.base, header.len, seed) != crc1) {
+        uvErrorf(uv, "corrupted batch header");
+        return RAFT_CORRUPT;
+    }
+
+    /* Decode the batch header, allocating the entries array. */
+    rv = uvDecodeBatchHeader(header.base, entries, n_entries);
+    if (rv != 0) {
+        return rv;
+    }
+
+    /* Calculate the total size of the batch data */
+    data.base = (uint8_t *)header.base + header.len;
+    data.len = 0;
+    for (i = 0; i < n; i++) {
+        data.len += (*entries)[i].buf.len;
+    }
+    if ((size_t)((const uint8_t *)content + size - (uint8_t *)data.base) <
+        data.len) {
+        uvErrorf(uv, "short batch data at %zu", *offset);
+        rv = RAFT_IOERR;
+        goto err_after_header_decode;
+    }
+
+    /* Check batch data integrity. */
+    if (uvSegmentChecksum(format, data.base, data.len, seed) != crc2) {
+        uvErrorf(uv, "corrupted batch data");
+        rv = RAFT_CORRUPT;
+        goto err_after_header_decode;
+    }
+
+    uvDecodeEntriesBatch(&data, *entries, *n_entries);
+    for (i = 0; i < n; i++) {
+        (*entries)[i].batch = (void *)content;
+    }
+
+    *offset += sizeof(uint32_t) * 2 + header.len + data.len;
+
+    return 0;
+
+err_after_header_decode:
+    raft_free(*entries);
+    assert(rv != 0);
+    return rv;
+}
+
+/* Release the batches that were allocated separately from @content, i.e. the
+ * decompressed ones, of the entries from @from to @n. A batch shared with the
+ * entry before @from is retained. */
+static void releaseBatches(struct raft_entry *entries,
+                           size_t from,
+                           size_t n,
+                           const void *content)
+{
+    const void *batch = from > 0 ? entries[from - 1].batch : NULL;
+    size_t i;
+
+    for (i = from; i < n; i++) {
+        if (entries[i].batch == batch || entries[i].batch == content) {
+            continue;
+        }
+        batch = entries[i].batch;
+        raft_free(entries[i].batch);
+    }
+}
+
+/* Read the whole content of the given closed segment with a single read. */
+static int readClosed(struct uv *uv,
+                      const char *filename,
+                      void **content,
+                      size_t *size)
+{
+    int fd;         /* Segment file descriptor */
+    struct stat st; /* To get the size of the segment file */
+    int rv;
+
+    /* Open the segment file. */
+    rv = osOpen(uv->dir, filename, O_RDONLY, &fd);
+    if (rv != 0) {
+        uvErrorf(uv, "open %s: %s", filename, osStrError(rv));
+        rv = RAFT_IOERR;
+        goto err;
+    }
+
+    rv = fstat(fd, &st);
+    if (rv == -1) {
+        uvErrorf(uv, "stat %s: %s", filename, osStrError(errno));
+        rv = RAFT_IOERR;
+        goto err_after_open;
+    }
+    *size = (size_t)st.st_size;
+
+    /* If the segment is completely empty, just bail out. */
+    if (*size == 0) {
+        uvErrorf(uv, "load %s: file is empty", filename);
+        rv = RAFT_CORRUPT;
+        goto err_after_open;
+    }
+
+    *content = raft_malloc(*size);
+    if (*content == NULL) {
+        rv = RAFT_NOMEM;
+        goto err_after_open;
+    }
+    rv = osReadN(fd, *content, *size);
+    if (rv != 0) {
+        uvErrorf(uv, "read %s: %s", filename, osStrError(rv));
+        rv = RAFT_IOERR;
+        goto err_after_content_alloc;
+    }
+    close(fd);
+
+    return 0;
+
+err_after_content_alloc:
+    raft_free(*content);
+err_after_open:
+    close(fd);
+err:
+    assert(rv != 0);
+    return rv;
+}
+
 int uvSegmentLoadClosed(struct uv *uv,
                         struct uvSegmentInfo *info,
                         struct raft_entry *entries[],
                         size_t *n)
 {
-    bool empty;                     /* Whether the file is empty */
-    int fd;                         /* Segment file descriptor */
     uint64_t format;                /* Format version */
-    bool last;                      /* Whether the last batch was reached */
+    uint64_t epoch;                 /* Segment epoch */
+    void *content;                  /* Content of the whole segment */
+    size_t size;                    /* Size of the segment file */
+    size_t offset;                  /* Offset of the current batch */
     struct raft_entry *tmp_entries; /* Entries in current batch */
     unsigned tmp_n;                 /* Number of entries in current batch */
-    int i;
+    size_t n_expected;              /* Number of entries in the filename */
+    size_t i;
     int rv;
 
-    /* If the segment is completely empty, just bail out. */
-    rv = osIsEmpty(uv->dir, info->filename, &empty);
+    /* Read the whole segment with a single read into a buffer that will act as
+     * the batch of all the entries in the segment: the entries data will point
+     * directly into it and it will be released once all entries are. */
+    rv = readClosed(uv, info->filename, &content, &size);
     if (rv != 0) {
-        uvErrorf(uv, "stat %s: %s", info->filename, osStrError(rv));
-        rv = RAFT_IOERR;
-        goto err;
-    }
-    if (empty) {
-        uvErrorf(uv, "load %s: file is empty", info->filename);
-        rv = RAFT_CORRUPT;
         goto err;
     }
 
-    /* Open the segment file. */
-    rv = openSegment(uv, info->filename, O_RDONLY, &fd, &format);
+    /* Leave out the index of the batches, if the segment has one. */
+    rv = uvSegmentIndexDecode(content, size, &size, NULL);
     if (rv != 0) {
-        goto err;
+        goto err_after_content_alloc;
+    }
+
+    /* Check the format version. */
+    if (size < sizeof(uint64_t)) {
+        uvErrorf(uv, "read %s: short read", info->filename);
+        rv = RAFT_IOERR;
+        goto err_after_content_alloc;
     }
-    if (format != UV__DISK_FORMAT) {
+    format = byteFlip64(*(uint64_t *)content);
+    if (!isKnownFormat(format)) {
         uvErrorf(uv, "load %s: unexpected format version: %lu", info->filename,
                  format);
         rv = RAFT_IOERR;
-        goto err_after_open;
+        goto err_after_content_alloc;
+    }
+    offset = sizeof(uint64_t);
+    epoch = 0;
+    if (format >= UV__SEGMENT_FORMAT_EPOCH) {
+        if (size < sizeof(uint64_t) * 2) {
+            uvErrorf(uv, "read %s: short read", info->filename);
+            rv = RAFT_IOERR;
+            goto err_after_content_alloc;
+        }
+        epoch = byteFlip64(*((uint64_t *)content + 1));
+        offset += sizeof(uint64_t);
     }
 
-    /* Load all batches in the segment. */
+    /* Load all batches in the segment, up to the one containing the end index
+     * in the segment filename. */
     *entries = NULL;
     *n = 0;
+    n_expected = (size_t)(info->end_index - info->first_index + 1);
 
-    last = false;
-    for (i = 1; !last; i++) {
-        rv = loadEntriesBatch(uv, fd, &tmp_entries, &tmp_n, &last);
+    do {
+        rv = decodeEntriesBatch(uv, format, uvSegmentChecksumSeed(epoch),
+                                content, size, &offset, &tmp_entries, &tmp_n);
         if (rv != 0) {
-            goto err_after_open;
+            goto err_after_entries_alloc;
         }
         rv = extendEntries(tmp_entries, tmp_n, entries, n);
         if (rv != 0) {
-            goto err_after_batch_load;
+            releaseBatches(tmp_entries, 0, tmp_n, content);
+            raft_free(tmp_entries);
+            goto err_after_entries_alloc;
         }
         raft_free(tmp_entries);
-    }
+    } while (offset < size && *n < n_expected);
 
-    assert(i > 1); /* At least one batch was loaded. */
+    /* A segment that was truncated in place keeps the whole batch containing
+     * its new end index, and a crash might have occurred after it was renamed
+     * but before its content was actually truncated: ignore the entries past
+     * its end index. */
+    if (*n > n_expected) {
+        releaseBatches(*entries, n_expected, *n, content);
+        *n = n_expected;
+    }
+    if (offset < size) {
+        uvWarnf(uv, "load %s: ignore data past end index", info->filename);
+    }
 
-    close(fd);
+    /* Uncompressed entries share the segment content as their batch, if there
+     * are none it can be released right away. */
+    for (i = 0; i < *n; i++) {
+        if ((*entries)[i].batch == content) {
+            break;
+        }
+    }
+    if (i == *n) {
+        raft_free(content);
+    }
 
     return 0;
 
-err_after_batch_load:
-    raft_free(tmp_entries[0].batch);
-    raft_free(tmp_entries);
-
-err_after_open:
-    close(fd);
-
+err_after_entries_alloc:
+    if (*entries != NULL) {
+        releaseBatches(*entries, 0, *n, content);
+        raft_free(*entries);
+    }
+err_after_content_alloc:
+    raft_free(content);
 err:
     assert(rv != 0);
-
     return rv;
 }
 
@@ -377,6 +942,7 @@ static int loadOpen(struct uv *uv,
     bool last = false;              /* Whether the last batch was reached */
     int fd;                         /* Segment file descriptor */
     uint64_t format;                /* Format version */
+    uint64_t epoch;                 /* Segment epoch */
     size_t n_batches = 0;           /* Number of loaded batches */
     struct raft_entry *tmp_entries; /* Entries in current batch */
     unsigned tmp_n_entries;         /* Number of entries in current batch */
@@ -398,14 +964,23 @@ static int loadOpen(struct uv *uv,
         goto done;
     }
 
-    rv = openSegment(uv, info->filename, O_RDWR, &fd, &format);
+    rv = openSegment(uv, info->filename, O_RDWR, &fd, &format, &epoch);
     if (rv != 0) {
         goto err;
     }
 
+    /* If the segment was recycled but never written, whatever follows the
+     * header is stale content from its previous use, let's remove it. */
+    if (isKnownFormat(format) && format >= UV__SEGMENT_FORMAT_EPOCH &&
+        epoch == 0) {
+        close(fd);
+        remove = true;
+        goto done;
+    }
+
     /* Check that the format is the expected one, or perhaps 0, indicating that
      * the segment was allocated but never written. */
-    if (format != UV__DISK_FORMAT) {
+    if (!isKnownFormat(format)) {
         if (format == 0) {
             rv = osHasTrailingZeros(fd, &all_zeros);
             if (rv != 0) {
@@ -437,7 +1012,8 @@ static int loadOpen(struct uv *uv,
             return RAFT_IOERR;
         }
 
-        rv = loadEntriesBatch(uv, fd, &tmp_entries, &tmp_n_entries, &last);
+        rv = loadEntriesBatch(uv, fd, format, uvSegmentChecksumSeed(epoch),
+                              &tmp_entries, &tmp_n_entries, &last);
         if (rv != 0) {
             int rv2;
 
@@ -585,6 +1161,9 @@ void uvSegmentBufferInit(struct uvSegmentBuffer *b, size_t block_size)
     b->arena.base = NULL;
     b->arena.len = 0;
     b->n = 0;
+    b->format = UV__DISK_FORMAT;
+    b->epoch = 0;
+    b->codec = NULL;
 }
 
 void uvSegmentBufferClose(struct uvSegmentBuffer *b)
@@ -594,20 +1173,133 @@ void uvSegmentBufferClose(struct uvSegmentBuffer *b)
     }
 }
 
-int uvSegmentBufferFormat(struct uvSegmentBuffer *b)
+int uvSegmentBufferFormat(struct uvSegmentBuffer *b, uint64_t epoch)
 {
     int rv;
     void *cursor;
     size_t n;
     assert(b->n == 0);
     n = sizeof(uint64_t);
+    if (epoch != 0) {
+        n += sizeof(uint64_t);
+    }
     rv = ensureSegmentBufferIsLargeEnough(b, n);
     if (rv != 0) {
         return rv;
     }
     b->n = n;
+    b->format = epoch == 0 ? UV__DISK_FORMAT : UV__SEGMENT_FORMAT;
+    b->epoch = epoch;
     cursor = b->arena.base;
-    bytePut64(&cursor, UV__DISK_FORMAT);
+    bytePut64(&cursor, b->format);
+    if (epoch != 0) {
+        bytePut64(&cursor, epoch);
+    }
+    return 0;
+}
+
+size_t uvSegmentSizeofBatch(uint64_t format,
+                            const struct raft_entry entries[],
+                            unsigned n_entries)
+{
+    size_t size;
+    unsigned i;
+
+    if (format >= UV__SEGMENT_FORMAT_COMPACT) {
+        size = sizeof(uint32_t) * 4; /* CRC checksums and sizes */
+        size += uvSizeofBatchHeaderCompact(entries, n_entries);
+        for (i = 0; i < n_entries; i++) {
+            size += entries[i].buf.len;
+        }
+        return size;
+    }
+
+    size = sizeof(uint32_t) * 2;            /* CRC checksums */
+    size += uvSizeofBatchHeader(n_entries); /* Batch header */
+    for (i = 0; i < n_entries; i++) {       /* Entries data */
+        size += bytePad64(entries[i].buf.len);
+    }
+    return size;
+}
+
+/* Encode a batch using the compact format at the given position of the
+ * buffer, compressing its data if the buffer has a codec and that makes it
+ * smaller. Set @size to the actual size of the batch. */
+static int appendCompact(struct uvSegmentBuffer *b,
+                         const struct raft_entry entries[],
+                         unsigned n_entries,
+                         void *cursor,
+                         size_t *size)
+{
+    size_t header_size; /* Size of the batch header */
+    size_t data_size;   /* Size of the batch data */
+    size_t compressed;  /* Size of the compressed data */
+    uint32_t crc1;      /* Header checksum */
+    uint32_t crc2;      /* Data checksum */
+    unsigned seed;      /* Initial checksum value */
+    void *crc_p;        /* Pointer to the checksum slots */
+    void *sizes;        /* Pointer to the sizes */
+    void *data;         /* Pointer to the batch data */
+    unsigned i;
+    int rv;
+
+    header_size = uvSizeofBatchHeaderCompact(entries, n_entries);
+    data_size = 0;
+    for (i = 0; i < n_entries; i++) {
+        data_size += entries[i].buf.len;
+    }
+
+    crc_p = cursor;
+    cursor += sizeof(uint32_t) * 2;
+    sizes = cursor;
+    cursor += sizeof(uint32_t) * 2;
+    uvEncodeBatchHeaderCompact(entries, n_entries, cursor);
+    cursor += header_size;
+    data = cursor;
+
+    /* Try to compress the data, leaving room for the codec ID and accepting
+     * the result only if it's smaller than the original. */
+    compressed = 0;
+    if (b->codec != NULL && data_size >= UV__CODEC_MIN_SIZE &&
+        data_size < UV__SEGMENT_BATCH_COMPRESSED) {
+        compressed = data_size - 2;
+        rv = uvCodecCompress(b->codec, entries, n_entries,
+                             (uint8_t *)data + 1, &compressed);
+        if (rv == RAFT_TOOBIG) {
+            compressed = 0;
+        } else if (rv != 0) {
+            return rv;
+        }
+    }
+
+    seed = uvSegmentChecksumSeed(b->epoch);
+    if (compressed > 0) {
+        *(uint8_t *)data = (uint8_t)b->codec->id;
+        data_size = compressed + 1;
+        crc2 = uvSegmentChecksum(b->format, data, data_size, seed);
+        bytePut32(&sizes, header_size);
+        bytePut32(&sizes, data_size | UV__SEGMENT_BATCH_COMPRESSED);
+    } else {
+        crc2 = seed;
+        for (i = 0; i < n_entries; i++) {
+            const struct raft_entry *entry = &entries[i];
+            memcpy(cursor, entry->buf.base, entry->buf.len);
+            crc2 = uvSegmentChecksum(b->format, cursor, entry->buf.len, crc2);
+            cursor += entry->buf.len;
+        }
+        bytePut32(&sizes, header_size);
+        bytePut32(&sizes, data_size);
+    }
+
+    /* The sizes are covered by the header checksum. */
+    crc1 = uvSegmentChecksum(b->format, (uint8_t *)crc_p + sizeof(uint32_t) * 2,
+                             sizeof(uint32_t) * 2 + header_size, seed);
+
+    bytePut32(&crc_p, crc1);
+    bytePut32(&crc_p, crc2);
+
+    *size = sizeof(uint32_t) * 4 + header_size + data_size;
+
     return 0;
 }
 
@@ -618,6 +1310,7 @@ int uvSegmentBufferAppend(struct uvSegmentBuffer *b,
     size_t size;   /* Total size of the batch */
     uint32_t crc1; /* Header checksum */
     uint32_t crc2; /* Data checksum */
+    unsigned seed; /* Initial checksum value */
     void *crc1_p;  /* Pointer to header checksum slot */
     void *crc2_p;  /* Pointer to data checksum slot */
     void *header;  /* Pointer to the header section */
@@ -625,11 +1318,7 @@ int uvSegmentBufferAppend(struct uvSegmentBuffer *b,
     unsigned i;
     int rv;
 
-    size = sizeof(uint32_t) * 2;            /* CRC checksums */
-    size += uvSizeofBatchHeader(n_entries); /* Batch header */
-    for (i = 0; i < n_entries; i++) {       /* Entries data */
-        size += bytePad64(entries[i].buf.len);
-    }
+    size = uvSegmentSizeofBatch(b->format, entries, n_entries);
 
     rv = ensureSegmentBufferIsLargeEnough(b, b->n + size);
     if (rv != 0) {
@@ -637,6 +1326,15 @@ int uvSegmentBufferAppend(struct uvSegmentBuffer *b,
     }
     cursor = b->arena.base + b->n;
 
+    if (b->format >= UV__SEGMENT_FORMAT_COMPACT) {
+        rv = appendCompact(b, entries, n_entries, cursor, &size);
+        if (rv != 0) {
+            return rv;
+        }
+        b->n += size;
+        return 0;
+    }
+
     /* Placeholder of the checksums */
     crc1_p = cursor;
     bytePut32(&cursor, 0);
@@ -646,18 +1344,20 @@ int uvSegmentBufferAppend(struct uvSegmentBuffer *b,
     /* Batch header */
     header = cursor;
     uvEncodeBatchHeader(entries, n_entries, cursor);
-    crc1 = byteCrc32(header, uvSizeofBatchHeader(n_entries), 0);
+    seed = uvSegmentChecksumSeed(b->epoch);
+    crc1 = uvSegmentChecksum(b->format, header, uvSizeofBatchHeader(n_entries),
+                             seed);
     cursor += uvSizeofBatchHeader(n_entries);
 
     /* Batch data */
-    crc2 = 0;
+    crc2 = seed;
     for (i = 0; i < n_entries; i++) {
         const struct raft_entry *entry = &entries[i];
         /* TODO: enforce the requirment of 8-byte aligment also in the
          * higher-level APIs. */
         assert(entry->buf.len % sizeof(uint64_t) == 0);
         memcpy(cursor, entry->buf.base, entry->buf.len);
-        crc2 = byteCrc32(cursor, entry->buf.len, crc2);
+        crc2 = uvSegmentChecksum(b->format, cursor, entry->buf.len, crc2);
         cursor += entry->buf.len;
     }
 
@@ -673,35 +1373,176 @@ void uvSegmentBufferFinalize(struct uvSegmentBuffer *b, uv_buf_t *out)
     unsigned n_blocks;
     unsigned tail;
 
-    n_blocks = b->n / b->block_size;
-    if (b->n % b->block_size != 0) {
-        n_blocks++;
+    n_blocks = b->n / b->block_size;
+    if (b->n % b->block_size != 0) {
+        n_blocks++;
+    }
+
+    /* Set the remainder of the last block to 0 */
+    tail = b->n % b->block_size;
+    if (tail != 0) {
+        memset(b->arena.base + b->n, 0, b->block_size - tail);
+    }
+
+    out->base = b->arena.base;
+    out->len = n_blocks * b->block_size;
+}
+
+void uvSegmentBufferReset(struct uvSegmentBuffer *b, unsigned retain)
+{
+    assert(b->n > 0);
+    assert(b->arena.base != NULL);
+
+    if (retain == 0) {
+        b->n = 0;
+        memset(b->arena.base, 0, b->block_size);
+        return;
+    }
+
+    memcpy(b->arena.base, b->arena.base + retain * b->block_size,
+           b->block_size);
+    b->n = b->n % b->block_size;
+}
+
+/* Maximum number of threads used to load closed segments in parallel,
+ * including the calling thread. */
+#define LOAD_MAX_THREADS 4
+
+/* Result of loading a single closed segment. */
+struct loadClosed
+{
+    struct uvSegmentInfo *info;  /* Segment to load */
+    struct raft_entry *entries;  /* Entries loaded from the segment */
+    size_t n;                    /* Number of entries loaded */
+    int status;                  /* Result of uvSegmentLoadClosed */
+};
+
+/* State shared by the threads loading closed segments. */
+struct loader
+{
+    struct uv *uv;
+    struct loadClosed *segments; /* Segments to load, in index order */
+    size_t n;                    /* Number of segments to load */
+    size_t next;                 /* Next segment to be picked by a thread */
+    uv_mutex_t mutex;            /* Serialize access to @next */
+};
+
+/* Keep loading the next segment not yet picked by other threads, until there's
+ * none left. */
+static void loaderWork(void *arg)
+{
+    struct loader *l = arg;
+    struct loadClosed *s;
+
+    while (1) {
+        uv_mutex_lock(&l->mutex);
+        if (l->next == l->n) {
+            uv_mutex_unlock(&l->mutex);
+            break;
+        }
+        s = &l->segments[l->next];
+        l->next++;
+        uv_mutex_unlock(&l->mutex);
+
+        s->status = uvSegmentLoadClosed(l->uv, s->info, &s->entries, &s->n);
+    }
+}
+
+/* Release the entries of all segments which were successfully loaded. */
+static void loadClosedDestroy(struct loadClosed *segments, size_t n)
+{
+    size_t i;
+    for (i = 0; i < n; i++) {
+        struct loadClosed *s = &segments[i];
+        if (s->status == 0 && s->entries != NULL) {
+            entryBatchesDestroy(s->entries, s->n);
+        }
+    }
+}
+
+/* Read and verify all the closed segments containing entries at or after
+ * @start_index, spreading the work across several threads. The results are
+ * stored in @segments, in the same order as @infos.
+ *
+ * Loading a closed segment doesn't depend on any other segment, so segments
+ * can be loaded independently and the checks that they are contiguous can be
+ * performed afterwards. */
+static int loadClosedSegments(struct uv *uv,
+                              const raft_index start_index,
+                              struct uvSegmentInfo *infos,
+                              size_t n_infos,
+                              struct loadClosed **segments,
+                              size_t *n)
+{
+    struct loader l;
+    uv_thread_t threads[LOAD_MAX_THREADS - 1];
+    unsigned n_threads;
+    unsigned i;
+    size_t j;
+    int rv;
+
+    *segments = NULL;
+    *n = 0;
+
+    l.uv = uv;
+    l.n = 0;
+    l.next = 0;
+    for (j = 0; j < n_infos; j++) {
+        if (!infos[j].is_open && infos[j].end_index >= start_index) {
+            l.n++;
+        }
+    }
+    if (l.n == 0) {
+        return 0;
+    }
+
+    l.segments = raft_malloc(l.n * sizeof *l.segments);
+    if (l.segments == NULL) {
+        return RAFT_NOMEM;
+    }
+    l.n = 0;
+    for (j = 0; j < n_infos; j++) {
+        if (!infos[j].is_open && infos[j].end_index >= start_index) {
+            struct loadClosed *s = &l.segments[l.n];
+            s->info = &infos[j];
+            s->entries = NULL;
+            s->n = 0;
+            s->status = 0;
+            l.n++;
+        }
     }
 
-    /* Set the remainder of the last block to 0 */
-    tail = b->n % b->block_size;
-    if (tail != 0) {
-        memset(b->arena.base + b->n, 0, b->block_size - tail);
+    rv = uv_mutex_init(&l.mutex);
+    if (rv != 0) {
+        /* UNTESTED: should fail only with ENOMEM */
+        raft_free(l.segments);
+        return RAFT_NOMEM;
     }
 
-    out->base = b->arena.base;
-    out->len = n_blocks * b->block_size;
-}
+    /* Start the helper threads. If we can't start a thread, just go on with
+     * the ones we have: the calling thread does the work too. */
+    n_threads = 0;
+    while (n_threads < LOAD_MAX_THREADS - 1 && n_threads + 1 < l.n) {
+        rv = uv_thread_create(&threads[n_threads], loaderWork, &l);
+        if (rv != 0) {
+            break;
+        }
+        n_threads++;
+    }
 
-void uvSegmentBufferReset(struct uvSegmentBuffer *b, unsigned retain)
-{
-    assert(b->n > 0);
-    assert(b->arena.base != NULL);
+    loaderWork(&l);
 
-    if (retain == 0) {
-        b->n = 0;
-        memset(b->arena.base, 0, b->block_size);
-        return;
+    for (i = 0; i < n_threads; i++) {
+        rv = uv_thread_join(&threads[i]);
+        assert(rv == 0);
     }
 
-    memcpy(b->arena.base, b->arena.base + retain * b->block_size,
-           b->block_size);
-    b->n = b->n % b->block_size;
+    uv_mutex_destroy(&l.mutex);
+
+    *segments = l.segments;
+    *n = l.n;
+
+    return 0;
 }
 
 int uvSegmentLoadAll(struct uv *uv,
@@ -714,6 +1555,10 @@ int uvSegmentLoadAll(struct uv *uv,
     raft_index next_index;          /* Next entry to load from disk */
     struct raft_entry *tmp_entries; /* Entries in current segment */
     size_t tmp_n;                   /* Number of entries in current segment */
+    struct loadClosed *closed;      /* Closed segments loaded in parallel */
+    size_t n_closed;                /* Number of closed segments loaded */
+    size_t k = 0;                   /* Next closed segment to consume */
+    size_t n_total = 0;             /* Entries in all closed segments */
     size_t i;
     int rv;
     assert(start_index >= 1);
@@ -724,6 +1569,25 @@ int uvSegmentLoadAll(struct uv *uv,
 
     next_index = start_index;
 
+    rv = loadClosedSegments(uv, start_index, infos, n_infos, &closed,
+                            &n_closed);
+    if (rv != 0) {
+        return rv;
+    }
+
+    /* Allocate the entries array once for all closed segments, so stitching
+     * them together doesn't need to grow it for each segment. */
+    for (i = 0; i < n_closed; i++) {
+        n_total += closed[i].n;
+    }
+    if (n_total > 0) {
+        *entries = raft_malloc(n_total * sizeof **entries);
+        if (*entries == NULL) {
+            rv = RAFT_NOMEM;
+            goto err;
+        }
+    }
+
     for (i = 0; i < n_infos; i++) {
         struct uvSegmentInfo *info = &infos[i];
 
@@ -773,18 +1637,21 @@ int uvSegmentLoadAll(struct uv *uv,
                 prefix = next_index - info->first_index;
             }
 
-            rv = uvSegmentLoadClosed(uv, info, &tmp_entries, &tmp_n);
+            assert(k < n_closed);
+            assert(closed[k].info == info);
+            rv = closed[k].status;
             if (rv != 0) {
                 goto err;
             }
+            tmp_entries = closed[k].entries;
+            tmp_n = closed[k].n;
+            k++;
 
             if (tmp_n - prefix > 0) {
-                rv = extendEntries(tmp_entries + prefix, tmp_n - prefix,
-                                   entries, n_entries);
-                if (rv != 0) {
-                    /* TODO: release memory of entries in tmp_entries */
-                    goto err;
-                }
+                assert(*n_entries + tmp_n - prefix <= n_total);
+                memcpy(*entries + *n_entries, tmp_entries + prefix,
+                       (tmp_n - prefix) * sizeof *tmp_entries);
+                *n_entries += tmp_n - prefix;
                 if (prefix > 0) {
                     batch = tmp_entries[prefix].batch;
                     for (j = prefix; j > 0; j--) {
@@ -812,11 +1679,26 @@ int uvSegmentLoadAll(struct uv *uv,
         }
     }
 
+    if (closed != NULL) {
+        raft_free(closed);
+    }
+
+    if (*n_entries == 0 && *entries != NULL) {
+        raft_free(*entries);
+        *entries = NULL;
+    }
+
     return 0;
 
 err:
     assert(rv != 0);
 
+    /* Free the closed segments loaded but not yet consumed. */
+    if (closed != NULL) {
+        loadClosedDestroy(closed + k, n_closed - k);
+        raft_free(closed);
+    }
+
     /* Free any batch that we might have allocated and the entries array as
      * well. */
     if (*entries != NULL) {
@@ -832,6 +1714,8 @@ err:
         }
 
         raft_free(*entries);
+        *entries = NULL;
+        *n_entries = 0;
     }
 
     return rv;
@@ -858,7 +1742,7 @@ static int writeFirstClosed(struct uv *uv,
 
     uvSegmentBufferInit(&buf, uv->block_size);
 
-    rv = uvSegmentBufferFormat(&buf);
+    rv = uvSegmentBufferFormat(&buf, 0);
     if (rv != 0) {
         return rv;
     }
@@ -940,77 +1824,472 @@ err:
     return rv;
 }
 
+void uvSegmentIndexInit(struct uvSegmentIndex *index)
+{
+    index->slots = NULL;
+    index->n = 0;
+    index->cap = 0;
+}
+
+void uvSegmentIndexClose(struct uvSegmentIndex *index)
+{
+    if (index->slots != NULL) {
+        raft_free(index->slots);
+    }
+    uvSegmentIndexInit(index);
+}
+
+int uvSegmentIndexAppend(struct uvSegmentIndex *index,
+                         size_t offset,
+                         raft_index first_index)
+{
+    if (index->n == index->cap) {
+        unsigned cap = index->cap == 0 ? 16 : index->cap * 2;
+        uint64_t *slots;
+        slots = raft_realloc(index->slots, cap * 2 * sizeof *slots);
+        if (slots == NULL) {
+            return RAFT_NOMEM;
+        }
+        index->slots = slots;
+        index->cap = cap;
+    }
+    index->slots[index->n * 2] = byteFlip64(offset);
+    index->slots[index->n * 2 + 1] = byteFlip64(first_index);
+    index->n++;
+    return 0;
+}
+
+/* Size of the trailer of a segment index footer, following the slots. */
+#define INDEX_TRAILER_SIZE (sizeof(uint32_t) * 2 + sizeof(uint64_t))
+
+int uvSegmentIndexEncode(const struct uvSegmentIndex *index, uv_buf_t *buf)
+{
+    size_t slots_size = index->n * 2 * sizeof(uint64_t);
+    void *cursor;
+    unsigned crc;
+
+    buf->len = slots_size + INDEX_TRAILER_SIZE;
+    buf->base = raft_malloc(buf->len);
+    if (buf->base == NULL) {
+        return RAFT_NOMEM;
+    }
+    cursor = buf->base;
+    memcpy(cursor, index->slots, slots_size);
+    cursor = (uint8_t *)cursor + slots_size;
+    bytePut32(&cursor, index->n);
+    crc = byteCrc32c(buf->base, slots_size + sizeof(uint32_t), 0);
+    bytePut32(&cursor, crc);
+    bytePut64(&cursor, UV__SEGMENT_INDEX_MAGIC);
+
+    return 0;
+}
+
+int uvSegmentIndexDecode(const void *content,
+                         size_t content_size,
+                         size_t *size,
+                         struct uvSegmentIndex *index)
+{
+    const void *cursor;
+    size_t slots_size;
+    unsigned n;
+    unsigned crc;
+
+    *size = content_size;
+
+    /* The footer must at least fit a segment header and the trailer. */
+    if (content_size < sizeof(uint64_t) + INDEX_TRAILER_SIZE) {
+        return 0;
+    }
+    cursor = (const uint8_t *)content + content_size - INDEX_TRAILER_SIZE;
+    n = byteGet32(&cursor);
+    crc = byteGet32(&cursor);
+    if (byteGet64(&cursor) != UV__SEGMENT_INDEX_MAGIC) {
+        return 0;
+    }
+    slots_size = (size_t)n * 2 * sizeof(uint64_t);
+    if (slots_size > content_size - sizeof(uint64_t) - INDEX_TRAILER_SIZE) {
+        return 0;
+    }
+    cursor = (const uint8_t *)content + content_size - INDEX_TRAILER_SIZE -
+             slots_size;
+    if (byteCrc32c(cursor, slots_size + sizeof(uint32_t), 0) != crc) {
+        return 0;
+    }
+
+    *size = content_size - INDEX_TRAILER_SIZE - slots_size;
+
+    if (index != NULL) {
+        uvSegmentIndexInit(index);
+        if (n > 0) {
+            index->slots = raft_malloc(slots_size);
+            if (index->slots == NULL) {
+                return RAFT_NOMEM;
+            }
+            memcpy(index->slots, cursor, slots_size);
+        }
+        index->n = n;
+        index->cap = n;
+    }
+
+    return 0;
+}
+
+/* Read the index of the batches appended to the closed segment open at @fd,
+ * whose file has the given size. If there's no valid index, @index is left
+ * empty. The @data_size output parameter is set to the size of the batches,
+ * excluding the index. */
+static int readIndex(struct uv *uv,
+                     struct uvSegmentInfo *info,
+                     int fd,
+                     size_t size,
+                     struct uvSegmentIndex *index,
+                     size_t *data_size)
+{
+    uint8_t trailer[INDEX_TRAILER_SIZE];
+    const void *cursor;
+    void *footer;
+    size_t footer_size;
+    size_t rest;
+    unsigned n;
+    int rv;
+
+    uvSegmentIndexInit(index);
+    *data_size = size;
+
+    if (size < sizeof(uint64_t) + sizeof trailer) {
+        return 0;
+    }
+
+    /* Read just the trailer first, to figure out the size of the index. */
+    if (lseek(fd, (off_t)(size - sizeof trailer), SEEK_SET) == -1) {
+        uvErrorf(uv, "seek %s: %s", info->filename, osStrError(errno));
+        return RAFT_IOERR;
+    }
+    rv = osReadN(fd, trailer, sizeof trailer);
+    if (rv != 0) {
+        uvErrorf(uv, "read %s: %s", info->filename, osStrError(rv));
+        return RAFT_IOERR;
+    }
+    cursor = trailer;
+    n = byteGet32(&cursor);
+    byteGet32(&cursor);
+    if (byteGet64(&cursor) != UV__SEGMENT_INDEX_MAGIC) {
+        return 0;
+    }
+
+    /* Read the whole index, along with the 8 bytes preceding it, which are
+     * part of the segment header or of the last batch. */
+    footer_size = sizeof(uint64_t) + (size_t)n * 2 * sizeof(uint64_t) +
+                  sizeof trailer;
+    if (footer_size > size) {
+        return 0;
+    }
+    footer = raft_malloc(footer_size);
+    if (footer == NULL) {
+        return RAFT_NOMEM;
+    }
+    if (lseek(fd, (off_t)(size - footer_size), SEEK_SET) == -1) {
+        uvErrorf(uv, "seek %s: %s", info->filename, osStrError(errno));
+        rv = RAFT_IOERR;
+        goto out;
+    }
+    rv = osReadN(fd, footer, footer_size);
+    if (rv != 0) {
+        uvErrorf(uv, "read %s: %s", info->filename, osStrError(rv));
+        rv = RAFT_IOERR;
+        goto out;
+    }
+    rv = uvSegmentIndexDecode(footer, footer_size, &rest, index);
+    if (rv != 0) {
+        goto out;
+    }
+    if (rest < footer_size) {
+        *data_size = size - footer_size + rest;
+    }
+
+out:
+    raft_free(footer);
+    return rv;
+}
+
+/* Build the index of the batches of a closed segment which doesn't have one,
+ * by decoding all of them. */
+static int scanIndex(struct uv *uv,
+                     struct uvSegmentInfo *info,
+                     struct uvSegmentIndex *index)
+{
+    uint64_t format;
+    uint64_t epoch = 0;
+    void *content;
+    size_t size;
+    size_t offset;
+    raft_index next_index = info->first_index;
+    struct raft_entry *entries;
+    unsigned n;
+    int rv;
+
+    rv = readClosed(uv, info->filename, &content, &size);
+    if (rv != 0) {
+        goto err;
+    }
+
+    offset = sizeof(uint64_t);
+    if (size < offset) {
+        uvErrorf(uv, "read %s: short read", info->filename);
+        rv = RAFT_IOERR;
+        goto err_after_read;
+    }
+    format = byteFlip64(*(uint64_t *)content);
+    if (!isKnownFormat(format)) {
+        uvErrorf(uv, "load %s: unexpected format version: %lu", info->filename,
+                 format);
+        rv = RAFT_IOERR;
+        goto err_after_read;
+    }
+    if (format >= UV__SEGMENT_FORMAT_EPOCH) {
+        offset += sizeof(uint64_t);
+        if (size < offset) {
+            uvErrorf(uv, "read %s: short read", info->filename);
+            rv = RAFT_IOERR;
+            goto err_after_read;
+        }
+        epoch = byteFlip64(*((uint64_t *)content + 1));
+    }
+
+    while (offset < size && next_index <= info->end_index) {
+        rv = uvSegmentIndexAppend(index, offset, next_index);
+        if (rv != 0) {
+            goto err_after_read;
+        }
+        rv = decodeEntriesBatch(uv, format, uvSegmentChecksumSeed(epoch),
+                                content, size, &offset, &entries, &n);
+        if (rv != 0) {
+            goto err_after_read;
+        }
+        releaseBatches(entries, 0, n, content);
+        raft_free(entries);
+        next_index += n;
+    }
+
+    raft_free(content);
+    return 0;
+
+err_after_read:
+    raft_free(content);
+err:
+    assert(rv != 0);
+    return rv;
+}
+
+/* Return the offset of the i'th batch in the given index. */
+static size_t indexOffset(const struct uvSegmentIndex *index, unsigned i)
+{
+    return (size_t)byteFlip64(index->slots[i * 2]);
+}
+
+/* Return the first entry index of the i'th batch in the given index. */
+static raft_index indexFirstIndex(const struct uvSegmentIndex *index,
+                                  unsigned i)
+{
+    return byteFlip64(index->slots[i * 2 + 1]);
+}
+
 int uvSegmentTruncate(struct uv *uv,
                       struct uvSegmentInfo *segment,
                       raft_index index)
 {
     osFilename filename;
-    struct raft_entry *entries;
-    struct uvSegmentBuffer buf;
-    size_t n;
-    size_t m;
+    struct uvSegmentIndex batches;
+    struct stat st;
+    uv_buf_t footer;
+    size_t data_size;
+    size_t size;
+    unsigned i;
     int fd;
     int rv;
 
     assert(!segment->is_open);
+    assert(index > segment->first_index);
+    assert(index <= segment->end_index);
 
     uvInfof(uv, "truncate %u-%u at %u", segment->first_index,
             segment->end_index, index);
 
-    rv = uvSegmentLoadClosed(uv, segment, &entries, &n);
+    rv = osOpen(uv->dir, segment->filename, O_RDWR, &fd);
     if (rv != 0) {
-        goto out;
+        uvErrorf(uv, "open %s: %s", segment->filename, osStrError(rv));
+        rv = RAFT_IOERR;
+        goto err;
+    }
+    rv = fstat(fd, &st);
+    if (rv == -1) {
+        uvErrorf(uv, "stat %s: %s", segment->filename, osStrError(errno));
+        rv = RAFT_IOERR;
+        goto err_after_open;
+    }
+
+    /* Figure out the offsets of the batches in the segment, using its index if
+     * it has one. */
+    rv = readIndex(uv, segment, fd, (size_t)st.st_size, &batches, &data_size);
+    if (rv != 0) {
+        goto err_after_open;
+    }
+    if (batches.n == 0) {
+        rv = scanIndex(uv, segment, &batches);
+        if (rv != 0) {
+            goto err_after_index;
+        }
     }
 
-    /* Discard all entries after the truncate index (included) */
-    assert(index - segment->first_index < n);
-    m = index - segment->first_index;
+    /* Find the batch containing the truncation index. If the index is the
+     * first of its batch, the segment gets truncated at the beginning of the
+     * batch, otherwise the batch is retained as a whole, and its entries past
+     * the new end index will be ignored at load time. */
+    for (i = batches.n; i > 0; i--) {
+        if (indexFirstIndex(&batches, i - 1) <= index) {
+            break;
+        }
+    }
+    if (i == 0) {
+        uvErrorf(uv, "truncate %s: no batch contains index %llu",
+                 segment->filename, index);
+        rv = RAFT_CORRUPT;
+        goto err_after_index;
+    }
+    if (indexFirstIndex(&batches, i - 1) == index) {
+        i--;
+    }
+    size = i < batches.n ? indexOffset(&batches, i) : data_size;
+    batches.n = i;
 
-    /* Render the path.
-     *
-     * TODO: we should use a temporary file name so in case of crash we don't
-     *      consider this segment as corrupted.
-     */
+    /* Rename the segment first, so all entries past the new end index are
+     * ignored from now on, in case we crash before actually truncating it. */
     sprintf(filename, UV__CLOSED_TEMPLATE, segment->first_index, index - 1);
+    rv = osRename(uv->dir, segment->filename, filename);
+    if (rv != 0) {
+        uvErrorf(uv, "rename %s: %s", segment->filename, osStrError(rv));
+        rv = RAFT_IOERR;
+        goto err_after_index;
+    }
 
-    /* Open the file. */
-    rv = osOpen(uv->dir, filename, O_WRONLY | O_CREAT | O_EXCL, &fd);
+    /* Truncate the segment and write the index of the retained batches. */
+    rv = ftruncate(fd, (off_t)size);
+    if (rv == -1) {
+        uvErrorf(uv, "truncate %s: %s", filename, osStrError(errno));
+        rv = RAFT_IOERR;
+        goto err_after_index;
+    }
+    rv = uvSegmentIndexEncode(&batches, &footer);
+    if (rv != 0) {
+        goto err_after_index;
+    }
+    if (lseek(fd, (off_t)size, SEEK_SET) == -1) {
+        rv = errno;
+    } else {
+        rv = osWriteN(fd, footer.base, footer.len);
+    }
+    raft_free(footer.base);
     if (rv != 0) {
-        goto out_after_load;
+        uvErrorf(uv, "write %s: %s", filename, osStrError(rv));
+        rv = RAFT_IOERR;
+        goto err_after_index;
+    }
+    rv = fsync(fd);
+    if (rv == -1) {
+        uvErrorf(uv, "fsync %s: %s", filename, osStrError(errno));
+        rv = RAFT_IOERR;
+        goto err_after_index;
     }
 
-    uvSegmentBufferInit(&buf, uv->block_size);
+    uvSegmentIndexClose(&batches);
+    close(fd);
+
+    return 0;
+
+err_after_index:
+    uvSegmentIndexClose(&batches);
+err_after_open:
+    close(fd);
+err:
+    assert(rv != 0);
+    return rv;
+}
+
+int uvSegmentRecycle(struct uv *uv,
+                     const char *filename,
+                     unsigned long long counter)
+{
+    osFilename filename1;
+    osFilename filename2;
+    uint64_t header[2];
+    size_t size;
+    void *cursor;
+    int fd;
+    int rv;
 
-    rv = uvSegmentBufferFormat(&buf);
+    /* First move the segment out of the way under a temporary name, which is
+     * neither loaded nor mistaken for a closed segment, should we crash while
+     * rewriting its header. Leftovers are removed by uvList(). */
+    sprintf(filename1, UV__RECYCLE_TEMPLATE, counter);
+    rv = osRename(uv->dir, filename, filename1);
     if (rv != 0) {
-        goto out_after_buffer_init;
+        uvErrorf(uv, "rename %s: %s", filename, osStrError(rv));
+        return RAFT_IOERR;
+    }
+    rv = osSyncDir(uv->dir);
+    if (rv != 0) {
+        uvErrorf(uv, "sync %s: %s", uv->dir, osStrError(rv));
+        return RAFT_IOERR;
     }
 
-    uvSegmentBufferAppend(&buf, entries, m);
+    rv = osOpen(uv->dir, filename1, O_WRONLY, &fd);
     if (rv != 0) {
-        goto out_after_buffer_init;
+        uvErrorf(uv, "open %s: %s", filename1, osStrError(rv));
+        return RAFT_IOERR;
     }
 
-    rv = osWriteN(fd, buf.arena.base, buf.n);
+    /* Overwrite the header with the recycled marker, so the stale content of
+     * the file won't be loaded, should we crash before writing to it. */
+    cursor = header;
+    bytePut64(&cursor, UV__SEGMENT_FORMAT);
+    bytePut64(&cursor, 0);
+    rv = osWriteN(fd, header, sizeof header);
     if (rv != 0) {
-        uvErrorf(uv, "write %s: %s", filename, osStrError(errno));
-        rv = RAFT_IOERR;
-        goto out_after_open;
+        uvErrorf(uv, "write %s: %s", filename1, osStrError(rv));
+        goto err_after_open;
+    }
+
+    /* Closed segments are truncated to the size of their content, allocate
+     * the space back. This is a no-op for the blocks still allocated. */
+    size = uv->block_size * uv->n_blocks;
+    rv = posix_fallocate(fd, 0, size);
+    if (rv != 0) {
+        uvErrorf(uv, "allocate %s: %s", filename1, osStrError(rv));
+        goto err_after_open;
     }
 
     rv = fsync(fd);
     if (rv == -1) {
-        uvErrorf(uv, "fsync %s: %s", filename, strerror(errno));
-        rv = RAFT_IOERR;
-        goto out_after_open;
+        uvErrorf(uv, "fsync %s: %s", filename1, osStrError(errno));
+        goto err_after_open;
     }
+    close(fd);
 
-out_after_buffer_init:
-    uvSegmentBufferClose(&buf);
-out_after_open:
+    sprintf(filename2, UV__OPEN_TEMPLATE, counter);
+    rv = osRename(uv->dir, filename1, filename2);
+    if (rv != 0) {
+        uvErrorf(uv, "rename %s: %s", filename1, osStrError(rv));
+        return RAFT_IOERR;
+    }
+    rv = osSyncDir(uv->dir);
+    if (rv != 0) {
+        uvErrorf(uv, "sync %s: %s", uv->dir, osStrError(rv));
+        return RAFT_IOERR;
+    }
+
+    return 0;
+
+err_after_open:
     close(fd);
-out_after_load:
-    entryBatchesDestroy(entries, n);
-out:
-    return rv;
+    return RAFT_IOERR;
 }
@@ -1,8 +1,18 @@
+#include <limits.h>
+#include <netinet/in.h>
 #include <string.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <time.h>
+
+#include <linux/sockios.h>
+
+#include <linux/errqueue.h>
 
 #include "../include/raft/uv.h"
 
 #include "assert.h"
+#include "byte.h"
 #include "uv.h"
 #include "uv_encoding.h"
 
@@ -28,6 +38,30 @@
  * - The write request fails (either synchronously or asynchronously). In this
  *   case we fire the request callback with an error, close the connection
  *   stream, and start a re-connection attempt.
+ *
+ * Each client has at most one write in flight: messages sent in the meantime
+ * wait in the queue, with votes and results going ahead of AppendEntries and
+ * InstallSnapshot messages, and are written together once the write completes.
+ * The bytes held by a client are bounded: messages carrying entries or
+ * snapshots that would exceed the bound are refused with RAFT_BUSY.
+ *
+ * Servers that support it get two clients: messages carrying entries or
+ * snapshots go through the RAFT_UV_BULK one, so they don't delay the messages
+ * going through the RAFT_UV_CONTROL one. Heartbeats also go through the bulk
+ * one while entries sent through it might not have reached the server yet, so
+ * they don't get there first.
+ *
+ * An AppendEntries message sent to several servers during the same loop
+ * iteration, like the heartbeats of up-to-date followers or entries replicated
+ * to followers at the same index, is encoded only once: the send requests share
+ * a reference-counted encoding, which is dropped from the cache once the
+ * corked messages are flushed.
+ *
+ * If zero-copy is enabled, batches with large payloads are first sent with
+ * MSG_ZEROCOPY, and only what the socket didn't take is left to the regular
+ * write. Such batches stay pinned in the client's pinned queue until the kernel
+ * reports on the socket error queue that it's done with their memory, and only
+ * then their callbacks are fired.
  */
 
 /* Set to 1 to enable tracing. */
@@ -46,9 +80,32 @@ enum {
     CLOSED,
 };
 
-/* Maximum number of requests that can be buffered.  */
+/* Message classes. */
+enum {
+    CONTROL = 1, /* Votes and results, which can overtake other messages */
+    HEARTBEAT,   /* AppendEntries without entries */
+    BULK         /* AppendEntries with entries and InstallSnapshot */
+};
+
+/* Maximum number of requests that can be buffered while not connected. */
 #define QUEUE_SIZE 3
 
+/* Maximum number of completed requests that each client keeps around for
+ * reuse, along with their buffers. */
+#define POOL_SIZE 64
+
+/* Bounds in milliseconds of the interval between checks for zero-copy
+ * completions while some batches are pinned. */
+#define ZERO_COPY_REAP_MIN_DELAY 2
+#define ZERO_COPY_REAP_MAX_DELAY 200
+
+/* MSG_ZEROCOPY needs the headers of Linux 4.14 and glibc 2.27: without them
+ * zero-copy sends are compiled out and messages are always written normally. */
+#if defined(MSG_ZEROCOPY) && defined(SO_ZEROCOPY) && \
+    defined(SO_EE_ORIGIN_ZEROCOPY)
+#define UV__ZERO_COPY
+#endif
+
 struct uvClient
 {
     struct uv *uv;                  /* libuv I/O implementation object */
@@ -58,9 +115,42 @@ struct uvClient
     unsigned n_connect_attempt;     /* Consecutive connection attempts */
     unsigned id;                    /* ID of the other server */
     char *address;                  /* Address of the other server */
+    int channel;                    /* RAFT_UV_CONTROL or RAFT_UV_BULK */
     int state;                      /* Current client state */
     queue send_reqs;                /* Pending send message requests */
     unsigned n_send_reqs;           /* Number of pending send requests */
+    size_t n_bytes;                 /* Bytes of pending and inflight requests */
+    unsigned n_bulk;                /* Pending and inflight bulk requests */
+    struct send *writing;           /* First request of the inflight write */
+    uv_buf_t *bufs;                 /* Buffers of a coalesced write */
+    unsigned n_bufs;                /* Capacity of the bufs array */
+    queue pool;                     /* Completed requests to be reused */
+    unsigned n_pool;                /* Number of requests in the pool */
+    bool zero_copy;                 /* Whether MSG_ZEROCOPY is enabled */
+    uint32_t zero_copy_seq;         /* Sequence of the next zero-copy send */
+    unsigned reap_delay;            /* Interval between completion checks */
+    queue pinned;                   /* Batches the kernel is still sending */
+};
+
+/* AppendEntries message encoded once for all the servers it's sent to during
+ * the same loop iteration. The buffers array and the header are allocated
+ * along with it. */
+struct uvEncoded
+{
+    struct uv *uv;         /* libuv I/O implementation object */
+    unsigned refs;         /* Requests using it, plus one while cached */
+    size_t capacity;       /* Size of the memory allocated for it */
+    raft_term term;        /* Term of the message */
+    raft_index prev_index; /* Index of the entry preceding the entries */
+    raft_term prev_term;   /* Term of the entry preceding the entries */
+    raft_index commit;     /* Leader commit index */
+    unsigned n_entries;    /* Number of entries */
+    const void *data;      /* Data of the first entry, if any */
+    bool compact;          /* Whether the compact encoding was used */
+    bool compress;         /* Whether compression was requested */
+    uv_buf_t *bufs;        /* Encoded message */
+    unsigned n_bufs;       /* Number of buffers */
+    size_t size;           /* Total size of the buffers */
 };
 
 /* Hold state for a single send RPC message request. */
@@ -70,19 +160,139 @@ struct send
     struct raft_io_send *req; /* Uer request */
     uv_buf_t *bufs;           /* Encoded raft RPC message to send */
     unsigned n_bufs;          /* Number of buffers */
+    size_t size;              /* Total size of the buffers */
+    int kind;                 /* Message class */
+    struct uvEncoded *shared; /* Encoding shared with other requests */
+    uv_buf_t *own_bufs;       /* Buffers of a message encoded by us */
+    unsigned bufs_size;       /* Capacity of the own_bufs array */
+    void *header;             /* Buffer for the encoded header */
+    size_t header_size;       /* Capacity of the header buffer */
+    bool pinned;              /* Waiting for a zero-copy completion */
+    uint32_t zero_copy_seq;   /* Sequence of its zero-copy send */
     uv_write_t write;         /* Stream write request */
     queue queue;              /* Pending send requests queue */
+    queue batch;              /* Requests written along with this one */
 };
 
 /* Free all memory used by the given send request object. */
+static void freeRequest(struct send *r)
+{
+    raft_free(r->header);
+    raft_free(r->own_bufs);
+    raft_free(r);
+}
+
+/* Allocate a new send request object, or reuse one from the pool of the given
+ * client, if any, making sure that it can hold a header of @header_size bytes
+ * and @n_bufs buffers. */
+static int getRequest(struct uvClient *c,
+                      size_t header_size,
+                      unsigned n_bufs,
+                      struct send **r)
+{
+    if (c != NULL && c->n_pool > 0) {
+        queue *head = QUEUE_HEAD(&c->pool);
+        QUEUE_REMOVE(head);
+        c->n_pool--;
+        *r = QUEUE_DATA(head, struct send, queue);
+    } else {
+        *r = raft_malloc(sizeof **r);
+        if (*r == NULL) {
+            return RAFT_NOMEM;
+        }
+        (*r)->header = NULL;
+        (*r)->header_size = 0;
+        (*r)->own_bufs = NULL;
+        (*r)->bufs_size = 0;
+    }
+
+    /* Grow the buffers if needed. Their content doesn't need to be
+     * preserved. */
+    if (header_size > (*r)->header_size) {
+        raft_free((*r)->header);
+        (*r)->header_size = 0;
+        (*r)->header = raft_malloc(header_size);
+        if ((*r)->header == NULL) {
+            goto oom;
+        }
+        (*r)->header_size = header_size;
+    }
+    if (n_bufs > (*r)->bufs_size) {
+        raft_free((*r)->own_bufs);
+        (*r)->bufs_size = 0;
+        (*r)->own_bufs = raft_malloc(n_bufs * sizeof *(*r)->own_bufs);
+        if ((*r)->own_bufs == NULL) {
+            goto oom;
+        }
+        (*r)->bufs_size = n_bufs;
+    }
+
+    return 0;
+
+oom:
+    freeRequest(*r);
+    return RAFT_NOMEM;
+}
+
+/* Release the compressed entries data of the given encoded message, if any.
+ * Further buffers are entry payloads, which we were passed but we don't own. */
+static void closeBufs(uv_buf_t *bufs)
+{
+    if (byteFlip64(*(uint64_t *)bufs[0].base) & UV__MESSAGE_COMPRESSED) {
+        raft_free(bufs[1].base);
+    }
+}
+
+/* Drop a reference to the given shared encoding, keeping its memory around
+ * for the next one when the last reference goes away. */
+static void unrefEncoded(struct uvEncoded *e)
+{
+    struct uv *uv = e->uv;
+    assert(e->refs > 0);
+    e->refs--;
+    if (e->refs > 0) {
+        return;
+    }
+    closeBufs(e->bufs);
+    if (uv->send_spare == NULL && !uv->closing) {
+        uv->send_spare = e;
+        return;
+    }
+    raft_free(e);
+}
+
+/* Drop the cached shared encoding, if any. */
+static void dropEncoded(struct uv *uv)
+{
+    if (uv->send_encoded != NULL) {
+        unrefEncoded(uv->send_encoded);
+        uv->send_encoded = NULL;
+    }
+}
+
+/* Release the encoded message of the given send request object. */
 static void closeRequest(struct send *r)
 {
-    /* Just release the first buffer. Further buffers are entry payloads, which
-     * we were passed but we don't own. */
-    raft_free(r->bufs[0].base);
+    if (r->shared != NULL) {
+        unrefEncoded(r->shared);
+        r->shared = NULL;
+        return;
+    }
+    closeBufs(r->bufs);
+}
 
-    /* Release the buffers array. */
-    raft_free(r->bufs);
+/* Put the given completed send request object back in the pool of its client,
+ * or free it if the pool is full or the client is closing. */
+static void releaseRequest(struct send *r)
+{
+    struct uvClient *c = r->c;
+    closeRequest(r);
+    if (c->state == CLOSING || c->n_pool == POOL_SIZE) {
+        freeRequest(r);
+        return;
+    }
+    QUEUE_PUSH(&c->pool, &r->queue);
+    c->n_pool++;
 }
 
 static void copyAddress(const char *address1, char **address2)
@@ -98,11 +308,13 @@ static void copyAddress(const char *address1, char **address2)
 static int initClient(struct uvClient *c,
                       struct uv *uv,
                       unsigned id,
-                      const char *address)
+                      const char *address,
+                      int channel)
 {
     c->uv = uv;
     c->timer.data = c;
     c->connect.data = c;
+    c->connect.channel = channel;
     c->stream = NULL;
     c->n_connect_attempt = 0;
     c->id = id;
@@ -110,9 +322,21 @@ static int initClient(struct uvClient *c,
     if (c->address == NULL) {
         return RAFT_NOMEM;
     }
+    c->channel = channel;
     c->state = 0;
     QUEUE_INIT(&c->send_reqs);
     c->n_send_reqs = 0;
+    c->n_bytes = 0;
+    c->n_bulk = 0;
+    c->writing = NULL;
+    c->bufs = NULL;
+    c->n_bufs = 0;
+    QUEUE_INIT(&c->pool);
+    c->n_pool = 0;
+    c->zero_copy = false;
+    c->zero_copy_seq = 0;
+    c->reap_delay = ZERO_COPY_REAP_MIN_DELAY;
+    QUEUE_INIT(&c->pinned);
 
     return 0;
 }
@@ -123,11 +347,368 @@ static void timerCloseCb(struct uv_handle_s *handle)
     struct uvClient *c = handle->data;
     assert(c->address != NULL);
     raft_free(c->address);
+    if (c->bufs != NULL) {
+        raft_free(c->bufs);
+    }
+    while (!QUEUE_IS_EMPTY(&c->pool)) {
+        queue *head = QUEUE_HEAD(&c->pool);
+        QUEUE_REMOVE(head);
+        freeRequest(QUEUE_DATA(head, struct send, queue));
+    }
     raft_free(c);
 }
 
-/* Invoked once an encoded RPC message has been written out. */
+/* Fire the callback of a send request which is no longer held by its client,
+ * and release it. */
+static void completeRequest(struct send *r, int status)
+{
+    struct uvClient *c = r->c;
+    assert(c->n_bytes >= r->size);
+    c->n_bytes -= r->size;
+    if (r->kind == BULK) {
+        assert(c->n_bulk > 0);
+        c->n_bulk--;
+    }
+    if (r->req->cb != NULL) {
+        r->req->cb(r->req, status);
+    }
+    releaseRequest(r);
+}
+
+/* Fire the callbacks of the given request and of all requests that were
+ * written along with it, and release them. */
+static void finishBatch(struct send *r, int status)
+{
+    while (!QUEUE_IS_EMPTY(&r->batch)) {
+        queue *head;
+        struct send *r2;
+        head = QUEUE_HEAD(&r->batch);
+        r2 = QUEUE_DATA(head, struct send, queue);
+        QUEUE_REMOVE(head);
+        completeRequest(r2, status);
+    }
+    completeRequest(r, status);
+}
+
+/* Make the kernel discard the data of the connection that it still has to
+ * send when the stream gets closed, since the memory of pinned batches is
+ * about to be released. */
+static void abortConnection(struct uvClient *c)
+{
+    struct linger linger;
+    uv_os_fd_t fd;
+    int rv;
+    rv = uv_fileno((struct uv_handle_s *)c->stream, &fd);
+    assert(rv == 0);
+    linger.l_onoff = 1;
+    linger.l_linger = 0;
+    setsockopt(fd, SOL_SOCKET, SO_LINGER, &linger, sizeof linger);
+}
+
+/* Fire the callbacks of all pinned batches, regardless of whether the kernel is
+ * done with them, because the connection is going away. */
+static void failPinned(struct uvClient *c, int status)
+{
+    while (!QUEUE_IS_EMPTY(&c->pinned)) {
+        queue *head;
+        struct send *r;
+        head = QUEUE_HEAD(&c->pinned);
+        r = QUEUE_DATA(head, struct send, queue);
+        QUEUE_REMOVE(head);
+        finishBatch(r, status);
+    }
+}
+
+#if defined(UV__ZERO_COPY)
+
+/* Return #true if @seq is in the range from @lo to @hi included, which might
+ * wrap around. */
+static bool seqInRange(uint32_t seq, uint32_t lo, uint32_t hi)
+{
+    return seq - lo <= hi - lo;
+}
+
+/* Return the first pinned batch sent with a zero-copy sequence number in the
+ * given range, or #NULL. */
+static struct send *findPinned(struct uvClient *c, uint32_t lo, uint32_t hi)
+{
+    queue *head;
+    QUEUE_FOREACH(head, &c->pinned)
+    {
+        struct send *r = QUEUE_DATA(head, struct send, queue);
+        if (seqInRange(r->zero_copy_seq, lo, hi)) {
+            return r;
+        }
+    }
+    return NULL;
+}
+
+/* The kernel is done with the batches sent with a zero-copy sequence number in
+ * the given range. The inflight one, if any, is completed by the write
+ * callback. */
+static void unpinBatches(struct uvClient *c, uint32_t lo, uint32_t hi)
+{
+    struct send *r;
+    if (c->writing != NULL && c->writing->pinned &&
+        seqInRange(c->writing->zero_copy_seq, lo, hi)) {
+        c->writing->pinned = false;
+    }
+    while ((r = findPinned(c, lo, hi)) != NULL) {
+        QUEUE_REMOVE(&r->queue);
+        r->pinned = false;
+        finishBatch(r, 0);
+    }
+}
+
+/* Process the zero-copy completions queued on the error queue of the socket,
+ * and return how many there were. */
+static unsigned readCompletions(struct uvClient *c)
+{
+    unsigned n = 0;
+    uv_os_fd_t fd;
+    int rv;
+
+    rv = uv_fileno((struct uv_handle_s *)c->stream, &fd);
+    assert(rv == 0);
+
+    for (;;) {
+        char control[128];
+        struct msghdr msg;
+        struct cmsghdr *cmsg;
+        memset(&msg, 0, sizeof msg);
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof control;
+        if (recvmsg(fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0) {
+            break;
+        }
+        for (cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL;
+             cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+            struct sock_extended_err *err;
+            if (!(cmsg->cmsg_level == SOL_IP &&
+                  cmsg->cmsg_type == IP_RECVERR) &&
+                !(cmsg->cmsg_level == SOL_IPV6 &&
+                  cmsg->cmsg_type == IPV6_RECVERR)) {
+                continue;
+            }
+            err = (struct sock_extended_err *)CMSG_DATA(cmsg);
+            if (err->ee_errno != 0 || err->ee_origin != SO_EE_ORIGIN_ZEROCOPY) {
+                continue;
+            }
+            /* The kernel had to copy the data after all, e.g. because the
+             * peer is on the loopback interface. */
+            if (err->ee_code & SO_EE_CODE_ZEROCOPY_COPIED) {
+                c->uv->send_n_zero_copy_copied += err->ee_data - err->ee_info + 1;
+            }
+            unpinBatches(c, err->ee_info, err->ee_data);
+            n++;
+        }
+        /* A callback might have closed the client. */
+        if (c->state != CONNECTED) {
+            break;
+        }
+    }
+
+    return n;
+}
+
+/* Enable MSG_ZEROCOPY on a new connection if it was requested, it's a TCP
+ * connection and the kernel supports it. */
+static bool enableZeroCopy(struct uvClient *c)
+{
+    uv_os_fd_t fd;
+    int one = 1;
+    if (c->uv->zero_copy_threshold == 0 || c->stream->type != UV_TCP) {
+        return false;
+    }
+    if (uv_fileno((struct uv_handle_s *)c->stream, &fd) != 0) {
+        return false;
+    }
+    return setsockopt(fd, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof one) == 0;
+}
+
+/* Send as much of the given buffers as the socket takes with MSG_ZEROCOPY,
+ * pinning the batch if anything was sent. Return the number of bytes sent. */
+static size_t sendZeroCopy(struct uvClient *c,
+                           struct send *r,
+                           uv_buf_t *bufs,
+                           unsigned n_bufs)
+{
+    struct msghdr msg;
+    uv_os_fd_t fd;
+    ssize_t n;
+    int rv;
+
+    rv = uv_fileno((struct uv_handle_s *)c->stream, &fd);
+    assert(rv == 0);
+
+    /* On Unix uv_buf_t has the same layout of struct iovec. */
+    memset(&msg, 0, sizeof msg);
+    msg.msg_iov = (struct iovec *)bufs;
+    msg.msg_iovlen = n_bufs;
+    n = sendmsg(fd, &msg, MSG_ZEROCOPY | MSG_DONTWAIT | MSG_NOSIGNAL);
+    if (n <= 0) {
+        /* E.g. EAGAIN if the socket buffer is full or ENOBUFS if we hit the
+         * limit of pinned memory: leave everything to the regular write, which
+         * also reports actual errors. */
+        return 0;
+    }
+
+    /* Each successful call gets the next sequence number, which the kernel
+     * then reports back in the completion. */
+    r->pinned = true;
+    r->zero_copy_seq = c->zero_copy_seq++;
+    c->uv->send_n_zero_copy++;
+
+    return (size_t)n;
+}
+
+#else
+
+static unsigned readCompletions(struct uvClient *c)
+{
+    (void)c;
+    return 0;
+}
+
+static bool enableZeroCopy(struct uvClient *c)
+{
+    (void)c;
+    return false;
+}
+
+static size_t sendZeroCopy(struct uvClient *c,
+                           struct send *r,
+                           uv_buf_t *bufs,
+                           unsigned n_bufs)
+{
+    (void)c;
+    (void)r;
+    (void)bufs;
+    (void)n_bufs;
+    return 0;
+}
+
+#endif
+
+static void zeroCopyTimerCb(uv_timer_t *timer);
+
+/* Check again for zero-copy completions later if some batches are still
+ * pinned. */
+static void scheduleReap(struct uvClient *c)
+{
+    int rv;
+    if (!QUEUE_IS_EMPTY(&c->pinned)) {
+        rv = uv_timer_start(&c->timer, zeroCopyTimerCb, c->reap_delay, 0);
+        assert(rv == 0);
+    }
+}
+
+/* Process the zero-copy completions received so far. */
+static void reapZeroCopy(struct uvClient *c)
+{
+    if (!c->zero_copy) {
+        return;
+    }
+    readCompletions(c);
+    if (c->state == CONNECTED) {
+        scheduleReap(c);
+    }
+}
+
+static void zeroCopyTimerCb(uv_timer_t *timer)
+{
+    struct uvClient *c = timer->data;
+    unsigned n;
+
+    /* We might have been disconnected in the meantime. */
+    if (c->state != CONNECTED) {
+        return;
+    }
+    n = readCompletions(c);
+    if (c->state != CONNECTED) {
+        return;
+    }
+
+    /* Adapt the interval to how long the server takes to acknowledge data:
+     * check less often while nothing completes, and more often otherwise. */
+    if (n == 0) {
+        c->reap_delay *= 2;
+        if (c->reap_delay > ZERO_COPY_REAP_MAX_DELAY) {
+            c->reap_delay = ZERO_COPY_REAP_MAX_DELAY;
+        }
+    } else {
+        c->reap_delay /= 2;
+        if (c->reap_delay < ZERO_COPY_REAP_MIN_DELAY) {
+            c->reap_delay = ZERO_COPY_REAP_MIN_DELAY;
+        }
+    }
+    scheduleReap(c);
+}
+
+/* Return #true if the given buffers hold a payload large enough to be worth
+ * sending with MSG_ZEROCOPY. */
+static bool shouldZeroCopy(struct uvClient *c, uv_buf_t *bufs, unsigned n_bufs)
+{
+    unsigned i;
+    if (!c->zero_copy || n_bufs > IOV_MAX) {
+        return false;
+    }
+    for (i = 0; i < n_bufs; i++) {
+        if (bufs[i].len >= c->uv->zero_copy_threshold) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/* Make sure that the buffers array of the client can hold @n_bufs buffers. */
+static int growBufs(struct uvClient *c, unsigned n_bufs)
+{
+    uv_buf_t *bufs;
+    if (n_bufs <= c->n_bufs) {
+        return 0;
+    }
+    bufs = raft_realloc(c->bufs, n_bufs * sizeof *bufs);
+    if (bufs == NULL) {
+        return RAFT_NOMEM;
+    }
+    c->bufs = bufs;
+    c->n_bufs = n_bufs;
+    return 0;
+}
+
+/* Fill the buffers array of the client with the given buffers, minus their
+ * first @n bytes. */
+static void skipBytes(struct uvClient *c,
+                      uv_buf_t **bufs,
+                      unsigned *n_bufs,
+                      size_t n)
+{
+    unsigned i = 0;
+    while (n >= (*bufs)[i].len) {
+        n -= (*bufs)[i].len;
+        i++;
+    }
+    memmove(c->bufs, *bufs + i, (*n_bufs - i) * sizeof **bufs);
+    c->bufs[0].base += n;
+    c->bufs[0].len -= n;
+    *bufs = c->bufs;
+    *n_bufs -= i;
+}
+
+/* Update the counters of the writes submitted. */
+static void countWrite(struct uv *uv, unsigned n_reqs)
+{
+    uv->send_n_writes++;
+    uv->send_n_messages += n_reqs;
+    if (n_reqs > uv->send_max_messages) {
+        uv->send_max_messages = n_reqs;
+    }
+}
+
+/* Invoked once a batch of encoded RPC messages has been written out. */
 static void startConnecting(struct uvClient *c);
+static void writeQueue(struct uvClient *c);
 static void writeCb(struct uv_write_s *write, const int status)
 {
     struct send *r = write->data;
@@ -136,6 +717,8 @@ static void writeCb(struct uv_write_s *write, const int status)
 
     tracef(c, "message write completed -> status %d", status);
 
+    c->writing = NULL;
+
     /* If the write failed and we're not currently disconnecting, let's close
      * the stream handle, and trigger a new connection
      * attempt. */
@@ -144,6 +727,12 @@ static void writeCb(struct uv_write_s *write, const int status)
         if (c->state == CONNECTED) {
             assert(status != UV_ECANCELED);
             assert(c->stream != NULL);
+            /* Make sure the kernel doesn't keep sending pinned memory that's
+             * about to be released. */
+            if (r->pinned || !QUEUE_IS_EMPTY(&c->pinned)) {
+                abortConnection(c);
+            }
+            failPinned(c, RAFT_IOERR);
             uv_close((struct uv_handle_s *)c->stream, (uv_close_cb)raft_free);
             c->stream = NULL;
             c->state = CONNECTING;
@@ -153,52 +742,281 @@ static void writeCb(struct uv_write_s *write, const int status)
         }
     }
 
-    if (r->req->cb != NULL) {
-        r->req->cb(r->req, cb_status);
+    /* The kernel might still be using the memory of the part of the batch
+     * that was sent with MSG_ZEROCOPY. */
+    if (r->pinned && status == 0) {
+        QUEUE_PUSH(&c->pinned, &r->queue);
+    } else {
+        finishBatch(r, cb_status);
     }
 
-    closeRequest(r);
-    raft_free(r);
+    /* Write the messages that were queued in the meantime, if any. */
+    if (c->state == CONNECTED) {
+        reapZeroCopy(c);
+        writeQueue(c);
+    }
 }
 
-int sendMessage(struct uvClient *c, struct send *r)
+/* Write all requests in the queue of a connected client with a single
+ * vectored write, so they cost one system call. */
+static void writeQueue(struct uvClient *c)
+{
+    struct uv *uv = c->uv;
+    struct send *r;
+    uv_buf_t *bufs;
+    unsigned n_bufs = 0;
+    unsigned n_reqs = c->n_send_reqs;
+    size_t size = 0;
+    size_t sent;
+    queue *head;
+    int rv;
+
+    assert(c->state == CONNECTED);
+    assert(c->stream != NULL);
+
+    if (n_reqs == 0 || c->writing != NULL) {
+        return;
+    }
+
+    QUEUE_FOREACH(head, &c->send_reqs)
+    {
+        r = QUEUE_DATA(head, struct send, queue);
+        n_bufs += r->n_bufs;
+        size += r->size;
+    }
+
+    /* Detach the requests from the queue: the first one holds the write
+     * request and the others get linked to it. */
+    head = QUEUE_HEAD(&c->send_reqs);
+    r = QUEUE_DATA(head, struct send, queue);
+    QUEUE_REMOVE(head);
+    QUEUE_INIT(&r->batch);
+    while (!QUEUE_IS_EMPTY(&c->send_reqs)) {
+        head = QUEUE_HEAD(&c->send_reqs);
+        QUEUE_REMOVE(head);
+        QUEUE_PUSH(&r->batch, head);
+    }
+    c->n_send_reqs = 0;
+
+    /* With a single request there's nothing to gather, otherwise collect the
+     * buffers of all requests in the array of the client, which libuv copies
+     * when submitting the write. */
+    bufs = r->bufs;
+    r->pinned = false;
+    if (n_reqs > 1) {
+        rv = growBufs(c, n_bufs);
+        if (rv != 0) {
+            goto err;
+        }
+        bufs = c->bufs;
+        memcpy(bufs, r->bufs, r->n_bufs * sizeof *bufs);
+        n_bufs = r->n_bufs;
+        QUEUE_FOREACH(head, &r->batch)
+        {
+            struct send *r2 = QUEUE_DATA(head, struct send, queue);
+            memcpy(bufs + n_bufs, r2->bufs, r2->n_bufs * sizeof *bufs);
+            n_bufs += r2->n_bufs;
+        }
+    }
+
+    /* Let the kernel send large payloads straight from their memory, leaving
+     * what the socket didn't take to the regular write. */
+    if (shouldZeroCopy(c, bufs, n_bufs)) {
+        rv = growBufs(c, n_bufs);
+        if (rv != 0) {
+            goto err;
+        }
+        sent = sendZeroCopy(c, r, bufs, n_bufs);
+        if (sent == size) {
+            tracef(c, "sent %u messages with zero-copy", n_reqs);
+            QUEUE_PUSH(&c->pinned, &r->queue);
+            countWrite(uv, n_reqs);
+            reapZeroCopy(c);
+            return;
+        }
+        if (sent > 0) {
+            skipBytes(c, &bufs, &n_bufs, sent);
+        }
+    }
+
+    tracef(c, "connection available -> write %u messages", n_reqs);
+    r->write.data = r;
+    rv = uv_write(&r->write, c->stream, bufs, n_bufs, writeCb);
+    if (rv != 0) {
+        tracef(c, "write messages failed -> rv %d", rv);
+        /* UNTESTED: what are the error conditions? perhaps ENOMEM */
+        rv = RAFT_IOERR;
+        goto err;
+    }
+    c->writing = r;
+    countWrite(uv, n_reqs);
+
+    return;
+
+err:
+    finishBatch(r, rv);
+}
+
+/* Write out the requests queued by all connected clients during this loop
+ * iteration. */
+static void flushClients(struct uv *uv)
+{
+    unsigned i;
+    int rv;
+
+    rv = uv_prepare_stop(&uv->send_prepare);
+    assert(rv == 0);
+    rv = uv_check_stop(&uv->send_check);
+    assert(rv == 0);
+
+    for (i = 0; i < uv->n_clients; i++) {
+        struct uvClient *c = uv->clients[i];
+        if (c->state == CONNECTED) {
+            writeQueue(c);
+        }
+    }
+
+    /* Messages sent from now on are part of another broadcast. */
+    dropEncoded(uv);
+}
+
+static void prepareCb(struct uv_prepare_s *prepare)
+{
+    flushClients(prepare->data);
+}
+
+static void checkCb(struct uv_check_s *check)
+{
+    flushClients(check->data);
+}
+
+/* Make sure that corked messages get flushed during this loop iteration. */
+static void startFlush(struct uv *uv)
 {
     int rv;
+    if (uv_is_active((struct uv_handle_s *)&uv->send_prepare)) {
+        return;
+    }
+    rv = uv_prepare_start(&uv->send_prepare, prepareCb);
+    assert(rv == 0);
+    rv = uv_check_start(&uv->send_check, checkCb);
+    assert(rv == 0);
+}
+
+/* Remove the given request from the queue of its client and fire its
+ * callback. */
+static void dequeueRequest(struct send *r, int status)
+{
+    struct uvClient *c = r->c;
+    QUEUE_REMOVE(&r->queue);
+    c->n_send_reqs--;
+    completeRequest(r, status);
+}
+
+/* Return the oldest queued request of the given class, or #NULL. */
+static struct send *findQueued(struct uvClient *c, int kind)
+{
+    queue *head;
+    QUEUE_FOREACH(head, &c->send_reqs)
+    {
+        struct send *r = QUEUE_DATA(head, struct send, queue);
+        if (r->kind == kind) {
+            return r;
+        }
+    }
+    return NULL;
+}
+
+/* Add a request to the queue of its client. Control messages go ahead of all
+ * other ones, while heartbeats can't overtake AppendEntries carrying entries,
+ * since the follower would then reject them. */
+static void enqueueRequest(struct uvClient *c, struct send *r)
+{
+    queue *head;
+    if (r->kind == CONTROL) {
+        QUEUE_FOREACH(head, &c->send_reqs)
+        {
+            struct send *r2 = QUEUE_DATA(head, struct send, queue);
+            if (r2->kind != CONTROL) {
+                break;
+            }
+        }
+        /* Pushing onto an element links the new one right before it. */
+        QUEUE_PUSH(head, &r->queue);
+    } else {
+        QUEUE_PUSH(&c->send_reqs, &r->queue);
+    }
+    c->n_send_reqs++;
+    c->n_bytes += r->size;
+    if (r->kind == BULK) {
+        c->n_bulk++;
+    }
+}
+
+/* Return true if a message of the given size carrying entries or a snapshot
+ * would exceed the bytes we hold for the server of the given client. A message
+ * is always accepted if nothing else is queued, regardless of its size. */
+static bool isFull(struct uvClient *c, size_t size)
+{
+    return c->n_bytes > 0 && c->n_bytes + size > c->uv->send_queue_size;
+}
+
+int sendMessage(struct uvClient *c, struct send *r)
+{
+    struct uv *uv = c->uv;
+    struct send *r2;
     assert(c->state == CONNECTED || c->state == DELAY ||
            c->state == CONNECTING);
     r->c = c;
 
-    /* If there's no connection available, let's queue the request. */
+    /* Refuse entries and snapshots that would exceed the bytes we hold for
+     * this server, so the caller retries later with up-to-date data instead of
+     * piling it up behind a slow server. */
+    if (r->kind == BULK && isFull(c, r->size)) {
+        tracef(c, "queue full -> refuse message");
+        uv->send_n_busy++;
+        return RAFT_BUSY;
+    }
+
+    /* A heartbeat that is still queued is superseded by the new one, which
+     * carries a more recent commit index and gets delivered in its place. */
+    if (r->kind == HEARTBEAT) {
+        r2 = findQueued(c, HEARTBEAT);
+        if (r2 != NULL) {
+            tracef(c, "new heartbeat -> drop stale one");
+            uv->send_n_dropped++;
+            dequeueRequest(r2, 0);
+        }
+    }
+
+    /* If there's no connection available, let's queue the request, making
+     * room for it if needed. */
     if (c->state == DELAY || c->state == CONNECTING) {
         assert(c->stream == NULL);
-        if (c->n_send_reqs == QUEUE_SIZE) {
-            /* Fail the oldest request */
+        while (c->n_send_reqs >= QUEUE_SIZE) {
+            /* Fail the oldest request, preferring bulk ones. */
             tracef(c, "queue full -> evict oldest message");
-            queue *head;
-            struct send *r2;
-            head = QUEUE_HEAD(&c->send_reqs);
-            r2 = QUEUE_DATA(head, struct send, queue);
-            QUEUE_REMOVE(head);
-            r2->req->cb(r2->req, RAFT_NOCONNECTION);
-            closeRequest(r2);
-            raft_free(r2);
-            c->n_send_reqs--;
+            r2 = findQueued(c, BULK);
+            if (r2 == NULL) {
+                r2 = QUEUE_DATA(QUEUE_HEAD(&c->send_reqs), struct send, queue);
+            }
+            dequeueRequest(r2, RAFT_NOCONNECTION);
         }
         tracef(c, "no connection available -> enqueue message");
-        QUEUE_PUSH(&c->send_reqs, &r->queue);
-        c->n_send_reqs++;
+        enqueueRequest(c, r);
         return 0;
     }
 
+    /* Otherwise cork the request: all messages sent during this loop iteration
+     * get written together right before the loop polls for I/O, or right
+     * after it has run the I/O callbacks, unless a write is already in flight,
+     * in which case they get written once it completes. */
     assert(c->stream != NULL);
-    tracef(c, "connection available -> write message");
-    rv = uv_write(&r->write, c->stream, r->bufs, r->n_bufs, writeCb);
-    if (rv != 0) {
-        tracef(c, "write message failed -> rv %d", rv);
-        /* UNTESTED: what are the error conditions? perhaps ENOMEM */
-        return RAFT_IOERR;
+    tracef(c, "connection available -> cork message");
+    enqueueRequest(c, r);
+    if (c->writing == NULL) {
+        startFlush(uv);
     }
-    r->write.data = r;
 
     return 0;
 }
@@ -207,26 +1025,30 @@ int sendMessage(struct uvClient *c, struct send *r)
  * connection. */
 static void flushQueue(struct uvClient *c)
 {
-    int rv;
     assert(c->state == CONNECTED);
     assert(c->stream != NULL);
     tracef(c, "flush pending messages");
-    while (!QUEUE_IS_EMPTY(&c->send_reqs)) {
-        queue *head;
-        struct send *r;
-        head = QUEUE_HEAD(&c->send_reqs);
-        r = QUEUE_DATA(head, struct send, queue);
-        QUEUE_REMOVE(head);
-        rv = sendMessage(c, r);
-        if (rv != 0) {
-            if (r->req->cb != NULL) {
-                r->req->cb(r->req, rv);
-            }
-            closeRequest(r);
-            raft_free(r);
+    writeQueue(c);
+}
+
+/* Return the delay before the next connection attempt. It doubles after each
+ * failed attempt, up to a maximum, and up to half of it is taken off at random,
+ * so servers that lost the same peer don't keep retrying in lockstep. */
+static unsigned retryDelay(struct uvClient *c)
+{
+    struct uv *uv = c->uv;
+    unsigned delay = uv->connect_retry_delay;
+    unsigned i;
+    for (i = 1; i < c->n_connect_attempt; i++) {
+        if (delay >= uv->connect_retry_max_delay) {
+            break;
         }
+        delay *= 2;
     }
-    c->n_send_reqs = 0;
+    if (delay > uv->connect_retry_max_delay) {
+        delay = uv->connect_retry_max_delay;
+    }
+    return delay - (unsigned)uv->io->random(uv->io, 0, (int)(delay / 2) + 1);
 }
 
 static void timerCb(uv_timer_t *timer)
@@ -279,6 +1101,9 @@ static void connectCb(struct raft_uv_connect *req,
         c->state = CONNECTED;
         c->n_connect_attempt = 0;
         c->stream->data = c;
+        c->zero_copy = enableZeroCopy(c);
+        c->zero_copy_seq = 0;
+        c->reap_delay = ZERO_COPY_REAP_MIN_DELAY;
         flushQueue(c);
         return;
     }
@@ -295,7 +1120,7 @@ static void connectCb(struct raft_uv_connect *req,
 
     /* Let's schedule another attempt. */
     c->state = DELAY;
-    rv = uv_timer_start(&c->timer, timerCb, c->uv->connect_retry_delay, 0);
+    rv = uv_timer_start(&c->timer, timerCb, retryDelay(c), 0);
     assert(rv == 0);
 }
 
@@ -311,7 +1136,7 @@ static void startConnecting(struct uvClient *c)
     if (rv != 0) {
         /* Restart the timer, so we can retry. */
         c->state = DELAY;
-        rv = uv_timer_start(&c->timer, timerCb, c->uv->connect_retry_delay, 0);
+        rv = uv_timer_start(&c->timer, timerCb, retryDelay(c), 0);
         assert(rv == 0);
         return;
     }
@@ -319,27 +1144,39 @@ static void startConnecting(struct uvClient *c)
     c->state = CONNECTING;
 }
 
+/* Return the client object for the given peer server and channel, or #NULL. */
+static struct uvClient *findClient(struct uv *uv,
+                                   const unsigned id,
+                                   const int channel)
+{
+    unsigned i;
+    for (i = 0; i < uv->n_clients; i++) {
+        struct uvClient *c = uv->clients[i];
+        if (c->id == id && c->channel == channel) {
+            assert(c->state == CONNECTED || c->state == DELAY ||
+                   c->state == CONNECTING);
+            return c;
+        }
+    }
+    return NULL;
+}
+
 static int getClient(struct uv *uv,
                      const unsigned id,
                      const char *address,
+                     const int channel,
                      struct uvClient **client)
 {
     struct uvClient **clients;
     unsigned n_clients;
-    unsigned i;
     int rv;
 
     /* Check if we already have a client object for this peer server. */
-    for (i = 0; i < uv->n_clients; i++) {
-        *client = uv->clients[i];
-
-        if ((*client)->id == id) {
-            /* TODO: handle a change in the address */
-            /* assert(strcmp((*client)->address, address) == 0); */
-            assert((*client)->state == CONNECTED || (*client)->state == DELAY ||
-                   (*client)->state == CONNECTING);
-            return 0;
-        }
+    *client = findClient(uv, id, channel);
+    if (*client != NULL) {
+        /* TODO: handle a change in the address */
+        /* assert(strcmp((*client)->address, address) == 0); */
+        return 0;
     }
 
     /* Grow the connections array */
@@ -362,7 +1199,7 @@ static int getClient(struct uv *uv,
 
     clients[n_clients - 1] = *client;
 
-    rv = initClient(*client, uv, id, address);
+    rv = initClient(*client, uv, id, address, channel);
     if (rv != 0) {
         goto err_after_client_alloc;
     }
@@ -388,6 +1225,255 @@ err:
     return rv;
 }
 
+/* Return the class of the given message. */
+static int messageKind(const struct raft_message *message)
+{
+    switch (message->type) {
+        case RAFT_IO_APPEND_ENTRIES:
+            if (message->append_entries.n_entries == 0) {
+                return HEARTBEAT;
+            }
+            return BULK;
+        case RAFT_IO_INSTALL_SNAPSHOT:
+            return BULK;
+        default:
+            return CONTROL;
+    }
+}
+
+/* Return #true if entries sent through the given bulk client might not have
+ * reached the server yet, because they are still queued, being written, or
+ * waiting to be acknowledged by the server. */
+static bool bulkInFlight(struct uvClient *c)
+{
+#ifdef SIOCOUTQ
+    uv_os_fd_t fd;
+    int n;
+#endif
+
+    if (c->n_bytes > 0) {
+        return true;
+    }
+    if (c->state != CONNECTED) {
+        return false;
+    }
+#ifdef SIOCOUTQ
+    if (uv_fileno((struct uv_handle_s *)c->stream, &fd) == 0 &&
+        ioctl(fd, SIOCOUTQ, &n) == 0 && n > 0) {
+        return true;
+    }
+#endif
+    return false;
+}
+
+/* Return #true if the given shared encoding is the one of the given
+ * AppendEntries message. A leader never rewrites the entries of its log during
+ * its term, so their position identifies them. */
+static bool matchEncoded(const struct uvEncoded *e,
+                         const struct raft_append_entries *args,
+                         bool compact,
+                         bool compress)
+{
+    return e->term == args->term && e->prev_index == args->prev_log_index &&
+           e->prev_term == args->prev_log_term &&
+           e->commit == args->leader_commit &&
+           e->n_entries == args->n_entries &&
+           (args->n_entries == 0 || e->data == args->entries[0].buf.base) &&
+           e->compact == compact && e->compress == compress;
+}
+
+/* Get a reference to the encoding of the given AppendEntries message, reusing
+ * the one of an identical message sent during this loop iteration, if any. */
+static int getEncoded(struct uv *uv,
+                      const struct raft_message *message,
+                      bool compact,
+                      bool compress,
+                      struct uvEncoded **e)
+{
+    const struct raft_append_entries *args = &message->append_entries;
+    uv_buf_t compressed;
+    uv_buf_t header;
+    unsigned n_bufs;
+    size_t capacity;
+    unsigned i;
+    int rv;
+
+    if (uv->send_encoded != NULL &&
+        matchEncoded(uv->send_encoded, args, compact, compress)) {
+        *e = uv->send_encoded;
+        (*e)->refs++;
+        uv->send_n_shared++;
+        return 0;
+    }
+
+    compressed.base = NULL;
+    compressed.len = 0;
+    if (compress) {
+        rv = uvCompressMessage(message, uv->codec, &compressed);
+        if (rv != 0) {
+            goto err;
+        }
+    }
+
+    rv = uvSizeofMessage(message, compact, compressed.base != NULL,
+                         &header.len, &n_bufs);
+    if (rv != 0) {
+        goto err_after_compress;
+    }
+
+    /* Reuse the memory of the last encoding that was released if it's large
+     * enough, so in the steady state no memory gets allocated. */
+    capacity = sizeof **e + n_bufs * sizeof *(*e)->bufs + header.len;
+    if (uv->send_spare != NULL && uv->send_spare->capacity >= capacity) {
+        *e = uv->send_spare;
+        uv->send_spare = NULL;
+    } else {
+        *e = raft_malloc(capacity);
+        if (*e == NULL) {
+            rv = RAFT_NOMEM;
+            goto err_after_compress;
+        }
+        (*e)->capacity = capacity;
+    }
+
+    (*e)->uv = uv;
+    (*e)->refs = 1;
+    (*e)->term = args->term;
+    (*e)->prev_index = args->prev_log_index;
+    (*e)->prev_term = args->prev_log_term;
+    (*e)->commit = args->leader_commit;
+    (*e)->n_entries = args->n_entries;
+    (*e)->data = args->n_entries > 0 ? args->entries[0].buf.base : NULL;
+    (*e)->compact = compact;
+    (*e)->compress = compress;
+    (*e)->bufs = (uv_buf_t *)(*e + 1);
+    (*e)->n_bufs = n_bufs;
+    header.base = (char *)((*e)->bufs + n_bufs);
+    uvEncodeMessageTo(message, compact, uv->codec, &compressed, &header,
+                      (*e)->bufs);
+    (*e)->size = 0;
+    for (i = 0; i < n_bufs; i++) {
+        (*e)->size += (*e)->bufs[i].len;
+    }
+
+    /* Keep it around for the other servers until the corked messages are
+     * flushed. */
+    dropEncoded(uv);
+    uv->send_encoded = *e;
+    (*e)->refs++;
+    startFlush(uv);
+
+    return 0;
+
+err_after_compress:
+    if (compressed.base != NULL) {
+        raft_free(compressed.base);
+    }
+err:
+    assert(rv != 0);
+    return rv;
+}
+
+/* Return the number of bytes that the given message takes once encoded, without
+ * compression. If it gets compressed, this is an upper bound. */
+static size_t estimateSize(const struct raft_message *message, bool compact)
+{
+    size_t size;
+    unsigned n_bufs;
+    unsigned i;
+    int rv;
+
+    rv = uvSizeofMessage(message, compact, false, &size, &n_bufs);
+    if (rv != 0) {
+        return 0;
+    }
+    switch (message->type) {
+        case RAFT_IO_APPEND_ENTRIES:
+            for (i = 0; i < message->append_entries.n_entries; i++) {
+                size += message->append_entries.entries[i].buf.len;
+            }
+            break;
+        case RAFT_IO_INSTALL_SNAPSHOT:
+            size += message->install_snapshot.data.len;
+            break;
+    }
+
+    return size;
+}
+
+/* Encode the given message into a new send request object. */
+static int encodeRequest(struct uv *uv,
+                         struct uvClient *c,
+                         const struct raft_message *message,
+                         bool compact,
+                         bool compress,
+                         struct send **r)
+{
+    uv_buf_t compressed;
+    uv_buf_t header;
+    unsigned n_bufs;
+    unsigned i;
+    int rv;
+
+    /* AppendEntries messages are often sent to several servers at once. */
+    if (message->type == RAFT_IO_APPEND_ENTRIES) {
+        rv = getRequest(c, 0, 0, r);
+        if (rv != 0) {
+            goto err;
+        }
+        rv = getEncoded(uv, message, compact, compress, &(*r)->shared);
+        if (rv != 0) {
+            freeRequest(*r);
+            goto err;
+        }
+        (*r)->bufs = (*r)->shared->bufs;
+        (*r)->n_bufs = (*r)->shared->n_bufs;
+        (*r)->size = (*r)->shared->size;
+        return 0;
+    }
+
+    compressed.base = NULL;
+    compressed.len = 0;
+    if (compress) {
+        rv = uvCompressMessage(message, uv->codec, &compressed);
+        if (rv != 0) {
+            goto err;
+        }
+    }
+
+    rv = uvSizeofMessage(message, compact, compressed.base != NULL,
+                         &header.len, &n_bufs);
+    if (rv != 0) {
+        goto err_after_compress;
+    }
+
+    rv = getRequest(c, header.len, n_bufs, r);
+    if (rv != 0) {
+        goto err_after_compress;
+    }
+
+    header.base = (*r)->header;
+    uvEncodeMessageTo(message, compact, uv->codec, &compressed, &header,
+                      (*r)->own_bufs);
+    (*r)->shared = NULL;
+    (*r)->bufs = (*r)->own_bufs;
+    (*r)->n_bufs = n_bufs;
+    (*r)->size = 0;
+    for (i = 0; i < n_bufs; i++) {
+        (*r)->size += (*r)->bufs[i].len;
+    }
+
+    return 0;
+
+err_after_compress:
+    if (compressed.base != NULL) {
+        raft_free(compressed.base);
+    }
+err:
+    assert(rv != 0);
+    return rv;
+}
+
 int uvSend(struct raft_io *io,
            struct raft_io_send *req,
            const struct raft_message *message,
@@ -396,48 +1482,111 @@ int uvSend(struct raft_io *io,
     struct uv *uv = io->impl;
     struct send *r;
     struct uvClient *c;
+    int kind;
+    int channel;
+    bool compact;
+    bool compress;
     int rv;
 
     assert(uv->state == UV__ACTIVE);
 
-    /* Allocate a new request object. */
-    r = raft_malloc(sizeof *r);
-    if (r == NULL) {
-        rv = RAFT_NOMEM;
-        goto err;
+    /* Hand the message over directly if the target server lives in this
+     * process. */
+    if (uv->local != NULL) {
+        rv = uvLocalSend(uv, req, message, cb);
+        if (rv != RAFT_NOCONNECTION) {
+            return rv;
+        }
     }
 
-    r->req = req;
-    req->cb = cb;
+    kind = messageKind(message);
+    channel = RAFT_UV_CONTROL;
+    if (kind == BULK && uvRecvCanBulk(uv, message->server_id)) {
+        channel = RAFT_UV_BULK;
+    }
+
+    /* A heartbeat refers to the last entry sent to the server, so it must not
+     * overtake entries still on their way over the bulk connection, or the
+     * server would reject it and we would fall back to probing. */
+    if (kind == HEARTBEAT && uvRecvCanBulk(uv, message->server_id)) {
+        c = findClient(uv, message->server_id, RAFT_UV_BULK);
+        if (c != NULL && bulkInFlight(c)) {
+            channel = RAFT_UV_BULK;
+        }
+    }
+
+    /* Use the compact batch encoding if the peer told us it supports it, and
+     * compress the entries if it also told us it uses the same codec. */
+    compact = uvRecvCanCompact(uv, message->server_id);
+    compress = compact && uv->codec != NULL &&
+               uvRecvCodec(uv, message->server_id) == uv->codec->id;
+
+    /* Refuse entries and snapshots that won't fit before going through the
+     * cost of compressing and encoding them. With compression the estimated
+     * size is an upper bound, the exact check is done by sendMessage(). */
+    c = findClient(uv, message->server_id, channel);
+    if (kind == BULK && c != NULL &&
+        isFull(c, estimateSize(message, compact))) {
+        tracef(c, "queue full -> refuse message");
+        uv->send_n_busy++;
+        return RAFT_BUSY;
+    }
 
-    rv = uvEncodeMessage(message, &r->bufs, &r->n_bufs);
+    /* Get a request object, reusing one of the client connected to the target
+     * server if we have it, so in the steady state no memory gets allocated
+     * for encoding the message. */
+    rv = encodeRequest(uv, c, message, compact, compress, &r);
     if (rv != 0) {
-        goto err_after_request_alloc;
+        goto err;
     }
 
+    r->req = req;
+    req->cb = cb;
+    r->kind = kind;
+
     /* Get a client object connected to the target server, creating it if it
      * doesn't exist yet. */
-    rv = getClient(uv, message->server_id, message->server_address, &c);
+    rv = getClient(uv, message->server_id, message->server_address, channel,
+                   &c);
     if (rv != 0) {
         goto err_after_request_encode;
     }
 
     rv = sendMessage(c, r);
     if (rv != 0) {
-        goto err_after_request_encode;
+        /* Keep the request around for the next message. */
+        releaseRequest(r);
+        goto err;
     }
 
     return 0;
 
 err_after_request_encode:
     closeRequest(r);
-err_after_request_alloc:
-    raft_free(r);
+    freeRequest(r);
 err:
     assert(rv != 0);
     return rv;
 }
 
+bool uvSendBusy(struct raft_io *io, unsigned server_id)
+{
+    struct uv *uv = io->impl;
+    struct uvClient *c;
+    int channel = RAFT_UV_CONTROL;
+
+    if (uv->local != NULL && uvLocalBusy(uv, server_id)) {
+        return true;
+    }
+
+    if (uvRecvCanBulk(uv, server_id)) {
+        channel = RAFT_UV_BULK;
+    }
+    c = findClient(uv, server_id, channel);
+
+    return c != NULL && c->n_bulk > 0;
+}
+
 static void streamCloseCb(struct uv_handle_s *handle)
 {
     struct uvClient *c = handle->data;
@@ -456,12 +1605,7 @@ static void closeClient(struct uvClient *c)
         struct send *r;
         head = QUEUE_HEAD(&c->send_reqs);
         r = QUEUE_DATA(head, struct send, queue);
-        QUEUE_REMOVE(head);
-        if (r->req->cb != NULL) {
-            r->req->cb(r->req, RAFT_CANCELED);
-        }
-        closeRequest(r);
-        raft_free(r);
+        dequeueRequest(r, RAFT_CANCELED);
     }
 
     rv = uv_timer_stop(&c->timer);
@@ -488,15 +1632,55 @@ static void closeClient(struct uvClient *c)
      * destroy ourselves. */
     assert(c->stream != NULL);
     tracef(c, "client stopped -> close outbound stream");
+    if (!QUEUE_IS_EMPTY(&c->pinned) ||
+        (c->writing != NULL && c->writing->pinned)) {
+        abortConnection(c);
+        failPinned(c, RAFT_CANCELED);
+    }
     uv_close((uv_handle_t *)c->stream, streamCloseCb);
 
 out:
     c->state = CLOSING;
 }
 
+void uvSendReconnect(struct uv *uv, unsigned id)
+{
+    unsigned i;
+    int rv;
+
+    for (i = 0; i < uv->n_clients; i++) {
+        struct uvClient *c = uv->clients[i];
+        if (c->id != id) {
+            continue;
+        }
+        /* A failure of an attempt in progress starts over from the shortest
+         * delay. */
+        c->n_connect_attempt = 0;
+        if (c->state == DELAY) {
+            tracef(c, "peer connected to us -> attempt to reconnect");
+            rv = uv_timer_stop(&c->timer);
+            assert(rv == 0);
+            startConnecting(c);
+        }
+    }
+}
+
 void uvSendClose(struct uv *uv)
 {
     unsigned i;
+
+    /* The flush handles hold no resources, so there's no need to wait for them
+     * to be closed: their close callbacks are run before the ones of the other
+     * handles of the backend, which get closed later. */
+    uv_close((struct uv_handle_s *)&uv->send_prepare, NULL);
+    uv_close((struct uv_handle_s *)&uv->send_check, NULL);
+
+    dropEncoded(uv);
+    if (uv->send_spare != NULL) {
+        raft_free(uv->send_spare);
+        uv->send_spare = NULL;
+    }
+
     for (i = 0; i < uv->n_clients; i++) {
         closeClient(uv->clients[i]);
     }
@@ -314,6 +314,9 @@ struct put
         uint64_t header[4];         /* Format, CRC, configuration index/len */
         struct raft_buffer bufs[2]; /* Premable and configuration */
     } meta;
+    unsigned long long recycle_counter; /* First counter for recycling */
+    unsigned n_recycled;                /* Number of recycled segments */
+    int recycled_fds[UV__MAX_RECYCLED_SEGMENTS]; /* Their file descriptors */
     int status;
     queue queue;
 };
@@ -332,7 +335,16 @@ struct get
  * errors.
  *
  * TODO: remove code duplication with io_uv_load.c */
-static int removeOldSegmentsAndSnapshots(struct uv *uv, raft_index last_index)
+/* Remove snapshots and closed segments which are no longer needed.
+ *
+ * The most recent obsolete closed segments, up to UV__MAX_RECYCLED_SEGMENTS,
+ * are not removed but recycled into open segments, using consecutive counters
+ * starting from @counter. The number of recycled segments is stored in
+ * @n_recycled. */
+static int removeOldSegmentsAndSnapshots(struct uv *uv,
+                                         raft_index last_index,
+                                         unsigned long long counter,
+                                         unsigned *n_recycled)
 {
     struct uvSnapshotInfo *snapshots;
     struct uvSegmentInfo *segments;
@@ -341,7 +353,15 @@ static int removeOldSegmentsAndSnapshots(struct uv *uv, raft_index last_index)
     size_t i;
     int rv = 0;
 
-    rv = uvList(uv, &snapshots, &n_snapshots, &segments, &n_segments);
+    *n_recycled = 0;
+    snapshots = NULL;
+    segments = NULL;
+
+    rv = uvCatalogSnapshots(uv, &snapshots, &n_snapshots);
+    if (rv != 0) {
+        goto out;
+    }
+    rv = uvCatalogSegmentsBefore(uv, last_index, &segments, &n_segments);
     if (rv != 0) {
         goto out;
     }
@@ -364,16 +384,21 @@ static int removeOldSegmentsAndSnapshots(struct uv *uv, raft_index last_index)
                 rv = RAFT_IOERR;
                 goto out;
             }
+            uvCatalogRemoveSnapshot(uv, s);
         }
     }
 
-    /* Remove all unused closed segments */
+    /* Remove all unused closed segments, except the most recent ones which
+     * get recycled. */
     for (i = 0; i < n_segments; i++) {
         struct uvSegmentInfo *segment = &segments[i];
-        if (segment->is_open) {
-            continue;
-        }
-        if (segment->end_index < last_index) {
+        if (n_segments - i <= UV__MAX_RECYCLED_SEGMENTS) {
+            rv = uvSegmentRecycle(uv, segment->filename, counter + *n_recycled);
+            if (rv != 0) {
+                goto out;
+            }
+            *n_recycled += 1;
+        } else {
             rv = osUnlink(uv->dir, segment->filename);
             if (rv != 0) {
                 uvErrorf(uv, "unlink %s: %s", segment->filename,
@@ -382,6 +407,7 @@ static int removeOldSegmentsAndSnapshots(struct uv *uv, raft_index last_index)
                 goto out;
             }
         }
+        uvCatalogRemoveSegment(uv, segment->first_index);
     }
 
 out:
@@ -395,10 +421,34 @@ out:
     return rv;
 }
 
+/* Open the segments recycled by a put request, so they can be handed over to
+ * the prepare logic without blocking the loop. If a segment can't be opened,
+ * just remove it. */
+static void openRecycledSegments(struct uv *uv, struct put *r)
+{
+    osFilename filename;
+    osPath path;
+    unsigned i;
+    int rv;
+
+    for (i = 0; i < r->n_recycled; i++) {
+        sprintf(filename, UV__OPEN_TEMPLATE, r->recycle_counter + i);
+        osJoin(uv->dir, filename, path);
+        rv = uvFileOpenFd(path, &r->recycled_fds[i]);
+        if (rv != 0) {
+            uvWarnf(uv, "open recycled segment %s: %s", filename,
+                    uv_strerror(rv));
+            r->recycled_fds[i] = -1;
+            osUnlink(uv->dir, filename); /* Ignore errors */
+        }
+    }
+}
+
 static void putWorkCb(uv_work_t *work)
 {
     struct put *r = work->data;
     struct uv *uv = r->uv;
+    struct uvSnapshotInfo info;
     osFilename filename;
     int rv;
 
@@ -423,7 +473,16 @@ static void putWorkCb(uv_work_t *work)
         return;
     }
 
-    rv = removeOldSegmentsAndSnapshots(uv, r->snapshot->index);
+    info.term = r->snapshot->term;
+    info.index = r->snapshot->index;
+    info.timestamp = r->meta.timestamp;
+    sprintf(info.filename, META_TEMPLATE, info.term, info.index,
+            info.timestamp);
+    uvCatalogAddSnapshot(uv, &info);
+
+    rv = removeOldSegmentsAndSnapshots(uv, r->snapshot->index,
+                                       r->recycle_counter, &r->n_recycled);
+    openRecycledSegments(uv, r);
     if (rv != 0) {
         r->status = rv;
         return;
@@ -445,11 +504,17 @@ static void putAfterWorkCb(uv_work_t *work, int status)
 {
     struct put *r = work->data;
     struct uv *uv = r->uv;
+    unsigned i;
 
     assert(status == 0);
     QUEUE_REMOVE(&r->queue);
     uv->snapshot_put_work.data = NULL;
 
+    /* Hand the recycled segments over to the prepare logic. */
+    for (i = 0; i < r->n_recycled; i++) {
+        uvPrepareRecycle(uv, r->recycle_counter + i, r->recycled_fds[i]);
+    }
+
     r->req->cb(r->req, r->status);
 
     raft_free(r->meta.bufs[1].base);
@@ -490,6 +555,12 @@ static void processPutRequests(struct uv *uv)
         uv->finalize_last_index = r->snapshot->index;
     }
 
+    /* Reserve the counters of the open segments that obsolete closed segments
+     * might be recycled into. */
+    r->recycle_counter = uv->prepare_next_counter;
+    r->n_recycled = 0;
+    uv->prepare_next_counter += UV__MAX_RECYCLED_SEGMENTS;
+
     uv->snapshot_put_work.data = r;
     rv = uv_queue_work(uv->loop, &uv->snapshot_put_work, putWorkCb,
                        putAfterWorkCb);
@@ -585,13 +656,11 @@ static void getWorkCb(uv_work_t *work)
     struct uv *uv = r->uv;
     struct uvSnapshotInfo *snapshots;
     size_t n_snapshots;
-    struct uvSegmentInfo *segments;
-    size_t n_segments;
     int rv;
 
     r->status = 0;
 
-    rv = uvList(uv, &snapshots, &n_snapshots, &segments, &n_segments);
+    rv = uvCatalogSnapshots(uv, &snapshots, &n_snapshots);
     if (rv != 0) {
         r->status = rv;
         goto out;
@@ -603,9 +672,6 @@ static void getWorkCb(uv_work_t *work)
         }
         raft_free(snapshots);
     }
-    if (segments != NULL) {
-        raft_free(segments);
-    }
 out:
     return;
 }
@@ -16,11 +16,37 @@ static int uvTcpInit(struct raft_uv_transport *transport,
     t = transport->impl;
     t->id = id;
     t->address = address;
-    rv = uv_tcp_init(t->loop, &t->listener);
+    if (t->unix_domain) {
+        rv = uv_pipe_init(t->loop, &t->listener.pipe, 0);
+    } else {
+        rv = uv_tcp_init(t->loop, &t->listener.tcp);
+    }
     assert(rv == 0);
+    t->listener.tcp.data = t;
     return 0;
 }
 
+struct uv_stream_s *uvTcpNewStream(struct uvTcp *t)
+{
+    struct uv_stream_s *stream;
+    int rv;
+    if (t->unix_domain) {
+        stream = raft_malloc(sizeof(struct uv_pipe_s));
+        if (stream == NULL) {
+            return NULL;
+        }
+        rv = uv_pipe_init(t->loop, (struct uv_pipe_s *)stream, 0);
+    } else {
+        stream = raft_malloc(sizeof(struct uv_tcp_s));
+        if (stream == NULL) {
+            return NULL;
+        }
+        rv = uv_tcp_init(t->loop, (struct uv_tcp_s *)stream);
+    }
+    assert(rv == 0);
+    return stream;
+}
+
 /* Close callback for uvTcp->listener. */
 static void listenerCloseCb(struct uv_handle_s *handle)
 {
@@ -41,8 +67,9 @@ static void uvTcpClose(struct raft_uv_transport *transport,
     uv_close((struct uv_handle_s *)&t->listener, listenerCloseCb);
 }
 
-int raft_uv_tcp_init(struct raft_uv_transport *transport,
-                     struct uv_loop_s *loop)
+static int transportInit(struct raft_uv_transport *transport,
+                         struct uv_loop_s *loop,
+                         bool unix_domain)
 {
     struct uvTcp *t;
 
@@ -53,9 +80,9 @@ int raft_uv_tcp_init(struct raft_uv_transport *transport,
     }
     t->transport = transport;
     t->loop = loop;
+    t->unix_domain = unix_domain;
     t->id = 0;
     t->address = NULL;
-    t->listener.data = t;
     t->accept_cb = NULL;
     t->close_cb = NULL;
     QUEUE_INIT(&t->accept_conns);
@@ -70,7 +97,24 @@ int raft_uv_tcp_init(struct raft_uv_transport *transport,
     return 0;
 }
 
+int raft_uv_tcp_init(struct raft_uv_transport *transport,
+                     struct uv_loop_s *loop)
+{
+    return transportInit(transport, loop, false);
+}
+
 void raft_uv_tcp_close(struct raft_uv_transport *transport)
 {
     raft_free(transport->impl);
 }
+
+int raft_uv_unix_init(struct raft_uv_transport *transport,
+                      struct uv_loop_s *loop)
+{
+    return transportInit(transport, loop, true);
+}
+
+void raft_uv_unix_close(struct raft_uv_transport *transport)
+{
+    raft_free(transport->impl);
+}
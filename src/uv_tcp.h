@@ -9,19 +9,34 @@
 /* Protocol version. */
 #define UV__TCP_HANDSHAKE_PROTOCOL 1
 
+/* Set in the protocol version of the handshake of RAFT_UV_BULK connections.
+ * Such connections are only established with servers that told us they
+ * support them, so older servers never see it. */
+#define UV__TCP_HANDSHAKE_BULK ((uint64_t)1 << 32)
+
+/* The same implementation is used for TCP and for Unix domain sockets, which
+ * libuv calls pipes: only the handle types and the addresses differ. */
 struct uvTcp
 {
     struct raft_uv_transport *transport; /* Interface object we implement */
     struct uv_loop_s *loop;              /* UV loop */
+    bool unix_domain;                    /* Whether to use Unix sockets */
     unsigned id;                         /* ID of this raft server */
     const char *address;                 /* Address of this raft server */
-    struct uv_tcp_s listener;            /* Listening TCP socket handle */
+    union {
+        struct uv_tcp_s tcp;
+        struct uv_pipe_s pipe;
+    } listener;                          /* Listening socket handle */
     raft_uv_accept_cb accept_cb;         /* After accepting a connection */
     raft_uv_transport_close_cb close_cb; /* When it's safe to free us */
     queue accept_conns;                  /* Connections being accepted */
     queue connect_reqs;                  /* Pending connection requests */
 };
 
+/* Allocate and initialize a new socket handle for a connection. Return #NULL
+ * if there's not enough memory. */
+struct uv_stream_s *uvTcpNewStream(struct uvTcp *t);
+
 /* Implementation of raft_uv_transport->listen. */
 int uvTcpListen(struct raft_uv_transport *t, raft_uv_accept_cb cb);
 
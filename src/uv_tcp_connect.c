@@ -35,7 +35,7 @@ struct connect
     struct uvTcp *t;             /* Transport implementation */
     struct raft_uv_connect *req; /* User request */
     uv_buf_t handshake;          /* Handshake data */
-    struct uv_tcp_s *tcp;        /* TCP connection socket handle */
+    struct uv_stream_s *tcp;     /* Connection socket handle */
     struct uv_connect_s connect; /* TCP connectionr request */
     struct uv_write_s write;     /* TCP handshake request */
     int status;                  /* Returned to the request callback */
@@ -43,8 +43,12 @@ struct connect
 };
 
 /* Encode an handshake message into the given buffer. */
-static int encodeHandshake(unsigned id, const char *address, uv_buf_t *buf)
+static int encodeHandshake(unsigned id,
+                           const char *address,
+                           int channel,
+                           uv_buf_t *buf)
 {
+    uint64_t protocol = UV__TCP_HANDSHAKE_PROTOCOL;
     void *cursor;
     size_t address_len = bytePad64(strlen(address) + 1);
     buf->len = sizeof(uint64_t) + /* Protocol version. */
@@ -55,8 +59,11 @@ static int encodeHandshake(unsigned id, const char *address, uv_buf_t *buf)
     if (buf->base == NULL) {
         return RAFT_NOMEM;
     }
+    if (channel == RAFT_UV_BULK) {
+        protocol |= UV__TCP_HANDSHAKE_BULK;
+    }
     cursor = buf->base;
-    bytePut64(&cursor, UV__TCP_HANDSHAKE_PROTOCOL);
+    bytePut64(&cursor, protocol);
     bytePut64(&cursor, id);
     bytePut64(&cursor, address_len);
     strcpy(cursor, address);
@@ -71,7 +78,7 @@ static void closeCb(struct uv_handle_s *handle)
     /* We must be careful to not reference the r->t field of the connect request
      * object, since that uvTcp object might have been released in the
      * meantime. */
-    assert((struct uv_tcp_s *)handle == r->tcp);
+    assert((struct uv_stream_s *)handle == r->tcp);
     assert(r->status != 0);
     r->req->cb(r->req, NULL, r->status);
     raft_free(handle);
@@ -102,7 +109,7 @@ static void writeCb(struct uv_write_s *write, int status)
         goto err;
     }
 
-    r->req->cb(r->req, (struct uv_stream_s *)r->tcp, 0);
+    r->req->cb(r->req, r->tcp, 0);
     raft_free(r);
 
     return;
@@ -129,13 +136,19 @@ static void connectCb(struct uv_connect_s *connect, int status)
         goto err;
     }
 
+    /* Control messages are small and latency sensitive, so don't let them be
+     * delayed waiting to fill a segment. */
+    if (r->req->channel == RAFT_UV_CONTROL && !r->t->unix_domain) {
+        uv_tcp_nodelay((struct uv_tcp_s *)r->tcp, 1);
+    }
+
     /* Initialize the handshake buffer and write it out. */
-    rv = encodeHandshake(r->t->id, r->t->address, &r->handshake);
+    rv = encodeHandshake(r->t->id, r->t->address, r->req->channel,
+                         &r->handshake);
     if (rv != 0) {
         goto err;
     }
-    rv = uv_write(&r->write, (struct uv_stream_s *)r->tcp, &r->handshake, 1,
-                  writeCb);
+    rv = uv_write(&r->write, r->tcp, &r->handshake, 1, writeCb);
     if (rv != 0) {
         /* UNTESTED: what are the error conditions? perhaps ENOMEM */
         rv = RAFT_IOERR;
@@ -155,30 +168,37 @@ err:
     uv_close((struct uv_handle_s *)r->tcp, closeCb);
 }
 
-/* Create a new TCP handle and submit a connection request to the event loop. */
+/* Create a new socket handle and submit a connection request to the event
+ * loop. */
 static int startConnecting(struct connect *r, const char *address)
 {
     struct sockaddr_in addr;
     int rv;
 
-    r->tcp = raft_malloc(sizeof *r->tcp);
+    r->tcp = uvTcpNewStream(r->t);
     if (r->tcp == NULL) {
         rv = RAFT_NOMEM;
         goto err;
     }
     r->handshake.base = NULL;
-
-    rv = uv_tcp_init(r->t->loop, r->tcp);
-    assert(rv == 0);
     r->tcp->data = r;
 
+    if (r->t->unix_domain) {
+        /* Errors, such as a missing socket file, are reported to the
+         * callback. */
+        uv_pipe_connect(&r->connect, (struct uv_pipe_s *)r->tcp, address,
+                        connectCb);
+        r->connect.data = r;
+        return 0;
+    }
+
     rv = uvIpParse(address, &addr);
     if (rv != 0) {
         goto err_after_tcp_init;
     }
 
-    rv = uv_tcp_connect(&r->connect, r->tcp, (struct sockaddr *)&addr,
-                        connectCb);
+    rv = uv_tcp_connect(&r->connect, (struct uv_tcp_s *)r->tcp,
+                        (struct sockaddr *)&addr, connectCb);
     if (rv != 0) {
         /* UNTESTED: since parsing succeed, this should fail only because of
          * lack of system resources */
@@ -37,7 +37,7 @@ struct handshake
 struct conn
 {
     struct uvTcp *t;            /* Transport implementation */
-    struct uv_tcp_s *tcp;       /* TCP connection socket handle */
+    struct uv_stream_s *tcp;    /* Connection socket handle */
     struct handshake handshake; /* Handshake data */
     queue queue;                /* Pending accept queue */
 };
@@ -60,7 +60,7 @@ static int decodePreamble(struct handshake *h)
 {
     uint64_t protocol;
     protocol = byteFlip64(h->preamble[0]);
-    if (protocol != UV__TCP_HANDSHAKE_PROTOCOL) {
+    if ((protocol & ~UV__TCP_HANDSHAKE_BULK) != UV__TCP_HANDSHAKE_PROTOCOL) {
         return RAFT_MALFORMED;
     }
     h->address.len = byteFlip64(h->preamble[2]);
@@ -148,7 +148,7 @@ static void addressReadCb(uv_stream_t *stream,
     id = byteFlip64(c->handshake.preamble[1]);
     address = c->handshake.address.base;
     QUEUE_REMOVE(&c->queue);
-    c->t->accept_cb(c->t->transport, id, address, (struct uv_stream_s *)c->tcp);
+    c->t->accept_cb(c->t->transport, id, address, c->tcp);
     raft_free(c->handshake.address.base);
     raft_free(c);
 }
@@ -204,16 +204,13 @@ static int readHandshake(struct conn *c)
     int rv;
     memset(&c->handshake, 0, sizeof c->handshake);
 
-    c->tcp = raft_malloc(sizeof *c->tcp);
+    c->tcp = uvTcpNewStream(c->t);
     if (c->tcp == NULL) {
         return RAFT_NOMEM;
     }
     c->tcp->data = c;
-    rv = uv_tcp_init(c->t->loop, c->tcp);
-    assert(rv == 0);
 
-    rv = uv_accept((struct uv_stream_s *)&c->t->listener,
-                   (struct uv_stream_s *)c->tcp);
+    rv = uv_accept((struct uv_stream_s *)&c->t->listener, c->tcp);
     if (rv != 0) {
         rv = RAFT_IOERR;
         goto err_after_tcp_init;
@@ -272,15 +269,27 @@ int uvTcpListen(struct raft_uv_transport *transport, raft_uv_accept_cb cb)
     t = transport->impl;
     t->accept_cb = cb;
 
+    if (t->unix_domain) {
+        /* This fails if the socket file already exists, e.g. because a
+         * previous process didn't exit cleanly. */
+        rv = uv_pipe_bind(&t->listener.pipe, t->address);
+        if (rv != 0) {
+            return RAFT_IOERR;
+        }
+        goto listen;
+    }
+
     rv = uvIpParse(t->address, &addr);
     if (rv != 0) {
         return rv;
     }
-    rv = uv_tcp_bind(&t->listener, (const struct sockaddr *)&addr, 0);
+    rv = uv_tcp_bind(&t->listener.tcp, (const struct sockaddr *)&addr, 0);
     if (rv != 0) {
         /* UNTESTED: what are the error conditions? */
         return RAFT_IOERR;
     }
+
+listen:
     rv = uv_listen((uv_stream_t *)&t->listener, 1, listenCb);
     if (rv != 0) {
         /* UNTESTED: what are the error conditions? */
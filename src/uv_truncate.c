@@ -20,57 +20,52 @@ static void workCb(uv_work_t *work)
 {
     struct truncate *r = work->data;
     struct uv *uv = r->uv;
-    struct uvSnapshotInfo *snapshots;
     struct uvSegmentInfo *segments;
     struct uvSegmentInfo *segment;
-    size_t n_snapshots;
     size_t n_segments;
-    size_t i;
     size_t j;
     int rv;
 
-    /* Load all segments on disk. */
-    rv = uvList(uv, &snapshots, &n_snapshots, &segments, &n_segments);
+    /* Get the closed segments that contain entries from the truncate point
+     * onward. The first one is the segment containing the truncate point, if
+     * any. */
+    rv = uvCatalogSegmentsFrom(uv, r->index, &segments, &n_segments);
     if (rv != 0) {
         goto err;
     }
-    if (snapshots != NULL) {
-        raft_free(snapshots);
-    }
-
-    /* Look for the segment that contains the truncate point. */
-    for (i = 0; i < n_segments; i++) {
-        segment = &segments[i];
-        if (segment->is_open) {
-            continue;
-        }
-        if (r->index >= segment->first_index &&
-            r->index <= segment->end_index) {
-            break;
-        }
-    }
 
     /* If there's no segment at all to truncate, we're done. */
-    if (i == n_segments) {
+    if (n_segments == 0 || segments[0].first_index > r->index) {
         goto out;
     }
 
-    /* If the truncate index is not the first of the segment, we need to
-     * truncate it. */
-    if (r->index > segment->first_index) {
-        rv = uvSegmentTruncate(uv, segment, r->index);
+    /* Remove all segments past the one containing the truncation index,
+     * starting from the last one, so a crash at any point leaves a contiguous
+     * log behind. */
+    for (j = n_segments; j > 1; j--) {
+        segment = &segments[j - 1];
+        rv = osUnlink(uv->dir, segment->filename);
         if (rv != 0) {
+            uvErrorf(uv, "unlink segment %s: %s", segment->filename,
+                     uv_strerror(rv));
+            rv = RAFT_IOERR;
             goto err_after_list;
         }
+        uvCatalogRemoveSegment(uv, segment->first_index);
     }
 
-    for (j = i; j < n_segments; j++) {
-        segment = &segments[j];
-
-        if (segment->is_open) {
-            continue;
+    /* If the truncate index is not the first of the segment, we need to
+     * truncate it, otherwise we remove it too. */
+    segment = &segments[0];
+    if (r->index > segment->first_index) {
+        rv = uvSegmentTruncate(uv, segment, r->index);
+        if (rv != 0) {
+            uvCatalogInvalidate(uv);
+            goto err_after_list;
         }
-
+        uvCatalogRemoveSegment(uv, segment->first_index);
+        uvCatalogAddSegment(uv, segment->first_index, r->index - 1);
+    } else {
         rv = osUnlink(uv->dir, segment->filename);
         if (rv != 0) {
             uvErrorf(uv, "unlink segment %s: %s", segment->filename,
@@ -78,6 +73,7 @@ static void workCb(uv_work_t *work)
             rv = RAFT_IOERR;
             goto err_after_list;
         }
+        uvCatalogRemoveSegment(uv, segment->first_index);
     }
 
     rv = osSyncDir(uv->dir);
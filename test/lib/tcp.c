@@ -115,6 +115,40 @@ void test_tcp_stop(struct test_tcp *t)
     t->server.socket = -1;
 }
 
+void test_tcp_restart(struct test_tcp *t)
+{
+    struct sockaddr_in addr;
+    int port;
+    int yes = 1;
+    int rv;
+
+    rv = sscanf(t->server.address, "127.0.0.1:%d", &port);
+    munit_assert_int(rv, ==, 1);
+
+    memset(&addr, 0, sizeof addr);
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = inet_addr("127.0.0.1");
+    addr.sin_port = htons(port);
+
+    t->server.socket = socket(AF_INET, SOCK_STREAM, 0);
+    if (t->server.socket == -1) {
+        munit_errorf("tcp: socket(): %s", strerror(errno));
+    }
+    rv = setsockopt(t->server.socket, SOL_SOCKET, SO_REUSEADDR, &yes,
+                    sizeof yes);
+    if (rv == -1) {
+        munit_errorf("tcp: setsockopt(): %s", strerror(errno));
+    }
+    rv = bind(t->server.socket, (struct sockaddr *)&addr, sizeof addr);
+    if (rv == -1) {
+        munit_errorf("tcp: bind(): %s", strerror(errno));
+    }
+    rv = listen(t->server.socket, 1);
+    if (rv == -1) {
+        munit_errorf("tcp: listen(): %s", strerror(errno));
+    }
+}
+
 void test_tcp_send(struct test_tcp *t, const void *buf, int len)
 {
     int rv;
@@ -57,5 +57,10 @@ int test_tcp_accept(struct test_tcp *t);
  */
 void test_tcp_stop(struct test_tcp *t);
 
+/**
+ * Re-open the server socket on the same address after test_tcp_stop().
+ */
+void test_tcp_restart(struct test_tcp *t);
+
 
 #endif /* TEST_TCP_H */
@@ -97,7 +97,7 @@
         int rv_;                                                    \
                                                                     \
         uvSegmentBufferInit(&buf_, 4096);                           \
-        rv_ = uvSegmentBufferFormat(&buf_);                         \
+        rv_ = uvSegmentBufferFormat(&buf_, 0);                      \
         munit_assert_int(rv_, ==, 0);                               \
                                                                     \
         entries_ = munit_malloc(N * sizeof *entries_);              \
@@ -55,3 +55,95 @@ TEST_CASE(crc32, invalid, NULL)
 
     return MUNIT_OK;
 }
+
+/* The checksum of the standard check input matches the reference value of the
+ * CRC-32/MPEG-2 algorithm, which uses the same polynomial and bit order. */
+TEST_CASE(crc32, check, NULL)
+{
+    const char *input = "123456789";
+
+    (void)data;
+    (void)params;
+
+    munit_assert_int(byteCrc32(input, 9, 0xffffffff), ==, 0x0376e6e7);
+
+    return MUNIT_OK;
+}
+
+/* Computing the sum in several steps, each one consuming a different number of
+ * bytes, gives the same result as computing it in one go. */
+TEST_CASE(crc32, incremental, NULL)
+{
+    uint8_t buf[256];
+    unsigned crc1;
+    unsigned crc2;
+    size_t i;
+
+    (void)data;
+    (void)params;
+
+    munit_rand_memory(sizeof buf, buf);
+
+    crc1 = byteCrc32(buf, sizeof buf, 0);
+
+    for (i = 0; i < 17; i++) {
+        crc2 = byteCrc32(buf, i, 0);
+        crc2 = byteCrc32(buf + i, sizeof buf - i, crc2);
+        munit_assert_int(crc1, ==, crc2);
+    }
+
+    /* Byte-by-byte */
+    crc2 = 0;
+    for (i = 0; i < sizeof buf; i++) {
+        crc2 = byteCrc32(buf + i, 1, crc2);
+    }
+    munit_assert_int(crc1, ==, crc2);
+
+    return MUNIT_OK;
+}
+
+/**
+ * byteCrc32c
+ */
+
+TEST_SUITE(crc32c);
+
+/* The checksum of the standard check input matches the reference value of the
+ * CRC-32C algorithm, once the initial value and the result are inverted. */
+TEST_CASE(crc32c, check, NULL)
+{
+    const char *input = "123456789";
+
+    (void)data;
+    (void)params;
+
+    munit_assert_int(~byteCrc32c(input, 9, 0xffffffff), ==, 0xe3069283);
+    munit_assert_int(~byteCrc32cPortable(input, 9, 0xffffffff), ==,
+                     0xe3069283);
+
+    return MUNIT_OK;
+}
+
+/* The portable implementation and the accelerated one (if any) agree, whatever
+ * the alignment and the size of the data. */
+TEST_CASE(crc32c, portable, NULL)
+{
+    uint8_t buf[256];
+    size_t offset;
+    size_t size;
+
+    (void)data;
+    (void)params;
+
+    munit_rand_memory(sizeof buf, buf);
+
+    for (offset = 0; offset < 9; offset++) {
+        for (size = 0; size < sizeof buf - offset; size += 7) {
+            unsigned crc1 = byteCrc32c(buf + offset, size, offset);
+            unsigned crc2 = byteCrc32cPortable(buf + offset, size, offset);
+            munit_assert_int(crc1, ==, crc2);
+        }
+    }
+
+    return MUNIT_OK;
+}
@@ -1,4 +1,7 @@
 #include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <unistd.h>
 
 #include "../lib/fs.h"
 #include "../lib/runner.h"
@@ -7,8 +10,6 @@
 
 TEST_MODULE(os);
 
-#if defined(RWF_NOWAIT)
-
 /******************************************************************************
  *
  * Helpers
@@ -41,6 +42,24 @@ static void tear_down(void *data)
  *
  *****************************************************************************/
 
+/* Create a file named "foo" of the given size, with the given byte written at
+ * @OFFSET (if non-zero), and open it setting its offset to @START. */
+#define OPEN_SPARSE(SIZE, OFFSET, BYTE, START)                      \
+    {                                                               \
+        osPath path_;                                               \
+        char byte_ = BYTE;                                          \
+        sprintf(path_, "%s/foo", f->dir);                           \
+        fd = open(path_, O_CREAT | O_RDWR, 0600);                   \
+        munit_assert_int(fd, >=, 0);                                \
+        munit_assert_int(ftruncate(fd, SIZE), ==, 0);               \
+        if (byte_ != 0) {                                           \
+            munit_assert_int(pwrite(fd, &byte_, 1, OFFSET), ==, 1); \
+        }                                                           \
+        munit_assert_int(lseek(fd, START, SEEK_SET), ==, START);    \
+    }
+
+#if defined(RWF_NOWAIT)
+
 /* Invoke @osProbeIO assert that it returns the given code. */
 #define ASSERT_PROBE_IO(RV)                             \
     {                                                   \
@@ -101,3 +120,56 @@ TEST_CASE(probe_io, error, no_resources, dir_fs_btrfs_params)
 #endif
 
 #endif /* RWF_NOWAIT */
+
+/******************************************************************************
+ *
+ * osHasTrailingZeros
+ *
+ *****************************************************************************/
+
+TEST_SUITE(has_trailing_zeros);
+TEST_SETUP(has_trailing_zeros, setup);
+TEST_TEAR_DOWN(has_trailing_zeros, tear_down);
+
+/* A sparse file with no data past the offset has only trailing zeros. */
+TEST_CASE(has_trailing_zeros, hole, NULL)
+{
+    struct fixture *f = data;
+    bool flag;
+    int fd;
+    (void)params;
+    OPEN_SPARSE(8 * 1024 * 1024, 0, 0, 16);
+    munit_assert_int(osHasTrailingZeros(fd, &flag), ==, 0);
+    munit_assert_true(flag);
+    munit_assert_int(lseek(fd, 0, SEEK_CUR), ==, 8 * 1024 * 1024);
+    close(fd);
+    return MUNIT_OK;
+}
+
+/* A non-zero byte at the very end of a large sparse file is detected. */
+TEST_CASE(has_trailing_zeros, data_at_end, NULL)
+{
+    struct fixture *f = data;
+    bool flag;
+    int fd;
+    (void)params;
+    OPEN_SPARSE(8 * 1024 * 1024, 8 * 1024 * 1024 - 1, 1, 16);
+    munit_assert_int(osHasTrailingZeros(fd, &flag), ==, 0);
+    munit_assert_false(flag);
+    close(fd);
+    return MUNIT_OK;
+}
+
+/* Non-zero data before the offset is not taken into account. */
+TEST_CASE(has_trailing_zeros, data_before_offset, NULL)
+{
+    struct fixture *f = data;
+    bool flag;
+    int fd;
+    (void)params;
+    OPEN_SPARSE(4096, 7, 1, 8);
+    munit_assert_int(osHasTrailingZeros(fd, &flag), ==, 0);
+    munit_assert_true(flag);
+    close(fd);
+    return MUNIT_OK;
+}
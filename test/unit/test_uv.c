@@ -261,7 +261,7 @@ TEST_CASE(start, recv, NULL)
     message.server_id = 1;
     message.server_address = "127.0.0.1:9000";
 
-    rv = uvEncodeMessage(&message, &bufs, &n_bufs);
+    rv = uvEncodeMessage(&message, false, NULL, false, &bufs, &n_bufs);
     munit_assert_int(rv, ==, 0);
     munit_assert_int(n_bufs, ==, 1);
 
@@ -137,77 +137,83 @@ static void appendCb(struct raft_io_append *req, int status)
  *
  *****************************************************************************/
 
-/* Assert that the open segment with the given counter has format version 1 and
- * N entries with a total data size of S bytes. */
-#define ASSERT_SEGMENT(COUNTER, N, SIZE)                                     \
-    {                                                                        \
-        struct raft_buffer buf;                                              \
-        const void *cursor;                                                  \
-        char filename[strlen("open-N") + 1];                                 \
-        unsigned i_ = 0;                                                     \
-        size_t total_data_size = 0;                                          \
-                                                                             \
-        sprintf(filename, "open-%d", COUNTER);                               \
-                                                                             \
-        buf.len = MAX_SEGMENT_BLOCKS * f->uv->block_size;                    \
-        buf.base = munit_malloc(buf.len);                                    \
-                                                                             \
-        test_dir_read_file(f->dir, filename, buf.base, buf.len);             \
-                                                                             \
-        cursor = buf.base;                                                   \
-        munit_assert_int(byteGet64(&cursor), ==, 1);                       \
-                                                                             \
-        while (i_ < N) {                                                     \
-            unsigned crc1 = byteGet32(&cursor);                            \
-            unsigned crc2 = byteGet32(&cursor);                            \
-            const void *header = cursor;                                     \
-            const void *content;                                             \
-            unsigned n_ = byteGet64(&cursor);                              \
-            struct raft_entry *entries = munit_malloc(n_ * sizeof *entries); \
-            unsigned j_;                                                     \
-            unsigned crc;                                                    \
-            size_t data_size = 0;                                            \
-                                                                             \
-            for (j_ = 0; j_ < n_; j_++) {                                    \
-                struct raft_entry *entry = &entries[j_];                     \
-                                                                             \
-                entry->term = byteGet64(&cursor);                          \
-                entry->type = byteGet8(&cursor);                           \
-                byteGet8(&cursor);                                         \
-                byteGet8(&cursor);                                         \
-                byteGet8(&cursor);                                         \
-                entry->buf.len = byteGet32(&cursor);                       \
-                                                                             \
-                munit_assert_int(entry->term, ==, 1);                        \
-                munit_assert_int(entry->type, ==, RAFT_COMMAND);             \
-                                                                             \
-                data_size += entry->buf.len;                                 \
-            }                                                                \
-                                                                             \
-            crc = byteCrc32(header, uvSizeofBatchHeader(n_), 0);           \
-            munit_assert_int(crc, ==, crc1);                                 \
-                                                                             \
-            content = cursor;                                                \
-                                                                             \
-            for (j_ = 0; j_ < n_; j_++) {                                    \
-                struct raft_entry *entry = &entries[j_];                     \
-                uint64_t value;                                              \
-                value = byteFlip64(*(uint64_t *)cursor);                   \
-                munit_assert_int(value, ==, i_);                             \
-                cursor += entry->buf.len;                                    \
-                i_++;                                                        \
-            }                                                                \
-                                                                             \
-            crc = byteCrc32(content, data_size, 0);                        \
-            munit_assert_int(crc, ==, crc2);                                 \
-                                                                             \
-            free(entries);                                                   \
-                                                                             \
-            total_data_size += data_size;                                    \
-        }                                                                    \
-                                                                             \
-        munit_assert_int(total_data_size, ==, SIZE);                         \
-        free(buf.base);                                                      \
+/* Return the size on disk of a batch with a single entry of the given size. */
+static size_t batchSize(size_t size)
+{
+    struct raft_entry entry;
+    entry.term = 1;
+    entry.type = RAFT_COMMAND;
+    entry.buf.base = NULL;
+    entry.buf.len = size;
+    return uvSegmentSizeofBatch(UV__SEGMENT_FORMAT, &entry, 1);
+}
+
+/* Assert that the open segment with the given counter has the current format
+ * version and N entries with a total data size of S bytes. */
+#define ASSERT_SEGMENT(COUNTER, N, SIZE)                                       \
+    {                                                                          \
+        struct raft_buffer buf;                                                \
+        const void *cursor;                                                    \
+        char filename[strlen("open-N") + 1];                                   \
+        unsigned i_ = 0;                                                       \
+        unsigned seed;                                                         \
+        size_t total_data_size = 0;                                            \
+                                                                               \
+        sprintf(filename, "open-%d", COUNTER);                                 \
+                                                                               \
+        buf.len = MAX_SEGMENT_BLOCKS * f->uv->block_size;                      \
+        buf.base = munit_malloc(buf.len);                                      \
+                                                                               \
+        test_dir_read_file(f->dir, filename, buf.base, buf.len);               \
+                                                                               \
+        cursor = buf.base;                                                     \
+        munit_assert_int(byteGet64(&cursor), ==, UV__SEGMENT_FORMAT);          \
+        seed = uvSegmentChecksumSeed(byteGet64(&cursor));                      \
+                                                                               \
+        while (i_ < N) {                                                       \
+            unsigned crc1 = byteGet32(&cursor);                                \
+            unsigned crc2 = byteGet32(&cursor);                                \
+            const void *sizes = cursor;                                        \
+            size_t header_size = byteGet32(&cursor);                           \
+            size_t data_size = byteGet32(&cursor);                             \
+            const void *content;                                               \
+            struct raft_entry *entries;                                        \
+            unsigned n_;                                                       \
+            unsigned j_;                                                       \
+            unsigned crc;                                                      \
+            int rv_;                                                           \
+                                                                               \
+            crc = byteCrc32c(sizes, 2 * sizeof(uint32_t) + header_size, seed); \
+            munit_assert_int(crc, ==, crc1);                                   \
+                                                                               \
+            rv_ = uvDecodeBatchHeaderCompact(cursor, header_size, &entries,    \
+                                             &n_);                             \
+            munit_assert_int(rv_, ==, 0);                                      \
+            cursor += header_size;                                             \
+                                                                               \
+            content = cursor;                                                  \
+                                                                               \
+            for (j_ = 0; j_ < n_; j_++) {                                      \
+                struct raft_entry *entry = &entries[j_];                       \
+                uint64_t value;                                                \
+                munit_assert_int(entry->term, ==, 1);                          \
+                munit_assert_int(entry->type, ==, RAFT_COMMAND);               \
+                value = byteFlip64(*(uint64_t *)cursor);                       \
+                munit_assert_int(value, ==, i_);                               \
+                cursor += entry->buf.len;                                      \
+                i_++;                                                          \
+            }                                                                  \
+                                                                               \
+            crc = byteCrc32c(content, data_size, seed);                        \
+            munit_assert_int(crc, ==, crc2);                                   \
+                                                                               \
+            raft_free(entries);                                                \
+                                                                               \
+            total_data_size += data_size;                                      \
+        }                                                                      \
+                                                                               \
+        munit_assert_int(total_data_size, ==, SIZE);                           \
+        free(buf.base);                                                        \
     }
 
 /******************************************************************************
@@ -252,6 +258,34 @@ TEST_CASE(success, fit_block, NULL)
     return MUNIT_OK;
 }
 
+/* Entries whose size is not a multiple of 8 bytes are stored without
+ * padding. */
+TEST_CASE(success, unaligned, NULL)
+{
+    struct fixture *f = data;
+    (void)params;
+    CREATE_ENTRIES(2, 13);
+    APPEND(0);
+    WAIT_CB(1, 0);
+    ASSERT_SEGMENT(1, 2, 26);
+    return MUNIT_OK;
+}
+
+/* If a codec is set, compressible batches are written compressed. */
+TEST_CASE(success, compressed, NULL)
+{
+    struct fixture *f = data;
+    struct raft_uv_append_stats stats;
+    (void)params;
+    f->uv->codec = raft_uv_codec_lz();
+    CREATE_ENTRIES(1, 4096);
+    APPEND(0);
+    WAIT_CB(1, 0);
+    raft_uv_get_append_stats(&f->io, &stats);
+    munit_assert_int(stats.n_bytes, <, 4096 / 8);
+    return MUNIT_OK;
+}
+
 /* Write an entry that fills the first block exactly and then another one. */
 TEST_CASE(success, match_block, NULL)
 {
@@ -260,9 +294,9 @@ TEST_CASE(success, match_block, NULL)
     (void)params;
 
     size = f->uv->block_size;
-    size -= sizeof(uint64_t) +      /* Format */
-            sizeof(uint64_t) +      /* Checksums */
-            uvSizeofBatchHeader(1); /* Header */
+    size -= sizeof(uint64_t) + /* Format */
+            sizeof(uint64_t);  /* Epoch */
+    size -= batchSize(size) - size; /* Checksums, sizes and header */
 
     CREATE_ENTRIES(1, size);
     APPEND(0);
@@ -299,18 +333,15 @@ TEST_CASE(success, exceed_block, NULL)
     APPEND(0);
     WAIT_CB(1, 0);
 
-    written = sizeof(uint64_t) +       /* Format version */
-              2 * sizeof(uint32_t) +   /* CRC sums of first batch */
-              uvSizeofBatchHeader(1) + /* Header of first batch */
-              size1 +                  /* Size of first batch */
-              2 * sizeof(uint32_t) +   /* CRC of second batch */
-              uvSizeofBatchHeader(1) + /* Header of second batch */
-              64;                      /* Size of second batch */
+    written = sizeof(uint64_t) + /* Format version */
+              sizeof(uint64_t) + /* Epoch */
+              batchSize(size1) + /* First batch */
+              batchSize(64);     /* Second batch */
 
     /* Write a third entry that fills the second block exactly */
     size2 = f->uv->block_size - (written % f->uv->block_size);
-    size2 -= (2 * sizeof(uint32_t) + uvSizeofBatchHeader(1));
     size2 += f->uv->block_size;
+    size2 -= batchSize(size2) - size2;
 
     CREATE_ENTRIES(1, size2);
     APPEND(0);
@@ -367,6 +398,98 @@ TEST_CASE(success, wait, NULL)
     return MUNIT_OK;
 }
 
+/* If group commit is enabled, append requests submitted while no write is in
+ * flight are held until the linger window expires, and then written together
+ * with a single write. */
+TEST_CASE(success, linger, NULL)
+{
+    struct fixture *f = data;
+    struct raft_uv_append_stats stats;
+    (void)params;
+
+    raft_uv_set_append_linger(&f->io, 20, 0);
+
+    CREATE_ENTRIES(1, 64);
+    APPEND(0);
+
+    uv_run(&f->loop, UV_RUN_NOWAIT);
+    munit_assert_int(f->invoked, ==, 0);
+
+    CREATE_ENTRIES(2, 64);
+    APPEND(0);
+
+    WAIT_CB(2, 0);
+
+    raft_uv_get_append_stats(&f->io, &stats);
+    munit_assert_int(stats.n_writes, ==, 1);
+    munit_assert_int(stats.n_reqs, ==, 2);
+    munit_assert_int(stats.n_entries, ==, 3);
+    munit_assert_int(stats.max_reqs, ==, 2);
+
+    ASSERT_SEGMENT(1, 3, 64 * 3);
+
+    return MUNIT_OK;
+}
+
+/* If the pending requests reach the group commit size threshold, the linger
+ * window is closed early. */
+TEST_CASE(success, linger_bytes, NULL)
+{
+    struct fixture *f = data;
+    struct raft_uv_append_stats stats;
+    size_t size;
+    (void)params;
+
+    size = batchSize(64);
+    raft_uv_set_append_linger(&f->io, 60 * 1000, size * 2);
+
+    CREATE_ENTRIES(1, 64);
+    APPEND(0);
+
+    uv_run(&f->loop, UV_RUN_NOWAIT);
+    munit_assert_int(f->invoked, ==, 0);
+
+    CREATE_ENTRIES(1, 64);
+    APPEND(0);
+
+    WAIT_CB(2, 0);
+
+    raft_uv_get_append_stats(&f->io, &stats);
+    munit_assert_int(stats.n_writes, ==, 1);
+    munit_assert_int(stats.n_reqs, ==, 2);
+    munit_assert_int(stats.n_bytes, ==, size * 2);
+
+    return MUNIT_OK;
+}
+
+/* Small batches are written in buffered mode, so only the new data hits the
+ * disk, instead of whole blocks. */
+TEST_CASE(success, buffered, NULL)
+{
+    struct fixture *f = data;
+    struct raft_uv_append_stats stats;
+    (void)params;
+
+    CREATE_ENTRIES(1, 64);
+    APPEND(0);
+    WAIT_CB(1, 0);
+
+    CREATE_ENTRIES(1, 64);
+    APPEND(0);
+    WAIT_CB(1, 0);
+
+    raft_uv_get_append_stats(&f->io, &stats);
+    munit_assert_int(stats.n_writes, ==, 2);
+    munit_assert_int(stats.n_buffered_writes, ==, 2);
+    munit_assert_int(stats.n_bytes, ==, batchSize(64) * 2);
+    munit_assert_int(stats.n_disk_bytes, ==,
+                     sizeof(uint64_t) * 2 + stats.n_bytes);
+
+    ASSERT_SEGMENT(1, 2, 128);
+
+    return MUNIT_OK;
+}
+
 /* Several batches with different size gets appended in fast pace, which forces
  * the segment arena to grow. */
 TEST_CASE(success, resize_arena, NULL)
@@ -470,29 +593,41 @@ TEST_CASE(success, counter, NULL)
     return MUNIT_OK;
 }
 
-/******************************************************************************
- *
- * Failure scenarios.
- *
- *****************************************************************************/
-
-TEST_SUITE(error);
-TEST_SETUP(error, setup);
-TEST_TEAR_DOWN(error, tear_down);
-
-/* The batch of entries to append is too big. */
-TEST_CASE(error, too_big, NULL)
+/* A batch of entries larger than a segment gets written to a segment grown to
+ * hold it, and the following batches can use the leftover space of its last
+ * block. */
+TEST_CASE(success, too_big, NULL)
 {
     struct fixture *f = data;
     struct uv *uv = f->io.impl;
     (void)params;
 
     CREATE_ENTRIES(MAX_SEGMENT_BLOCKS, uv->block_size);
-    APPEND(RAFT_TOOBIG);
+    APPEND(0);
+    WAIT_CB(1, 0);
+
+    CREATE_ENTRIES(1, 64);
+    APPEND(0);
+    WAIT_CB(1, 0);
+
+    UV_CLOSE;
+    LOOP_RUN(2);
+
+    munit_assert_true(test_dir_has_file(f->dir, "1-5"));
 
     return MUNIT_OK;
 }
 
+/******************************************************************************
+ *
+ * Failure scenarios.
+ *
+ *****************************************************************************/
+
+TEST_SUITE(error);
+TEST_SETUP(error, setup);
+TEST_TEAR_DOWN(error, tear_down);
+
 /* If the I/O instance is closed, all pending append requests get canceled. */
 TEST_CASE(error, cancel, NULL)
 {
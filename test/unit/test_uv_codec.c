@@ -0,0 +1,123 @@
+#include <string.h>
+
+#include "../../src/uv_codec.h"
+
+#include "../lib/runner.h"
+
+TEST_MODULE(uv_codec);
+
+/* Compress the SIZE bytes of BUF with the built-in codec, decompress them and
+ * check that the result matches. The compressed size is stored in COMPRESSED,
+ * or set to 0 if the data could not be compressed in SIZE - 1 bytes. */
+#define ROUND_TRIP(BUF, SIZE, COMPRESSED)                                    \
+    {                                                                        \
+        const struct raft_uv_codec *codec_ = raft_uv_codec_lz();             \
+        uint8_t dst_[SIZE];                                                  \
+        uint8_t out_[SIZE];                                                  \
+        size_t n_ = SIZE - 1;                                                \
+        if (codec_->compress(BUF, SIZE, dst_, &n_) != 0) {                   \
+            n_ = 0;                                                          \
+        } else {                                                             \
+            munit_assert_int(n_, <, SIZE);                                   \
+            munit_assert_int(codec_->decompress(dst_, n_, out_, SIZE), ==, 0); \
+            munit_assert_int(memcmp(BUF, out_, SIZE), ==, 0);                \
+        }                                                                    \
+        COMPRESSED = n_;                                                     \
+    }
+
+/**
+ * Built-in LZ codec
+ */
+
+TEST_SUITE(lz);
+
+/* Repetitive data, including runs longer than what fits in a token, gets
+ * compressed and decompressed back. */
+TEST_CASE(lz, repetitive, NULL)
+{
+    uint8_t buf[4096];
+    size_t compressed;
+    unsigned i;
+
+    (void)data;
+    (void)params;
+
+    for (i = 0; i < sizeof buf; i++) {
+        buf[i] = i < 1000 ? 'a' : (uint8_t)(i % 7);
+    }
+
+    ROUND_TRIP(buf, sizeof buf, compressed);
+    munit_assert_int(compressed, >, 0);
+    munit_assert_int(compressed, <, sizeof buf / 10);
+
+    return MUNIT_OK;
+}
+
+/* Data with long stretches of literals between matches. */
+TEST_CASE(lz, literals, NULL)
+{
+    uint8_t buf[2048];
+    size_t compressed;
+    unsigned seed = 1;
+    unsigned i;
+
+    (void)data;
+    (void)params;
+
+    for (i = 0; i < sizeof buf; i++) {
+        seed = seed * 1103515245 + 12345;
+        buf[i] = (uint8_t)(seed >> 16);
+    }
+    memcpy(buf + 1024, buf, 512);
+
+    ROUND_TRIP(buf, sizeof buf, compressed);
+    munit_assert_int(compressed, >, 0);
+
+    return MUNIT_OK;
+}
+
+/* Random data can't be compressed into a smaller buffer. */
+TEST_CASE(lz, incompressible, NULL)
+{
+    uint8_t buf[1024];
+    size_t compressed;
+    unsigned seed = 1;
+    unsigned i;
+
+    (void)data;
+    (void)params;
+
+    for (i = 0; i < sizeof buf; i++) {
+        seed = seed * 1103515245 + 12345;
+        buf[i] = (uint8_t)(seed >> 16);
+    }
+
+    ROUND_TRIP(buf, sizeof buf, compressed);
+    munit_assert_int(compressed, ==, 0);
+
+    return MUNIT_OK;
+}
+
+/* Decompressing garbage or into a buffer of the wrong size fails. */
+TEST_CASE(lz, invalid, NULL)
+{
+    const struct raft_uv_codec *codec = raft_uv_codec_lz();
+    uint8_t buf[256];
+    uint8_t dst[256];
+    uint8_t out[256];
+    uint8_t garbage[] = {0x0f, 0x01, 0x00};
+    size_t n = sizeof dst;
+
+    (void)data;
+    (void)params;
+
+    memset(buf, 'x', sizeof buf);
+    munit_assert_int(codec->compress(buf, sizeof buf, dst, &n), ==, 0);
+
+    munit_assert_int(codec->decompress(dst, n, out, sizeof out - 1), !=, 0);
+    munit_assert_int(codec->decompress(dst, n - 1, out, sizeof out), !=, 0);
+    munit_assert_int(codec->decompress(garbage, sizeof garbage, out, 16), !=,
+                     0);
+
+    return MUNIT_OK;
+}
@@ -394,6 +394,32 @@ TEST_CASE(write, success, twice, dir_fs_supported_params)
     return MUNIT_OK;
 }
 
+/* Switch to buffered mode to write data not aligned to the block size, then
+ * back to direct mode to overwrite it. */
+TEST_CASE(write, success, buffered, dir_fs_supported_params)
+{
+    struct write_fixture *f = data;
+
+    (void)params;
+
+    write__complete;
+
+    munit_assert_int(uvFileSetBuffered(&f->file, true), ==, 0);
+    f->offset = f->block_size;
+    f->bufs[0].len = 10;
+    write__invoke(0);
+    write__wait_cb(1, 10);
+
+    munit_assert_int(uvFileSetBuffered(&f->file, false), ==, 0);
+    f->bufs[0].len = f->block_size;
+    memset(f->bufs[0].base, 2, f->bufs[0].len);
+    write__complete;
+
+    write__assert_content(2);
+
+    return MUNIT_OK;
+}
+
 /* Write a vector of buffers. */
 TEST_CASE(write, success, vec, dir_fs_supported_params)
 {
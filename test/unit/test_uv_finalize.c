@@ -1,6 +1,7 @@
 #include "../lib/runner.h"
 #include "../lib/uv.h"
 
+#include "../../src/byte.h"
 #include "../../src/uv.h"
 
 TEST_MODULE(uv_finalize);
@@ -18,6 +19,7 @@ struct fixture
     size_t used;
     raft_index first_index;
     raft_index last_index;
+    struct uvSegmentIndex index;
 };
 
 static void *setup(const MunitParameter params[], void *user_data)
@@ -28,12 +30,14 @@ static void *setup(const MunitParameter params[], void *user_data)
     f->used = 256;
     f->first_index = 1;
     f->last_index = 2;
+    uvSegmentIndexInit(&f->index);
     return f;
 }
 
 static void tear_down(void *data)
 {
     struct fixture *f = data;
+    uvSegmentIndexClose(&f->index);
     TEAR_DOWN_UV;
 }
 
@@ -51,7 +55,7 @@ static void tear_down(void *data)
     {                                                               \
         int rv;                                                     \
         rv = uvFinalize(f->uv, f->counter, f->used, f->first_index, \
-                        f->last_index);                             \
+                        f->last_index, &f->index);                  \
         munit_assert_int(rv, ==, RV);                               \
     }
 
@@ -83,6 +87,35 @@ TEST_CASE(success, first, NULL)
     return MUNIT_OK;
 }
 
+/* The index of the batches in the segment is appended to it. */
+TEST_CASE(success, index, NULL)
+{
+    struct fixture *f = data;
+    struct uvSegmentIndex index;
+    uint8_t buf[64 + 16 + 16];
+    size_t size;
+    (void)params;
+
+    test_dir_write_file_with_zeros(f->dir, "open-1", 256);
+    f->used = 64;
+    munit_assert_int(uvSegmentIndexAppend(&f->index, 16, 1), ==, 0);
+
+    FINALIZE(0);
+
+    LOOP_RUN(1);
+
+    test_dir_read_file(f->dir, "1-2", buf, sizeof buf);
+    munit_assert_int(uvSegmentIndexDecode(buf, sizeof buf, &size, &index), ==,
+                     0);
+    munit_assert_int(size, ==, 64);
+    munit_assert_int(index.n, ==, 1);
+    munit_assert_int(byteFlip64(index.slots[0]), ==, 16);
+    munit_assert_int(byteFlip64(index.slots[1]), ==, 1);
+    uvSegmentIndexClose(&index);
+
+    return MUNIT_OK;
+}
+
 /* Submet a request to finalize an open segment that was never written. */
 TEST_CASE(success, unused, NULL)
 {
@@ -78,6 +78,56 @@ static void tear_down(void *data)
         munit_assert_int(rv, ==, RV);                            \
     }
 
+/* Write a segment with two batches using the current format, with compression
+ * enabled: the first with a highly compressible entry and the second with an
+ * entry too small to be compressed. */
+#define WRITE_COMPRESSED_SEGMENT(FILENAME)                          \
+    {                                                               \
+        struct uvSegmentBuffer buf_;                                \
+        struct raft_entry entry_;                                   \
+        char data_[1024];                                           \
+        unsigned i_;                                                \
+        uvSegmentBufferInit(&buf_, 4096);                           \
+        buf_.codec = raft_uv_codec_lz();                            \
+        munit_assert_int(uvSegmentBufferFormat(&buf_, 1), ==, 0);   \
+        for (i_ = 0; i_ < sizeof data_; i_++) {                     \
+            data_[i_] = (char)(i_ % 16);                            \
+        }                                                           \
+        entry_.term = 1;                                            \
+        entry_.type = RAFT_COMMAND;                                 \
+        entry_.buf.base = data_;                                    \
+        entry_.buf.len = sizeof data_;                              \
+        munit_assert_int(uvSegmentBufferAppend(&buf_, &entry_, 1), \
+                         ==, 0);                                    \
+        munit_assert_int(buf_.n, <, sizeof data_);                  \
+        entry_.buf.len = 8;                                         \
+        munit_assert_int(uvSegmentBufferAppend(&buf_, &entry_, 1), \
+                         ==, 0);                                    \
+        test_dir_write_file(f->dir, FILENAME, buf_.arena.base,      \
+                            buf_.n);                                \
+        uvSegmentBufferClose(&buf_);                                \
+    }
+
+/* Assert that the entries in the segment written by WRITE_COMPRESSED_SEGMENT
+ * were loaded. */
+#define ASSERT_COMPRESSED_ENTRIES                                        \
+    {                                                                    \
+        unsigned i_;                                                     \
+        munit_assert_int(f->n, ==, 2);                                   \
+        munit_assert_int(f->entries[0].buf.len, ==, 1024);               \
+        munit_assert_int(f->entries[1].buf.len, ==, 8);                  \
+        for (i_ = 0; i_ < 1024; i_++) {                                  \
+            munit_assert_int(((char *)f->entries[0].buf.base)[i_], ==,   \
+                             (char)(i_ % 16));                           \
+        }                                                                \
+        for (i_ = 0; i_ < 8; i_++) {                                     \
+            munit_assert_int(((char *)f->entries[1].buf.base)[i_], ==,   \
+                             (char)i_);                                  \
+        }                                                                \
+        munit_assert_ptr_not_equal(f->entries[0].batch,                  \
+                                   f->entries[1].batch);                 \
+    }
+
 /******************************************************************************
  *
  * Success scenarios.
@@ -114,25 +164,54 @@ TEST_CASE(success, ignore_unknown, NULL)
     return MUNIT_OK;
 }
 
-/* The data directory has a closed segment with entries that are no longer
- * needed, since they are included in a snapshot. */
+/* The data directory has closed segments with entries that are all included in
+ * the last snapshot. They are not loaded, but are left on disk. */
 TEST_CASE(success, closed_not_needed, NULL)
 {
-    /* TODO: We should support a trailing amount */
-    return MUNIT_SKIP;
     struct fixture *f = data;
     uint8_t buf[8];
 
     (void)params;
 
-    test_io_uv_write_snapshot_meta_file(f->dir, 1, 2, 123, 1, 1);
-    test_io_uv_write_snapshot_data_file(f->dir, 1, 2, 123, buf, sizeof buf);
-    UV_WRITE_CLOSED_SEGMENT(1, 1, 1);
+    test_io_uv_write_snapshot_meta_file(f->dir, 1, 4, 123, 1, 1);
+    test_io_uv_write_snapshot_data_file(f->dir, 1, 4, 123, buf, sizeof buf);
+    UV_WRITE_CLOSED_SEGMENT(1, 2, 1);
+    UV_WRITE_CLOSED_SEGMENT(3, 2, 3);
+    UV_WRITE_CLOSED_SEGMENT(5, 2, 5);
 
     LOAD(0);
 
-    /* The segment has been removed. */
-    munit_assert_false(test_dir_has_file(f->dir, "1-1"));
+    munit_assert_int(f->start_index, ==, 5);
+    munit_assert_int(f->n, ==, 2);
+
+    munit_assert_true(test_dir_has_file(f->dir, "1-2"));
+    munit_assert_true(test_dir_has_file(f->dir, "3-4"));
+
+    return MUNIT_OK;
+}
+
+/* The last closed segment is loaded even if its entries are all included in
+ * the last snapshot, since the entries of the open segment that follows it
+ * must be indexed from its end. */
+TEST_CASE(success, closed_not_needed_open, NULL)
+{
+    struct fixture *f = data;
+    uint8_t buf[8];
+
+    (void)params;
+
+    test_io_uv_write_snapshot_meta_file(f->dir, 1, 4, 123, 1, 1);
+    test_io_uv_write_snapshot_data_file(f->dir, 1, 4, 123, buf, sizeof buf);
+    UV_WRITE_CLOSED_SEGMENT(1, 2, 1);
+    UV_WRITE_CLOSED_SEGMENT(3, 2, 3);
+    UV_WRITE_OPEN_SEGMENT(1, 2, 5);
+
+    LOAD(0);
+
+    munit_assert_int(f->start_index, ==, 3);
+    munit_assert_int(f->n, ==, 4);
+
+    munit_assert_true(test_dir_has_file(f->dir, "1-2"));
 
     return MUNIT_OK;
 }
@@ -155,6 +234,125 @@ TEST_CASE(success, closed, NULL)
     return MUNIT_OK;
 }
 
+/* The data directory has many closed segments, which get loaded in parallel
+ * and stitched together in index order. */
+TEST_CASE(success, closed_many, NULL)
+{
+    struct fixture *f = data;
+    unsigned i;
+
+    (void)params;
+
+    for (i = 0; i < 16; i++) {
+        UV_WRITE_CLOSED_SEGMENT(i * 3 + 1, 3, i * 3);
+    }
+
+    LOAD(0);
+
+    munit_assert_int(f->n, ==, 48);
+    for (i = 0; i < 48; i++) {
+        const void *cursor = f->entries[i].buf.base;
+        munit_assert_int(byteGet64(&cursor), ==, i);
+    }
+
+    return MUNIT_OK;
+}
+
+/* The entries of a closed segment containing several batches all point into a
+ * single buffer, holding the content of the whole segment. */
+TEST_CASE(success, closed_shared_batch, NULL)
+{
+    struct fixture *f = data;
+    struct uvSegmentBuffer buf;
+    struct raft_entry entry;
+    uint64_t value;
+    unsigned i;
+    int rv_;
+
+    (void)params;
+
+    uvSegmentBufferInit(&buf, 4096);
+    rv_ = uvSegmentBufferFormat(&buf, 0);
+    munit_assert_int(rv_, ==, 0);
+    entry.term = 1;
+    entry.type = RAFT_COMMAND;
+    entry.buf.base = &value;
+    entry.buf.len = sizeof value;
+    for (i = 0; i < 3; i++) {
+        void *cursor = &value;
+        bytePut64(&cursor, i);
+        rv_ = uvSegmentBufferAppend(&buf, &entry, 1);
+        munit_assert_int(rv_, ==, 0);
+    }
+    test_dir_write_file(f->dir, "1-3", buf.arena.base, buf.n);
+    uvSegmentBufferClose(&buf);
+
+    LOAD(0);
+
+    munit_assert_int(f->n, ==, 3);
+    for (i = 0; i < 3; i++) {
+        const void *cursor = f->entries[i].buf.base;
+        munit_assert_ptr_equal(f->entries[i].batch, f->entries[0].batch);
+        munit_assert_int(byteGet64(&cursor), ==, i);
+    }
+
+    return MUNIT_OK;
+}
+
+/* The data directory has a closed segment with a compressed batch, which gets
+ * its own batch memory once decompressed. */
+TEST_CASE(success, closed_compressed, NULL)
+{
+    struct fixture *f = data;
+
+    (void)params;
+
+    WRITE_COMPRESSED_SEGMENT("1-2");
+
+    LOAD(0);
+
+    ASSERT_COMPRESSED_ENTRIES;
+
+    return MUNIT_OK;
+}
+
+/* The data directory has a closed segment with data past its end index, left
+ * behind by a crash occurred while truncating it. */
+TEST_CASE(success, closed_past_end_index, NULL)
+{
+    struct fixture *f = data;
+    struct uvSegmentBuffer buf;
+    struct raft_entry entry;
+    uint64_t value;
+    unsigned i;
+
+    (void)params;
+
+    uvSegmentBufferInit(&buf, 4096);
+    munit_assert_int(uvSegmentBufferFormat(&buf, 0), ==, 0);
+    entry.term = 1;
+    entry.type = RAFT_COMMAND;
+    entry.buf.base = &value;
+    entry.buf.len = sizeof value;
+    for (i = 0; i < 3; i++) {
+        void *cursor = &value;
+        bytePut64(&cursor, i);
+        munit_assert_int(uvSegmentBufferAppend(&buf, &entry, 1), ==, 0);
+    }
+    test_dir_write_file(f->dir, "1-1", buf.arena.base, buf.n);
+    uvSegmentBufferClose(&buf);
+    UV_WRITE_CLOSED_SEGMENT(2, 2, 10);
+
+    LOAD(0);
+
+    munit_assert_int(f->n, ==, 3);
+    munit_assert_int(byteFlip64(*(uint64_t *)f->entries[0].buf.base), ==, 0);
+    munit_assert_int(byteFlip64(*(uint64_t *)f->entries[1].buf.base), ==, 10);
+    munit_assert_int(byteFlip64(*(uint64_t *)f->entries[2].buf.base), ==, 11);
+
+    return MUNIT_OK;
+}
+
 /* The data directory has an empty open segment. */
 TEST_CASE(success, open_empty, NULL)
 {
@@ -189,6 +387,55 @@ TEST_CASE(success, open_all_zeros, NULL)
     return MUNIT_OK;
 }
 
+/* The data directory has an open segment which was recycled from an obsolete
+ * closed segment but never written, so it still contains stale entries. */
+TEST_CASE(success, open_recycled, NULL)
+{
+    struct fixture *f = data;
+    uint8_t buf[WORD_SIZE + /* Format version */
+                WORD_SIZE /* Epoch */];
+    void *cursor = buf;
+    (void)params;
+
+    bytePut64(&cursor, 2); /* Format version */
+    bytePut64(&cursor, 0); /* Epoch */
+
+    UV_WRITE_OPEN_SEGMENT(1, 1, 1);
+
+    test_dir_overwrite_file(f->dir, "open-1", buf, sizeof buf, 0);
+
+    LOAD(0);
+
+    /* The stale entries were not loaded and the segment has been removed. */
+    munit_assert_int(f->n, ==, 0);
+    munit_assert_false(test_dir_has_file(f->dir, "open-1"));
+
+    return MUNIT_OK;
+}
+
+/* The data directory has a closed segment which was being recycled when we
+ * crashed, it gets removed. */
+TEST_CASE(success, recycling, NULL)
+{
+    struct fixture *f = data;
+    uint8_t buf[WORD_SIZE + /* Format version */
+                WORD_SIZE /* Epoch */];
+    void *cursor = buf;
+    (void)params;
+
+    bytePut64(&cursor, 2); /* Format version */
+    bytePut64(&cursor, 0); /* Epoch */
+
+    test_dir_write_file(f->dir, "recycle-1", buf, sizeof buf);
+
+    LOAD(0);
+
+    munit_assert_int(f->n, ==, 0);
+    munit_assert_false(test_dir_has_file(f->dir, "recycle-1"));
+
+    return MUNIT_OK;
+}
+
 /* The data directory has an allocated open segment which contains non-zero
  * corrupted data in its second batch. */
 TEST_CASE(success, open_not_all_zeros, NULL)
@@ -342,6 +589,22 @@ TEST_CASE(success, open, NULL)
     return MUNIT_OK;
 }
 
+/* The data directory has an open segment with a compressed batch. */
+TEST_CASE(success, open_compressed, NULL)
+{
+    struct fixture *f = data;
+
+    (void)params;
+
+    WRITE_COMPRESSED_SEGMENT("open-1");
+
+    LOAD(0);
+
+    ASSERT_COMPRESSED_ENTRIES;
+
+    return MUNIT_OK;
+}
+
 /******************************************************************************
  *
  * Failure scenarios.
@@ -486,6 +749,28 @@ TEST_CASE(error, closed_bad_index, NULL)
     return MUNIT_OK;
 }
 
+/* One of the many closed segments in the data directory is corrupted. */
+TEST_CASE(error, closed_many_corrupt, NULL)
+{
+    struct fixture *f = data;
+    uint8_t buf[WORD_SIZE];
+    void *cursor = buf;
+    unsigned i;
+
+    (void)params;
+
+    for (i = 0; i < 16; i++) {
+        UV_WRITE_CLOSED_SEGMENT(i + 1, 1, i);
+    }
+
+    bytePut64(&cursor, 123456789); /* Checksums */
+    test_dir_overwrite_file(f->dir, "9-9", buf, sizeof buf, WORD_SIZE);
+
+    LOAD(RAFT_CORRUPT);
+
+    return MUNIT_OK;
+}
+
 /* The data directory has an empty closed segment. */
 TEST_CASE(error, closed_empty, NULL)
 {
@@ -505,7 +790,7 @@ TEST_CASE(error, closed_bad_format, NULL)
 {
     struct fixture *f = data;
 
-    uint8_t buf[8] = {2, 0, 0, 0, 0, 0, 0, 0};
+    uint8_t buf[8] = {4, 0, 0, 0, 0, 0, 0, 0};
 
     (void)params;
 
@@ -561,7 +846,7 @@ TEST_CASE(error, open_bad_format, NULL)
     void *cursor = buf;
     (void)params;
 
-    bytePut64(&cursor, 2); /* Format version */
+    bytePut64(&cursor, UV__SEGMENT_FORMAT + 1); /* Format version */
 
     UV_WRITE_OPEN_SEGMENT(1, 1, 1);
 
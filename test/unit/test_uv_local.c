@@ -0,0 +1,393 @@
+#include "../lib/fs.h"
+#include "../lib/heap.h"
+#include "../lib/loop.h"
+#include "../lib/runner.h"
+
+#include "../../include/raft.h"
+#include "../../include/raft/uv.h"
+
+TEST_MODULE(uv_local);
+
+/******************************************************************************
+ *
+ * Fixture
+ *
+ *****************************************************************************/
+
+#define N_SERVERS 2
+
+struct server
+{
+    struct fixture *f;
+    char *dir;
+    char address[256];
+    struct raft_uv_transport transport;
+    struct raft_io io;
+    bool closed;
+    int n_recv;
+    struct raft_message message;
+    struct raft_entry entries[2];
+    char data[2][8];
+};
+
+struct fixture
+{
+    struct raft_heap heap;
+    FIXTURE_LOOP;
+    struct raft_logger logger;
+    struct raft_uv_local local;
+    struct server servers[N_SERVERS];
+    struct raft_io_send req;
+    int n_sent;
+    int status;
+};
+
+/* Copy the received message, releasing the memory it owns. */
+static void recvCb(struct raft_io *io, struct raft_message *message)
+{
+    struct server *s = io->data;
+    unsigned i;
+    s->n_recv++;
+    s->message = *message;
+    switch (message->type) {
+        case RAFT_IO_APPEND_ENTRIES:
+            munit_assert_int(message->append_entries.n_entries, <=, 2);
+            for (i = 0; i < message->append_entries.n_entries; i++) {
+                struct raft_entry *entry = &message->append_entries.entries[i];
+                munit_assert_int(entry->buf.len, ==, 8);
+                munit_assert_ptr_equal(entry->batch,
+                                       message->append_entries.entries[0].batch);
+                s->entries[i] = *entry;
+                memcpy(s->data[i], entry->buf.base, entry->buf.len);
+            }
+            if (message->append_entries.n_entries > 0) {
+                raft_free(message->append_entries.entries[0].batch);
+                raft_free(message->append_entries.entries);
+            }
+            break;
+        case RAFT_IO_INSTALL_SNAPSHOT:
+            munit_assert_int(message->install_snapshot.conf.n, ==, 1);
+            munit_assert_int(message->install_snapshot.data.len, ==, 8);
+            munit_assert_int(
+                memcmp(message->install_snapshot.data.base, "snapshot", 8), ==,
+                0);
+            raft_configuration_close(&message->install_snapshot.conf);
+            raft_free(message->install_snapshot.data.base);
+            break;
+    }
+}
+
+static void sendCb(struct raft_io_send *req, int status)
+{
+    struct fixture *f = req->data;
+    f->n_sent++;
+    f->status = status;
+}
+
+static void *setup(const MunitParameter params[], void *user_data)
+{
+    struct fixture *f = munit_malloc(sizeof *f);
+    unsigned i;
+    int rv;
+    (void)user_data;
+    test_heap_setup(params, &f->heap);
+    SETUP_LOOP;
+    rv = raft_default_logger_init(&f->logger);
+    munit_assert_int(rv, ==, 0);
+    rv = raft_uv_local_init(&f->local);
+    munit_assert_int(rv, ==, 0);
+    for (i = 0; i < N_SERVERS; i++) {
+        struct server *s = &f->servers[i];
+        s->f = f;
+        s->dir = test_dir_setup(params);
+        sprintf(s->address, "%s/sock", s->dir);
+        rv = raft_uv_unix_init(&s->transport, &f->loop);
+        munit_assert_int(rv, ==, 0);
+        rv = raft_uv_init(&s->io, &f->loop, s->dir, &s->transport);
+        munit_assert_int(rv, ==, 0);
+        s->io.data = s;
+        raft_uv_set_local(&s->io, &f->local);
+        rv = s->io.init(&s->io, &f->logger, i + 1, s->address);
+        munit_assert_int(rv, ==, 0);
+        rv = s->io.start(&s->io, 10000, NULL, recvCb);
+        munit_assert_int(rv, ==, 0);
+        s->closed = false;
+        s->n_recv = 0;
+    }
+    f->req.data = f;
+    f->n_sent = 0;
+    f->status = -1;
+    return f;
+}
+
+static void tear_down(void *data)
+{
+    struct fixture *f = data;
+    unsigned i;
+    for (i = 0; i < N_SERVERS; i++) {
+        struct server *s = &f->servers[i];
+        if (!s->closed) {
+            s->io.close(&s->io, NULL);
+        }
+    }
+    LOOP_STOP;
+    for (i = 0; i < N_SERVERS; i++) {
+        struct server *s = &f->servers[i];
+        raft_uv_close(&s->io);
+        raft_uv_unix_close(&s->transport);
+        test_dir_tear_down(s->dir);
+    }
+    raft_uv_local_close(&f->local);
+    TEAR_DOWN_LOOP;
+    test_heap_tear_down(&f->heap);
+    free(f);
+}
+
+/******************************************************************************
+ *
+ * Helper macros
+ *
+ *****************************************************************************/
+
+/* Send the given message from server 1 to server 2. */
+#define SEND(MESSAGE)                                                    \
+    {                                                                    \
+        int rv_;                                                         \
+        (MESSAGE)->server_id = 2;                                        \
+        (MESSAGE)->server_address = f->servers[1].address;               \
+        rv_ = f->servers[0].io.send(&f->servers[0].io, &f->req, MESSAGE, \
+                                    sendCb);                             \
+        munit_assert_int(rv_, ==, 0);                                    \
+    }
+
+/* Run the loop until the message is sent and received. */
+#define WAIT                                                         \
+    {                                                                \
+        int j;                                                       \
+        for (j = 0; j < 10; j++) {                                   \
+            if (f->n_sent == 1 && f->servers[1].n_recv == 1) {       \
+                break;                                               \
+            }                                                        \
+            uv_run(&f->loop, UV_RUN_ONCE);                           \
+        }                                                            \
+        munit_assert_int(f->n_sent, ==, 1);                          \
+        munit_assert_int(f->status, ==, 0);                          \
+        munit_assert_int(f->servers[1].n_recv, ==, 1);               \
+        munit_assert_int(f->servers[1].message.server_id, ==, 1);    \
+    }
+
+/******************************************************************************
+ *
+ * Success scenarios
+ *
+ *****************************************************************************/
+
+TEST_SUITE(success);
+
+TEST_SETUP(success, setup)
+TEST_TEAR_DOWN(success, tear_down)
+
+/* A message without payload is delivered as is. */
+TEST_CASE(success, request_vote, NULL)
+{
+    struct fixture *f = data;
+    struct raft_message message;
+    (void)params;
+    memset(&message, 0, sizeof message);
+    message.type = RAFT_IO_REQUEST_VOTE;
+    message.request_vote.term = 3;
+    message.request_vote.candidate_id = 1;
+    message.request_vote.last_log_index = 5;
+    message.request_vote.last_log_term = 2;
+    SEND(&message);
+    WAIT;
+    message = f->servers[1].message;
+    munit_assert_int(message.type, ==, RAFT_IO_REQUEST_VOTE);
+    munit_assert_int(message.request_vote.term, ==, 3);
+    munit_assert_int(message.request_vote.last_log_index, ==, 5);
+    munit_assert_int(message.request_vote.last_log_term, ==, 2);
+    return MUNIT_OK;
+}
+
+/* The entries of an AppendEntries message are copied into a single batch owned
+ * by the receiver, so the sender can release its own right away. */
+TEST_CASE(success, append_entries, NULL)
+{
+    struct fixture *f = data;
+    struct raft_message message;
+    struct raft_entry entries[2];
+    char data1[8] = "entry-1";
+    char data2[8] = "entry-2";
+    (void)params;
+    entries[0].term = 1;
+    entries[0].type = RAFT_COMMAND;
+    entries[0].buf.base = data1;
+    entries[0].buf.len = sizeof data1;
+    entries[0].batch = NULL;
+    entries[1].term = 2;
+    entries[1].type = RAFT_BARRIER;
+    entries[1].buf.base = data2;
+    entries[1].buf.len = sizeof data2;
+    entries[1].batch = NULL;
+    memset(&message, 0, sizeof message);
+    message.type = RAFT_IO_APPEND_ENTRIES;
+    message.append_entries.term = 2;
+    message.append_entries.prev_log_index = 3;
+    message.append_entries.entries = entries;
+    message.append_entries.n_entries = 2;
+    SEND(&message);
+    memset(data1, 0, sizeof data1);
+    WAIT;
+    munit_assert_int(f->servers[1].message.append_entries.n_entries, ==, 2);
+    munit_assert_int(f->servers[1].entries[0].term, ==, 1);
+    munit_assert_int(f->servers[1].entries[0].type, ==, RAFT_COMMAND);
+    munit_assert_string_equal(f->servers[1].data[0], "entry-1");
+    munit_assert_int(f->servers[1].entries[1].type, ==, RAFT_BARRIER);
+    munit_assert_string_equal(f->servers[1].data[1], "entry-2");
+    return MUNIT_OK;
+}
+
+/* The configuration and data of an InstallSnapshot message are copied. */
+TEST_CASE(success, install_snapshot, NULL)
+{
+    struct fixture *f = data;
+    struct raft_message message;
+    char snapshot[9] = "snapshot";
+    int rv;
+    (void)params;
+    memset(&message, 0, sizeof message);
+    message.type = RAFT_IO_INSTALL_SNAPSHOT;
+    message.install_snapshot.term = 2;
+    message.install_snapshot.last_index = 10;
+    raft_configuration_init(&message.install_snapshot.conf);
+    rv = raft_configuration_add(&message.install_snapshot.conf, 1, "1", true);
+    munit_assert_int(rv, ==, 0);
+    message.install_snapshot.data.base = snapshot;
+    message.install_snapshot.data.len = 8;
+    SEND(&message);
+    raft_configuration_close(&message.install_snapshot.conf);
+    WAIT;
+    munit_assert_int(f->servers[1].message.install_snapshot.last_index, ==, 10);
+    return MUNIT_OK;
+}
+
+/******************************************************************************
+ *
+ * Failure scenarios
+ *
+ *****************************************************************************/
+
+TEST_SUITE(error);
+
+TEST_SETUP(error, setup)
+TEST_TEAR_DOWN(error, tear_down)
+
+/* Messages carrying entries are refused if the bytes not yet drained by the
+ * receiver would exceed the send queue size. */
+TEST_CASE(error, busy, NULL)
+{
+    struct fixture *f = data;
+    struct raft_io *io = &f->servers[0].io;
+    struct raft_message message;
+    struct raft_io_send req;
+    struct raft_entry entry;
+    char buf[8] = "entry-1";
+    int rv;
+    (void)params;
+    raft_uv_set_send_queue_size(io, 8);
+    entry.term = 1;
+    entry.type = RAFT_COMMAND;
+    entry.buf.base = buf;
+    entry.buf.len = sizeof buf;
+    entry.batch = NULL;
+    memset(&message, 0, sizeof message);
+    message.type = RAFT_IO_APPEND_ENTRIES;
+    message.append_entries.entries = &entry;
+    message.append_entries.n_entries = 1;
+
+    /* The first message is accepted, the second one is not. */
+    munit_assert_false(io->busy(io, 2));
+    SEND(&message);
+    munit_assert_true(io->busy(io, 2));
+    req.data = f;
+    rv = io->send(io, &req, &message, sendCb);
+    munit_assert_int(rv, ==, RAFT_BUSY);
+
+    /* Heartbeats are always accepted. */
+    message.append_entries.entries = NULL;
+    message.append_entries.n_entries = 0;
+    rv = io->send(io, &req, &message, sendCb);
+    munit_assert_int(rv, ==, 0);
+
+    LOOP_RUN(2);
+    munit_assert_int(f->n_sent, ==, 2);
+    munit_assert_int(f->servers[1].n_recv, ==, 2);
+
+    /* Once the receiver has drained its inbox, messages are accepted again. */
+    munit_assert_false(io->busy(io, 2));
+    message.append_entries.entries = &entry;
+    message.append_entries.n_entries = 1;
+    rv = io->send(io, &req, &message, sendCb);
+    munit_assert_int(rv, ==, 0);
+    LOOP_RUN(1);
+    munit_assert_int(f->servers[1].n_recv, ==, 3);
+
+    return MUNIT_OK;
+}
+
+/******************************************************************************
+ *
+ * Close scenarios
+ *
+ *****************************************************************************/
+
+TEST_SUITE(close);
+
+TEST_SETUP(close, setup)
+TEST_TEAR_DOWN(close, tear_down)
+
+/* The receiver gets closed before the message is delivered: the message is
+ * dropped, but the send request still succeeds. */
+TEST_CASE(close, receiver, NULL)
+{
+    struct fixture *f = data;
+    struct raft_message message;
+    struct raft_entry entry;
+    char buf[8] = "entry-1";
+    (void)params;
+    entry.term = 1;
+    entry.type = RAFT_COMMAND;
+    entry.buf.base = buf;
+    entry.buf.len = sizeof buf;
+    entry.batch = NULL;
+    memset(&message, 0, sizeof message);
+    message.type = RAFT_IO_APPEND_ENTRIES;
+    message.append_entries.entries = &entry;
+    message.append_entries.n_entries = 1;
+    SEND(&message);
+    f->servers[1].io.close(&f->servers[1].io, NULL);
+    f->servers[1].closed = true;
+    LOOP_RUN(2);
+    munit_assert_int(f->n_sent, ==, 1);
+    munit_assert_int(f->status, ==, 0);
+    munit_assert_int(f->servers[1].n_recv, ==, 0);
+    return MUNIT_OK;
+}
+
+/* The sender gets closed before its send callback fires: the callback is
+ * fired synchronously and the message is still delivered. */
+TEST_CASE(close, sender, NULL)
+{
+    struct fixture *f = data;
+    struct raft_message message;
+    (void)params;
+    memset(&message, 0, sizeof message);
+    message.type = RAFT_IO_REQUEST_VOTE;
+    SEND(&message);
+    f->servers[0].io.close(&f->servers[0].io, NULL);
+    f->servers[0].closed = true;
+    munit_assert_int(f->n_sent, ==, 1);
+    munit_assert_int(f->status, ==, 0);
+    WAIT;
+    return MUNIT_OK;
+}
@@ -1,6 +1,7 @@
 #include "../lib/uv.h"
 #include "../lib/runner.h"
 
+#include "../../src/queue.h"
 #include "../../src/uv.h"
 
 TEST_MODULE(uv_prepare);
@@ -79,6 +80,22 @@ static void prepareCb(struct uvPrepare *req,
         f->invoked = 0;                          \
     }
 
+/* Run the loop until the pool holds at least N prepared segments. */
+#define WAIT_POOL(N)                                                \
+    {                                                               \
+        int n_;                                                     \
+        for (n_ = 0; n_ < 10; n_++) {                               \
+            queue *head_;                                           \
+            unsigned size_ = 0;                                     \
+            QUEUE_FOREACH(head_, &f->uv->prepare_pool) { size_++; } \
+            if (size_ >= N) {                                       \
+                break;                                              \
+            }                                                       \
+            LOOP_RUN(1);                                            \
+        }                                                           \
+        munit_assert_int(n_, <, 10);                                \
+    }
+
 /******************************************************************************
  *
  * Success scenarios.
@@ -116,6 +133,84 @@ TEST_CASE(success, second, NULL)
     return MUNIT_OK;
 }
 
+/* A request which can't be served by the pool is counted as a stall. */
+TEST_CASE(success, stall, NULL)
+{
+    struct fixture *f = data;
+    (void)params;
+    PREPARE;
+    WAIT_CB(0);
+    munit_assert_int(f->uv->prepare_n_stalls, ==, 1);
+    WAIT_POOL(1);
+    uvFileClose(f->file, (uvFileCloseCb)raft_free);
+    PREPARE;
+    WAIT_CB(0);
+    munit_assert_int(f->counter, ==, 2);
+    munit_assert_int(f->uv->prepare_n_stalls, ==, 1);
+    return MUNIT_OK;
+}
+
+/* The target pool size grows when segments get used faster than they can be
+ * created, and shrinks again when the rate drops, removing surplus segments. */
+TEST_CASE(success, adapt, NULL)
+{
+    struct fixture *f = data;
+    (void)params;
+    PREPARE;
+    WAIT_CB(0);
+    WAIT_POOL(1);
+
+    /* Pretend that creating a segment takes a long time. */
+    f->uv->prepare_create_time = 1000 * 1000 * 1000;
+    uvFileClose(f->file, (uvFileCloseCb)raft_free);
+    PREPARE;
+    WAIT_CB(0);
+    munit_assert_int(f->uv->prepare_pool_target, ==, UV__PREPARE_POOL_MAX);
+    WAIT_POOL(3);
+
+    /* Pretend that creating a segment is instantaneous. */
+    f->uv->prepare_create_time = 0;
+    uvFileClose(f->file, (uvFileCloseCb)raft_free);
+    PREPARE;
+    WAIT_CB(0);
+    munit_assert_int(f->uv->prepare_pool_target, ==, UV__PREPARE_POOL_MIN);
+    LOOP_RUN(1);
+    munit_assert_true(test_dir_has_file(f->dir, "open-4"));
+    munit_assert_false(test_dir_has_file(f->dir, "open-5"));
+
+    return MUNIT_OK;
+}
+
+/* The target pool size shrinks also when no segment gets used for a while,
+ * removing surplus segments. */
+TEST_CASE(success, decay, NULL)
+{
+    struct fixture *f = data;
+    (void)params;
+    PREPARE;
+    WAIT_CB(0);
+    WAIT_POOL(1);
+
+    /* Pretend that creating a segment takes a long time. */
+    f->uv->prepare_create_time = 1000 * 1000 * 1000;
+    uvFileClose(f->file, (uvFileCloseCb)raft_free);
+    PREPARE;
+    WAIT_CB(0);
+    munit_assert_int(f->uv->prepare_pool_target, ==, UV__PREPARE_POOL_MAX);
+    WAIT_POOL(3);
+
+    /* Pretend that the last segment was used a long time ago. */
+    f->uv->prepare_used_at -= 1000 * 1000 * 1000;
+    uvPrepareTick(f->uv);
+    munit_assert_int(f->uv->prepare_pool_target, ==, UV__PREPARE_POOL_MIN + 1);
+    LOOP_RUN(1);
+    munit_assert_true(test_dir_has_file(f->dir, "open-3"));
+    munit_assert_true(test_dir_has_file(f->dir, "open-4"));
+    munit_assert_false(test_dir_has_file(f->dir, "open-5"));
+
+    return MUNIT_OK;
+}
+
 /******************************************************************************
  *
  * Failure scenarios.
@@ -17,9 +17,12 @@ struct fixture
     {
         char handshake[sizeof(uint64_t) * 3 /* Preamble */ + 16 /* Address */];
         struct raft_message message;
+        bool compact;
+        const struct raft_uv_codec *codec;
     } peer;
     int invoked;
     struct raft_message *message;
+    struct raft_message first; /* Copy of the first message received */
 };
 
 static void recv_cb(struct raft_io *io, struct raft_message *message)
@@ -27,6 +30,9 @@ static void recv_cb(struct raft_io *io, struct raft_message *message)
     struct fixture *f = io->data;
     f->invoked++;
     f->message = message;
+    if (f->invoked == 1) {
+        f->first = *message;
+    }
 }
 
 static void *setup(const MunitParameter params[], void *user_data)
@@ -39,6 +45,8 @@ static void *setup(const MunitParameter params[], void *user_data)
     f->peer.message.type = RAFT_IO_REQUEST_VOTE;
     f->peer.message.server_id = 1;
     f->peer.message.server_address = f->tcp.server.address;
+    f->peer.compact = false;
+    f->peer.codec = NULL;
     f->invoked = 0;
     f->message = NULL;
     return f;
@@ -72,7 +80,9 @@ static void tear_down(void *data)
         unsigned n_bufs;                                               \
         unsigned i;                                                    \
         int rv2;                                                       \
-        rv2 = uvEncodeMessage(&f->peer.message, &bufs, &n_bufs); \
+        rv2 = uvEncodeMessage(&f->peer.message, f->peer.compact,       \
+                              f->peer.codec, f->peer.codec != NULL,    \
+                              &bufs, &n_bufs);                         \
         munit_assert_int(rv2, ==, 0);                                  \
         if (N == 0) {                                                  \
             n = n_bufs;                                                \
@@ -211,6 +221,281 @@ TEST_CASE(success, append_entries, NULL)
     return MUNIT_OK;
 }
 
+/* Receive an AppendEntries message whose batch uses the compact encoding. */
+TEST_CASE(success, append_entries_compact, NULL)
+{
+    struct fixture *f = data;
+    struct raft_entry entries[3];
+
+    (void)params;
+
+    entries[0].term = 1;
+    entries[0].type = RAFT_COMMAND;
+    entries[0].buf.base = raft_malloc(6);
+    entries[0].buf.len = 6;
+    strcpy(entries[0].buf.base, "hello");
+
+    entries[1].term = 1;
+    entries[1].type = RAFT_BARRIER;
+    entries[1].buf.base = raft_malloc(1);
+    entries[1].buf.len = 1;
+    strcpy(entries[1].buf.base, "");
+
+    entries[2].term = 300;
+    entries[2].type = RAFT_COMMAND;
+    entries[2].buf.base = raft_malloc(6);
+    entries[2].buf.len = 6;
+    strcpy(entries[2].buf.base, "world");
+
+    f->peer.message.type = RAFT_IO_APPEND_ENTRIES;
+    f->peer.message.append_entries.entries = entries;
+    f->peer.message.append_entries.n_entries = 3;
+    f->peer.compact = true;
+
+    munit_assert_false(uvRecvCanCompact(f->uv, 2));
+
+    recv__peer_connect;
+    recv__peer_handshake;
+    recv__peer_send;
+
+    LOOP_RUN(2);
+
+    munit_assert_int(f->invoked, ==, 1);
+    munit_assert_ptr_not_null(f->message);
+    munit_assert_true(uvRecvCanCompact(f->uv, 2));
+
+    munit_assert_int(f->message->append_entries.n_entries, ==, 3);
+
+    munit_assert_int(f->message->append_entries.entries[0].term, ==, 1);
+    munit_assert_int(f->message->append_entries.entries[1].term, ==, 1);
+    munit_assert_int(f->message->append_entries.entries[1].type, ==,
+                     RAFT_BARRIER);
+    munit_assert_int(f->message->append_entries.entries[2].term, ==, 300);
+
+    munit_assert_string_equal(f->message->append_entries.entries[0].buf.base,
+                              "hello");
+    munit_assert_string_equal(f->message->append_entries.entries[2].buf.base,
+                              "world");
+
+    raft_free(f->message->append_entries.entries[0].batch);
+    raft_free(f->message->append_entries.entries);
+
+    return MUNIT_OK;
+}
+
+/* Receive an AppendEntries message whose entries data is compressed. */
+TEST_CASE(success, append_entries_compressed, NULL)
+{
+    struct fixture *f = data;
+    struct raft_entry entries[2];
+    char *data1;
+    char *data2;
+    unsigned j;
+
+    (void)params;
+
+    /* Highly compressible data. */
+    data1 = raft_malloc(1024);
+    data2 = raft_malloc(16);
+    for (j = 0; j < 1024; j++) {
+        data1[j] = "hello world "[j % 12];
+    }
+    memset(data2, 'x', 16);
+
+    entries[0].term = 1;
+    entries[0].type = RAFT_COMMAND;
+    entries[0].buf.base = data1;
+    entries[0].buf.len = 1024;
+
+    entries[1].term = 2;
+    entries[1].type = RAFT_COMMAND;
+    entries[1].buf.base = data2;
+    entries[1].buf.len = 16;
+
+    f->peer.message.type = RAFT_IO_APPEND_ENTRIES;
+    f->peer.message.append_entries.entries = entries;
+    f->peer.message.append_entries.n_entries = 2;
+    f->peer.compact = true;
+    f->peer.codec = raft_uv_codec_lz();
+
+    recv__peer_connect;
+    recv__peer_handshake;
+    recv__peer_send;
+
+    LOOP_RUN(2);
+
+    munit_assert_int(f->invoked, ==, 1);
+    munit_assert_ptr_not_null(f->message);
+    munit_assert_int(uvRecvCodec(f->uv, 2), ==, RAFT_UV_CODEC_LZ);
+
+    munit_assert_int(f->message->append_entries.n_entries, ==, 2);
+    munit_assert_int(f->message->append_entries.entries[0].buf.len, ==, 1024);
+    munit_assert_int(f->message->append_entries.entries[1].buf.len, ==, 16);
+    munit_assert_int(
+        memcmp(f->message->append_entries.entries[0].buf.base, data1, 1024), ==,
+        0);
+    munit_assert_int(
+        memcmp(f->message->append_entries.entries[1].buf.base, data2, 16), ==,
+        0);
+
+    /* The compressed data was sent in place of the entries buffers. */
+    raft_free(data1);
+    raft_free(data2);
+
+    raft_free(f->message->append_entries.entries[0].batch);
+    raft_free(f->message->append_entries.entries);
+
+    return MUNIT_OK;
+}
+
+/* Receive an AppendEntries message whose payload is larger than the receive
+ * buffer, so it gets read directly into its own buffer. */
+TEST_CASE(success, append_entries_large, NULL)
+{
+    struct fixture *f = data;
+    struct raft_entry entry;
+    const uint8_t *cursor;
+    size_t size = 1024 * 1024;
+    unsigned j;
+
+    (void)params;
+
+    /* The entry buffer gets released by recv__peer_send. */
+    entry.type = RAFT_COMMAND;
+    entry.buf.len = size;
+    entry.buf.base = raft_malloc(entry.buf.len);
+    for (j = 0; j < size; j++) {
+        ((uint8_t *)entry.buf.base)[j] = (uint8_t)(j % 251);
+    }
+
+    f->peer.message.type = RAFT_IO_APPEND_ENTRIES;
+    f->peer.message.append_entries.entries = &entry;
+    f->peer.message.append_entries.n_entries = 1;
+
+    recv__peer_connect;
+    recv__peer_handshake;
+    recv__peer_send;
+
+    for (j = 0; j < 50 && f->invoked == 0; j++) {
+        LOOP_RUN(1);
+    }
+
+    munit_assert_int(f->invoked, ==, 1);
+    munit_assert_int(f->message->append_entries.n_entries, ==, 1);
+    munit_assert_int(f->message->append_entries.entries[0].buf.len, ==, size);
+    cursor = f->message->append_entries.entries[0].buf.base;
+    for (j = 0; j < size; j++) {
+        munit_assert_int(cursor[j], ==, j % 251);
+    }
+
+    raft_free(f->message->append_entries.entries[0].batch);
+    raft_free(f->message->append_entries.entries);
+
+    return MUNIT_OK;
+}
+
+/* Several messages received with a single read are all decoded. */
+TEST_CASE(success, many, NULL)
+{
+    struct fixture *f = data;
+    uv_buf_t *bufs;
+    unsigned n_bufs;
+    char buf[256];
+    size_t n = 0;
+    unsigned i;
+    int rv;
+
+    (void)params;
+
+    f->peer.message.request_vote.term = 3;
+    rv = uvEncodeMessage(&f->peer.message, false, NULL, false, &bufs, &n_bufs);
+    munit_assert_int(rv, ==, 0);
+    munit_assert_int(n_bufs, ==, 1);
+    for (i = 0; i < 3; i++) {
+        munit_assert_int(n + bufs[0].len, <=, sizeof buf);
+        memcpy(buf + n, bufs[0].base, bufs[0].len);
+        n += bufs[0].len;
+    }
+    raft_free(bufs[0].base);
+    raft_free(bufs);
+
+    recv__peer_connect;
+    recv__peer_handshake;
+    test_tcp_send(&f->tcp, buf, n);
+
+    LOOP_RUN(2);
+
+    munit_assert_int(f->invoked, ==, 3);
+    munit_assert_int(f->message->request_vote.term, ==, 3);
+
+    return MUNIT_OK;
+}
+
+/* A message following a payload whose size is not a multiple of 8 bytes, and
+ * received with the same read, is decoded from a misaligned offset. */
+TEST_CASE(success, misaligned, NULL)
+{
+    struct fixture *f = data;
+    struct raft_install_snapshot *p = &f->peer.message.install_snapshot;
+    uv_buf_t *bufs;
+    unsigned n_bufs;
+    char buf[512];
+    size_t n = 0;
+    unsigned i;
+    int rv;
+
+    (void)params;
+
+    f->peer.message.type = RAFT_IO_INSTALL_SNAPSHOT;
+    raft_configuration_init(&p->conf);
+    rv = raft_configuration_add(&p->conf, 1, "1", true);
+    munit_assert_int(rv, ==, 0);
+    p->data.len = 3;
+    p->data.base = raft_malloc(p->data.len);
+    memcpy(p->data.base, "abc", 3);
+    rv = uvEncodeMessage(&f->peer.message, false, NULL, false, &bufs, &n_bufs);
+    munit_assert_int(rv, ==, 0);
+    for (i = 0; i < n_bufs; i++) {
+        munit_assert_int(n + bufs[i].len, <=, sizeof buf);
+        memcpy(buf + n, bufs[i].base, bufs[i].len);
+        n += bufs[i].len;
+        raft_free(bufs[i].base);
+    }
+    raft_free(bufs);
+    raft_configuration_close(&p->conf);
+    munit_assert_int(n % sizeof(uint64_t), !=, 0);
+
+    f->peer.message.type = RAFT_IO_REQUEST_VOTE;
+    f->peer.message.request_vote.term = 3;
+    f->peer.message.request_vote.candidate_id = 2;
+    rv = uvEncodeMessage(&f->peer.message, false, NULL, false, &bufs, &n_bufs);
+    munit_assert_int(rv, ==, 0);
+    munit_assert_int(n_bufs, ==, 1);
+    munit_assert_int(n + bufs[0].len, <=, sizeof buf);
+    memcpy(buf + n, bufs[0].base, bufs[0].len);
+    n += bufs[0].len;
+    raft_free(bufs[0].base);
+    raft_free(bufs);
+
+    recv__peer_connect;
+    recv__peer_handshake;
+    test_tcp_send(&f->tcp, buf, n);
+
+    LOOP_RUN(2);
+
+    munit_assert_int(f->invoked, ==, 2);
+    munit_assert_int(f->first.type, ==, RAFT_IO_INSTALL_SNAPSHOT);
+    munit_assert_int(f->first.install_snapshot.data.len, ==, 3);
+    munit_assert_memory_equal(3, f->first.install_snapshot.data.base, "abc");
+    raft_configuration_close(&f->first.install_snapshot.conf);
+    raft_free(f->first.install_snapshot.data.base);
+
+    munit_assert_int(f->message->request_vote.term, ==, 3);
+    munit_assert_int(f->message->request_vote.candidate_id, ==, 2);
+
+    return MUNIT_OK;
+}
+
 /* Receive an AppendEntries message with no entries (i.e. an heartbeat). */
 TEST_CASE(success, heartbeat, NULL)
 {
@@ -378,6 +663,44 @@ TEST_CASE(error, bad_type, NULL)
     return MUNIT_OK;
 }
 
+/* An AppendEntries message with a malformed compact batch header causes the
+ * connection to be aborted. */
+TEST_CASE(error, bad_compact_batch, NULL)
+{
+    struct fixture *f = data;
+    uint64_t buf[7];
+    void *cursor = buf;
+    uint8_t *batch;
+
+    (void)params;
+
+    recv__peer_connect;
+    recv__peer_handshake;
+
+    bytePut64(&cursor, RAFT_IO_APPEND_ENTRIES | UV__MESSAGE_COMPACT);
+    bytePut64(&cursor, sizeof(uint64_t) * 5); /* Message size */
+    bytePut64(&cursor, 1);                    /* Term */
+    bytePut64(&cursor, 0);                    /* Previous log index */
+    bytePut64(&cursor, 0);                    /* Previous log term */
+    bytePut64(&cursor, 0);                    /* Leader commit */
+
+    /* Two entries, the first having a bad type. */
+    batch = cursor;
+    memset(batch, 0, sizeof(uint64_t));
+    batch[0] = 2;   /* Number of entries */
+    batch[1] = 1;   /* Term delta */
+    batch[2] = 1;   /* Run length */
+    batch[3] = 255; /* Type */
+
+    test_tcp_send(&f->tcp, buf, sizeof buf);
+
+    LOOP_RUN(2);
+
+    munit_assert_int(f->invoked, ==, 0);
+
+    return MUNIT_OK;
+}
+
 static char *error_oom_heap_fault_delay[] = {"3", "4", "5", "6", NULL};
 static char *error_oom_heap_fault_repeat[] = {"1", NULL};
 
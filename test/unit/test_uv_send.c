@@ -1,9 +1,11 @@
+#include <string.h>
 #include <unistd.h>
 
 #include "../lib/uv.h"
 #include "../lib/runner.h"
 
 #include "../../src/uv.h"
+#include "../../src/uv_encoding.h"
 
 TEST_MODULE(io_uv_send);
 
@@ -18,6 +20,7 @@ struct fixture
     struct raft_message message;
     int invoked;
     int status;
+    int received;
 };
 
 static void *setup(const MunitParameter params[], void *user_data)
@@ -30,6 +33,7 @@ static void *setup(const MunitParameter params[], void *user_data)
     f->req.data = f;
     f->invoked = 0;
     f->status = -1;
+    f->received = 0;
     return f;
 }
 
@@ -69,6 +73,59 @@ static void send__send_cb(struct raft_io_send *req, int status)
 
 #define send__set_message_type(TYPE) f->message.type = TYPE;
 
+static void send__recv_cb(struct raft_io *io, struct raft_message *message)
+{
+    struct fixture *f = io->data;
+    (void)message;
+    f->received++;
+}
+
+/* Make the target server connect to us and send us a message, telling us what
+ * it supports. */
+#define send__peer_hello                                                   \
+    {                                                                      \
+        struct raft_message message2;                                      \
+        uint8_t handshake[sizeof(uint64_t) * 5];                           \
+        void *cursor2 = handshake;                                         \
+        uv_buf_t *bufs;                                                    \
+        unsigned n_bufs;                                                   \
+        unsigned k;                                                        \
+        int rv2;                                                           \
+        rv2 = f->io.start(&f->io, 10000, NULL, send__recv_cb);             \
+        munit_assert_int(rv2, ==, 0);                                      \
+        test_tcp_connect(&f->tcp, 9000);                                   \
+        bytePut64(&cursor2, 1);  /* Protocol */                            \
+        bytePut64(&cursor2, 1);  /* Server ID */                           \
+        bytePut64(&cursor2, 16); /* Address size */                        \
+        strcpy(cursor2, "127.0.0.1:66");                                   \
+        test_tcp_send(&f->tcp, handshake, sizeof handshake);               \
+        memset(&message2, 0, sizeof message2);                             \
+        message2.type = RAFT_IO_REQUEST_VOTE;                              \
+        rv2 = uvEncodeMessage(&message2, false, NULL, false, &bufs,        \
+                              &n_bufs);                                    \
+        munit_assert_int(rv2, ==, 0);                                      \
+        for (k = 0; k < n_bufs; k++) {                                     \
+            test_tcp_send(&f->tcp, bufs[k].base, (int)bufs[k].len);        \
+            raft_free(bufs[k].base);                                       \
+        }                                                                  \
+        raft_free(bufs);                                                   \
+        for (k = 0; k < 5 && f->received == 0; k++) {                      \
+            LOOP_RUN(1);                                                   \
+        }                                                                  \
+        munit_assert_int(f->received, ==, 1);                              \
+    }
+
+/* Read exactly N bytes from the given socket. */
+static void send__read(int socket, void *buf, size_t n)
+{
+    size_t offset = 0;
+    while (offset < n) {
+        ssize_t rv = read(socket, (uint8_t *)buf + offset, n - offset);
+        munit_assert_int(rv, >, 0);
+        offset += (size_t)rv;
+    }
+}
+
 #define send__set_connect_retry_delay(MSECS) \
     {                                        \
         struct uv *uv = f->io.impl;          \
@@ -216,6 +273,318 @@ TEST_CASE(success, install_snapshot, NULL)
     return MUNIT_OK;
 }
 
+/* Messages sent to a connected server during the same loop iteration are
+ * written out together with a single write. */
+TEST_CASE(success, coalesce, NULL)
+{
+    struct fixture *f = data;
+    struct raft_io_send reqs[3];
+    struct raft_uv_send_stats stats;
+    unsigned j;
+    int rv;
+
+    (void)params;
+
+    send__invoke(0);
+    send__wait_cb(0);
+
+    for (j = 0; j < 3; j++) {
+        reqs[j].data = f;
+        rv = f->io.send(&f->io, &reqs[j], &f->message, send__send_cb);
+        munit_assert_int(rv, ==, 0);
+    }
+
+    for (j = 0; j < 5 && f->invoked < 3; j++) {
+        LOOP_RUN(1);
+    }
+    munit_assert_int(f->invoked, ==, 3);
+    munit_assert_int(f->status, ==, 0);
+
+    raft_uv_get_send_stats(&f->io, &stats);
+    munit_assert_int(stats.n_messages, ==, 4);
+    munit_assert_int(stats.n_writes, ==, 2);
+    munit_assert_int(stats.max_messages, ==, 3);
+
+    return MUNIT_OK;
+}
+
+static char *success_reuse_heap_fault_delay[] = {"0", NULL};
+static char *success_reuse_heap_fault_repeat[] = {"-1", NULL};
+
+static MunitParameterEnum success_reuse_params[] = {
+    {TEST_HEAP_FAULT_DELAY, success_reuse_heap_fault_delay},
+    {TEST_HEAP_FAULT_REPEAT, success_reuse_heap_fault_repeat},
+    {NULL, NULL},
+};
+
+/* Once a request to a server has completed, its memory gets reused for the
+ * next one, so sending it doesn't need to allocate memory. */
+TEST_CASE(success, reuse, success_reuse_params)
+{
+    struct fixture *f = data;
+
+    (void)params;
+
+    send__invoke(0);
+    send__wait_cb(0);
+
+    test_heap_fault_enable(&f->heap);
+
+    send__invoke(0);
+    send__wait_cb(0);
+
+    return MUNIT_OK;
+}
+
+/* A heartbeat still waiting to be written is dropped when a new one is sent,
+ * and its callback fired as if it had been sent. */
+TEST_CASE(success, heartbeat_stale, NULL)
+{
+    struct fixture *f = data;
+    struct raft_io_send req;
+    struct raft_uv_send_stats stats;
+    int rv;
+
+    (void)params;
+
+    send__set_message_type(RAFT_IO_APPEND_ENTRIES);
+
+    f->message.append_entries.entries = NULL;
+    f->message.append_entries.n_entries = 0;
+
+    req.data = f;
+    rv = f->io.send(&f->io, &req, &f->message, send__send_cb);
+    munit_assert_int(rv, ==, 0);
+
+    send__invoke(0);
+    munit_assert_int(f->invoked, ==, 1);
+    munit_assert_int(f->status, ==, 0);
+    f->invoked = 0;
+
+    send__wait_cb(0);
+
+    raft_uv_get_send_stats(&f->io, &stats);
+    munit_assert_int(stats.n_messages, ==, 1);
+    munit_assert_int(stats.n_dropped, ==, 1);
+
+    return MUNIT_OK;
+}
+
+/* If the target server supports it, AppendEntries messages carrying entries go
+ * through a separate bulk connection, and heartbeats sent while such messages
+ * are pending follow them through that connection. */
+TEST_CASE(success, bulk, NULL)
+{
+    struct fixture *f = data;
+    struct raft_message message;
+    struct raft_io_send req;
+    struct raft_entry entry;
+    uint64_t buf[4];
+    uint8_t skip[64];
+    int socket;
+    unsigned j;
+    int rv;
+
+    (void)params;
+
+    send__peer_hello;
+
+    entry.term = 2;
+    entry.type = RAFT_COMMAND;
+    entry.buf.len = 8;
+    entry.buf.base = raft_malloc(entry.buf.len);
+    entry.batch = NULL;
+    message = f->message;
+    message.type = RAFT_IO_APPEND_ENTRIES;
+    message.append_entries.term = 2;
+    message.append_entries.prev_log_index = 5;
+    message.append_entries.prev_log_term = 1;
+    message.append_entries.leader_commit = 5;
+    message.append_entries.entries = &entry;
+    message.append_entries.n_entries = 1;
+
+    req.data = f;
+    rv = f->io.send(&f->io, &req, &message, send__send_cb);
+    munit_assert_int(rv, ==, 0);
+
+    message.append_entries.prev_log_index = 6;
+    message.append_entries.prev_log_term = 2;
+    message.append_entries.entries = NULL;
+    message.append_entries.n_entries = 0;
+    rv = f->io.send(&f->io, &f->req, &message, send__send_cb);
+    munit_assert_int(rv, ==, 0);
+
+    for (j = 0; j < 5 && f->invoked < 2; j++) {
+        LOOP_RUN(1);
+    }
+    munit_assert_int(f->invoked, ==, 2);
+    munit_assert_int(f->status, ==, 0);
+
+    /* Both messages went through the bulk connection, the only one opened. */
+    socket = test_tcp_accept(&f->tcp);
+    send__read(socket, buf, sizeof(uint64_t) * 3);
+    munit_assert_uint64(byteFlip64(buf[0]), ==, 1 | ((uint64_t)1 << 32));
+    munit_assert_int(byteFlip64(buf[2]), <=, sizeof skip);
+    send__read(socket, skip, byteFlip64(buf[2]));
+
+    /* Skip the entries, then check the previous index and term of the
+     * heartbeat that follows them. */
+    send__read(socket, buf, sizeof(uint64_t) * 2);
+    munit_assert_int(byteFlip64(buf[1]), <=, sizeof skip);
+    send__read(socket, skip, byteFlip64(buf[1]));
+    send__read(socket, skip, entry.buf.len);
+    send__read(socket, buf, sizeof(uint64_t) * 2);
+    send__read(socket, buf, sizeof(uint64_t) * 3);
+    munit_assert_int(byteFlip64(buf[0]), ==, 2);
+    munit_assert_int(byteFlip64(buf[1]), ==, 6);
+    munit_assert_int(byteFlip64(buf[2]), ==, 2);
+
+    close(socket);
+    raft_free(entry.buf.base);
+
+    return MUNIT_OK;
+}
+
+/* The target server comes back and connects to us while we're waiting to retry
+ * connecting to it: we reconnect right away instead of waiting for the retry
+ * delay to expire. */
+TEST_CASE(success, reconnect, NULL)
+{
+    struct fixture *f = data;
+    struct uv *uv = f->io.impl;
+    uint64_t start;
+
+    (void)params;
+
+    uv->connect_retry_delay = 10000;
+    test_tcp_stop(&f->tcp);
+    send__invoke(0);
+    LOOP_RUN(1); /* The connection attempt gets refused */
+    munit_assert_int(f->invoked, ==, 0);
+
+    test_tcp_restart(&f->tcp);
+    uv_update_time(&f->loop);
+    start = uv_now(&f->loop);
+    send__peer_hello;
+    send__wait_cb(0);
+    uv_update_time(&f->loop);
+    munit_assert_int(uv_now(&f->loop) - start, <, 1000);
+
+    return MUNIT_OK;
+}
+
+/* An AppendEntries message sent to several servers during the same loop
+ * iteration is encoded only once. */
+TEST_CASE(success, shared, NULL)
+{
+    struct fixture *f = data;
+    struct raft_uv_send_stats stats;
+    struct raft_io_send reqs[2];
+    struct raft_entry entry;
+    char buf[8] = "entry-1";
+    unsigned j;
+    int rv;
+
+    (void)params;
+
+    entry.term = 1;
+    entry.type = RAFT_COMMAND;
+    entry.buf.base = buf;
+    entry.buf.len = sizeof buf;
+    entry.batch = NULL;
+    f->message.type = RAFT_IO_APPEND_ENTRIES;
+    f->message.append_entries.term = 1;
+    f->message.append_entries.entries = &entry;
+    f->message.append_entries.n_entries = 1;
+
+    for (j = 0; j < 2; j++) {
+        reqs[j].data = f;
+        f->message.server_id = j + 1;
+        rv = f->io.send(&f->io, &reqs[j], &f->message, send__send_cb);
+        munit_assert_int(rv, ==, 0);
+    }
+    for (j = 0; j < 5 && f->invoked < 2; j++) {
+        LOOP_RUN(1);
+    }
+    munit_assert_int(f->invoked, ==, 2);
+    munit_assert_int(f->status, ==, 0);
+
+    raft_uv_get_send_stats(&f->io, &stats);
+    munit_assert_int(stats.n_shared, ==, 1);
+
+    /* The encoding is not reused past the loop iteration. */
+    f->invoked = 0;
+    send__invoke(0);
+    send__wait_cb(0);
+    raft_uv_get_send_stats(&f->io, &stats);
+    munit_assert_int(stats.n_shared, ==, 1);
+
+    return MUNIT_OK;
+}
+
+/* Large payloads are sent with MSG_ZEROCOPY, and the send callback fires once
+ * the kernel is done with their memory. */
+TEST_CASE(success, zero_copy, NULL)
+{
+    struct fixture *f = data;
+    struct raft_uv_send_stats stats;
+    struct raft_entry entry;
+    uint64_t preamble[3];
+    uint8_t *buf;
+    int socket;
+    size_t i;
+
+    (void)params;
+
+#if !defined(MSG_ZEROCOPY) || !defined(SO_ZEROCOPY)
+    return MUNIT_SKIP;
+#endif
+
+    raft_uv_set_zero_copy(&f->io, 4096);
+
+    entry.term = 1;
+    entry.type = RAFT_COMMAND;
+    entry.buf.len = 64 * 1024;
+    entry.buf.base = raft_malloc(entry.buf.len);
+    entry.batch = NULL;
+    for (i = 0; i < entry.buf.len; i++) {
+        ((uint8_t *)entry.buf.base)[i] = (uint8_t)i;
+    }
+    f->message.type = RAFT_IO_APPEND_ENTRIES;
+    f->message.append_entries.term = 1;
+    f->message.append_entries.entries = &entry;
+    f->message.append_entries.n_entries = 1;
+
+    /* The kernel reports the completion only after the data is acknowledged,
+     * which might take a delayed ACK. */
+    send__invoke(0);
+    for (i = 0; i < 1000 && f->invoked == 0; i++) {
+        LOOP_RUN(1);
+    }
+    munit_assert_int(f->invoked, ==, 1);
+    munit_assert_int(f->status, ==, 0);
+
+    raft_uv_get_send_stats(&f->io, &stats);
+    munit_assert_int(stats.n_zero_copy, >=, 1);
+
+    /* Skip the handshake, the preamble and the header, and check that the
+     * entry data made it intact. */
+    socket = test_tcp_accept(&f->tcp);
+    buf = munit_malloc(entry.buf.len);
+    send__read(socket, preamble, sizeof preamble);
+    send__read(socket, buf, byteFlip64(preamble[2]));
+    send__read(socket, preamble, sizeof(uint64_t) * 2);
+    send__read(socket, buf, byteFlip64(preamble[1]));
+    send__read(socket, buf, entry.buf.len);
+    munit_assert_int(memcmp(buf, entry.buf.base, entry.buf.len), ==, 0);
+
+    close(socket);
+    free(buf);
+    raft_free(entry.buf.base);
+
+    return MUNIT_OK;
+}
+
 /**
  * Error scenarios.
  */
@@ -325,6 +694,105 @@ TEST_CASE(error, queue, NULL)
     return MUNIT_OK;
 }
 
+static void send__evicted_cb(struct raft_io_send *req, int status)
+{
+    int *evicted = req->data;
+    munit_assert_int(status, ==, RAFT_NOCONNECTION);
+    *evicted = 1;
+}
+
+/* When making room in the queue of pending requests, messages carrying entries
+ * get evicted before older control messages. */
+TEST_CASE(error, queue_bulk, NULL)
+{
+    struct fixture *f = data;
+    struct raft_message message;
+    struct raft_io_send req;
+    struct raft_entry entry;
+    int evicted = 0;
+    int rv;
+
+    (void)params;
+
+    test_tcp_stop(&f->tcp);
+
+    entry.buf.len = 8;
+    entry.buf.base = raft_malloc(entry.buf.len);
+    message = f->message;
+    message.type = RAFT_IO_APPEND_ENTRIES;
+    message.append_entries.entries = &entry;
+    message.append_entries.n_entries = 1;
+
+    send__invoke(0);
+    req.data = &evicted;
+    rv = f->io.send(&f->io, &req, &message, send__evicted_cb);
+    munit_assert_int(rv, ==, 0);
+    send__invoke(0);
+
+    send__invoke(0);
+    munit_assert_int(evicted, ==, 1);
+    munit_assert_int(f->invoked, ==, 0);
+
+    raft_free(entry.buf.base);
+
+    return MUNIT_OK;
+}
+
+/* Messages carrying entries are refused if the bytes already queued for the
+ * target server would exceed the limit, which the busy probe tells in
+ * advance. */
+TEST_CASE(error, busy, NULL)
+{
+    struct fixture *f = data;
+    struct raft_io_send req;
+    struct raft_uv_send_stats stats;
+    struct raft_entry entry;
+    int rv;
+
+    (void)params;
+
+    raft_uv_set_send_queue_size(&f->io, 64);
+
+    entry.buf.len = 64;
+    entry.buf.base = raft_malloc(entry.buf.len);
+    send__set_message_type(RAFT_IO_APPEND_ENTRIES);
+    f->message.append_entries.entries = &entry;
+    f->message.append_entries.n_entries = 1;
+
+    /* The first message is accepted even if larger than the limit. */
+    munit_assert_false(f->io.busy(&f->io, f->message.server_id));
+    req.data = f;
+    rv = f->io.send(&f->io, &req, &f->message, send__send_cb);
+    munit_assert_int(rv, ==, 0);
+    munit_assert_true(f->io.busy(&f->io, f->message.server_id));
+
+    send__invoke(RAFT_BUSY);
+
+    /* Heartbeats are always accepted. */
+    f->message.append_entries.entries = NULL;
+    f->message.append_entries.n_entries = 0;
+    send__invoke(0);
+
+    LOOP_RUN(2);
+    munit_assert_int(f->invoked, ==, 2);
+    munit_assert_int(f->status, ==, 0);
+    f->invoked = 0;
+
+    raft_uv_get_send_stats(&f->io, &stats);
+    munit_assert_int(stats.n_busy, ==, 1);
+
+    /* Once the queue is drained, messages are accepted again. */
+    munit_assert_false(f->io.busy(&f->io, f->message.server_id));
+    f->message.append_entries.entries = &entry;
+    f->message.append_entries.n_entries = 1;
+    send__invoke(0);
+    send__wait_cb(0);
+
+    raft_free(entry.buf.base);
+
+    return MUNIT_OK;
+}
+
 static char *error_oom_heap_fault_delay[] = {"0", "1", "2", "3",
                                              "4", "5", NULL};
 static char *error_oom_heap_fault_repeat[] = {"1", NULL};
@@ -349,6 +817,38 @@ TEST_CASE(error, oom, error_oom_params)
     return MUNIT_OK;
 }
 
+/* Out of memory while growing the buffers of a request reused from the pool. */
+TEST_CASE(error, oom_pooled, NULL)
+{
+    struct fixture *f = data;
+    struct raft_install_snapshot *p = &f->message.install_snapshot;
+    int rv;
+
+    (void)params;
+
+    send__invoke(0);
+    send__wait_cb(0);
+
+    /* The header of an InstallSnapshot message is larger than the one of the
+     * RequestVote message just sent. */
+    send__set_message_type(RAFT_IO_INSTALL_SNAPSHOT);
+    raft_configuration_init(&p->conf);
+    rv = raft_configuration_add(&p->conf, 1, "1", true);
+    munit_assert_int(rv, ==, 0);
+    p->data.len = 8;
+    p->data.base = raft_malloc(p->data.len);
+
+    test_heap_fault_config(&f->heap, 0, 1);
+    test_heap_fault_enable(&f->heap);
+
+    send__invoke(RAFT_NOMEM);
+
+    raft_configuration_close(&p->conf);
+    raft_free(p->data.base);
+
+    return MUNIT_OK;
+}
+
 static char *error_oom_async_heap_fault_delay[] = {"0", NULL};
 static char *error_oom_async_heap_fault_repeat[] = {"1", NULL};
 
@@ -433,3 +933,45 @@ TEST_CASE(close, connecting, NULL)
 
     return MUNIT_OK;
 }
+
+/* The backend gets closed while the kernel is still using the memory of a
+ * message sent with MSG_ZEROCOPY. */
+TEST_CASE(close, zero_copy, NULL)
+{
+    struct fixture *f = data;
+    struct raft_uv_send_stats stats;
+    struct raft_entry entry;
+
+    (void)params;
+
+#if !defined(MSG_ZEROCOPY) || !defined(SO_ZEROCOPY)
+    return MUNIT_SKIP;
+#endif
+
+    raft_uv_set_zero_copy(&f->io, 4096);
+
+    entry.buf.len = 64 * 1024;
+    entry.buf.base = raft_malloc(entry.buf.len);
+
+    send__set_message_type(RAFT_IO_APPEND_ENTRIES);
+
+    f->message.append_entries.entries = &entry;
+    f->message.append_entries.n_entries = 1;
+
+    send__invoke(0);
+
+    /* Spin once so the connection attempt succeeds and we flush the pending
+     * request, which gets pinned until the data is acknowledged. */
+    LOOP_RUN(1);
+    munit_assert_int(f->invoked, ==, 0);
+    raft_uv_get_send_stats(&f->io, &stats);
+    munit_assert_int(stats.n_zero_copy, ==, 1);
+
+    UV_CLOSE;
+
+    send__wait_cb(RAFT_CANCELED);
+
+    raft_free(entry.buf.base);
+
+    return MUNIT_OK;
+}
@@ -395,6 +395,31 @@ TEST_CASE(put, after_truncate, NULL)
     return MUNIT_OK;
 }
 
+/* The most recent closed segments made obsolete by the snapshot are recycled
+ * into open segments, the older ones are removed. */
+TEST_CASE(put, recycle, NULL)
+{
+    struct put_fixture *f = data;
+
+    (void)params;
+
+    UV_WRITE_CLOSED_SEGMENT(1, 1, 1);
+    UV_WRITE_CLOSED_SEGMENT(2, 2, 2);
+    UV_WRITE_CLOSED_SEGMENT(4, 3, 4);
+
+    put__invoke(0);
+    put__wait_cb(0);
+
+    munit_assert_false(test_dir_has_file(f->dir, "1-1"));
+    munit_assert_false(test_dir_has_file(f->dir, "2-3"));
+    munit_assert_false(test_dir_has_file(f->dir, "4-6"));
+
+    munit_assert_true(test_dir_has_file(f->dir, "open-1"));
+    munit_assert_true(test_dir_has_file(f->dir, "open-2"));
+
+    return MUNIT_OK;
+}
+
 /******************************************************************************
  *
  * raft_io->snapshot_get
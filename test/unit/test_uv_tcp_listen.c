@@ -162,6 +162,28 @@ TEST_CASE(success, first, NULL)
     return MUNIT_OK;
 }
 
+/* The handshake of a bulk connection is accepted as well. */
+TEST_CASE(success, bulk, NULL)
+{
+    struct fixture *f = data;
+    void *cursor = f->handshake.buf;
+    (void)params;
+
+    bytePut64(&cursor, 1 | ((uint64_t)1 << 32));
+
+    PEER_CONNECT;
+    PEER_HANDSHAKE(0);
+
+    WAIT_ACCEPTED_CB;
+
+    munit_assert_int(f->id, ==, 2);
+    munit_assert_ptr_not_null(f->stream);
+
+    uv_close((struct uv_handle_s *)f->stream, (uv_close_cb)raft_free);
+
+    return MUNIT_OK;
+}
+
 /******************************************************************************
  *
  * Failure scenarios.
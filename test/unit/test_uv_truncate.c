@@ -176,6 +176,125 @@ TEST_CASE(success, partial_segment, NULL)
     return MUNIT_OK;
 }
 
+/* Consecutive truncations see the segments renamed by the previous ones. */
+TEST_CASE(success, twice, NULL)
+{
+    struct fixture *f = data;
+    raft_term term;
+    unsigned voted_for;
+    struct raft_snapshot *snapshot;
+    raft_index start_index;
+    struct raft_entry *entries;
+    size_t n;
+    int rv;
+
+    (void)params;
+
+    APPEND(3);
+    APPEND(1);
+    TRUNCATE(4, 0);
+    LOOP_RUN(3);
+    munit_assert_true(test_dir_has_file(f->dir, "1-3"));
+
+    TRUNCATE(3, 0);
+    LOOP_RUN(2);
+    munit_assert_false(test_dir_has_file(f->dir, "1-3"));
+    munit_assert_true(test_dir_has_file(f->dir, "1-2"));
+
+    rv = f->io.load(&f->io, &term, &voted_for, &snapshot, &start_index,
+                    &entries, &n);
+    munit_assert_int(rv, ==, 0);
+    munit_assert_int(n, ==, 2);
+
+    raft_free(entries[0].batch);
+    raft_free(entries);
+
+    return MUNIT_OK;
+}
+
+/* If the index to truncate is the first one of a batch, the preceding batches
+ * are copied as they are. */
+TEST_CASE(success, batch_boundary, NULL)
+{
+    struct fixture *f = data;
+    raft_term term;
+    unsigned voted_for;
+    struct raft_snapshot *snapshot;
+    raft_index start_index;
+    struct raft_entry *entries;
+    size_t n;
+    int rv;
+
+    (void)params;
+
+    APPEND(2);
+    f->appended = false;
+    APPEND(1);
+    f->appended = false;
+    APPEND(1);
+    TRUNCATE(4, 0);
+    LOOP_RUN(3);
+
+    munit_assert_false(test_dir_has_file(f->dir, "1-4"));
+    munit_assert_true(test_dir_has_file(f->dir, "1-3"));
+
+    rv = f->io.load(&f->io, &term, &voted_for, &snapshot, &start_index,
+                    &entries, &n);
+    munit_assert_int(rv, ==, 0);
+
+    munit_assert_int(n, ==, 3);
+    munit_assert_int(byteFlip64(*(uint64_t *)entries[0].buf.base), ==, 1);
+    munit_assert_int(byteFlip64(*(uint64_t *)entries[1].buf.base), ==, 2);
+    munit_assert_int(byteFlip64(*(uint64_t *)entries[2].buf.base), ==, 1);
+
+    raft_free(entries[0].batch);
+    raft_free(entries);
+
+    return MUNIT_OK;
+}
+
+/* A closed segment without an index of its batches gets truncated in place as
+ * well. */
+TEST_CASE(success, no_index, NULL)
+{
+    struct fixture *f = data;
+    raft_term term;
+    unsigned voted_for;
+    struct raft_snapshot *snapshot;
+    raft_index start_index;
+    struct raft_entry *entries;
+    size_t n;
+    int rv;
+
+    (void)params;
+
+    UV_WRITE_CLOSED_SEGMENT(1, 3, 1);
+    rv = f->io.load(&f->io, &term, &voted_for, &snapshot, &start_index,
+                    &entries, &n);
+    munit_assert_int(rv, ==, 0);
+    raft_free(entries[0].batch);
+    raft_free(entries);
+
+    TRUNCATE(3, 0);
+    LOOP_RUN(1);
+
+    munit_assert_false(test_dir_has_file(f->dir, "1-3"));
+    munit_assert_true(test_dir_has_file(f->dir, "1-2"));
+
+    rv = f->io.load(&f->io, &term, &voted_for, &snapshot, &start_index,
+                    &entries, &n);
+    munit_assert_int(rv, ==, 0);
+
+    munit_assert_int(n, ==, 2);
+    munit_assert_int(byteFlip64(*(uint64_t *)entries[0].buf.base), ==, 1);
+    munit_assert_int(byteFlip64(*(uint64_t *)entries[1].buf.base), ==, 2);
+
+    raft_free(entries[0].batch);
+    raft_free(entries);
+
+    return MUNIT_OK;
+}
+
 /******************************************************************************
  *
  * Failure scenarios.
@@ -0,0 +1,194 @@
+#include "../lib/fs.h"
+#include "../lib/heap.h"
+#include "../lib/loop.h"
+#include "../lib/runner.h"
+
+#include "../../include/raft.h"
+#include "../../include/raft/uv.h"
+
+TEST_MODULE(uv_unix);
+
+/******************************************************************************
+ *
+ * Fixture
+ *
+ *****************************************************************************/
+
+struct fixture
+{
+    struct raft_heap heap;
+    FIXTURE_DIR;
+    FIXTURE_LOOP;
+    struct raft_uv_transport transport;
+    char address[256];
+    struct
+    {
+        int invoked;
+        unsigned id;
+        char address[256];
+        struct uv_stream_s *stream;
+    } accept;
+    struct
+    {
+        struct raft_uv_connect req;
+        int invoked;
+        int status;
+        struct uv_stream_s *stream;
+    } connect;
+};
+
+static void acceptCb(struct raft_uv_transport *t,
+                     unsigned id,
+                     const char *address,
+                     struct uv_stream_s *stream)
+{
+    struct fixture *f = t->data;
+    f->accept.invoked++;
+    f->accept.id = id;
+    strcpy(f->accept.address, address);
+    f->accept.stream = stream;
+}
+
+static void connectCb(struct raft_uv_connect *req,
+                      struct uv_stream_s *stream,
+                      int status)
+{
+    struct fixture *f = req->data;
+    f->connect.invoked++;
+    f->connect.status = status;
+    f->connect.stream = stream;
+}
+
+static void *setup(const MunitParameter params[], void *user_data)
+{
+    struct fixture *f = munit_malloc(sizeof *f);
+    int rv;
+    (void)user_data;
+    test_heap_setup(params, &f->heap);
+    SETUP_DIR;
+    SETUP_LOOP;
+    sprintf(f->address, "%s/1.sock", f->dir);
+    rv = raft_uv_unix_init(&f->transport, &f->loop);
+    munit_assert_int(rv, ==, 0);
+    f->transport.data = f;
+    rv = f->transport.init(&f->transport, 1, f->address);
+    munit_assert_int(rv, ==, 0);
+    memset(&f->accept, 0, sizeof f->accept);
+    memset(&f->connect, 0, sizeof f->connect);
+    f->connect.req.data = f;
+    f->connect.status = -1;
+    return f;
+}
+
+static void tear_down(void *data)
+{
+    struct fixture *f = data;
+    f->transport.close(&f->transport, NULL);
+    LOOP_STOP;
+    raft_uv_unix_close(&f->transport);
+    TEAR_DOWN_LOOP;
+    TEAR_DOWN_DIR;
+    test_heap_tear_down(&f->heap);
+    free(f);
+}
+
+/******************************************************************************
+ *
+ * Helper macros
+ *
+ *****************************************************************************/
+
+#define LISTEN                                                \
+    {                                                         \
+        int rv;                                               \
+        rv = f->transport.listen(&f->transport, acceptCb);    \
+        munit_assert_int(rv, ==, 0);                          \
+    }
+
+#define CONNECT(ADDRESS)                                                   \
+    {                                                                      \
+        int rv;                                                            \
+        rv = f->transport.connect(&f->transport, &f->connect.req, 1,       \
+                                  ADDRESS, connectCb);                     \
+        munit_assert_int(rv, ==, 0);                                       \
+    }
+
+/* Run the loop until the connect callback fires, and the accept one too if we
+ * expect the connection to succeed. */
+#define WAIT_CONNECT_CB(STATUS)                               \
+    {                                                         \
+        int j;                                                \
+        for (j = 0; j < 10; j++) {                            \
+            if (f->connect.invoked == 1 &&                    \
+                (STATUS != 0 || f->accept.invoked == 1)) {    \
+                break;                                        \
+            }                                                 \
+            uv_run(&f->loop, UV_RUN_ONCE);                    \
+        }                                                     \
+        munit_assert_int(f->connect.invoked, ==, 1);          \
+        munit_assert_int(f->connect.status, ==, STATUS);      \
+    }
+
+/******************************************************************************
+ *
+ * Success scenarios
+ *
+ *****************************************************************************/
+
+TEST_SUITE(success);
+
+TEST_SETUP(success, setup)
+TEST_TEAR_DOWN(success, tear_down)
+
+/* Connect to our own socket and complete the handshake. */
+TEST_CASE(success, handshake, NULL)
+{
+    struct fixture *f = data;
+    (void)params;
+    LISTEN;
+    CONNECT(f->address);
+    WAIT_CONNECT_CB(0);
+    munit_assert_ptr_not_null(f->connect.stream);
+    munit_assert_int(f->accept.invoked, ==, 1);
+    munit_assert_int(f->accept.id, ==, 1);
+    munit_assert_string_equal(f->accept.address, f->address);
+    munit_assert_ptr_not_null(f->accept.stream);
+    uv_close((struct uv_handle_s *)f->connect.stream, (uv_close_cb)raft_free);
+    uv_close((struct uv_handle_s *)f->accept.stream, (uv_close_cb)raft_free);
+    return MUNIT_OK;
+}
+
+/******************************************************************************
+ *
+ * Failure scenarios
+ *
+ *****************************************************************************/
+
+TEST_SUITE(error);
+
+TEST_SETUP(error, setup)
+TEST_TEAR_DOWN(error, tear_down)
+
+/* There's no socket file at the given address. */
+TEST_CASE(error, no_socket, NULL)
+{
+    struct fixture *f = data;
+    char address[256];
+    (void)params;
+    sprintf(address, "%s/2.sock", f->dir);
+    CONNECT(address);
+    WAIT_CONNECT_CB(RAFT_NOCONNECTION);
+    return MUNIT_OK;
+}
+
+/* A stale socket file is in the way of the listener. */
+TEST_CASE(error, address_in_use, NULL)
+{
+    struct fixture *f = data;
+    int rv;
+    (void)params;
+    test_dir_write_file(f->dir, "1.sock", "x", 1);
+    rv = f->transport.listen(&f->transport, acceptCb);
+    munit_assert_int(rv, ==, RAFT_IOERR);
+    return MUNIT_OK;
+}